@@ -0,0 +1,411 @@
+#pragma once
+
+// Build-time tuning knobs. Every value can be overridden from the build
+// (e.g. idf.py build -DGSUSB_RX_BATCH=1 via CFLAGS) or edited here.
+
+// ---- RX batching (CAN -> USB) ----
+// Pack several gs_host_frame records into one bulk IN transfer instead of
+// one transfer per CAN frame. The host driver must accept multi-frame
+// transfers (mainline Linux gs_usb submits one-frame URBs), so it is off by
+// default.
+#ifndef GSUSB_RX_BATCH
+#define GSUSB_RX_BATCH 0
+#endif
+
+// Bytes per batched transfer; must not exceed CONFIG_TINYUSB_VENDOR_TX_BUFSIZE
+// (with GSUSB_USB_DIRECT it sizes the IN buffers instead).
+#ifndef GSUSB_RX_BATCH_BYTES
+#define GSUSB_RX_BATCH_BYTES 64
+#endif
+
+// A partially filled batch is sent once its oldest frame is this old.
+#ifndef GSUSB_RX_BATCH_FLUSH_US
+#define GSUSB_RX_BATCH_FLUSH_US 250
+#endif
+
+// ---- Direct endpoint transfers ----
+// Run the gs_usb bulk endpoints with usbd_edpt_xfer() on two ping-pong
+// buffers per direction instead of through the vendor class FIFOs: frames
+// are copied once into the IN buffer and decoded where the OUT transfer
+// left them, and the next IN transfer starts from the completion callback.
+#ifndef GSUSB_USB_DIRECT
+#define GSUSB_USB_DIRECT 0
+#endif
+
+// ---- RX ring (CAN -> USB) ----
+// Pre-encoded frames buffered between can_rx_task and the USB IN writer, so
+// short host stalls are absorbed instead of dropping frames. Rounded up to
+// a power of two; 24 bytes per slot (a timestamped gs_host_frame), so 6 KiB
+// at the default.
+#ifndef GSUSB_RX_RING_SLOTS
+#define GSUSB_RX_RING_SLOTS 256
+#endif
+
+// Place the RX ring in PSRAM when the module has it.
+#ifndef GSUSB_RX_RING_PSRAM
+#define GSUSB_RX_RING_PSRAM 0
+#endif
+
+// TX echoes (and TX error frames) waiting for the bulk IN endpoint.
+#ifndef GSUSB_ECHO_RING_SLOTS
+#define GSUSB_ECHO_RING_SLOTS 32
+#endif
+
+// ---- Error reporting ----
+// Sustained and burst limit for CAN_ERR_FLAG frames on the IN endpoint.
+// Events beyond it are merged into the next frame instead of queued.
+#ifndef GSUSB_ERR_FRAMES_PER_SEC
+#define GSUSB_ERR_FRAMES_PER_SEC 100
+#endif
+
+#ifndef GSUSB_ERR_FRAME_BURST
+#define GSUSB_ERR_FRAME_BURST 10
+#endif
+
+// Leave bus-off on our own (the gs_usb driver has no restart request).
+#ifndef GSUSB_BUS_OFF_AUTO_RECOVER
+#define GSUSB_BUS_OFF_AUTO_RECOVER 1
+#endif
+
+// ---- Instrumentation ----
+// Per-stage cycle histograms and drop counters, read with GSUSB_BREQ_STATS.
+// Costs a few dozen cycles per frame; 0 compiles every probe out.
+#ifndef GSUSB_STATS
+#define GSUSB_STATS 1
+#endif
+
+// ---- Acceptance filter ----
+// Merged 29-bit ID ranges the software filter can hold (8 bytes each);
+// 11-bit IDs use a fixed 2048-bit bitset.
+#ifndef GSUSB_FILTER_EXT_RANGES
+#define GSUSB_FILTER_EXT_RANGES 64
+#endif
+
+// Ranges accepted per GSUSB_BREQ_FILTER control transfer.
+#ifndef GSUSB_FILTER_REQ_RANGES
+#define GSUSB_FILTER_REQ_RANGES 32
+#endif
+
+// ---- TX queue (USB -> CAN) ----
+// Depth of the TWAI driver TX queue (one more frame sits in the controller).
+#ifndef GSUSB_CAN_TX_QUEUE_LEN
+#define GSUSB_CAN_TX_QUEUE_LEN 20
+#endif
+
+// How long usb_tx_task waits for a TWAI TX slot per attempt while the queue
+// is full. Bulk OUT is not drained meanwhile, so the host is NAKed rather
+// than frames being dropped.
+#ifndef GSUSB_TX_BLOCK_MS
+#define GSUSB_TX_BLOCK_MS 10
+#endif
+
+// Longest a single RX/TX/alert driver call may block. A BITTIMING or MODE
+// request waits up to this long for those calls to return before it stops
+// or reinstalls the driver.
+#ifndef GSUSB_CAN_WAIT_SLICE_MS
+#define GSUSB_CAN_WAIT_SLICE_MS 10
+#endif
+
+// ---- TX completion (USB -> CAN) ----
+// Frames handed to the controller are held in a slot table indexed by
+// echo_id until TWAI reports them done on the bus. Linux gs_usb keeps at
+// most 10 echo_ids (0..9) in flight; anything outside the table is refused.
+#ifndef GSUSB_TX_ECHO_SLOTS
+#define GSUSB_TX_ECHO_SLOTS 16
+#endif
+
+// Completions are tracked for every frame TWAI holds, echoed or not: frames
+// from the network bridge, the SLCAN port and cyclic jobs take no echo slot
+// but can fill the whole TX queue plus the controller.
+#ifndef GSUSB_TX_ORDER_SLOTS
+#define GSUSB_TX_ORDER_SLOTS 32
+#endif
+
+// ---- TX scheduling (USB -> CAN) ----
+// Host frames wait on the device in arbitration order and only
+// GSUSB_TX_SCHED_INFLIGHT of them at a time go into the FIFO TWAI queue,
+// so a low ID the host sends behind a bulk transfer waits for at most that
+// many frames instead of the whole queue. 0 queues frames in host order.
+#ifndef GSUSB_TX_SCHED
+#define GSUSB_TX_SCHED 1
+#endif
+
+// Frames in the TWAI queue and controller ahead of the next scheduled one;
+// too few and the bus idles while a refill is on its way at high bitrates.
+#ifndef GSUSB_TX_SCHED_INFLIGHT
+#define GSUSB_TX_SCHED_INFLIGHT 3
+#endif
+
+// With GSUSB_CAN_MODE_TX_TIMED a host frame can carry the device time to
+// send it at; it waits in a time-ordered queue, and a one-shot esp_timer
+// wakes usb_tx_task when the first one is due.
+#ifndef GSUSB_TX_TIMED
+#define GSUSB_TX_TIMED 1
+#endif
+
+// A frame queued to TWAI later than this after its time counts as late.
+#ifndef GSUSB_TX_TIMED_LATE_US
+#define GSUSB_TX_TIMED_LATE_US 50
+#endif
+
+// A time further ahead than this is taken as already past: a host on the
+// wrong clock would otherwise hold the echo_id for up to half an hour.
+#ifndef GSUSB_TX_TIMED_HORIZON_US
+#define GSUSB_TX_TIMED_HORIZON_US 10000000
+#endif
+
+// ---- Task layout ----
+// USB servicing (TinyUSB, bulk OUT -> TWAI, bulk IN writer) is pinned to
+// GSUSB_USB_CORE, CAN servicing (RX drain, alerts and echoes) to
+// GSUSB_CAN_CORE, so a busy bus and a busy host do not share a core. On
+// single-core targets everything runs on core 0.
+#ifndef GSUSB_USB_CORE
+#define GSUSB_USB_CORE 0
+#endif
+
+#ifndef GSUSB_CAN_CORE
+#define GSUSB_CAN_CORE 1
+#endif
+
+// Priorities and stack sizes (bytes) per task. The alert task wakes the RX
+// task, so it must not run below it.
+#ifndef GSUSB_TINYUSB_TASK_PRIO
+#define GSUSB_TINYUSB_TASK_PRIO 10
+#endif
+#ifndef GSUSB_TINYUSB_TASK_STACK
+#define GSUSB_TINYUSB_TASK_STACK 4096
+#endif
+
+#ifndef GSUSB_USB_TX_TASK_PRIO
+#define GSUSB_USB_TX_TASK_PRIO 8
+#endif
+#ifndef GSUSB_USB_TX_TASK_STACK
+#define GSUSB_USB_TX_TASK_STACK 4096
+#endif
+
+#ifndef GSUSB_USB_IN_TASK_PRIO
+#define GSUSB_USB_IN_TASK_PRIO 7
+#endif
+#ifndef GSUSB_USB_IN_TASK_STACK
+#define GSUSB_USB_IN_TASK_STACK 4096
+#endif
+
+#ifndef GSUSB_CAN_RX_TASK_PRIO
+#define GSUSB_CAN_RX_TASK_PRIO 9
+#endif
+#ifndef GSUSB_CAN_RX_TASK_STACK
+#define GSUSB_CAN_RX_TASK_STACK 4096
+#endif
+
+#ifndef GSUSB_CAN_ALERT_TASK_PRIO
+#define GSUSB_CAN_ALERT_TASK_PRIO 9
+#endif
+#ifndef GSUSB_CAN_ALERT_TASK_STACK
+#define GSUSB_CAN_ALERT_TASK_STACK 4096
+#endif
+
+// ---- Status LED ----
+// While the bus is up the LED shows traffic: the data path only bumps
+// counters, and the LED task samples them every GSUSB_LED_SAMPLE_MS and
+// sets colour (RX vs TX share) and brightness (bus load). 0 keeps a steady
+// green LED.
+#ifndef GSUSB_LED_ACTIVITY
+#define GSUSB_LED_ACTIVITY 1
+#endif
+
+#ifndef GSUSB_LED_SAMPLE_MS
+#define GSUSB_LED_SAMPLE_MS 50
+#endif
+
+// ---- Flight recorder ----
+// Every frame on the bus (RX before the acceptance filter, TX as queued) is
+// also written to a circular buffer of GSUSB_REC_BYTES / 20 records that the
+// host can freeze and read back with GSUSB_BREQ_REC*. Without PSRAM the
+// buffer shrinks until it fits in internal RAM.
+#ifndef GSUSB_RECORDER
+#define GSUSB_RECORDER 1
+#endif
+
+#ifndef GSUSB_REC_BYTES
+#define GSUSB_REC_BYTES (1024 * 1024)
+#endif
+
+#ifndef GSUSB_REC_PSRAM
+#define GSUSB_REC_PSRAM 1
+#endif
+
+// Stop recording at bus-off so the frames leading up to it survive until
+// the host reads them.
+#ifndef GSUSB_REC_FREEZE_ON_BUS_OFF
+#define GSUSB_REC_FREEZE_ON_BUS_OFF 1
+#endif
+
+// ---- Traffic statistics ----
+// Bus load from the bits every frame takes with worst-case stuffing, kept
+// in GSUSB_TRAFFIC_SLOTS slots of GSUSB_TRAFFIC_SLOT_US, and a table of
+// GSUSB_TRAFFIC_IDS IDs per direction with count and period statistics.
+// Read with GSUSB_BREQ_TRAFFIC*.
+#ifndef GSUSB_TRAFFIC
+#define GSUSB_TRAFFIC 1
+#endif
+
+// Power of two; 36 bytes each, RX and TX tables.
+#ifndef GSUSB_TRAFFIC_IDS
+#define GSUSB_TRAFFIC_IDS 256
+#endif
+
+// Slots an ID looks at before it counts as untracked.
+#ifndef GSUSB_TRAFFIC_PROBES
+#define GSUSB_TRAFFIC_PROBES 16
+#endif
+
+#ifndef GSUSB_TRAFFIC_SLOT_US
+#define GSUSB_TRAFFIC_SLOT_US 10000
+#endif
+
+#ifndef GSUSB_TRAFFIC_SLOTS
+#define GSUSB_TRAFFIC_SLOTS 100
+#endif
+
+// ---- Cyclic transmit ----
+// Frames the host uploads once with GSUSB_BREQ_CYCLIC and the device sends
+// on its own from a timing wheel of GSUSB_CYCLIC_WHEEL_SLOTS slots of
+// GSUSB_CYCLIC_TICK_US, woken by a one-shot esp_timer at each frame's time.
+#ifndef GSUSB_CYCLIC
+#define GSUSB_CYCLIC 1
+#endif
+
+#ifndef GSUSB_CYCLIC_JOBS
+#define GSUSB_CYCLIC_JOBS 32
+#endif
+
+// Power of two.
+#ifndef GSUSB_CYCLIC_WHEEL_SLOTS
+#define GSUSB_CYCLIC_WHEEL_SLOTS 64
+#endif
+
+#ifndef GSUSB_CYCLIC_TICK_US
+#define GSUSB_CYCLIC_TICK_US 1000
+#endif
+
+#ifndef GSUSB_CYCLIC_MIN_PERIOD_US
+#define GSUSB_CYCLIC_MIN_PERIOD_US 100
+#endif
+
+// A frame released later than this after its time counts as late.
+#ifndef GSUSB_CYCLIC_LATE_US
+#define GSUSB_CYCLIC_LATE_US 100
+#endif
+
+// ---- Automatic bitrate detection ----
+// GSUSB_BREQ_AUTOBAUD listens in listen-only mode at each bitrate of
+// gsusb_timing_table, for up to GSUSB_AUTOBAUD_WINDOW_MS each. A bitrate
+// that receives GSUSB_AUTOBAUD_LOCK_FRAMES valid frames without a bus error
+// wins at once; one that sees GSUSB_AUTOBAUD_REJECT_ERRORS bus errors before
+// its first frame is given up early.
+#ifndef GSUSB_AUTOBAUD
+#define GSUSB_AUTOBAUD 1
+#endif
+
+#ifndef GSUSB_AUTOBAUD_WINDOW_MS
+#define GSUSB_AUTOBAUD_WINDOW_MS 50
+#endif
+
+#ifndef GSUSB_AUTOBAUD_LOCK_FRAMES
+#define GSUSB_AUTOBAUD_LOCK_FRAMES 3
+#endif
+
+#ifndef GSUSB_AUTOBAUD_REJECT_ERRORS
+#define GSUSB_AUTOBAUD_REJECT_ERRORS 8
+#endif
+
+// ---- Network bridge (cannelloni over Wi-Fi) ----
+// Bridges the bus to a cannelloni peer over UDP, with or without a USB
+// host. Off by default: it pulls in the Wi-Fi stack.
+#ifndef GSUSB_NET
+#define GSUSB_NET 0
+#endif
+
+#ifndef GSUSB_NET_WIFI_SSID
+#define GSUSB_NET_WIFI_SSID ""
+#endif
+#ifndef GSUSB_NET_WIFI_PASS
+#define GSUSB_NET_WIFI_PASS ""
+#endif
+
+// Peer address; "" answers whoever sends the first datagram.
+#ifndef GSUSB_NET_PEER_IP
+#define GSUSB_NET_PEER_IP ""
+#endif
+#ifndef GSUSB_NET_PEER_PORT
+#define GSUSB_NET_PEER_PORT 20000
+#endif
+#ifndef GSUSB_NET_LOCAL_PORT
+#define GSUSB_NET_LOCAL_PORT 20000
+#endif
+
+// Bitrate the bridge starts the bus with when no USB host has; 0 waits
+// for a host to do it.
+#ifndef GSUSB_NET_BITRATE
+#define GSUSB_NET_BITRATE 500000
+#endif
+
+// Sample point of that timing, per mille; the SLCAN port's rates use it too.
+#ifndef GSUSB_NET_SAMPLE_POINT
+#define GSUSB_NET_SAMPLE_POINT 875
+#endif
+
+// Largest datagram sent; 1472 fills a 1500-byte MTU without fragmenting.
+#ifndef GSUSB_NET_MAX_PACKET
+#define GSUSB_NET_MAX_PACKET 1472
+#endif
+
+// A datagram that is not full is sent once its oldest frame is this old.
+#ifndef GSUSB_NET_FLUSH_US
+#define GSUSB_NET_FLUSH_US 1000
+#endif
+
+// Frames buffered per direction; rounded up to a power of two.
+#ifndef GSUSB_NET_RING_SLOTS
+#define GSUSB_NET_RING_SLOTS 512
+#endif
+
+// Wi-Fi and lwIP run on core 0, with the USB tasks.
+#ifndef GSUSB_NET_CORE
+#define GSUSB_NET_CORE GSUSB_USB_CORE
+#endif
+#ifndef GSUSB_NET_TASK_PRIO
+#define GSUSB_NET_TASK_PRIO 6
+#endif
+#ifndef GSUSB_NET_TASK_STACK
+#define GSUSB_NET_TASK_STACK 4096
+#endif
+
+// ---- SLCAN (CDC-ACM) ----
+// Adds a CDC-ACM interface speaking SLCAN next to gs_usb, for tools
+// without a gs_usb driver. Needs CDC enabled in the TinyUSB menu.
+#ifndef GSUSB_SLCAN
+#define GSUSB_SLCAN 0
+#endif
+
+// Bitrate O opens the bus with until the host sends Sn.
+#ifndef GSUSB_SLCAN_BITRATE
+#define GSUSB_SLCAN_BITRATE 500000
+#endif
+
+// Frames waiting for the CDC IN endpoint; rounded up to a power of two.
+#ifndef GSUSB_SLCAN_RING_SLOTS
+#define GSUSB_SLCAN_RING_SLOTS 512
+#endif
+
+// Command replies and z/Z acknowledgements waiting for it.
+#ifndef GSUSB_SLCAN_REPLY_SLOTS
+#define GSUSB_SLCAN_REPLY_SLOTS 64
+#endif
+
+#ifndef GSUSB_SLCAN_TASK_PRIO
+#define GSUSB_SLCAN_TASK_PRIO GSUSB_USB_IN_TASK_PRIO
+#endif
+#ifndef GSUSB_SLCAN_TASK_STACK
+#define GSUSB_SLCAN_TASK_STACK 4096
+#endif
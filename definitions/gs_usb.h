@@ -9,10 +9,68 @@
 #define GS_USB_BREQ_DEVICE_CONFIG 5
 #define GS_USB_BREQ_TIMESTAMP 6
 #define GS_USB_BREQ_IDENTIFY 7
+#define GS_USB_BREQ_GET_STATE 14
+
+// Device-specific requests, above the range used by the gs_usb driver.
+#define GSUSB_BREQ_FILTER 0x40
+#define GSUSB_BREQ_STATS  0x41 // IN: struct gsusb_stats; wValue 1 clears after the read
+#define GSUSB_BREQ_REC      0x42 // OUT, no data: wValue is a GSUSB_REC_* command
+#define GSUSB_BREQ_REC_INFO 0x43 // IN: struct gsusb_rec_info
+#define GSUSB_BREQ_REC_READ 0x44 // IN, frozen only: records from wValue * GSUSB_REC_READ_RECORDS
+#define GSUSB_BREQ_TRAFFIC      0x45 // IN: struct gsusb_traffic_info; wValue 1 clears after the read
+#define GSUSB_BREQ_TRAFFIC_READ 0x46 // IN: IDs in slots from wValue * GSUSB_TRAFFIC_READ_SLOTS
+#define GSUSB_BREQ_CYCLIC        0x47 // OUT: wValue is the job; gsusb_cyclic_job starts it, no data stops it
+#define GSUSB_BREQ_CYCLIC_STATUS 0x48 // IN: a gsusb_cyclic_status per job
+#define GSUSB_BREQ_AUTOBAUD        0x49 // OUT, no data: detect the bitrate while the bus is stopped
+#define GSUSB_BREQ_AUTOBAUD_RESULT 0x4A // IN: struct gsusb_autobaud
+
+// GSUSB_BREQ_FILTER wValue; the data stage is an array of gsusb_filter_range.
+// REPLACE with no data accepts every frame again.
+#define GSUSB_FILTER_REPLACE 0
+#define GSUSB_FILTER_APPEND  1
+
+// GSUSB_BREQ_REC wValue
+#define GSUSB_REC_RESUME 0
+#define GSUSB_REC_FREEZE 1
+#define GSUSB_REC_CLEAR  2 // forget every record and resume
 
 #define GS_CAN_MODE_RESET 0
 #define GS_CAN_MODE_START 1
 
+// gs_device_bt_const.feature
+#define GS_CAN_FEATURE_LISTEN_ONLY      (1U << 0)
+#define GS_CAN_FEATURE_LOOP_BACK        (1U << 1)
+#define GS_CAN_FEATURE_TRIPLE_SAMPLE    (1U << 2)
+#define GS_CAN_FEATURE_ONE_SHOT         (1U << 3)
+#define GS_CAN_FEATURE_HW_TIMESTAMP     (1U << 4)
+#define GS_CAN_FEATURE_IDENTIFY         (1U << 5)
+#define GS_CAN_FEATURE_USER_ID          (1U << 6)
+#define GS_CAN_FEATURE_PAD_PKTS_TO_MAX_PKT_SIZE (1U << 7)
+#define GS_CAN_FEATURE_FD               (1U << 8)
+#define GS_CAN_FEATURE_BT_CONST_EXT     (1U << 10)
+#define GS_CAN_FEATURE_TERMINATION      (1U << 11)
+#define GS_CAN_FEATURE_BERR_REPORTING   (1U << 12)
+#define GS_CAN_FEATURE_GET_STATE        (1U << 13)
+
+// gs_device_mode.flags
+#define GS_CAN_MODE_NORMAL              0
+#define GS_CAN_MODE_LISTEN_ONLY         (1U << 0)
+#define GS_CAN_MODE_LOOP_BACK           (1U << 1)
+#define GS_CAN_MODE_TRIPLE_SAMPLE       (1U << 2)
+#define GS_CAN_MODE_ONE_SHOT            (1U << 3)
+#define GS_CAN_MODE_HW_TIMESTAMP        (1U << 4)
+#define GS_CAN_MODE_PAD_PKTS_TO_MAX_PKT_SIZE (1U << 7)
+#define GS_CAN_MODE_FD                  (1U << 8)
+#define GS_CAN_MODE_BERR_REPORTING      (1U << 12)
+
+// Device-specific, far above the bits the gs_usb driver uses. With
+// GSUSB_CAN_MODE_TX_TIMED every OUT frame is GS_HOST_FRAME_TS_SIZE long;
+// one with GSUSB_FRAME_FLAG_TX_TIMED in flags goes on the bus when the
+// device clock (GS_USB_BREQ_TIMESTAMP) reaches its timestamp_us.
+#define GSUSB_CAN_FEATURE_TX_TIMED      (1U << 31)
+#define GSUSB_CAN_MODE_TX_TIMED         (1U << 31)
+#define GSUSB_FRAME_FLAG_TX_TIMED       0x80
+
 struct __attribute__((packed)) gs_device_config
 {
     uint8_t reserved1;
@@ -61,6 +119,246 @@ struct __attribute__((packed)) gs_host_frame
     uint8_t flags;
     uint8_t reserved;
     uint8_t data[8];
+    uint32_t timestamp_us; // only on the wire with GS_CAN_MODE_HW_TIMESTAMP
+};
+
+// SocketCAN can_id flags and error-frame layout (linux/can/error.h).
+#define CAN_EFF_FLAG       0x80000000U
+#define CAN_RTR_FLAG       0x40000000U
+#define CAN_ERR_FLAG       0x20000000U
+#define CAN_ERR_DLC        8
+
+// Error classes, ORed into can_id.
+#define CAN_ERR_TX_TIMEOUT 0x00000001U
+#define CAN_ERR_LOSTARB    0x00000002U // data[0]: bit position, 0 = unspecified
+#define CAN_ERR_CRTL       0x00000004U // data[1]: CAN_ERR_CRTL_*
+#define CAN_ERR_PROT       0x00000008U // data[2]: type, data[3]: location
+#define CAN_ERR_BUSOFF     0x00000040U
+#define CAN_ERR_BUSERROR   0x00000080U
+#define CAN_ERR_RESTARTED  0x00000100U
+#define CAN_ERR_CNT        0x00000200U // data[6]: TEC, data[7]: REC
+
+#define CAN_ERR_CRTL_RX_OVERFLOW 0x01
+#define CAN_ERR_CRTL_RX_WARNING  0x04
+#define CAN_ERR_CRTL_TX_WARNING  0x08
+#define CAN_ERR_CRTL_RX_PASSIVE  0x10
+#define CAN_ERR_CRTL_TX_PASSIVE  0x20
+#define CAN_ERR_CRTL_ACTIVE      0x40
+
+#define GS_HOST_FRAME_ECHO_ID_RX 0xFFFFFFFFU
+
+// Bytes of a classic gs_host_frame on the wire, without / with timestamp.
+#define GS_HOST_FRAME_SIZE    20
+#define GS_HOST_FRAME_TS_SIZE 24
+
+// GS_USB_BREQ_GET_STATE
+#define GS_CAN_STATE_ERROR_ACTIVE  0
+#define GS_CAN_STATE_ERROR_WARNING 1
+#define GS_CAN_STATE_ERROR_PASSIVE 2
+#define GS_CAN_STATE_BUS_OFF       3
+#define GS_CAN_STATE_STOPPED       4
+#define GS_CAN_STATE_SLEEPING      5
+
+struct __attribute__((packed)) gs_device_state
+{
+    uint32_t state;
+    uint32_t rxerr;
+    uint32_t txerr;
+};
+
+// Inclusive ID range; CAN_EFF_FLAG set in both bounds selects 29-bit IDs.
+struct __attribute__((packed)) gsusb_filter_range
+{
+    uint32_t id_lo;
+    uint32_t id_hi;
+};
+
+// gsusb_stats.counters[]
+enum gsusb_stat_counter
+{
+    GSUSB_STAT_RX_FRAMES,          // dequeued from the TWAI driver
+    GSUSB_STAT_RX_FILTERED,        // rejected by the software filter
+    GSUSB_STAT_RX_TO_USB,          // written to the IN FIFO
+    GSUSB_STAT_RX_DROP_RING_FULL,
+    GSUSB_STAT_RX_DROP_UNMOUNTED,
+    GSUSB_STAT_RX_DROP_DRIVER,     // TWAI rx_missed + rx_overrun
+    GSUSB_STAT_TX_FRAMES,          // read from bulk OUT
+    GSUSB_STAT_TX_QUEUED,          // accepted by twai_transmit
+    GSUSB_STAT_TX_BACKPRESSURE,    // retries while the TWAI queue was full
+    GSUSB_STAT_TX_DROP_ECHO_ID,
+    GSUSB_STAT_TX_DROP_INACTIVE,
+    GSUSB_STAT_TX_DROP_ERROR,
+    GSUSB_STAT_TX_ECHOES,
+    GSUSB_STAT_TX_FAILED,
+    GSUSB_STAT_ERR_FRAMES,
+    GSUSB_STAT_USB_IN_WRITES,      // bulk IN transfers started
+    GSUSB_STAT_RX_TO_NET,          // sent to the cannelloni peer
+    GSUSB_STAT_RX_DROP_NET,        // network ring full
+    GSUSB_STAT_NET_OUT_PACKETS,    // datagrams sent
+    GSUSB_STAT_NET_SEND_ERRORS,    // datagrams the stack refused, frames lost
+    GSUSB_STAT_NET_IN_PACKETS,     // datagrams received from the peer
+    GSUSB_STAT_NET_IN_LOST,        // datagrams missing from the peer's sequence
+    GSUSB_STAT_NET_IN_BAD,         // malformed datagrams, CAN FD and error frames
+    GSUSB_STAT_TX_FROM_NET,        // frames from the peer queued for TWAI
+    GSUSB_STAT_TX_NET_BACKPRESSURE, // waits while the network TX ring was full
+    GSUSB_STAT_RX_TO_SLCAN,        // written to the CDC port
+    GSUSB_STAT_RX_DROP_SLCAN,      // SLCAN ring full
+    GSUSB_STAT_TX_FROM_SLCAN,      // SLCAN frames queued for TWAI
+    GSUSB_STAT_SLCAN_BAD_LINES,    // malformed or unknown SLCAN lines
+    GSUSB_STAT_SLCAN_DROP_REPLY,   // replies lost while the host was not reading
+    GSUSB_STAT_TX_TIMED,           // host frames held for their time
+    GSUSB_STAT_TX_TIMED_LATE,      // queued to TWAI over GSUSB_TX_TIMED_LATE_US late
+    GSUSB_STAT_COUNT
+};
+
+// gsusb_stats.hist[], in CPU cycles
+enum gsusb_stat_hist
+{
+    GSUSB_HIST_RX_CONVERT,   // TWAI dequeue -> RX ring
+    GSUSB_HIST_RX_DWELL,     // TWAI dequeue -> IN FIFO
+    GSUSB_HIST_TX_SUBMIT,    // OUT packet received -> twai_transmit accepted
+    GSUSB_HIST_TX_COMPLETE,  // twai_transmit accepted -> echo queued
+    GSUSB_HIST_QUIESCE,      // BITTIMING/MODE waiting for RX/TX to leave the driver
+    GSUSB_HIST_TX_TIMED,     // timed frame's time -> twai_transmit accepted
+    GSUSB_HIST_COUNT
+};
+
+// Bucket 0 counts samples below 2^GSUSB_STATS_BUCKET_SHIFT cycles, bucket
+// i counts [2^(i+SHIFT-1), 2^(i+SHIFT)), the last bucket everything above.
+#define GSUSB_STATS_BUCKETS      16
+#define GSUSB_STATS_BUCKET_SHIFT 7
+#define GSUSB_STATS_VERSION      5
+
+struct __attribute__((packed)) gsusb_stats
+{
+    uint32_t version;
+    uint32_t cpu_hz;
+    uint32_t uptime_ms;
+    uint32_t counters[GSUSB_STAT_COUNT];
+    uint32_t hist[GSUSB_HIST_COUNT][GSUSB_STATS_BUCKETS];
+};
+
+// Flight recorder. A GSUSB_BREQ_REC_READ returns up to this many records
+// (3840 bytes), oldest first; a short read ends the dump.
+#define GSUSB_REC_VERSION      1
+#define GSUSB_REC_READ_RECORDS 192
+
+// gsusb_rec_frame.flags
+#define GSUSB_REC_TX (1U << 0) // accepted for transmission, not received
+
+// gsusb_rec_info.frozen
+#define GSUSB_REC_RUNNING        0
+#define GSUSB_REC_FROZEN_HOST    1
+#define GSUSB_REC_FROZEN_BUS_OFF 2
+
+// Naturally aligned without padding, so records are written in place.
+struct gsusb_rec_frame
+{
+    uint32_t timestamp_us;
+    uint32_t can_id;  // CAN_EFF_FLAG / CAN_RTR_FLAG as in gs_host_frame
+    uint8_t can_dlc;
+    uint8_t flags;
+    uint16_t seq;     // low 16 bits of the record number; any other value
+                      // means the slot was being written when frozen
+    uint8_t data[8];
+};
+
+struct __attribute__((packed)) gsusb_rec_info
+{
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity;  // records; 0 when the recorder is compiled out
+    uint32_t count;     // records held
+    uint32_t first_seq; // record number of the oldest record
+    uint32_t frozen;    // GSUSB_REC_RUNNING / GSUSB_REC_FROZEN_*
+    uint32_t missed;    // frames not recorded while frozen
+};
+
+// Traffic statistics. A GSUSB_BREQ_TRAFFIC_READ looks at this many table
+// slots, RX table first, and returns the IDs found in them; the host reads
+// until it has seen gsusb_traffic_info.slots slots.
+#define GSUSB_TRAFFIC_VERSION    1
+#define GSUSB_TRAFFIC_READ_SLOTS 100
+#define GSUSB_TRAFFIC_WINDOWS    3
+
+// gsusb_traffic_id.flags
+#define GSUSB_TRAFFIC_TX (1U << 0) // sent by this device
+
+struct __attribute__((packed)) gsusb_traffic_info
+{
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t slots;           // ID table slots, both tables; 0 when compiled out
+    uint32_t ids;             // slots in use
+    uint32_t untracked;       // frames whose ID found no free slot
+    uint32_t bitrate;         // nominal; 0 until the bus was configured
+    uint32_t window_us[GSUSB_TRAFFIC_WINDOWS];     // shortest first
+    uint32_t load_permille[GSUSB_TRAFFIC_WINDOWS]; // over the last complete window
+    uint32_t peak_permille;   // busiest shortest window within the longest
+};
+
+struct __attribute__((packed)) gsusb_traffic_id
+{
+    uint32_t can_id;          // CAN_EFF_FLAG as in gs_host_frame
+    uint32_t flags;           // GSUSB_TRAFFIC_TX
+    uint32_t count;
+    uint32_t bits;            // bus bits with worst-case stuffing; wraps
+    uint32_t last_us;         // timestamp of the latest frame
+    uint32_t period_min_us;   // periods are 0 until the second frame
+    uint32_t period_mean_us;
+    uint32_t period_max_us;
+    uint32_t jitter_us;       // RFC 3550 estimate: smoothed change between periods
+};
+
+// Cyclic transmit. GSUSB_BREQ_CYCLIC with wValue GSUSB_CYCLIC_ALL and no
+// data stops every job.
+#define GSUSB_CYCLIC_ALL  0xFFFFU
+#define GSUSB_CYCLIC_NONE 0xFFU // counter_pos / checksum_pos: not used
+
+// gsusb_cyclic_job.checksum_type: over the other data bytes.
+#define GSUSB_CYCLIC_SUM8 0
+#define GSUSB_CYCLIC_XOR8 1
+
+struct __attribute__((packed)) gsusb_cyclic_job
+{
+    uint32_t can_id;        // CAN_EFF_FLAG / CAN_RTR_FLAG as in gs_host_frame
+    uint32_t period_us;
+    uint32_t count;         // frames to send, 0 until stopped
+    uint32_t delay_us;      // before the first frame, to set the phase between jobs
+    uint8_t can_dlc;
+    uint8_t counter_pos;    // byte with a rolling counter, or GSUSB_CYCLIC_NONE
+    uint8_t counter_mask;   // its bits in that byte, e.g. 0x0F
+    uint8_t checksum_pos;   // byte with a checksum, written after the counter
+    uint8_t checksum_type;  // GSUSB_CYCLIC_SUM8 / GSUSB_CYCLIC_XOR8
+    uint8_t reserved[3];
+    uint8_t data[8];
+};
+
+struct __attribute__((packed)) gsusb_cyclic_status
+{
+    uint32_t period_us;     // 0 once the job is stopped or done
+    uint32_t sent;
+    uint32_t late;          // released more than GSUSB_CYCLIC_LATE_US after their time
+    uint32_t max_late_us;
+    uint32_t skipped;       // periods missed entirely or refused by TWAI (bus-off, listen-only)
+};
+
+// Automatic bitrate detection, gsusb_autobaud.state
+#define GSUSB_AUTOBAUD_IDLE    0
+#define GSUSB_AUTOBAUD_RUNNING 1
+#define GSUSB_AUTOBAUD_LOCKED  2 // bitrate found and installed, bus stopped
+#define GSUSB_AUTOBAUD_FAILED  3 // no candidate saw a valid frame
+
+struct __attribute__((packed)) gsusb_autobaud
+{
+    uint32_t state;
+    uint32_t bitrate;         // 0 unless locked
+    uint32_t sample_point;    // per mille
+    uint32_t frames;          // valid frames the winner received in its window
+    uint32_t errors;          // bus errors the winner saw
+    uint32_t candidates;      // bitrates listened to
+    uint32_t elapsed_us;
+    struct gs_device_bittiming bt; // the winner, as GS_USB_BREQ_BITTIMING takes it
 };
 
 struct __attribute__((packed)) gs_host_config
@@ -1,23 +1,109 @@
+#include <atomic>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 
 #include "driver/twai.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "board_pins.h"
 #include "dbg_helpers.h"
 #include "gs_usb.h"
 #include "gsusb_can.h"
+#include "gsusb_config.h"
+#include "gsusb_filter.h"
+#include "gsusb_stats.h"
+#include "gsusb_timing.h"
 
 #include "led_service.h"
 
-static volatile bool can_active = false;
-static volatile bool can_initialized = false;
+// Driver state word: flags in the low byte, an epoch above it that moves on
+// every install, uninstall, start and stop. The fast paths (RX, TX, alerts)
+// never lock: they announce themselves in can_users and then re-check the
+// state; a writer sets CAN_ST_QUIESCING and waits for can_users to reach
+// zero before touching the driver. Both sides use seq_cst so one of them
+// always sees the other.
+#define CAN_ST_INSTALLED  0x01U
+#define CAN_ST_RUNNING    0x02U
+#define CAN_ST_QUIESCING  0x04U
+#define CAN_ST_FLAGS      0xFFU
+#define CAN_ST_EPOCH_SHIFT 8
+
+static std::atomic<uint32_t> can_state{0};
+static std::atomic<uint32_t> can_users{0};
+
+// Serializes the writers (control requests, bus-off recovery) only.
 static SemaphoreHandle_t can_mutex = nullptr;
 
+static bool driver_enter(uint32_t need)
+{
+    can_users.fetch_add(1, std::memory_order_seq_cst);
+    uint32_t st = can_state.load(std::memory_order_seq_cst);
+    if ((st & (need | CAN_ST_QUIESCING)) != need)
+    {
+        can_users.fetch_sub(1, std::memory_order_release);
+        return false;
+    }
+    return true;
+}
+
+static void driver_exit(void)
+{
+    can_users.fetch_sub(1, std::memory_order_release);
+}
+
+static TickType_t wait_slice(TickType_t timeout)
+{
+    const TickType_t slice = pdMS_TO_TICKS(GSUSB_CAN_WAIT_SLICE_MS);
+    return timeout < slice ? timeout : (slice > 0 ? slice : 1);
+}
+
+static void writer_lock(void)
+{
+    if (can_mutex)
+    {
+        xSemaphoreTake(can_mutex, portMAX_DELAY);
+    }
+}
+
+static void writer_unlock(void)
+{
+    if (can_mutex)
+    {
+        xSemaphoreGive(can_mutex);
+    }
+}
+
+// Keeps new fast-path callers out and waits for the ones inside the driver
+// to leave; their waits are capped at GSUSB_CAN_WAIT_SLICE_MS.
+static void quiesce(void)
+{
+    uint32_t t0 = GSUSB_STAT_CYCLES();
+    can_state.fetch_or(CAN_ST_QUIESCING, std::memory_order_seq_cst);
+    while (can_users.load(std::memory_order_seq_cst) != 0)
+    {
+        vTaskDelay(1);
+    }
+    GSUSB_STAT_SINCE(GSUSB_HIST_QUIESCE, t0);
+}
+
+// Publishes the new flags under a new epoch and lets the fast paths back in.
+static void publish(uint32_t flags)
+{
+    uint32_t st = can_state.load(std::memory_order_relaxed);
+    uint32_t epoch = (st >> CAN_ST_EPOCH_SHIFT) + 1;
+    can_state.store((epoch << CAN_ST_EPOCH_SHIFT) | flags, std::memory_order_seq_cst);
+}
+
+static uint32_t state_flags(void)
+{
+    return can_state.load(std::memory_order_acquire) & (CAN_ST_INSTALLED | CAN_ST_RUNNING);
+}
+
 void gsusb_can_init(void)
 {
     if (!can_mutex)
@@ -32,70 +118,154 @@ void gsusb_can_init(void)
             GSUSB_LOGI("GSUSB", "CAN mutex created");
         }
     }
-    can_active = false;
-    can_initialized = false;
+    can_state.store(0, std::memory_order_seq_cst);
 }
 
-SemaphoreHandle_t gsusb_can_get_mutex(void)
+bool gsusb_can_is_initialized(void)
 {
-    return can_mutex;
+    return (state_flags() & CAN_ST_INSTALLED) != 0;
 }
 
-bool gsusb_can_is_initialized(void)
+bool gsusb_can_is_active(void)
 {
-    return can_initialized;
+    return (state_flags() & CAN_ST_RUNNING) != 0;
 }
 
-bool gsusb_can_is_active(void)
+uint32_t gsusb_can_epoch(void)
 {
-    return can_active;
+    return can_state.load(std::memory_order_acquire) >> CAN_ST_EPOCH_SHIFT;
 }
 
-bool gsusb_can_set_bittiming(const struct gs_device_bittiming *bt)
+bool gsusb_can_acquire(uint32_t *epoch)
 {
-    twai_general_config_t g_config =
-        TWAI_GENERAL_CONFIG_DEFAULT(TX_CAN, RX_CAN, TWAI_MODE_NORMAL);
-    g_config.tx_queue_len = 20;
-    g_config.rx_queue_len = 20;
-    g_config.alerts_enabled = TWAI_ALERT_RX_DATA |
-                              TWAI_ALERT_BUS_OFF |
-                              TWAI_ALERT_BUS_ERROR;
+    if (!driver_enter(CAN_ST_INSTALLED | CAN_ST_RUNNING))
+    {
+        return false;
+    }
+    if (epoch)
+    {
+        *epoch = can_state.load(std::memory_order_relaxed) >> CAN_ST_EPOCH_SHIFT;
+    }
+    return true;
+}
 
-    twai_timing_config_t t_config = {};
-    t_config.brp = bt->brp;
-    t_config.tseg_1 = bt->prop_seg + bt->phase_seg1;
-    t_config.tseg_2 = bt->phase_seg2;
-    t_config.sjw = bt->sjw;
-    t_config.triple_sampling = false;
+void gsusb_can_release(void)
+{
+    driver_exit();
+}
 
-    GSUSB_LOGI("GSUSB",
-               "set_can_bittiming: brp=%" PRIu32
-               " prop=%" PRIu32 " phase1=%" PRIu32
-               " phase2=%" PRIu32 " sjw=%" PRIu32
-               " => tseg1=%u tseg2=%u",
-               bt->brp, bt->prop_seg, bt->phase_seg1,
-               bt->phase_seg2, bt->sjw,
-               (unsigned)t_config.tseg_1,
-               (unsigned)t_config.tseg_2);
+// Configuration the installed driver runs with; a BITTIMING or MODE START
+// that matches it only stops the controller instead of reinstalling.
+static twai_timing_config_t applied_timing;
+static twai_filter_config_t applied_filter;
+static twai_mode_t applied_mode = TWAI_MODE_NORMAL;
+
+static std::atomic<uint32_t> applied_bitrate{0};
+
+uint32_t gsusb_can_bitrate(void)
+{
+    return applied_bitrate.load(std::memory_order_relaxed);
+}
+
+// gs_device_mode.flags of the last MODE START; BITTIMING installs for them.
+static uint32_t requested_flags = 0;
+
+// Loopback maps to no-ACK mode: with self reception (set per frame) the
+// device hears its own frames without another node on the bus.
+static twai_mode_t mode_from_flags(uint32_t flags)
+{
+    if (flags & GS_CAN_MODE_LISTEN_ONLY)
+    {
+        return TWAI_MODE_LISTEN_ONLY;
+    }
+    if (flags & GS_CAN_MODE_LOOP_BACK)
+    {
+        return TWAI_MODE_NO_ACK;
+    }
+    return TWAI_MODE_NORMAL;
+}
+
+static bool timing_equal(const twai_timing_config_t &a, const twai_timing_config_t &b)
+{
+    return a.brp == b.brp && a.tseg_1 == b.tseg_1 && a.tseg_2 == b.tseg_2 &&
+           a.sjw == b.sjw && a.triple_sampling == b.triple_sampling;
+}
+
+static bool filter_equal(const twai_filter_config_t &a, const twai_filter_config_t &b)
+{
+    return a.acceptance_code == b.acceptance_code && a.acceptance_mask == b.acceptance_mask &&
+           a.single_filter == b.single_filter;
+}
 
-    if (t_config.tseg_1 > 16 || t_config.tseg_2 > 8)
+// Takes the host's timing when the controller can run it as is. Otherwise
+// the requested bitrate and sample point are mapped onto the nearest legal
+// timing: the precomputed table first, the solver for anything else.
+static bool resolve_timing(const struct gs_device_bittiming *bt, struct gsusb_timing *out)
+{
+    uint32_t tseg1 = bt->prop_seg + bt->phase_seg1;
+    uint32_t tseg2 = bt->phase_seg2;
+    uint32_t tq = 1 + tseg1 + tseg2;
+    if (bt->brp == 0 || tseg1 == 0 || tseg2 == 0 || bt->brp > GSUSB_TWAI_CLOCK_HZ / tq)
     {
-        GSUSB_LOGE("GSUSB", "Bit timing out of range, rejecting");
         return false;
     }
 
-    twai_filter_config_t f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+    if (gsusb_timing_legal(bt->brp, tseg1, tseg2))
+    {
+        out->brp = bt->brp;
+        out->tseg1 = (uint8_t)tseg1;
+        out->tseg2 = (uint8_t)tseg2;
+        uint32_t sjw = bt->sjw ? bt->sjw : 1;
+        sjw = sjw < tseg2 ? sjw : tseg2;
+        out->sjw = (uint8_t)(sjw < GSUSB_TWAI_SJW_MAX ? sjw : GSUSB_TWAI_SJW_MAX);
+        return true;
+    }
+
+    uint64_t div = (uint64_t)bt->brp * tq;
+    uint32_t bitrate = (uint32_t)((GSUSB_TWAI_CLOCK_HZ + div / 2) / div);
+    uint32_t sp = 1000 * (1 + tseg1) / tq;
 
-    if (can_initialized)
+    for (const gsusb_timing_entry &e : gsusb_timing_table)
+    {
+        if (e.bitrate == bitrate && gsusb_abs_diff(e.sp, sp) <= 25)
+        {
+            *out = e.timing;
+            return true;
+        }
+    }
+    return gsusb_timing_solve(bitrate, sp, *out);
+}
+
+// Leaves the driver installed with t/f/mode and stopped. Only a different
+// configuration reinstalls it; otherwise stopping empties the TX queue and
+// stale RX frames are dropped by hand. Called quiesced under writer_lock();
+// the caller publishes the new state.
+static bool driver_apply(const twai_timing_config_t &t, const twai_filter_config_t &f,
+                         twai_mode_t mode)
+{
+    uint32_t flags = state_flags();
+    if ((flags & CAN_ST_INSTALLED) && mode == applied_mode &&
+        timing_equal(t, applied_timing) && filter_equal(f, applied_filter))
+    {
+        if (flags & CAN_ST_RUNNING)
+        {
+            twai_stop();
+        }
+        twai_clear_receive_queue();
+        GSUSB_LOGI("GSUSB", "CAN configuration unchanged, driver kept");
+        return true;
+    }
+
+    if (flags & CAN_ST_INSTALLED)
     {
         GSUSB_LOGI("GSUSB", "Reconfig CAN: stopping + uninstall before reinstall");
 
-        if (can_active)
+        if (flags & CAN_ST_RUNNING)
         {
             esp_err_t stop_err = twai_stop();
+            (void)stop_err; // only logged
             GSUSB_LOGI("GSUSB", "twai_stop (reconfig) returned: %s",
                        esp_err_to_name(stop_err));
-            can_active = false;
         }
 
         esp_err_t un_err = twai_driver_uninstall();
@@ -106,58 +276,148 @@ bool gsusb_can_set_bittiming(const struct gs_device_bittiming *bt)
         }
     }
 
-    esp_err_t err = twai_driver_install(&g_config, &t_config, &f_config);
+    twai_general_config_t g_config =
+        TWAI_GENERAL_CONFIG_DEFAULT(TX_CAN, RX_CAN, mode);
+    g_config.tx_queue_len = GSUSB_CAN_TX_QUEUE_LEN;
+    g_config.rx_queue_len = 20;
+    g_config.alerts_enabled = TWAI_ALERT_RX_DATA |
+                              TWAI_ALERT_TX_SUCCESS |
+                              TWAI_ALERT_TX_FAILED |
+                              TWAI_ALERT_ERR_ACTIVE |
+                              TWAI_ALERT_ABOVE_ERR_WARN |
+                              TWAI_ALERT_ERR_PASS |
+                              TWAI_ALERT_BUS_OFF |
+                              TWAI_ALERT_BUS_RECOVERED |
+                              TWAI_ALERT_BUS_ERROR |
+                              TWAI_ALERT_ARB_LOST |
+                              TWAI_ALERT_RX_QUEUE_FULL |
+                              TWAI_ALERT_RX_FIFO_OVERRUN;
+
+    esp_err_t err = twai_driver_install(&g_config, &t, &f);
     if (err != ESP_OK)
     {
         GSUSB_LOGE("GSUSB", "twai_driver_install failed: %s",
                    esp_err_to_name(err));
-        can_initialized = false;
         return false;
     }
 
-    can_initialized = true;
-    GSUSB_LOGI("GSUSB", "twai_driver_install OK");
+    applied_timing = t;
+    applied_filter = f;
+    applied_mode = mode;
+    struct gsusb_timing timing = {t.brp, (uint8_t)t.tseg_1, (uint8_t)t.tseg_2, (uint8_t)t.sjw};
+    applied_bitrate.store(gsusb_timing_bitrate(timing), std::memory_order_relaxed);
+    LedService::getInstance().setBitrate(gsusb_timing_bitrate(timing));
+    GSUSB_LOGI("GSUSB", "twai_driver_install OK (mode %d, triple sampling %d)",
+               (int)mode, (int)t.triple_sampling);
     return true;
 }
 
-esp_err_t gsusb_can_start(void)
+bool gsusb_can_set_bittiming(const struct gs_device_bittiming *bt)
+{
+    struct gsusb_timing timing = {};
+    if (!resolve_timing(bt, &timing))
+    {
+        GSUSB_LOGE("GSUSB", "Bit timing brp=%" PRIu32 " prop=%" PRIu32 " phase1=%" PRIu32
+                   " phase2=%" PRIu32 " has no legal TWAI equivalent, rejecting",
+                   bt->brp, bt->prop_seg, bt->phase_seg1, bt->phase_seg2);
+        return false;
+    }
+
+    twai_timing_config_t t_config = {};
+    t_config.brp = timing.brp;
+    t_config.tseg_1 = timing.tseg1;
+    t_config.tseg_2 = timing.tseg2;
+    t_config.sjw = timing.sjw;
+
+    GSUSB_LOGI("GSUSB",
+               "set_can_bittiming: brp=%" PRIu32
+               " prop=%" PRIu32 " phase1=%" PRIu32
+               " phase2=%" PRIu32 " sjw=%" PRIu32
+               " => brp=%" PRIu32 " tseg1=%u tseg2=%u sjw=%u (%" PRIu32 " bit/s, sp %" PRIu32 ")",
+               bt->brp, bt->prop_seg, bt->phase_seg1,
+               bt->phase_seg2, bt->sjw,
+               timing.brp, (unsigned)timing.tseg1, (unsigned)timing.tseg2,
+               (unsigned)timing.sjw, gsusb_timing_bitrate(timing),
+               gsusb_timing_sample_point(timing));
+
+    twai_filter_config_t f_config;
+    gsusb_filter_get_hw_config(&f_config);
+
+    writer_lock();
+    quiesce();
+    // Install for the mode the interface ran with last time, so a plain
+    // down/up in the same mode never reinstalls at MODE START.
+    t_config.triple_sampling = (requested_flags & GS_CAN_MODE_TRIPLE_SAMPLE) != 0;
+    bool ok = driver_apply(t_config, f_config, mode_from_flags(requested_flags));
+    publish(ok ? CAN_ST_INSTALLED : 0);
+    writer_unlock();
+    return ok;
+}
+
+esp_err_t gsusb_can_start(uint32_t mode_flags)
 {
-    if (!can_initialized)
+    writer_lock();
+    uint32_t flags = state_flags();
+    if (!(flags & CAN_ST_INSTALLED))
     {
+        writer_unlock();
         GSUSB_LOGE("GSUSB", "gsusb_can_start: CAN not initialized");
         return ESP_ERR_INVALID_STATE;
     }
 
-    if (can_active)
+    if (flags & CAN_ST_RUNNING)
     {
+        writer_unlock();
         GSUSB_LOGI("GSUSB", "gsusb_can_start: CAN already active");
         return ESP_OK;
     }
 
+    // Nobody is inside the driver while it is stopped, but a caller that
+    // was refused a moment ago must not slip in half-way.
+    quiesce();
+
+    // Listen-only, no-ACK and triple sampling are fixed at install time.
+    requested_flags = mode_flags;
+    twai_timing_config_t t_config = applied_timing;
+    t_config.triple_sampling = (mode_flags & GS_CAN_MODE_TRIPLE_SAMPLE) != 0;
+    if (!driver_apply(t_config, applied_filter, mode_from_flags(mode_flags)))
+    {
+        publish(0);
+        LedService::getInstance().setStatusLed(LED_ERROR);
+        writer_unlock();
+        return ESP_FAIL;
+    }
+
     esp_err_t err = twai_start();
     if (err == ESP_OK)
     {
-        can_active = true;
+        publish(CAN_ST_INSTALLED | CAN_ST_RUNNING);
         LedService::getInstance().setStatusLed(LED_ACTIVE);
         GSUSB_LOGI("GSUSB", "twai_start OK, CAN active");
     }
     else
     {
+        publish(flags);
         LedService::getInstance().setStatusLed(LED_ERROR);
         GSUSB_LOGE("GSUSB", "twai_start failed: %s", esp_err_to_name(err));
     }
+    writer_unlock();
     return err;
 }
 
 void gsusb_can_stop(void)
 {
-    if (!can_initialized)
+    writer_lock();
+    uint32_t flags = state_flags();
+    if (!(flags & CAN_ST_INSTALLED))
     {
+        writer_unlock();
         GSUSB_LOGW("GSUSB", "gsusb_can_stop called but CAN not initialized");
         return;
     }
-    if (can_active)
+    if (flags & CAN_ST_RUNNING)
     {
+        quiesce();
         esp_err_t err = twai_stop();
         if (err == ESP_OK)
         {
@@ -169,28 +429,303 @@ void gsusb_can_stop(void)
             LedService::getInstance().setStatusLed(LED_ERROR);
             GSUSB_LOGE("GSUSB", "twai_stop failed: %s", esp_err_to_name(err));
         }
-        can_active = false;
+        publish(CAN_ST_INSTALLED);
     }
     else
     {
         GSUSB_LOGI("GSUSB", "gsusb_can_stop: CAN already inactive");
     }
+    writer_unlock();
 }
 
 esp_err_t gsusb_can_receive(twai_message_t *msg, TickType_t timeout)
 {
-    if (!can_initialized || !can_active)
+    if (!driver_enter(CAN_ST_INSTALLED | CAN_ST_RUNNING))
     {
         return ESP_ERR_INVALID_STATE;
     }
-    return twai_receive(msg, timeout);
+    esp_err_t err = twai_receive(msg, wait_slice(timeout));
+    driver_exit();
+    return err;
 }
 
 esp_err_t gsusb_can_transmit(const twai_message_t *msg, TickType_t timeout)
 {
-    if (!can_initialized || !can_active)
+    if (!driver_enter(CAN_ST_INSTALLED | CAN_ST_RUNNING))
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = twai_transmit(msg, wait_slice(timeout));
+    driver_exit();
+    return err;
+}
+
+esp_err_t gsusb_can_read_alerts(uint32_t *alerts, TickType_t timeout)
+{
+    if (!driver_enter(CAN_ST_INSTALLED | CAN_ST_RUNNING))
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = twai_read_alerts(alerts, wait_slice(timeout));
+    driver_exit();
+    return err;
+}
+
+esp_err_t gsusb_can_get_status(twai_status_info_t *status)
+{
+    if (!driver_enter(CAN_ST_INSTALLED))
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = twai_get_status_info(status);
+    driver_exit();
+    return err;
+}
+
+void gsusb_can_get_state(struct gs_device_state *state)
+{
+    twai_status_info_t status;
+
+    state->state = GS_CAN_STATE_STOPPED;
+    state->rxerr = 0;
+    state->txerr = 0;
+
+    if (gsusb_can_get_status(&status) != ESP_OK)
+    {
+        return;
+    }
+
+    state->rxerr = status.rx_error_counter;
+    state->txerr = status.tx_error_counter;
+
+    if (status.state == TWAI_STATE_BUS_OFF || status.state == TWAI_STATE_RECOVERING)
+    {
+        state->state = GS_CAN_STATE_BUS_OFF;
+    }
+    else if (status.state != TWAI_STATE_RUNNING || !gsusb_can_is_active())
+    {
+        state->state = GS_CAN_STATE_STOPPED;
+    }
+    else if (status.tx_error_counter >= 128 || status.rx_error_counter >= 128)
+    {
+        state->state = GS_CAN_STATE_ERROR_PASSIVE;
+    }
+    else if (status.tx_error_counter >= 96 || status.rx_error_counter >= 96)
+    {
+        state->state = GS_CAN_STATE_ERROR_WARNING;
+    }
+    else
+    {
+        state->state = GS_CAN_STATE_ERROR_ACTIVE;
+    }
+}
+
+esp_err_t gsusb_can_recover(void)
+{
+    writer_lock();
+    if (state_flags() != (CAN_ST_INSTALLED | CAN_ST_RUNNING))
+    {
+        writer_unlock();
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = twai_initiate_recovery();
+    if (err == ESP_OK)
+    {
+        LedService::getInstance().setStatusLed(LED_ERROR);
+        GSUSB_LOGW("GSUSB", "Bus-off, recovery started");
+    }
+    writer_unlock();
+    return err;
+}
+
+esp_err_t gsusb_can_restart(void)
+{
+    writer_lock();
+    if (state_flags() != (CAN_ST_INSTALLED | CAN_ST_RUNNING))
     {
+        writer_unlock();
         return ESP_ERR_INVALID_STATE;
     }
-    return twai_transmit(msg, timeout);
+    esp_err_t err = twai_start();
+    if (err == ESP_OK)
+    {
+        LedService::getInstance().setStatusLed(LED_ACTIVE);
+        GSUSB_LOGI("GSUSB", "Bus recovered, CAN active again");
+    }
+    else
+    {
+        GSUSB_LOGE("GSUSB", "twai_start after recovery failed: %s", esp_err_to_name(err));
+    }
+    writer_unlock();
+    return err;
+}
+
+#if GSUSB_AUTOBAUD
+// Candidates in the order they are tried: the rates vehicle buses use most
+// come first, so a busy bus usually locks within the first windows.
+static const uint32_t autobaud_order[] = {500000, 250000, 125000, 1000000, 100000,
+                                          50000,  800000, 83333,  20000,   10000};
+
+struct autobaud_score
+{
+    uint32_t frames;
+    uint32_t errors;
+};
+
+// One window in listen-only mode at timing. Frames are only counted, never
+// forwarded; the controller only keeps frames that passed its CRC check.
+static void autobaud_listen(const struct gsusb_timing &timing, struct autobaud_score *score)
+{
+    twai_general_config_t g_config =
+        TWAI_GENERAL_CONFIG_DEFAULT(TX_CAN, RX_CAN, TWAI_MODE_LISTEN_ONLY);
+    g_config.rx_queue_len = 20;
+    g_config.alerts_enabled = TWAI_ALERT_RX_DATA | TWAI_ALERT_BUS_ERROR;
+    twai_timing_config_t t_config = {};
+    t_config.brp = timing.brp;
+    t_config.tseg_1 = timing.tseg1;
+    t_config.tseg_2 = timing.tseg2;
+    t_config.sjw = timing.sjw;
+    twai_filter_config_t f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+
+    score->frames = 0;
+    score->errors = 0;
+    if (twai_driver_install(&g_config, &t_config, &f_config) != ESP_OK)
+    {
+        return;
+    }
+    if (twai_start() == ESP_OK)
+    {
+        int64_t end = esp_timer_get_time() + GSUSB_AUTOBAUD_WINDOW_MS * 1000;
+        for (;;)
+        {
+            int64_t left_us = end - esp_timer_get_time();
+            if (left_us <= 0)
+            {
+                break;
+            }
+            TickType_t wait = pdMS_TO_TICKS((left_us + 999) / 1000);
+            uint32_t alerts;
+            twai_read_alerts(&alerts, wait > 0 ? wait : 1);
+
+            twai_message_t msg;
+            while (twai_receive(&msg, 0) == ESP_OK)
+            {
+                score->frames++;
+            }
+            twai_status_info_t status;
+            if (twai_get_status_info(&status) == ESP_OK)
+            {
+                score->errors = status.bus_error_count;
+            }
+            if ((score->frames >= GSUSB_AUTOBAUD_LOCK_FRAMES && score->errors == 0) ||
+                (score->frames == 0 && score->errors >= GSUSB_AUTOBAUD_REJECT_ERRORS))
+            {
+                break;
+            }
+        }
+        twai_stop();
+    }
+    twai_driver_uninstall();
+}
+#endif
+
+bool gsusb_can_autobaud(struct gsusb_autobaud *result)
+{
+    memset(result, 0, sizeof(*result));
+    result->state = GSUSB_AUTOBAUD_FAILED;
+#if GSUSB_AUTOBAUD
+    writer_lock();
+    uint32_t flags = state_flags();
+    if (flags & CAN_ST_RUNNING)
+    {
+        writer_unlock();
+        GSUSB_LOGW("GSUSB", "Autobaud refused: CAN is running");
+        return false;
+    }
+    int64_t t0 = esp_timer_get_time();
+
+    // The driver has to be reinstalled for every candidate. The fast paths
+    // are kept out once for the whole sweep: with nothing published as
+    // installed they stay away without a quiesce per bitrate.
+    quiesce();
+    if (flags & CAN_ST_INSTALLED)
+    {
+        twai_driver_uninstall();
+    }
+    publish(0);
+
+    struct gsusb_timing best = {};
+    struct autobaud_score best_score = {};
+    int32_t best_value = 0;
+    for (uint32_t bitrate : autobaud_order)
+    {
+        const gsusb_timing_entry *entry = nullptr;
+        for (const gsusb_timing_entry &e : gsusb_timing_table)
+        {
+            if (e.bitrate == bitrate)
+            {
+                entry = &e;
+            }
+        }
+        if (entry == nullptr)
+        {
+            continue;
+        }
+
+        struct autobaud_score score;
+        autobaud_listen(entry->timing, &score);
+        result->candidates++;
+        int32_t value = (int32_t)score.frames - (int32_t)score.errors;
+        if (score.frames > 0 && value > best_value)
+        {
+            best = entry->timing;
+            best_score = score;
+            best_value = value;
+        }
+        if (score.frames >= GSUSB_AUTOBAUD_LOCK_FRAMES && score.errors == 0)
+        {
+            break;
+        }
+    }
+
+    // The winner is installed like a BITTIMING request would; without one
+    // the previous configuration comes back.
+    bool installed = false;
+    if (best_value > 0)
+    {
+        twai_timing_config_t t_config = {};
+        t_config.brp = best.brp;
+        t_config.tseg_1 = best.tseg1;
+        t_config.tseg_2 = best.tseg2;
+        t_config.sjw = best.sjw;
+        t_config.triple_sampling = (requested_flags & GS_CAN_MODE_TRIPLE_SAMPLE) != 0;
+        twai_filter_config_t f_config;
+        gsusb_filter_get_hw_config(&f_config);
+        installed = driver_apply(t_config, f_config, mode_from_flags(requested_flags));
+    }
+    else if (flags & CAN_ST_INSTALLED)
+    {
+        installed = driver_apply(applied_timing, applied_filter, applied_mode);
+    }
+    publish(installed ? CAN_ST_INSTALLED : 0);
+    writer_unlock();
+
+    result->elapsed_us = (uint32_t)(esp_timer_get_time() - t0);
+    if (best_value > 0 && installed)
+    {
+        result->state = GSUSB_AUTOBAUD_LOCKED;
+        result->bitrate = gsusb_timing_bitrate(best);
+        result->sample_point = gsusb_timing_sample_point(best);
+        result->frames = best_score.frames;
+        result->errors = best_score.errors;
+        result->bt.prop_seg = best.tseg1 / 2;
+        result->bt.phase_seg1 = best.tseg1 - best.tseg1 / 2;
+        result->bt.phase_seg2 = best.tseg2;
+        result->bt.sjw = best.sjw;
+        result->bt.brp = best.brp;
+    }
+    GSUSB_LOGI("GSUSB", "Autobaud: %" PRIu32 " bit/s after %" PRIu32 " candidates, %" PRIu32 " us",
+               result->bitrate, result->candidates, result->elapsed_us);
+#endif
+    return true;
 }
@@ -14,17 +14,46 @@ void gsusb_can_init(void);
 
 bool gsusb_can_set_bittiming(const struct gs_device_bittiming *bt);
 
-esp_err_t gsusb_can_start(void);
+// mode_flags are gs_device_mode.flags. Listen-only, loopback (no-ACK mode;
+// the TX path asks for self reception) and triple sampling are install
+// settings: the driver is reinstalled when they differ from the last start.
+esp_err_t gsusb_can_start(uint32_t mode_flags);
 void      gsusb_can_stop(void);
 
 
 bool gsusb_can_is_initialized(void);
 bool gsusb_can_is_active(void);
 
-SemaphoreHandle_t gsusb_can_get_mutex(void);
+// Nominal bitrate of the last install; 0 before the first.
+uint32_t gsusb_can_bitrate(void);
 
+// Bumped by every install, uninstall, start and stop.
+uint32_t gsusb_can_epoch(void);
+
+// Lock-free fast-path access. While acquired the driver stays running in
+// the returned epoch; BITTIMING/MODE wait for every holder to release.
+// Keep it short: the calls below block for at most GSUSB_CAN_WAIT_SLICE_MS.
+bool gsusb_can_acquire(uint32_t *epoch);
+void gsusb_can_release(void);
+
+// Driver calls; ESP_ERR_INVALID_STATE while stopped or being reconfigured.
+// Longer timeouts are cut to GSUSB_CAN_WAIT_SLICE_MS.
 esp_err_t gsusb_can_receive(twai_message_t *msg, TickType_t timeout);
 esp_err_t gsusb_can_transmit(const twai_message_t *msg, TickType_t timeout);
+esp_err_t gsusb_can_read_alerts(uint32_t *alerts, TickType_t timeout);
+esp_err_t gsusb_can_get_status(twai_status_info_t *status);
+
+void      gsusb_can_get_state(struct gs_device_state *state);
+
+// Bus-off handling: start recovery (128 x 11 recessive bits), then
+// restart the controller once TWAI_ALERT_BUS_RECOVERED arrives.
+esp_err_t gsusb_can_recover(void);
+esp_err_t gsusb_can_restart(void);
+
+// Listens for the bus bitrate (GSUSB_BREQ_AUTOBAUD) and leaves the winner
+// installed and stopped, as a BITTIMING request for it would. Blocks for up
+// to one window per candidate; false while the bus is running.
+bool gsusb_can_autobaud(struct gsusb_autobaud *result);
 
 #ifdef __cplusplus
 }
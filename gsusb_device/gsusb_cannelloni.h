@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "driver/twai.h"
+#include "gs_usb.h"
+#include "gsusb_frame.h"
+
+// cannelloni UDP wire format, version 2 (github.com/mguentner/cannelloni).
+// A datagram is a 5-byte header followed by count frames:
+//
+//   header: version (2) | op_code (0 = data) | seq_no | count (BE16)
+//   frame:  can_id (BE32, SocketCAN flags) | len | data[len]
+//
+// RTR frames carry no data bytes. A len with bit 7 set is a CAN FD frame
+// and is followed by a flags byte. Header-only so the host sim peer speaks
+// exactly the same format.
+
+#define GSUSB_CNL_VERSION     2
+#define GSUSB_CNL_OP_DATA     0
+#define GSUSB_CNL_HEADER_SIZE 5
+#define GSUSB_CNL_FRAME_MAX   (4 + 1 + 8) // largest classic frame
+#define GSUSB_CNL_LEN_FD      0x80
+
+static inline void gsusb_cnl_put_header(uint8_t *p, uint8_t seq, uint16_t count)
+{
+    p[0] = GSUSB_CNL_VERSION;
+    p[1] = GSUSB_CNL_OP_DATA;
+    p[2] = seq;
+    p[3] = (uint8_t)(count >> 8);
+    p[4] = (uint8_t)count;
+}
+
+static inline uint32_t gsusb_cnl_frame_size(const twai_message_t *msg)
+{
+    return 5 + (msg->rtr ? 0 : gsusb_frame_dlc(msg->data_length_code));
+}
+
+// Encodes msg at p; returns the bytes written.
+static inline uint32_t gsusb_cnl_put_frame(uint8_t *p, const twai_message_t *msg)
+{
+    uint32_t id = gsusb_frame_can_id(msg);
+    uint8_t len = gsusb_frame_dlc(msg->data_length_code);
+    p[0] = (uint8_t)(id >> 24);
+    p[1] = (uint8_t)(id >> 16);
+    p[2] = (uint8_t)(id >> 8);
+    p[3] = (uint8_t)id;
+    p[4] = len;
+    if (msg->rtr)
+    {
+        return 5;
+    }
+    memcpy(p + 5, msg->data, len);
+    return 5 + len;
+}
+
+struct gsusb_cnl_reader
+{
+    const uint8_t *p;
+    const uint8_t *end;
+    uint32_t left; // frames announced by the header and not read yet
+};
+
+// Checks the header of a received datagram; false if it is not a version 2
+// data packet.
+static inline bool gsusb_cnl_begin(struct gsusb_cnl_reader *r, const uint8_t *buf, uint32_t len,
+                                   uint8_t *seq)
+{
+    if (len < GSUSB_CNL_HEADER_SIZE || buf[0] != GSUSB_CNL_VERSION || buf[1] != GSUSB_CNL_OP_DATA)
+    {
+        return false;
+    }
+    *seq = buf[2];
+    r->left = ((uint32_t)buf[3] << 8) | buf[4];
+    r->p = buf + GSUSB_CNL_HEADER_SIZE;
+    r->end = buf + len;
+    return true;
+}
+
+enum gsusb_cnl_result
+{
+    GSUSB_CNL_END,   // all frames read
+    GSUSB_CNL_FRAME, // msg holds a classic data or RTR frame
+    GSUSB_CNL_SKIP,  // CAN FD or error frame, not for a classic bus
+    GSUSB_CNL_BAD,   // truncated or malformed; stop reading
+};
+
+static inline enum gsusb_cnl_result gsusb_cnl_next(struct gsusb_cnl_reader *r, twai_message_t *msg)
+{
+    if (r->left == 0)
+    {
+        return GSUSB_CNL_END;
+    }
+    if (r->end - r->p < 5)
+    {
+        return GSUSB_CNL_BAD;
+    }
+    uint32_t id = ((uint32_t)r->p[0] << 24) | ((uint32_t)r->p[1] << 16) |
+                  ((uint32_t)r->p[2] << 8) | r->p[3];
+    uint8_t raw_len = r->p[4];
+    bool fd = (raw_len & GSUSB_CNL_LEN_FD) != 0;
+    uint32_t len = raw_len & ~GSUSB_CNL_LEN_FD;
+    uint32_t head = fd ? 6 : 5;
+    uint32_t body = (id & CAN_RTR_FLAG) ? 0 : len;
+    if (len > (fd ? 64U : 8U) || (uint32_t)(r->end - r->p) < head + body)
+    {
+        return GSUSB_CNL_BAD;
+    }
+
+    const uint8_t *data = r->p + head;
+    r->p += head + body;
+    r->left--;
+    if (fd || (id & CAN_ERR_FLAG))
+    {
+        return GSUSB_CNL_SKIP;
+    }
+
+    memset(msg, 0, sizeof(*msg));
+    msg->extd = (id & CAN_EFF_FLAG) ? 1 : 0;
+    msg->rtr = (id & CAN_RTR_FLAG) ? 1 : 0;
+    msg->identifier = id & (msg->extd ? GSUSB_CAN_ID_MASK : 0x7FFU);
+    msg->data_length_code = (uint8_t)len;
+    memcpy(msg->data, data, body);
+    return GSUSB_CNL_FRAME;
+}
@@ -0,0 +1,406 @@
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "tinyusb.h"
+#include "esp_log.h"
+
+#include "dbg_helpers.h"
+#include "gs_usb.h"
+#include "gsusb_config.h"
+
+#include "gsusb_can.h"
+#include "gsusb_cdc.h"
+#include "gsusb_slcan.h"
+#include "gsusb_stats.h"
+#include "gsusb_usb.h"
+#include "spsc_ring.h"
+
+#if GSUSB_SLCAN
+
+#include "class/cdc/cdc_device.h"
+
+#define CDC_RX_BUF_SIZE 256 // host lines read per tud_cdc_read()
+#define CDC_IN_BUF_SIZE 512 // lines per tud_cdc_write()
+
+static_assert(CDC_IN_BUF_SIZE >= GSUSB_SLCAN_LINE_MAX, "CDC_IN_BUF_SIZE must hold a line");
+
+struct cdc_rx_entry
+{
+    twai_message_t msg;
+    uint32_t ts_us;
+};
+
+struct cdc_reply
+{
+    uint8_t len;
+    char text[GSUSB_SLCAN_LINE_MAX];
+};
+
+static TaskHandle_t h_cdc_in_task = nullptr;
+
+static SpscRing<struct cdc_rx_entry> cdc_rx_ring; // can_rx_task -> cdc_in_task
+static SpscRing<struct cdc_reply> cdc_reply_ring; // usb_tx_task -> cdc_in_task
+static char cdc_in_buf[CDC_IN_BUF_SIZE];
+
+// Channel state, changed by usb_tx_task (commands) and the TinyUSB task
+// (port closed).
+static std::atomic<bool> cdc_open{false};
+static std::atomic<bool> cdc_timestamps{false};
+static uint32_t cdc_bitrate = GSUSB_SLCAN_BITRATE;
+
+// usb_tx_task only: host bytes not parsed yet.
+static char cdc_rx_buf[CDC_RX_BUF_SIZE];
+static uint32_t cdc_rx_len = 0;
+static uint32_t cdc_rx_pos = 0;
+static bool cdc_rx_overlong = false;
+
+bool gsusb_cdc_active(void)
+{
+    return cdc_open.load(std::memory_order_relaxed);
+}
+
+void gsusb_cdc_rx_frame(const twai_message_t *msg, uint32_t ts_us)
+{
+    if (!cdc_open.load(std::memory_order_relaxed) || !tud_cdc_connected())
+    {
+        return;
+    }
+    struct cdc_rx_entry e;
+    e.msg = *msg;
+    e.ts_us = ts_us;
+    if (!cdc_rx_ring.push(e))
+    {
+        GSUSB_STAT_INC(GSUSB_STAT_RX_DROP_SLCAN);
+        return;
+    }
+    xTaskNotifyGive(h_cdc_in_task);
+}
+
+// Fills one CDC write with queued replies, then frames, and sends it;
+// false when nothing was written (nothing queued or no room).
+static bool cdc_in_write(void)
+{
+    uint32_t room = tud_cdc_write_available();
+    if (room > sizeof(cdc_in_buf))
+    {
+        room = sizeof(cdc_in_buf);
+    }
+
+    uint32_t len = 0;
+    const struct cdc_reply *reply;
+    while ((reply = cdc_reply_ring.front()) != nullptr && len + reply->len <= room)
+    {
+        memcpy(cdc_in_buf + len, reply->text, reply->len);
+        len += reply->len;
+        cdc_reply_ring.pop();
+    }
+
+    bool ts = cdc_timestamps.load(std::memory_order_relaxed);
+    uint32_t frames = 0;
+    const struct cdc_rx_entry *e;
+    while (len + GSUSB_SLCAN_LINE_MAX <= room && (e = cdc_rx_ring.front()) != nullptr)
+    {
+        int32_t ts_ms = ts ? (int32_t)((e->ts_us / 1000) % GSUSB_SLCAN_TS_WRAP) : -1;
+        len += gsusb_slcan_put_frame(cdc_in_buf + len, &e->msg, ts_ms);
+        cdc_rx_ring.pop();
+        frames++;
+    }
+
+    if (len == 0)
+    {
+        return false;
+    }
+    tud_cdc_write(cdc_in_buf, len);
+    tud_cdc_write_flush();
+    GSUSB_STAT_ADD(GSUSB_STAT_RX_TO_SLCAN, frames);
+    return true;
+}
+
+extern "C" void cdc_in_task(void *arg)
+{
+    (void)arg;
+
+    GSUSB_LOGI("gsusb_cdc", "cdc_in_task started");
+
+    for (;;)
+    {
+        // Woken by new frames and replies, and by tud_cdc_tx_complete_cb
+        // once the FIFO has room again.
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (cdc_in_write())
+        {
+        }
+    }
+}
+
+extern "C" void tud_cdc_tx_complete_cb(uint8_t itf)
+{
+    (void)itf;
+    if (h_cdc_in_task != nullptr)
+    {
+        xTaskNotifyGive(h_cdc_in_task);
+    }
+}
+
+// A dropped reply only happens when the host stopped reading the port.
+static void cdc_reply(const char *text, uint32_t len)
+{
+    struct cdc_reply r;
+    r.len = (uint8_t)len;
+    memcpy(r.text, text, len);
+    if (!cdc_reply_ring.push(r))
+    {
+        GSUSB_STAT_INC(GSUSB_STAT_SLCAN_DROP_REPLY);
+        return;
+    }
+    xTaskNotifyGive(h_cdc_in_task);
+}
+
+static void cdc_ok(void)
+{
+    cdc_reply("\r", 1);
+}
+
+static void cdc_bell(void)
+{
+    const char bell = GSUSB_SLCAN_BELL;
+    cdc_reply(&bell, 1);
+}
+
+static bool cdc_open_bus(uint32_t mode_flags)
+{
+    if (cdc_open.load() || gsusb_can_is_active())
+    {
+        return false;
+    }
+    if (gsusb_usb_bus_start(cdc_bitrate, mode_flags) != ESP_OK)
+    {
+        GSUSB_LOGE("gsusb_cdc", "Could not start the bus at %u bit/s", (unsigned)cdc_bitrate);
+        return false;
+    }
+    cdc_open.store(true);
+    gsusb_usb_kick();
+    return true;
+}
+
+static bool cdc_close_bus(void)
+{
+    if (!cdc_open.exchange(false))
+    {
+        return false;
+    }
+    gsusb_can_stop();
+    gsusb_usb_kick();
+    return true;
+}
+
+// Lawicel status flags: error warning (bit 2), error passive (5), bus
+// error (7, reported for bus-off).
+static void cdc_status(void)
+{
+    struct gs_device_state st;
+    gsusb_can_get_state(&st);
+    uint8_t flags = st.state == GS_CAN_STATE_ERROR_WARNING   ? 0x04
+                    : st.state == GS_CAN_STATE_ERROR_PASSIVE ? 0x20
+                    : st.state == GS_CAN_STATE_BUS_OFF       ? 0x80
+                                                             : 0x00;
+    char line[4] = {'F'};
+    gsusb_slcan_put_byte(line + 1, flags);
+    line[3] = '\r';
+    cdc_reply(line, sizeof(line));
+}
+
+// One host line, '\r' excluded; true if it is a frame to send.
+static bool cdc_line(const char *p, uint32_t len, twai_message_t *msg)
+{
+    // Tools that end lines with "\r\n" leave the '\n' in front of the next.
+    while (len > 0 && *p == '\n')
+    {
+        p++;
+        len--;
+    }
+    if (cdc_rx_overlong)
+    {
+        cdc_rx_overlong = false;
+        GSUSB_STAT_INC(GSUSB_STAT_SLCAN_BAD_LINES);
+        cdc_bell();
+        return false;
+    }
+    if (len == 0)
+    {
+        // slcand opens with "\r\r\r" to flush the line; nothing to answer.
+        return false;
+    }
+
+    switch (p[0])
+    {
+    case 't':
+    case 'T':
+    case 'r':
+    case 'R':
+        if (!cdc_open.load(std::memory_order_relaxed))
+        {
+            cdc_bell();
+            return false;
+        }
+        if (!gsusb_slcan_parse_frame(p, len, msg))
+        {
+            GSUSB_STAT_INC(GSUSB_STAT_SLCAN_BAD_LINES);
+            cdc_bell();
+            return false;
+        }
+        return true;
+
+    case 'S':
+    {
+        uint32_t rate = len == 2 ? gsusb_slcan_bitrate(p[1]) : 0;
+        if (rate == 0 || cdc_open.load())
+        {
+            cdc_bell();
+            return false;
+        }
+        cdc_bitrate = rate;
+        cdc_ok();
+        return false;
+    }
+
+    case 'O':
+    case 'L':
+        if (cdc_open_bus(p[0] == 'L' ? GS_CAN_MODE_LISTEN_ONLY : 0))
+            cdc_ok();
+        else
+            cdc_bell();
+        return false;
+
+    case 'C':
+        if (cdc_close_bus())
+            cdc_ok();
+        else
+            cdc_bell();
+        return false;
+
+    case 'Z':
+        if (len != 2 || (p[1] != '0' && p[1] != '1'))
+        {
+            cdc_bell();
+            return false;
+        }
+        cdc_timestamps.store(p[1] == '1');
+        cdc_ok();
+        return false;
+
+    case 'F':
+        cdc_status();
+        return false;
+
+    case 'V':
+        cdc_reply("V1013\r", 6);
+        return false;
+
+    case 'N':
+        cdc_reply("N0001\r", 6);
+        return false;
+
+    case 'M':
+    case 'm':
+        // Acceptance code/mask of the SJA1000: accepted and ignored; the
+        // gs_usb filter request is the way to filter on this device.
+        cdc_ok();
+        return false;
+
+    default:
+        GSUSB_STAT_INC(GSUSB_STAT_SLCAN_BAD_LINES);
+        cdc_bell();
+        return false;
+    }
+}
+
+bool gsusb_cdc_tx_next(twai_message_t *msg)
+{
+    for (;;)
+    {
+        char *line = cdc_rx_buf + cdc_rx_pos;
+        uint32_t left = cdc_rx_len - cdc_rx_pos;
+        char *end = static_cast<char *>(memchr(line, '\r', left));
+        if (end != nullptr)
+        {
+            cdc_rx_pos += (uint32_t)(end - line) + 1;
+            if (cdc_line(line, (uint32_t)(end - line), msg))
+            {
+                return true;
+            }
+            continue;
+        }
+
+        // Keep the partial line and read more behind it. A line that fills
+        // the whole buffer is garbage: drop it up to its '\r'.
+        if (left == sizeof(cdc_rx_buf))
+        {
+            cdc_rx_overlong = true;
+            left = 0;
+        }
+        memmove(cdc_rx_buf, line, left);
+        cdc_rx_pos = 0;
+        cdc_rx_len = left;
+
+        uint32_t n = tud_cdc_read(cdc_rx_buf + left, sizeof(cdc_rx_buf) - left);
+        if (n == 0)
+        {
+            return false;
+        }
+        cdc_rx_len += n;
+    }
+}
+
+void gsusb_cdc_tx_done(const twai_message_t *msg, bool queued)
+{
+    if (!queued)
+    {
+        cdc_bell();
+        return;
+    }
+    GSUSB_STAT_INC(GSUSB_STAT_TX_FROM_SLCAN);
+    cdc_reply(msg->extd ? "Z\r" : "z\r", 2);
+}
+
+// Closing the port (DTR dropped) closes a channel the tool left open.
+extern "C" void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts)
+{
+    (void)itf;
+    (void)rts;
+    if (!dtr && cdc_close_bus())
+    {
+        GSUSB_LOGI("gsusb_cdc", "Port closed, bus stopped");
+    }
+}
+
+esp_err_t gsusb_cdc_start(void)
+{
+    if (!cdc_rx_ring.init(GSUSB_SLCAN_RING_SLOTS, false) ||
+        !cdc_reply_ring.init(GSUSB_SLCAN_REPLY_SLOTS, false))
+    {
+        GSUSB_LOGE("gsusb_cdc", "Failed to allocate the SLCAN rings");
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreatePinnedToCore(cdc_in_task, "cdc_in", GSUSB_SLCAN_TASK_STACK, nullptr,
+                                GSUSB_SLCAN_TASK_PRIO, &h_cdc_in_task,
+                                GSUSB_USB_CORE < portNUM_PROCESSORS ? GSUSB_USB_CORE : 0) != pdPASS)
+    {
+        GSUSB_LOGE("gsusb_cdc", "Failed to create cdc_in_task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+#else
+
+esp_err_t gsusb_cdc_start(void)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "driver/twai.h"
+#include "gsusb_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// SLCAN on a CDC-ACM interface next to the gs_usb one, for tools that only
+// speak slcan. Host lines are parsed in place out of a read buffer by
+// usb_tx_task, which hands frames to TWAI like bulk OUT frames: while TWAI
+// is full the CDC FIFO is not read and the host is NAKed. Bus frames are
+// encoded by cdc_in_task, as many per CDC write as fit.
+//
+// The bus is shared with gs_usb: O fails while something else has it
+// running, and only the SLCAN side's own O is undone by C or by the port
+// being closed (DTR dropped).
+
+// Allocates the rings and creates cdc_in_task. Called by gsusb_init().
+esp_err_t gsusb_cdc_start(void);
+
+#if GSUSB_SLCAN
+// The host opened the channel with O or L.
+bool gsusb_cdc_active(void);
+
+// can_rx_task: one received frame, already through the acceptance filter.
+void gsusb_cdc_rx_frame(const twai_message_t *msg, uint32_t ts_us);
+
+// usb_tx_task: the next frame the host asked for; false once the CDC FIFO
+// holds no complete frame line. Commands on the way are answered here.
+bool gsusb_cdc_tx_next(twai_message_t *msg);
+
+// usb_tx_task: whether that frame was queued for TWAI (z/Z) or not (BELL).
+void gsusb_cdc_tx_done(const twai_message_t *msg, bool queued);
+#else
+static inline bool gsusb_cdc_active(void)
+{
+    return false;
+}
+
+static inline void gsusb_cdc_rx_frame(const twai_message_t *msg, uint32_t ts_us)
+{
+    (void)msg;
+    (void)ts_us;
+}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
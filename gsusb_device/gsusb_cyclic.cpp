@@ -0,0 +1,369 @@
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "dbg_helpers.h"
+#include "gs_usb.h"
+#include "gsusb_config.h"
+
+#include "gsusb_cyclic.h"
+#include "gsusb_frame.h"
+#include "spsc_ring.h"
+
+#if GSUSB_CYCLIC
+
+#define CYCLIC_END  0xFFU // end of a wheel slot list
+#define CYCLIC_MASK (GSUSB_CYCLIC_WHEEL_SLOTS - 1)
+
+static_assert((GSUSB_CYCLIC_WHEEL_SLOTS & CYCLIC_MASK) == 0, "GSUSB_CYCLIC_WHEEL_SLOTS must be a power of two");
+static_assert(GSUSB_CYCLIC_JOBS < CYCLIC_END, "GSUSB_CYCLIC_JOBS must fit a wheel link");
+
+struct cyclic_cmd
+{
+    uint32_t job;
+    bool stop;
+    struct gsusb_cyclic_job def;
+};
+
+struct cyclic_entry
+{
+    struct gsusb_cyclic_job def;
+    int64_t due_us;
+    uint32_t late_us;   // lateness of the frame handed out last
+    uint32_t remaining; // frames left; 0 until stopped
+    uint8_t counter;
+    uint8_t next;       // next job in the same wheel slot
+    bool active;
+};
+
+// usb_tx_task only, except status, which the TinyUSB task reads.
+static struct cyclic_entry jobs[GSUSB_CYCLIC_JOBS];
+static struct gsusb_cyclic_status status[GSUSB_CYCLIC_JOBS];
+static uint32_t active_jobs = 0;
+
+// Slot t & CYCLIC_MASK lists the jobs due in tick t, t + SLOTS, ... by due
+// time, so a head that is not due means nothing in the slot is.
+static uint8_t wheel[GSUSB_CYCLIC_WHEEL_SLOTS];
+static uint32_t wheel_tick = 0; // oldest tick that may still hold due jobs
+
+static esp_timer_handle_t timer = nullptr;
+static int64_t armed_us = 0;
+static std::atomic<bool> armed{false};
+static void (*wake_fn)(void) = nullptr;
+
+static SpscRing<struct cyclic_cmd> cmd_ring; // TinyUSB task -> usb_tx_task
+
+static uint32_t cyclic_tick(int64_t t_us)
+{
+    return (uint32_t)(t_us / GSUSB_CYCLIC_TICK_US);
+}
+
+static void wheel_insert(uint32_t i)
+{
+    uint8_t *link = &wheel[cyclic_tick(jobs[i].due_us) & CYCLIC_MASK];
+    while (*link != CYCLIC_END && jobs[*link].due_us <= jobs[i].due_us)
+    {
+        link = &jobs[*link].next;
+    }
+    jobs[i].next = *link;
+    *link = (uint8_t)i;
+}
+
+static void wheel_remove(uint32_t i)
+{
+    uint8_t *link = &wheel[cyclic_tick(jobs[i].due_us) & CYCLIC_MASK];
+    while (*link != CYCLIC_END && *link != i)
+    {
+        link = &jobs[*link].next;
+    }
+    if (*link == i)
+    {
+        *link = jobs[i].next;
+    }
+}
+
+static void cyclic_stop(uint32_t i)
+{
+    if (jobs[i].active)
+    {
+        wheel_remove(i);
+        jobs[i].active = false;
+        active_jobs--;
+    }
+    status[i].period_us = 0;
+}
+
+static void cyclic_apply(const struct cyclic_cmd &c, int64_t now)
+{
+    uint32_t first = c.job == GSUSB_CYCLIC_ALL ? 0 : c.job;
+    uint32_t last = c.job == GSUSB_CYCLIC_ALL ? GSUSB_CYCLIC_JOBS - 1 : c.job;
+    for (uint32_t i = first; i <= last; i++)
+    {
+        cyclic_stop(i);
+        if (c.stop)
+        {
+            continue;
+        }
+
+        struct cyclic_entry &e = jobs[i];
+        e.def = c.def;
+        e.due_us = now + c.def.delay_us;
+        e.remaining = c.def.count;
+        e.counter = 0;
+        e.active = true;
+        active_jobs++;
+        wheel_insert(i);
+
+        memset(&status[i], 0, sizeof(status[i]));
+        status[i].period_us = c.def.period_us;
+    }
+}
+
+static void cyclic_timer_cb(void *arg)
+{
+    (void)arg;
+    armed.store(false, std::memory_order_release);
+    wake_fn();
+}
+
+// Arms the timer for the earliest due job. Slots are looked at from the
+// current tick on; a head due in the very tick looked at is the earliest,
+// since anything in a later slot, or a later round, is due after it.
+static void cyclic_arm(int64_t now)
+{
+    int64_t next = INT64_MAX;
+    for (uint32_t k = 0; k < GSUSB_CYCLIC_WHEEL_SLOTS; k++)
+    {
+        uint32_t tick = wheel_tick + k;
+        uint8_t head = wheel[tick & CYCLIC_MASK];
+        if (head == CYCLIC_END)
+        {
+            continue;
+        }
+        if (jobs[head].due_us < next)
+        {
+            next = jobs[head].due_us;
+        }
+        if (cyclic_tick(jobs[head].due_us) == tick)
+        {
+            break;
+        }
+    }
+    if (next == INT64_MAX || (next == armed_us && armed.load(std::memory_order_acquire)))
+    {
+        return;
+    }
+
+    esp_timer_stop(timer);
+    armed_us = next;
+    armed.store(true, std::memory_order_release);
+    if (esp_timer_start_once(timer, next > now ? (uint64_t)(next - now) : 0) != ESP_OK)
+    {
+        armed.store(false, std::memory_order_release);
+    }
+}
+
+// Takes the first due job off the wheel, or returns -1.
+static int32_t wheel_pop_due(int64_t now)
+{
+    uint32_t now_tick = cyclic_tick(now);
+    if ((int32_t)(now_tick - wheel_tick) >= GSUSB_CYCLIC_WHEEL_SLOTS)
+    {
+        // Every slot once is enough after a long sleep.
+        wheel_tick = now_tick - GSUSB_CYCLIC_WHEEL_SLOTS + 1;
+    }
+    for (;;)
+    {
+        uint8_t &head = wheel[wheel_tick & CYCLIC_MASK];
+        if (head != CYCLIC_END && jobs[head].due_us <= now)
+        {
+            uint32_t i = head;
+            head = jobs[i].next;
+            return (int32_t)i;
+        }
+        if (wheel_tick == now_tick)
+        {
+            return -1;
+        }
+        wheel_tick++;
+    }
+}
+
+// The job's frame with its counter and checksum for this round.
+static void cyclic_frame(const struct cyclic_entry &e, twai_message_t *msg)
+{
+    const struct gsusb_cyclic_job &d = e.def;
+    memset(msg, 0, sizeof(*msg));
+    msg->extd = (d.can_id & CAN_EFF_FLAG) ? 1 : 0;
+    msg->rtr = (d.can_id & CAN_RTR_FLAG) ? 1 : 0;
+    msg->identifier = d.can_id & GSUSB_CAN_ID_MASK;
+    msg->data_length_code = gsusb_frame_dlc(d.can_dlc);
+    memcpy(msg->data, d.data, msg->data_length_code);
+
+    if (d.counter_pos < msg->data_length_code)
+    {
+        uint8_t shifted = (uint8_t)(e.counter << __builtin_ctz(d.counter_mask));
+        msg->data[d.counter_pos] = (uint8_t)((msg->data[d.counter_pos] & ~d.counter_mask) |
+                                             (shifted & d.counter_mask));
+    }
+    if (d.checksum_pos < msg->data_length_code)
+    {
+        uint8_t sum = 0;
+        for (uint32_t j = 0; j < msg->data_length_code; j++)
+        {
+            if (j != d.checksum_pos)
+            {
+                sum = d.checksum_type == GSUSB_CYCLIC_XOR8 ? sum ^ msg->data[j] : (uint8_t)(sum + msg->data[j]);
+            }
+        }
+        msg->data[d.checksum_pos] = sum;
+    }
+}
+
+bool gsusb_cyclic_init(void (*wake)(void))
+{
+    memset(wheel, CYCLIC_END, sizeof(wheel));
+    wake_fn = wake;
+    if (!cmd_ring.init(2 * GSUSB_CYCLIC_JOBS, false))
+    {
+        return false;
+    }
+
+    esp_timer_create_args_t args = {};
+    args.callback = cyclic_timer_cb;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "gsusb_cyclic";
+    return esp_timer_create(&args, &timer) == ESP_OK;
+}
+
+bool gsusb_cyclic_set(uint32_t job, const struct gsusb_cyclic_job *def)
+{
+    struct cyclic_cmd c = {};
+    c.job = job;
+    c.stop = def == nullptr;
+    if (def != nullptr)
+    {
+        if (job >= GSUSB_CYCLIC_JOBS || def->period_us < GSUSB_CYCLIC_MIN_PERIOD_US ||
+            def->can_dlc > 8 || (def->counter_pos != GSUSB_CYCLIC_NONE && def->counter_mask == 0) ||
+            def->checksum_type > GSUSB_CYCLIC_XOR8)
+        {
+            return false;
+        }
+        c.def = *def;
+    }
+    else if (job >= GSUSB_CYCLIC_JOBS && job != GSUSB_CYCLIC_ALL)
+    {
+        return false;
+    }
+
+    if (!cmd_ring.push(c))
+    {
+        GSUSB_LOGE("gsusb_cyclic", "Command ring full, job %u unchanged", (unsigned)job);
+        return false;
+    }
+    wake_fn();
+    return true;
+}
+
+bool gsusb_cyclic_next(twai_message_t *msg, uint32_t *job)
+{
+    const struct cyclic_cmd *c;
+    while ((c = cmd_ring.front()) != nullptr)
+    {
+        cyclic_apply(*c, esp_timer_get_time());
+        cmd_ring.pop();
+    }
+    if (active_jobs == 0)
+    {
+        return false;
+    }
+
+    int64_t now = esp_timer_get_time();
+    int32_t i = wheel_pop_due(now);
+    if (i < 0)
+    {
+        cyclic_arm(now);
+        return false;
+    }
+
+    struct cyclic_entry &e = jobs[i];
+    struct gsusb_cyclic_status &s = status[i];
+    e.late_us = (uint32_t)(now - e.due_us);
+    *job = (uint32_t)i;
+
+    cyclic_frame(e, msg);
+    e.counter++;
+
+    if (e.remaining != 0 && --e.remaining == 0)
+    {
+        e.active = false;
+        active_jobs--;
+        s.period_us = 0;
+        return true;
+    }
+
+    // A frame more than a period late skips the rounds it missed instead
+    // of bursting them out, so the job keeps its phase.
+    e.due_us += e.def.period_us;
+    if (e.due_us <= now)
+    {
+        uint32_t missed = (uint32_t)((now - e.due_us) / e.def.period_us) + 1;
+        e.due_us += (int64_t)missed * e.def.period_us;
+        s.skipped += missed;
+    }
+    wheel_insert(i);
+    return true;
+}
+
+void gsusb_cyclic_done(uint32_t job, bool queued)
+{
+    const struct cyclic_entry &e = jobs[job];
+    struct gsusb_cyclic_status &s = status[job];
+    if (!queued)
+    {
+        s.skipped++;
+        return;
+    }
+    s.sent++;
+    if (e.late_us > GSUSB_CYCLIC_LATE_US)
+    {
+        s.late++;
+    }
+    if (e.late_us > s.max_late_us)
+    {
+        s.max_late_us = e.late_us;
+    }
+}
+
+void gsusb_cyclic_reset(void)
+{
+    if (active_jobs == 0)
+    {
+        return;
+    }
+    for (uint32_t i = 0; i < GSUSB_CYCLIC_JOBS; i++)
+    {
+        cyclic_stop(i);
+    }
+}
+
+uint32_t gsusb_cyclic_status(struct gsusb_cyclic_status *out, uint32_t max)
+{
+    uint32_t n = max < GSUSB_CYCLIC_JOBS ? max : GSUSB_CYCLIC_JOBS;
+    memcpy(out, status, n * sizeof(out[0]));
+    return n;
+}
+
+#else
+
+uint32_t gsusb_cyclic_status(struct gsusb_cyclic_status *out, uint32_t max)
+{
+    (void)out;
+    (void)max;
+    return 0;
+}
+
+#endif
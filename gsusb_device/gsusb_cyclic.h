@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "driver/twai.h"
+#include "gs_usb.h"
+#include "gsusb_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Cyclic transmit offload: frames the host uploads once (GSUSB_BREQ_CYCLIC)
+// and the device sends on its own. Jobs sit on a hashed timing wheel keyed
+// by their next due time; a one-shot esp_timer is armed for the earliest one
+// and wakes usb_tx_task, which takes the due frames from here and queues
+// them through the normal TX path, so tx_order keeps a single producer.
+// usb_tx_task owns the jobs; the TinyUSB task only posts changes.
+
+#if GSUSB_CYCLIC
+// Before the tasks start. wake is called from the timer and after a change.
+bool gsusb_cyclic_init(void (*wake)(void));
+
+// TinyUSB task: replaces job (GSUSB_CYCLIC_ALL with def == nullptr stops
+// every job), or stops it when def is nullptr. False for an invalid job.
+bool gsusb_cyclic_set(uint32_t job, const struct gsusb_cyclic_job *def);
+
+// usb_tx_task: the next frame that is due and its job, or false when none
+// is; the timer is armed for the one after.
+bool gsusb_cyclic_next(twai_message_t *msg, uint32_t *job);
+
+// usb_tx_task: whether that frame was queued for TWAI (sent) or refused
+// (skipped), as during bus-off or in listen-only mode.
+void gsusb_cyclic_done(uint32_t job, bool queued);
+
+// usb_tx_task: drops every job, as when the host goes away.
+void gsusb_cyclic_reset(void);
+#else
+static inline bool gsusb_cyclic_set(uint32_t job, const struct gsusb_cyclic_job *def)
+{
+    (void)job;
+    (void)def;
+    return false;
+}
+
+static inline bool gsusb_cyclic_next(twai_message_t *msg, uint32_t *job)
+{
+    (void)msg;
+    (void)job;
+    return false;
+}
+
+static inline void gsusb_cyclic_done(uint32_t job, bool queued)
+{
+    (void)job;
+    (void)queued;
+}
+
+static inline void gsusb_cyclic_reset(void)
+{
+}
+#endif
+
+// Status of up to max jobs from job 0; returns how many were written.
+uint32_t gsusb_cyclic_status(struct gsusb_cyclic_status *out, uint32_t max);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,260 @@
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+#include "tinyusb.h"
+#include "class/vendor/vendor_device.h"
+#include "esp_log.h"
+
+#include "dbg_helpers.h"
+#include "gs_usb.h"
+#include "gsusb_config.h"
+
+#include "gsusb_ep.h"
+
+#if GSUSB_USB_DIRECT
+
+#include "device/usbd_pvt.h"
+
+// Whole max-size packets and whole host frames, so a host that streams
+// frames back to back never has one cut by the end of a transfer.
+#define EP_OUT_BUF_SIZE (5 * CFG_TUD_VENDOR_EPSIZE)
+#define EP_OUT_FREE     (-1)
+#define EP_OUT_ARMED    (-2)
+
+static_assert(EP_OUT_BUF_SIZE % GS_HOST_FRAME_SIZE == 0, "EP_OUT_BUF_SIZE must hold whole frames");
+static_assert(GSUSB_EP_IN_BUF_SIZE >= GS_HOST_FRAME_TS_SIZE, "IN buffer smaller than one gs_host_frame");
+
+CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static uint8_t ep_in_buf[2][GSUSB_EP_IN_BUF_SIZE];
+CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static uint8_t ep_out_buf[2][EP_OUT_BUF_SIZE];
+
+static uint8_t ep_in = 0;
+static uint8_t ep_out = 0;
+static std::atomic<bool> ep_open{false};
+
+// Bumped on every SET_CONFIGURATION: the tasks drop whatever they held
+// from before.
+static std::atomic<uint32_t> ep_session{0};
+
+// The n-th transfer in each direction always uses buffer n & 1, so filling,
+// submitting and completing go round in the same order and each side only
+// needs its own count.
+static std::atomic<uint32_t> in_len[2]; // 0: free, else queued or on the wire
+static uint32_t in_fill = 0;             // usb_in_task
+static uint32_t in_fill_session = 0;     // usb_in_task
+static uint32_t in_sent = 0;             // under the endpoint claim
+static uint32_t in_done = 0;             // TinyUSB task
+
+static std::atomic<int32_t> out_len[2]; // EP_OUT_FREE, EP_OUT_ARMED or bytes received
+static uint32_t out_armed = 0;          // under the endpoint claim
+static uint32_t out_done = 0;           // TinyUSB task
+static uint32_t out_read = 0;           // usb_tx_task
+static uint32_t out_pos = 0;            // usb_tx_task
+static uint32_t out_read_session = 0;   // usb_tx_task
+
+bool gsusb_ep_mounted(void)
+{
+    return ep_open.load(std::memory_order_relaxed);
+}
+
+// Starts the next queued IN buffer unless a transfer is on the wire; its
+// completion calls this again. Safe from usb_in_task and the TinyUSB task.
+static void ep_in_kick(void)
+{
+    if (!ep_open.load() || !usbd_edpt_claim(0, ep_in))
+    {
+        return;
+    }
+    uint32_t i = in_sent & 1;
+    uint32_t len = in_len[i].load(std::memory_order_acquire);
+    if (len == 0)
+    {
+        usbd_edpt_release(0, ep_in);
+        return;
+    }
+    in_sent++;
+    usbd_edpt_xfer(0, ep_in, ep_in_buf[i], (uint16_t)len);
+}
+
+// Arms the next free OUT buffer unless one already is.
+static void ep_out_arm(void)
+{
+    if (!ep_open.load() || !usbd_edpt_claim(0, ep_out))
+    {
+        return;
+    }
+    uint32_t i = out_armed & 1;
+    int32_t expected = EP_OUT_FREE;
+    if (!out_len[i].compare_exchange_strong(expected, EP_OUT_ARMED))
+    {
+        usbd_edpt_release(0, ep_out);
+        return;
+    }
+    out_armed++;
+    usbd_edpt_xfer(0, ep_out, ep_out_buf[i], EP_OUT_BUF_SIZE);
+}
+
+uint8_t *gsusb_ep_in_acquire(void)
+{
+    uint32_t session = ep_session.load(std::memory_order_acquire);
+    if (session != in_fill_session)
+    {
+        in_fill_session = session;
+        in_fill = 0;
+    }
+    if (!ep_open.load(std::memory_order_relaxed))
+    {
+        return nullptr;
+    }
+    uint32_t i = in_fill & 1;
+    return in_len[i].load(std::memory_order_acquire) == 0 ? ep_in_buf[i] : nullptr;
+}
+
+void gsusb_ep_in_commit(uint32_t len)
+{
+    if (len == 0 || ep_session.load(std::memory_order_acquire) != in_fill_session)
+    {
+        return;
+    }
+    in_len[in_fill & 1].store(len, std::memory_order_release);
+    in_fill++;
+    ep_in_kick();
+}
+
+const void *gsusb_ep_out_peek(uint32_t len)
+{
+    uint32_t session = ep_session.load(std::memory_order_acquire);
+    if (session != out_read_session)
+    {
+        out_read_session = session;
+        out_read = 0;
+        out_pos = 0;
+    }
+
+    for (;;)
+    {
+        uint32_t i = out_read & 1;
+        int32_t got = out_len[i].load(std::memory_order_acquire);
+        if (got < 0)
+        {
+            return nullptr;
+        }
+        if ((uint32_t)got - out_pos >= len)
+        {
+            return ep_out_buf[i] + out_pos;
+        }
+        if ((uint32_t)got != out_pos)
+        {
+            GSUSB_LOGE("gsusb_ep", "bulk OUT partial frame: %u/%u bytes",
+                       (unsigned)((uint32_t)got - out_pos), (unsigned)len);
+        }
+
+        // Used up: back to the endpoint.
+        if (ep_session.load(std::memory_order_acquire) != out_read_session)
+        {
+            return nullptr;
+        }
+        out_len[i].store(EP_OUT_FREE, std::memory_order_release);
+        out_read++;
+        out_pos = 0;
+        ep_out_arm();
+    }
+}
+
+void gsusb_ep_out_consume(uint32_t len)
+{
+    out_pos += len;
+}
+
+static void ep_init(void)
+{
+}
+
+static bool ep_deinit(void)
+{
+    return true;
+}
+
+static void ep_reset(uint8_t rhport)
+{
+    (void)rhport;
+    ep_open.store(false);
+}
+
+static uint16_t ep_open_itf(uint8_t rhport, tusb_desc_interface_t const *itf, uint16_t max_len)
+{
+    if (itf->bInterfaceClass != TUSB_CLASS_VENDOR_SPECIFIC || itf->bInterfaceNumber != 0 ||
+        max_len < TUD_VENDOR_DESC_LEN)
+    {
+        return 0;
+    }
+    if (!usbd_open_edpt_pair(rhport, tu_desc_next(itf), 2, TUSB_XFER_BULK, &ep_out, &ep_in))
+    {
+        GSUSB_LOGE("gsusb_ep", "Could not open the bulk endpoints");
+        return 0;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        in_len[i].store(0);
+        out_len[i].store(EP_OUT_FREE);
+    }
+    in_sent = 0;
+    in_done = 0;
+    out_armed = 0;
+    out_done = 0;
+    ep_session.fetch_add(1);
+    ep_open.store(true);
+
+    ep_out_arm();
+    return TUD_VENDOR_DESC_LEN;
+}
+
+static bool ep_control_xfer(uint8_t rhport, uint8_t stage, tusb_control_request_t const *request)
+{
+    (void)rhport;
+    (void)stage;
+    (void)request;
+    return false;
+}
+
+static bool ep_xfer_done(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes)
+{
+    (void)rhport;
+    (void)result;
+
+    if (ep_addr == ep_in)
+    {
+        in_len[in_done++ & 1].store(0, std::memory_order_release);
+        ep_in_kick();
+        tud_vendor_tx_cb(0, xferred_bytes);
+    }
+    else if (ep_addr == ep_out)
+    {
+        uint32_t i = out_done++ & 1;
+        out_len[i].store((int32_t)xferred_bytes, std::memory_order_release);
+        ep_out_arm();
+        tud_vendor_rx_cb(0, ep_out_buf[i], (uint16_t)xferred_bytes);
+    }
+    return true;
+}
+
+static const usbd_class_driver_t ep_driver = {
+    .name = "GSUSB",
+    .init = ep_init,
+    .deinit = ep_deinit,
+    .reset = ep_reset,
+    .open = ep_open_itf,
+    .control_xfer_cb = ep_control_xfer,
+    .xfer_cb = ep_xfer_done,
+    .sof = nullptr,
+};
+
+// Application drivers are offered each interface before the built-in classes.
+extern "C" usbd_class_driver_t const *usbd_app_driver_get_cb(uint8_t *driver_count)
+{
+    *driver_count = 1;
+    return &ep_driver;
+}
+
+#endif
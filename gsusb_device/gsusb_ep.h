@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gs_usb.h"
+#include "gsusb_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Direct transfers on the gs_usb bulk endpoints (GSUSB_USB_DIRECT): a small
+// TinyUSB class driver takes interface 0 from the vendor class and moves
+// data with usbd_edpt_xfer() on two buffers per direction. While one IN
+// buffer is on the wire usb_in_task fills the other, and the completion
+// starts it right away; while usb_tx_task decodes one OUT buffer the other
+// is already armed. With both OUT buffers unread the endpoint stays unarmed
+// and the host is NAKed, as with a full vendor FIFO.
+//
+// Completions are reported through tud_vendor_tx_cb() / tud_vendor_rx_cb(),
+// like the vendor class does; control requests still go to
+// tud_vendor_control_xfer_cb().
+
+#if GSUSB_USB_DIRECT
+
+#if GSUSB_RX_BATCH
+#define GSUSB_EP_IN_BUF_SIZE GSUSB_RX_BATCH_BYTES
+#else
+#define GSUSB_EP_IN_BUF_SIZE GS_HOST_FRAME_TS_SIZE
+#endif
+
+// Configured by the host and the endpoints open.
+bool gsusb_ep_mounted(void);
+
+// usb_in_task: the free IN buffer (GSUSB_EP_IN_BUF_SIZE bytes), or nullptr
+// while both are queued or on the wire.
+uint8_t *gsusb_ep_in_acquire(void);
+
+// usb_in_task: queues len bytes of the acquired buffer as one transfer.
+void gsusb_ep_in_commit(uint32_t len);
+
+// usb_tx_task: the next len bytes from the host, where the OUT transfer
+// put them; nullptr until a completed transfer holds them.
+const void *gsusb_ep_out_peek(uint32_t len);
+
+// usb_tx_task: moves past them; they stay valid until the next peek.
+void gsusb_ep_out_consume(uint32_t len);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,169 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "driver/twai.h"
+#include "esp_timer.h"
+
+#include "gs_usb.h"
+#include "gsusb_config.h"
+#include "gsusb_errors.h"
+
+#define ERR_FRAME_INTERVAL_US (1000000 / GSUSB_ERR_FRAMES_PER_SEC)
+
+// Only touched by can_alert_task.
+static uint32_t last_rx_missed = 0;
+static uint32_t last_rx_overrun = 0;
+static uint32_t last_arb_lost = 0;
+static uint32_t last_bus_errors = 0;
+static uint32_t last_ring_overflows = 0;
+
+static uint32_t pending_class = 0; // CAN_ERR_* classes not yet reported
+static uint8_t pending_ctrl = 0;   // CAN_ERR_CRTL_* events not derived from TEC/REC
+static bool pending_state = false; // error state changed; bits come from TEC/REC
+
+static int64_t credit_us = 0;
+static int64_t credit_updated_us = 0;
+
+static uint32_t frames_sent = 0;
+static uint32_t events_merged = 0;
+
+static bool take_token(void)
+{
+    const int64_t cap = (int64_t)ERR_FRAME_INTERVAL_US * GSUSB_ERR_FRAME_BURST;
+    int64_t now = esp_timer_get_time();
+
+    credit_us += now - credit_updated_us;
+    credit_updated_us = now;
+    if (credit_us > cap)
+    {
+        credit_us = cap;
+    }
+    if (credit_us < ERR_FRAME_INTERVAL_US)
+    {
+        return false;
+    }
+    credit_us -= ERR_FRAME_INTERVAL_US;
+    return true;
+}
+
+// The kernel derives the interface state from these bits, checking warning
+// before passive, so only the current level is reported per direction.
+static uint8_t state_bits(const twai_status_info_t *status)
+{
+    uint8_t bits = 0;
+
+    if (status->tx_error_counter >= 128)
+        bits |= CAN_ERR_CRTL_TX_PASSIVE;
+    else if (status->tx_error_counter >= 96)
+        bits |= CAN_ERR_CRTL_TX_WARNING;
+
+    if (status->rx_error_counter >= 128)
+        bits |= CAN_ERR_CRTL_RX_PASSIVE;
+    else if (status->rx_error_counter >= 96)
+        bits |= CAN_ERR_CRTL_RX_WARNING;
+
+    return bits ? bits : CAN_ERR_CRTL_ACTIVE;
+}
+
+void gsusb_errors_reset(const twai_status_info_t *status, uint32_t rx_ring_overflows)
+{
+    last_rx_missed = status->rx_missed_count;
+    last_rx_overrun = status->rx_overrun_count;
+    last_arb_lost = status->arb_lost_count;
+    last_bus_errors = status->bus_error_count;
+    last_ring_overflows = rx_ring_overflows;
+
+    pending_class = 0;
+    pending_ctrl = 0;
+    pending_state = false;
+
+    credit_updated_us = esp_timer_get_time();
+    credit_us = (int64_t)ERR_FRAME_INTERVAL_US * GSUSB_ERR_FRAME_BURST;
+}
+
+void gsusb_errors_collect(uint32_t alerts, const twai_status_info_t *status,
+                          uint32_t rx_ring_overflows, bool berr)
+{
+    uint32_t cls = 0;
+    uint8_t ctrl = 0;
+
+    if (alerts & TWAI_ALERT_BUS_OFF)
+    {
+        cls |= CAN_ERR_BUSOFF;
+        pending_class &= ~CAN_ERR_RESTARTED; // the newest state wins
+    }
+    if (alerts & TWAI_ALERT_BUS_RECOVERED)
+    {
+        cls |= CAN_ERR_RESTARTED;
+    }
+    if (alerts & (TWAI_ALERT_ERR_ACTIVE | TWAI_ALERT_ABOVE_ERR_WARN | TWAI_ALERT_ERR_PASS))
+    {
+        cls |= CAN_ERR_CRTL;
+        pending_state = true;
+    }
+
+    // Frames lost in the controller FIFO, the driver queue or our RX ring.
+    uint32_t lost = (status->rx_missed_count - last_rx_missed) +
+                    (status->rx_overrun_count - last_rx_overrun) +
+                    (rx_ring_overflows - last_ring_overflows);
+    if (lost)
+    {
+        cls |= CAN_ERR_CRTL;
+        ctrl |= CAN_ERR_CRTL_RX_OVERFLOW;
+    }
+
+    if (berr && status->bus_error_count != last_bus_errors)
+    {
+        cls |= CAN_ERR_PROT | CAN_ERR_BUSERROR;
+    }
+    if (berr && status->arb_lost_count != last_arb_lost)
+    {
+        cls |= CAN_ERR_LOSTARB;
+    }
+
+    last_rx_missed = status->rx_missed_count;
+    last_rx_overrun = status->rx_overrun_count;
+    last_arb_lost = status->arb_lost_count;
+    last_bus_errors = status->bus_error_count;
+    last_ring_overflows = rx_ring_overflows;
+
+    if (cls && pending_class)
+    {
+        events_merged++;
+    }
+    pending_class |= cls;
+    pending_ctrl |= ctrl;
+}
+
+bool gsusb_errors_take(const twai_status_info_t *status, struct gs_host_frame *frame)
+{
+    if (!pending_class || !take_token())
+    {
+        return false;
+    }
+
+    memset(frame, 0, sizeof(*frame));
+    frame->echo_id = GS_HOST_FRAME_ECHO_ID_RX;
+    frame->can_id = CAN_ERR_FLAG | CAN_ERR_CNT | pending_class;
+    frame->can_dlc = CAN_ERR_DLC;
+    frame->data[1] = pending_ctrl | (pending_state ? state_bits(status) : 0);
+    frame->data[6] = (uint8_t)(status->tx_error_counter > 255 ? 255 : status->tx_error_counter);
+    frame->data[7] = (uint8_t)(status->rx_error_counter > 255 ? 255 : status->rx_error_counter);
+
+    pending_class = 0;
+    pending_ctrl = 0;
+    pending_state = false;
+    frames_sent++;
+    return true;
+}
+
+bool gsusb_errors_pending(void)
+{
+    return pending_class != 0;
+}
+
+void gsusb_errors_get_counts(uint32_t *sent, uint32_t *merged)
+{
+    *sent = frames_sent;
+    *merged = events_merged;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "driver/twai.h"
+#include "gs_usb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Turns TWAI alerts and status counters into SocketCAN error frames.
+// Everything observed while the rate limit is exhausted is merged into the
+// next frame, so an error storm costs at most GSUSB_ERR_FRAMES_PER_SEC IN
+// slots and no state change is lost.
+
+// Re-reads the counter baseline, e.g. after a driver (re)install.
+void gsusb_errors_reset(const twai_status_info_t *status, uint32_t rx_ring_overflows);
+
+// Collects what changed since the last call. berr selects whether bus
+// errors and lost arbitration are reported (CAN_CTRLMODE_BERR_REPORTING).
+void gsusb_errors_collect(uint32_t alerts, const twai_status_info_t *status,
+                          uint32_t rx_ring_overflows, bool berr);
+
+// Fills frame and returns true when an error frame is due and a token is
+// available.
+bool gsusb_errors_take(const twai_status_info_t *status, struct gs_host_frame *frame);
+
+bool gsusb_errors_pending(void);
+
+// Error frames sent and error events merged away by the rate limit.
+void gsusb_errors_get_counts(uint32_t *sent, uint32_t *merged);
+
+#ifdef __cplusplus
+}
+#endif
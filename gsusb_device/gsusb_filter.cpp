@@ -0,0 +1,290 @@
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+#include "driver/twai.h"
+#include "esp_log.h"
+
+#include "dbg_helpers.h"
+#include "gs_usb.h"
+#include "gsusb_config.h"
+#include "gsusb_filter.h"
+
+#define STD_ID_MAX 0x7FFU
+#define EXT_ID_MAX 0x1FFFFFFFU
+
+struct ext_range
+{
+    uint32_t lo;
+    uint32_t hi;
+};
+
+// Written only from the control path, read from can_rx_task. Writers bump
+// filter_seq to odd before touching the tables and back to even after;
+// readers retry when they saw an odd or changed sequence.
+static std::atomic<uint32_t> filter_seq{0};
+static bool filter_enabled = false;
+static uint32_t std_bits[(STD_ID_MAX + 1) / 32];
+static uint32_t std_count = 0; // ranges added, not IDs
+static struct ext_range ext_ranges[GSUSB_FILTER_EXT_RANGES];
+static uint32_t ext_count = 0;
+
+static std::atomic<uint32_t> rejected{0};
+
+static void write_begin(void)
+{
+    filter_seq.store(filter_seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+static void write_end(void)
+{
+    filter_seq.store(filter_seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+static bool range_valid(const struct gsusb_filter_range &r)
+{
+    bool ext = (r.id_lo & CAN_EFF_FLAG) != 0;
+    if (ext != ((r.id_hi & CAN_EFF_FLAG) != 0))
+    {
+        return false;
+    }
+    uint32_t lo = r.id_lo & ~CAN_EFF_FLAG;
+    uint32_t hi = r.id_hi & ~CAN_EFF_FLAG;
+    return lo <= hi && hi <= (ext ? EXT_ID_MAX : STD_ID_MAX);
+}
+
+// Inserts [lo, hi] keeping the table sorted and non-overlapping.
+static void ext_insert(uint32_t lo, uint32_t hi)
+{
+    uint32_t i = 0;
+    while (i < ext_count && ext_ranges[i].hi + 1 < lo)
+    {
+        i++;
+    }
+
+    uint32_t j = i;
+    while (j < ext_count && ext_ranges[j].lo <= hi + 1)
+    {
+        if (ext_ranges[j].lo < lo)
+        {
+            lo = ext_ranges[j].lo;
+        }
+        if (ext_ranges[j].hi > hi)
+        {
+            hi = ext_ranges[j].hi;
+        }
+        j++;
+    }
+
+    // Ranges i..j-1 collapse into one.
+    if (j == i)
+    {
+        memmove(&ext_ranges[i + 1], &ext_ranges[i], (ext_count - i) * sizeof(ext_ranges[0]));
+        ext_count++;
+    }
+    else if (j > i + 1)
+    {
+        memmove(&ext_ranges[i + 1], &ext_ranges[j], (ext_count - j) * sizeof(ext_ranges[0]));
+        ext_count -= j - i - 1;
+    }
+    ext_ranges[i].lo = lo;
+    ext_ranges[i].hi = hi;
+}
+
+// Worst case for the merge: every new range lands separately.
+static uint32_t ext_ranges_needed(const struct gsusb_filter_range *ranges, uint32_t count)
+{
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (ranges[i].id_lo & CAN_EFF_FLAG)
+        {
+            n++;
+        }
+    }
+    return n;
+}
+
+void gsusb_filter_clear(void)
+{
+    write_begin();
+    filter_enabled = false;
+    memset(std_bits, 0, sizeof(std_bits));
+    std_count = 0;
+    ext_count = 0;
+    write_end();
+}
+
+bool gsusb_filter_add(const struct gsusb_filter_range *ranges, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!range_valid(ranges[i]))
+        {
+            GSUSB_LOGE("GSUSB", "filter range %" PRIu32 " malformed: 0x%08" PRIx32 "..0x%08" PRIx32,
+                       i, ranges[i].id_lo, ranges[i].id_hi);
+            return false;
+        }
+    }
+    if (ext_count + ext_ranges_needed(ranges, count) > GSUSB_FILTER_EXT_RANGES)
+    {
+        GSUSB_LOGE("GSUSB", "filter: more than %u 29-bit ranges", (unsigned)GSUSB_FILTER_EXT_RANGES);
+        return false;
+    }
+
+    write_begin();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t lo = ranges[i].id_lo & ~CAN_EFF_FLAG;
+        uint32_t hi = ranges[i].id_hi & ~CAN_EFF_FLAG;
+        if (ranges[i].id_lo & CAN_EFF_FLAG)
+        {
+            ext_insert(lo, hi);
+        }
+        else
+        {
+            for (uint32_t id = lo; id <= hi; id++)
+            {
+                std_bits[id >> 5] |= 1U << (id & 31);
+            }
+            std_count++;
+        }
+    }
+    filter_enabled = filter_enabled || count > 0;
+    write_end();
+
+    GSUSB_LOGI("GSUSB", "filter: %" PRIu32 " 11-bit ranges, %" PRIu32 " 29-bit ranges",
+               std_count, ext_count);
+    return true;
+}
+
+static bool match_unsynchronized(uint32_t identifier, bool extd)
+{
+    if (!filter_enabled)
+    {
+        return true;
+    }
+    if (!extd)
+    {
+        return (std_bits[(identifier >> 5) & 63] >> (identifier & 31)) & 1U;
+    }
+
+    uint32_t lo = 0;
+    uint32_t hi = ext_count;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (ext_ranges[mid].hi < identifier)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo < ext_count && ext_ranges[lo].lo <= identifier;
+}
+
+bool gsusb_filter_match(uint32_t identifier, bool extd)
+{
+    bool accept;
+    uint32_t seq;
+    do
+    {
+        seq = filter_seq.load(std::memory_order_acquire);
+        accept = match_unsynchronized(identifier, extd);
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((seq & 1) || seq != filter_seq.load(std::memory_order_relaxed));
+
+    if (!accept)
+    {
+        rejected.fetch_add(1, std::memory_order_relaxed);
+    }
+    return accept;
+}
+
+uint32_t gsusb_filter_rejected(void)
+{
+    return rejected.load(std::memory_order_relaxed);
+}
+
+// Bits that are not identical across every accepted ID; they become
+// don't-care bits of the hardware mask.
+struct id_cover
+{
+    bool any;
+    uint32_t base;
+    uint32_t varying;
+};
+
+static void cover_add(struct id_cover &c, uint32_t lo, uint32_t hi)
+{
+    uint32_t span = lo ^ hi;
+    uint32_t dc = 0;
+    while (span)
+    {
+        dc = (dc << 1) | 1;
+        span >>= 1;
+    }
+    if (!c.any)
+    {
+        c.any = true;
+        c.base = lo;
+    }
+    c.varying |= dc | (lo ^ c.base);
+}
+
+void gsusb_filter_get_hw_config(twai_filter_config_t *config)
+{
+    struct id_cover std_cover = {};
+    struct id_cover ext_cover = {};
+
+    // Runs on the control path, the only writer, so no retry is needed.
+    bool enabled = filter_enabled;
+    for (uint32_t id = 0; id <= STD_ID_MAX; id++)
+    {
+        if ((std_bits[id >> 5] >> (id & 31)) & 1U)
+        {
+            cover_add(std_cover, id, id);
+        }
+    }
+    for (uint32_t i = 0; i < ext_count; i++)
+    {
+        cover_add(ext_cover, ext_ranges[i].lo, ext_ranges[i].hi);
+    }
+
+    // Mask bits set to 1 are ignored by the controller.
+    if (!enabled || (!std_cover.any && !ext_cover.any))
+    {
+        twai_filter_config_t accept_all = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+        *config = accept_all;
+    }
+    else if (!ext_cover.any)
+    {
+        // Single filter, 11-bit layout: ID[31:21] RTR[20] data0[15:8] data1[7:0].
+        config->acceptance_code = (std_cover.base & ~std_cover.varying) << 21;
+        config->acceptance_mask = (std_cover.varying << 21) | 0x001FFFFFU;
+        config->single_filter = true;
+    }
+    else if (!std_cover.any)
+    {
+        // Single filter, 29-bit layout: ID[31:3] RTR[2].
+        config->acceptance_code = (ext_cover.base & ~ext_cover.varying) << 3;
+        config->acceptance_mask = (ext_cover.varying << 3) | 0x7U;
+        config->single_filter = true;
+    }
+    else
+    {
+        // Dual filter: filter 1 takes the 11-bit IDs in [31:21], filter 2
+        // compares ID[28:13] of 29-bit frames in [15:0]. Filter 1 also
+        // checks the low nibble of an 11-bit frame's data byte 1 against
+        // [3:0], so those bits cannot narrow the 29-bit IDs.
+        config->acceptance_code = ((std_cover.base & ~std_cover.varying) << 21) |
+                                  (((ext_cover.base & ~ext_cover.varying) >> 13) & 0xFFF0U);
+        config->acceptance_mask = (std_cover.varying << 21) | 0x001F0000U |
+                                  ((ext_cover.varying >> 13) & 0xFFFFU) | 0xFU;
+        config->single_filter = false;
+    }
+}
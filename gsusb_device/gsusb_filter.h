@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "driver/twai.h"
+#include "gs_usb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Host-configured acceptance filter. With no ranges set every frame is
+// accepted; otherwise only IDs inside one of the ranges pass. The TWAI
+// hardware filter is programmed with a superset of the ranges and the
+// software table below makes the exact decision.
+
+void gsusb_filter_clear(void);
+
+// Adds count ranges. Returns false (and leaves the table unchanged) if a
+// range is malformed or the 29-bit range table would overflow.
+bool gsusb_filter_add(const struct gsusb_filter_range *ranges, uint32_t count);
+
+// Exact software match; safe to call from the RX task while the control
+// task updates the table.
+bool gsusb_filter_match(uint32_t identifier, bool extd);
+
+// Hardware acceptance filter covering every range; applied at the next
+// twai_driver_install().
+void gsusb_filter_get_hw_config(twai_filter_config_t *config);
+
+// Frames the software filter has rejected since boot.
+uint32_t gsusb_filter_rejected(void);
+
+#ifdef __cplusplus
+}
+#endif
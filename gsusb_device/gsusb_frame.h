@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "driver/twai.h"
+#include "gs_usb.h"
+
+// Conversions between the TWAI driver's frame and the gs_usb wire frame.
+// Header-only so the RX/TX paths inline them and host tools (host_sim
+// replay) run exactly the same code.
+
+#define GSUSB_CAN_ID_MASK 0x1FFFFFFFU
+
+static inline uint32_t gsusb_frame_can_id(const twai_message_t *msg)
+{
+    return msg->identifier | (msg->extd ? CAN_EFF_FLAG : 0) | (msg->rtr ? CAN_RTR_FLAG : 0);
+}
+
+static inline uint8_t gsusb_frame_dlc(uint8_t dlc)
+{
+    return dlc > 8 ? 8 : dlc;
+}
+
+// Bits the frame takes on the bus with the most stuff bits it can get (one
+// per four bits from SOF to the end of the CRC), intermission included.
+static inline uint32_t gsusb_frame_bits_max(const twai_message_t *msg)
+{
+    uint32_t stuffed = (msg->extd ? 54 : 34) + (msg->rtr ? 0 : 8 * gsusb_frame_dlc(msg->data_length_code));
+    return stuffed + (stuffed - 1) / 4 + 13;
+}
+
+// Arbitration order on the bus: the lower key wins. Base ID, then RTR (SRR
+// for an extended frame), IDE, the ID extension and the extended RTR.
+static inline uint32_t gsusb_frame_arb_key(const twai_message_t *msg)
+{
+    if (msg->extd)
+    {
+        return ((msg->identifier >> 18) << 21) | (3U << 19) | ((msg->identifier & 0x3FFFFU) << 1) |
+               (msg->rtr ? 1U : 0U);
+    }
+    return ((msg->identifier & 0x7FFU) << 21) | (msg->rtr ? 1U << 20 : 0U);
+}
+
+// Received frame -> IN frame. Bytes past the DLC are zero.
+static inline void gsusb_frame_from_twai(const twai_message_t *msg, uint32_t timestamp_us,
+                                         struct gs_host_frame *frame)
+{
+    memset(frame, 0, sizeof(*frame));
+    frame->echo_id = GS_HOST_FRAME_ECHO_ID_RX;
+    frame->can_id = gsusb_frame_can_id(msg);
+    frame->can_dlc = gsusb_frame_dlc(msg->data_length_code);
+    memcpy(frame->data, msg->data, frame->can_dlc);
+    frame->timestamp_us = timestamp_us;
+}
+
+// OUT frame -> frame to transmit.
+static inline void gsusb_frame_to_twai(const struct gs_host_frame *frame, twai_message_t *msg)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->extd = (frame->can_id & CAN_EFF_FLAG) ? 1 : 0;
+    msg->rtr = (frame->can_id & CAN_RTR_FLAG) ? 1 : 0;
+    msg->identifier = frame->can_id & GSUSB_CAN_ID_MASK;
+    msg->data_length_code = gsusb_frame_dlc(frame->can_dlc);
+    memcpy(msg->data, frame->data, msg->data_length_code);
+}
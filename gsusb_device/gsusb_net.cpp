@@ -0,0 +1,323 @@
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "lwip/sockets.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "dbg_helpers.h"
+#include "gs_usb.h"
+#include "gsusb_config.h"
+
+#include "gsusb_can.h"
+#include "gsusb_cannelloni.h"
+#include "gsusb_net.h"
+#include "gsusb_stats.h"
+#include "gsusb_usb.h"
+#include "spsc_ring.h"
+
+void gsusb_net_default_config(struct gsusb_net_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    if (GSUSB_NET_PEER_IP[0] != '\0')
+    {
+        cfg->peer_addr = inet_addr(GSUSB_NET_PEER_IP);
+    }
+    cfg->peer_port = GSUSB_NET_PEER_PORT;
+    cfg->local_port = GSUSB_NET_LOCAL_PORT;
+    cfg->bitrate = GSUSB_NET_BITRATE;
+}
+
+#if GSUSB_NET
+
+#define NET_RX_PACKET_MAX 1600 // cannelloni's own receive buffer
+#define NET_FULL_FRAMES   ((GSUSB_NET_MAX_PACKET - GSUSB_CNL_HEADER_SIZE) / GSUSB_CNL_FRAME_MAX)
+
+static_assert(GSUSB_NET_MAX_PACKET >= GSUSB_CNL_HEADER_SIZE + GSUSB_CNL_FRAME_MAX,
+              "GSUSB_NET_MAX_PACKET must hold a frame");
+
+static TaskHandle_t h_net_out_task = nullptr;
+static TaskHandle_t h_net_in_task = nullptr;
+static int net_sock = -1;
+static std::atomic<bool> net_running{false};
+
+// Peer as (addr << 16) | port, both in network byte order; 0 until known.
+static std::atomic<uint64_t> net_peer{0};
+static bool net_learn_peer = false;
+
+static SpscRing<twai_message_t> net_ring; // can_rx_task -> net_out_task
+static int64_t net_batch_start_us = 0;
+static uint8_t net_out_seq = 0;
+static uint8_t net_out_buf[GSUSB_NET_MAX_PACKET];
+static uint8_t net_in_buf[NET_RX_PACKET_MAX];
+
+static uint64_t net_peer_key(const struct sockaddr_in &addr)
+{
+    return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+bool gsusb_net_active(void)
+{
+    return net_running.load(std::memory_order_relaxed);
+}
+
+void gsusb_net_rx_frame(const twai_message_t *msg)
+{
+    // Nobody to send to yet: nothing is buffered for a peer that may
+    // never show up.
+    if (!net_running.load(std::memory_order_relaxed) ||
+        net_peer.load(std::memory_order_relaxed) == 0)
+    {
+        return;
+    }
+    if (!net_ring.push(*msg))
+    {
+        GSUSB_STAT_INC(GSUSB_STAT_RX_DROP_NET);
+        return;
+    }
+    xTaskNotifyGive(h_net_out_task);
+}
+
+// Packs as many queued frames as fit into one datagram and sends it.
+static void net_send_packet(uint64_t peer)
+{
+    uint32_t len = GSUSB_CNL_HEADER_SIZE;
+    uint32_t count = 0;
+    const twai_message_t *msg;
+    while (count < UINT16_MAX && (msg = net_ring.front()) != nullptr &&
+           len + gsusb_cnl_frame_size(msg) <= sizeof(net_out_buf))
+    {
+        len += gsusb_cnl_put_frame(net_out_buf + len, msg);
+        net_ring.pop();
+        count++;
+    }
+    gsusb_cnl_put_header(net_out_buf, net_out_seq++, (uint16_t)count);
+
+    struct sockaddr_in to = {};
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = (uint32_t)(peer >> 16);
+    to.sin_port = (uint16_t)peer;
+    if (sendto(net_sock, net_out_buf, len, 0, (struct sockaddr *)&to, sizeof(to)) != (int)len)
+    {
+        // Out of buffers or no route yet (Wi-Fi still connecting).
+        GSUSB_STAT_INC(GSUSB_STAT_NET_SEND_ERRORS);
+        return;
+    }
+    GSUSB_STAT_INC(GSUSB_STAT_NET_OUT_PACKETS);
+    GSUSB_STAT_ADD(GSUSB_STAT_RX_TO_NET, count);
+}
+
+// Same batching rule as usb_in_drain(): a full datagram goes at once, a
+// partial one when its oldest frame is GSUSB_NET_FLUSH_US old. Returns how
+// long net_out_task may sleep.
+static TickType_t net_out_drain(void)
+{
+    uint64_t peer = net_peer.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        uint32_t pending = net_ring.size();
+        if (pending == 0)
+        {
+            net_batch_start_us = 0;
+            return portMAX_DELAY;
+        }
+
+        if (pending < NET_FULL_FRAMES)
+        {
+            int64_t now = esp_timer_get_time();
+            if (net_batch_start_us == 0)
+            {
+                net_batch_start_us = now;
+            }
+            int64_t left_us = net_batch_start_us + GSUSB_NET_FLUSH_US - now;
+            if (left_us > 0)
+            {
+                TickType_t ticks = (TickType_t)((left_us * configTICK_RATE_HZ + 999999) / 1000000);
+                return ticks > 0 ? ticks : 1;
+            }
+        }
+
+        net_send_packet(peer);
+        net_batch_start_us = 0;
+    }
+}
+
+extern "C" void net_out_task(void *arg)
+{
+    (void)arg;
+
+    TickType_t wait = portMAX_DELAY;
+
+    GSUSB_LOGI("gsusb_net", "net_out_task started");
+
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, wait);
+        wait = net_out_drain();
+    }
+}
+
+// Hands one datagram's frames to the TX path. While the TX ring is full
+// this task stops reading the socket, so the backlog builds up in the
+// stack's receive buffer instead of frames being dropped here.
+static void net_in_packet(const uint8_t *buf, uint32_t len, int &last_seq)
+{
+    struct gsusb_cnl_reader r;
+    uint8_t seq;
+    if (!gsusb_cnl_begin(&r, buf, len, &seq))
+    {
+        GSUSB_STAT_INC(GSUSB_STAT_NET_IN_BAD);
+        return;
+    }
+    GSUSB_STAT_INC(GSUSB_STAT_NET_IN_PACKETS);
+
+    // A jump backwards is a restarted peer, not loss.
+    if (last_seq >= 0)
+    {
+        uint8_t gap = (uint8_t)(seq - (uint8_t)(last_seq + 1));
+        if (gap < 128)
+        {
+            GSUSB_STAT_ADD(GSUSB_STAT_NET_IN_LOST, gap);
+        }
+    }
+    last_seq = seq;
+
+    twai_message_t msg;
+    enum gsusb_cnl_result res;
+    while ((res = gsusb_cnl_next(&r, &msg)) != GSUSB_CNL_END)
+    {
+        if (res == GSUSB_CNL_BAD)
+        {
+            GSUSB_STAT_INC(GSUSB_STAT_NET_IN_BAD);
+            return;
+        }
+        if (res == GSUSB_CNL_SKIP)
+        {
+            GSUSB_STAT_INC(GSUSB_STAT_NET_IN_BAD);
+            continue;
+        }
+
+        esp_err_t err;
+        while ((err = gsusb_usb_net_tx(&msg)) == ESP_ERR_TIMEOUT)
+        {
+            GSUSB_STAT_INC(GSUSB_STAT_TX_NET_BACKPRESSURE);
+            vTaskDelay(1);
+        }
+        if (err == ESP_OK)
+        {
+            GSUSB_STAT_INC(GSUSB_STAT_TX_FROM_NET);
+        }
+    }
+}
+
+extern "C" void net_in_task(void *arg)
+{
+    (void)arg;
+
+    int last_seq = -1;
+
+    GSUSB_LOGI("gsusb_net", "net_in_task started");
+
+    for (;;)
+    {
+        struct sockaddr_in from = {};
+        socklen_t from_len = sizeof(from);
+        int n = recvfrom(net_sock, net_in_buf, sizeof(net_in_buf), 0,
+                         (struct sockaddr *)&from, &from_len);
+        if (n < 0)
+        {
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
+        }
+
+        uint64_t peer = net_peer.load(std::memory_order_relaxed);
+        if (peer == 0 && net_learn_peer)
+        {
+            peer = net_peer_key(from);
+            net_peer.store(peer, std::memory_order_relaxed);
+            GSUSB_LOGI("gsusb_net", "Peer %s:%u", inet_ntoa(from.sin_addr),
+                       (unsigned)ntohs(from.sin_port));
+        }
+        if (net_peer_key(from) != peer)
+        {
+            continue;
+        }
+        net_in_packet(net_in_buf, (uint32_t)n, last_seq);
+    }
+}
+
+esp_err_t gsusb_net_start(const struct gsusb_net_config *cfg)
+{
+    if (net_running.load())
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!net_ring.init(GSUSB_NET_RING_SLOTS, false))
+    {
+        GSUSB_LOGE("gsusb_net", "Failed to allocate the network ring");
+        return ESP_ERR_NO_MEM;
+    }
+
+    net_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (net_sock < 0)
+    {
+        GSUSB_LOGE("gsusb_net", "socket() failed");
+        return ESP_FAIL;
+    }
+    struct sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = htons(cfg->local_port);
+    if (bind(net_sock, (struct sockaddr *)&local, sizeof(local)) != 0)
+    {
+        GSUSB_LOGE("gsusb_net", "bind to port %u failed", (unsigned)cfg->local_port);
+        close(net_sock);
+        net_sock = -1;
+        return ESP_FAIL;
+    }
+
+    net_learn_peer = cfg->peer_addr == 0;
+    if (!net_learn_peer)
+    {
+        struct sockaddr_in peer = {};
+        peer.sin_addr.s_addr = cfg->peer_addr;
+        peer.sin_port = htons(cfg->peer_port);
+        net_peer.store(net_peer_key(peer));
+    }
+
+    if (cfg->bitrate != 0 && !gsusb_can_is_active() &&
+        gsusb_usb_bus_start(cfg->bitrate, 0) != ESP_OK)
+    {
+        GSUSB_LOGE("gsusb_net", "Could not start the bus at %u bit/s", (unsigned)cfg->bitrate);
+    }
+
+    if (xTaskCreatePinnedToCore(net_out_task, "net_out", GSUSB_NET_TASK_STACK, nullptr,
+                                GSUSB_NET_TASK_PRIO, &h_net_out_task,
+                                GSUSB_NET_CORE < portNUM_PROCESSORS ? GSUSB_NET_CORE : 0) != pdPASS ||
+        xTaskCreatePinnedToCore(net_in_task, "net_in", GSUSB_NET_TASK_STACK, nullptr,
+                                GSUSB_NET_TASK_PRIO, &h_net_in_task,
+                                GSUSB_NET_CORE < portNUM_PROCESSORS ? GSUSB_NET_CORE : 0) != pdPASS)
+    {
+        GSUSB_LOGE("gsusb_net", "Failed to create the bridge tasks");
+        return ESP_ERR_NO_MEM;
+    }
+    net_running.store(true);
+    gsusb_usb_kick();
+
+    GSUSB_LOGI("gsusb_net", "cannelloni bridge on UDP port %u", (unsigned)cfg->local_port);
+    return ESP_OK;
+}
+
+#else
+
+esp_err_t gsusb_net_start(const struct gsusb_net_config *cfg)
+{
+    (void)cfg;
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "driver/twai.h"
+#include "gsusb_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Network bridge: the bus relayed to a cannelloni peer over UDP, next to
+// (or instead of) the USB host. Bus frames are packed into datagrams of up
+// to GSUSB_NET_MAX_PACKET bytes, sent when full or GSUSB_NET_FLUSH_US after
+// their first frame. Frames from the peer go through the same TX path as
+// bulk OUT: while TWAI is full the socket is not read.
+
+struct gsusb_net_config
+{
+    uint32_t peer_addr;  // IPv4, network byte order; 0 learns it from the first datagram
+    uint16_t peer_port;
+    uint16_t local_port;
+    uint32_t bitrate;    // bus started at this rate if nobody has; 0 leaves it to the host
+};
+
+// GSUSB_NET_* from gsusb_config.h.
+void gsusb_net_default_config(struct gsusb_net_config *cfg);
+
+// Opens the socket and starts the bridge tasks. Call after gsusb_init();
+// the network itself (Wi-Fi) may come up later.
+esp_err_t gsusb_net_start(const struct gsusb_net_config *cfg);
+
+#if GSUSB_NET
+bool gsusb_net_active(void);
+
+// can_rx_task: one received frame, already through the acceptance filter.
+void gsusb_net_rx_frame(const twai_message_t *msg);
+#else
+static inline bool gsusb_net_active(void)
+{
+    return false;
+}
+
+static inline void gsusb_net_rx_frame(const twai_message_t *msg)
+{
+    (void)msg;
+}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
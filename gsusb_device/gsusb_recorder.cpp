@@ -0,0 +1,229 @@
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include "dbg_helpers.h"
+#include "gs_usb.h"
+#include "gsusb_config.h"
+#include "gsusb_recorder.h"
+
+#if GSUSB_RECORDER
+
+#define REC_MIN_BYTES 4096
+
+static_assert(sizeof(struct gsusb_rec_frame) == 20, "gsusb_rec_frame layout");
+static_assert(GSUSB_REC_BYTES >= REC_MIN_BYTES, "GSUSB_REC_BYTES too small");
+
+static struct gsusb_rec_frame *rec_buf = nullptr;
+static uint32_t rec_capacity = 0;
+// Record numbers run from 0 to rec_wrap - 1, a multiple of rec_capacity, so
+// number % rec_capacity stays continuous when the counter wraps.
+static uint32_t rec_wrap = 0;
+
+static std::atomic<uint32_t> rec_head{0};      // next record number
+static std::atomic<bool> rec_full{false};      // the ring has wrapped at least once
+static std::atomic<uint32_t> rec_frozen{GSUSB_REC_RUNNING};
+static std::atomic<uint32_t> rec_missed{0};
+
+// Pinned by gsusb_rec_freeze(); only the control path reads them.
+static uint32_t frozen_first = 0;
+static uint32_t frozen_count = 0;
+
+bool gsusb_rec_init(void)
+{
+    uint32_t bytes = GSUSB_REC_BYTES;
+    void *mem = nullptr;
+
+    if (GSUSB_REC_PSRAM)
+    {
+        mem = heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+    for (; mem == nullptr && bytes >= REC_MIN_BYTES; bytes /= 2)
+    {
+        mem = heap_caps_malloc(bytes, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        if (mem != nullptr)
+        {
+            break;
+        }
+    }
+    if (mem == nullptr)
+    {
+        GSUSB_LOGE("gsusb_rec", "No memory for the flight recorder");
+        return false;
+    }
+
+    uint32_t capacity = bytes / sizeof(struct gsusb_rec_frame);
+    // A capacity that is a multiple of 2^16 would give the oldest record the
+    // same seq as a write racing the freeze, hiding the overwrite.
+    if ((capacity & 0xFFFF) == 0)
+    {
+        capacity--;
+    }
+
+    memset(mem, 0, bytes);
+    rec_buf = static_cast<struct gsusb_rec_frame *>(mem);
+    rec_capacity = capacity;
+    rec_wrap = (UINT32_MAX / capacity) * capacity;
+    GSUSB_LOGI("gsusb_rec", "Flight recorder: %u records", (unsigned)capacity);
+    return true;
+}
+
+void gsusb_rec_frame(uint32_t timestamp_us, uint32_t can_id, uint8_t dlc,
+                     const uint8_t *data, uint8_t flags)
+{
+    if (rec_buf == nullptr)
+    {
+        return;
+    }
+    if (rec_frozen.load(std::memory_order_relaxed) != GSUSB_REC_RUNNING)
+    {
+        rec_missed.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    uint32_t n = rec_head.load(std::memory_order_relaxed);
+    uint32_t next;
+    do
+    {
+        next = n + 1 == rec_wrap ? 0 : n + 1;
+    } while (!rec_head.compare_exchange_weak(n, next, std::memory_order_relaxed));
+
+    struct gsusb_rec_frame *r = &rec_buf[n % rec_capacity];
+    __atomic_store_n(&r->seq, (uint16_t)~n, __ATOMIC_RELAXED);
+    r->timestamp_us = timestamp_us;
+    r->can_id = can_id;
+    r->can_dlc = dlc;
+    r->flags = flags;
+    memcpy(r->data, data, sizeof(r->data));
+    __atomic_store_n(&r->seq, (uint16_t)n, __ATOMIC_RELEASE);
+
+    if (n + 1 == rec_capacity)
+    {
+        rec_full.store(true, std::memory_order_relaxed);
+    }
+}
+
+static void rec_window(uint32_t *first, uint32_t *count)
+{
+    uint32_t head = rec_head.load(std::memory_order_acquire);
+    if (rec_full.load(std::memory_order_relaxed))
+    {
+        *first = head >= rec_capacity ? head - rec_capacity : head + (rec_wrap - rec_capacity);
+        *count = rec_capacity;
+    }
+    else
+    {
+        *first = 0;
+        *count = head;
+    }
+}
+
+void gsusb_rec_freeze(uint32_t reason)
+{
+    uint32_t expected = GSUSB_REC_RUNNING;
+    if (rec_frozen.compare_exchange_strong(expected, reason))
+    {
+        rec_window(&frozen_first, &frozen_count);
+    }
+}
+
+void gsusb_rec_resume(bool clear)
+{
+    if (clear)
+    {
+        rec_frozen.store(GSUSB_REC_FROZEN_HOST);
+        rec_head.store(0);
+        rec_full.store(false);
+        rec_missed.store(0);
+    }
+    rec_frozen.store(GSUSB_REC_RUNNING);
+}
+
+void gsusb_rec_info(struct gsusb_rec_info *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->version = GSUSB_REC_VERSION;
+    out->record_size = sizeof(struct gsusb_rec_frame);
+    out->capacity = rec_capacity;
+    out->frozen = rec_frozen.load();
+    out->missed = rec_missed.load(std::memory_order_relaxed);
+    if (out->frozen != GSUSB_REC_RUNNING)
+    {
+        out->first_seq = frozen_first;
+        out->count = frozen_count;
+    }
+    else
+    {
+        uint32_t first;
+        uint32_t count;
+        rec_window(&first, &count);
+        out->first_seq = first;
+        out->count = count;
+    }
+}
+
+uint32_t gsusb_rec_read(uint32_t first, struct gsusb_rec_frame *out, uint32_t max)
+{
+    if (rec_buf == nullptr || rec_frozen.load() == GSUSB_REC_RUNNING || first >= frozen_count)
+    {
+        return 0;
+    }
+
+    uint32_t n = frozen_count - first < max ? frozen_count - first : max;
+    uint32_t seq = first < rec_wrap - frozen_first ? frozen_first + first
+                                                   : first - (rec_wrap - frozen_first);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        // A producer that passed the frozen check just before the freeze
+        // may still be rewriting the oldest slot; such a record keeps a
+        // seq that does not match its number.
+        const struct gsusb_rec_frame *r = &rec_buf[seq % rec_capacity];
+        uint16_t tag = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+        out[i] = *r;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != tag)
+        {
+            tag = (uint16_t)~seq;
+        }
+        out[i].seq = tag;
+        seq = seq + 1 == rec_wrap ? 0 : seq + 1;
+    }
+    return n;
+}
+
+#else
+
+bool gsusb_rec_init(void)
+{
+    return true;
+}
+
+void gsusb_rec_freeze(uint32_t reason)
+{
+    (void)reason;
+}
+
+void gsusb_rec_resume(bool clear)
+{
+    (void)clear;
+}
+
+void gsusb_rec_info(struct gsusb_rec_info *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->version = GSUSB_REC_VERSION;
+    out->record_size = sizeof(struct gsusb_rec_frame);
+}
+
+uint32_t gsusb_rec_read(uint32_t first, struct gsusb_rec_frame *out, uint32_t max)
+{
+    (void)first;
+    (void)out;
+    (void)max;
+    return 0;
+}
+
+#endif
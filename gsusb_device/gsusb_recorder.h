@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gs_usb.h"
+#include "gsusb_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Flight recorder: the most recent frames seen on the bus, kept in a ring
+// that the host freezes and reads back after an incident. can_rx_task and
+// usb_tx_task record concurrently; a record costs one compare-and-swap and
+// a 20-byte store.
+
+// Allocates the ring; false only if not even a small buffer is available.
+bool gsusb_rec_init(void);
+
+#if GSUSB_RECORDER
+// Records one frame unless the recorder is frozen. data is always 8 bytes.
+void gsusb_rec_frame(uint32_t timestamp_us, uint32_t can_id, uint8_t dlc,
+                     const uint8_t *data, uint8_t flags);
+#else
+static inline void gsusb_rec_frame(uint32_t timestamp_us, uint32_t can_id, uint8_t dlc,
+                                   const uint8_t *data, uint8_t flags)
+{
+    (void)timestamp_us;
+    (void)can_id;
+    (void)dlc;
+    (void)data;
+    (void)flags;
+}
+#endif
+
+// Stops recording with reason (GSUSB_REC_FROZEN_*) and pins the current
+// contents for gsusb_rec_read(). Freezing again keeps the first reason.
+void gsusb_rec_freeze(uint32_t reason);
+
+// Restarts recording; clear also forgets everything recorded so far.
+void gsusb_rec_resume(bool clear);
+
+void gsusb_rec_info(struct gsusb_rec_info *out);
+
+// Copies up to max records starting first records after the oldest one.
+// Returns the number copied, 0 past the end or while recording.
+uint32_t gsusb_rec_read(uint32_t first, struct gsusb_rec_frame *out, uint32_t max);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "driver/twai.h"
+#include "gsusb_frame.h"
+
+// SLCAN (Lawicel) ASCII format, as spoken by slcand, python-can and
+// CANHacker. One command or frame per line, ended by '\r':
+//
+//   tIIILDD..        standard data frame    TIIIIIIIILDD..  extended
+//   rIIIL            standard RTR           RIIIIIIIIL      extended
+//
+// Frames to the host may end in a 4-digit millisecond timestamp (Z1).
+// Hex digits go through lookup tables both ways, with no printf/strtol on
+// the data path. Header-only so the host sim speaks exactly the same format.
+
+#define GSUSB_SLCAN_LINE_MAX 31 // 'T' + 8 id + 1 dlc + 16 data + 4 timestamp + '\r'
+#define GSUSB_SLCAN_BELL     '\a'
+#define GSUSB_SLCAN_TS_WRAP  60000
+
+struct gsusb_slcan_tables
+{
+    char hex[256][2];    // byte -> two upper-case digits
+    uint8_t nibble[256]; // digit -> value, 0xFF if not a hex digit
+};
+
+static constexpr struct gsusb_slcan_tables gsusb_slcan_make_tables(void)
+{
+    struct gsusb_slcan_tables t = {};
+    const char upper[] = "0123456789ABCDEF";
+    const char lower[] = "0123456789abcdef";
+    for (int i = 0; i < 256; i++)
+    {
+        t.hex[i][0] = upper[i >> 4];
+        t.hex[i][1] = upper[i & 0xF];
+        t.nibble[i] = 0xFF;
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        t.nibble[(uint8_t)upper[i]] = (uint8_t)i;
+        t.nibble[(uint8_t)lower[i]] = (uint8_t)i;
+    }
+    return t;
+}
+
+inline constexpr struct gsusb_slcan_tables gsusb_slcan_tab = gsusb_slcan_make_tables();
+
+static inline char *gsusb_slcan_put_byte(char *p, uint8_t b)
+{
+    memcpy(p, gsusb_slcan_tab.hex[b], 2);
+    return p + 2;
+}
+
+// Writes the line for msg, '\r' included, and returns its length. ts_ms < 0
+// leaves the timestamp out.
+static inline uint32_t gsusb_slcan_put_frame(char *p, const twai_message_t *msg, int32_t ts_ms)
+{
+    char *start = p;
+    uint32_t id = msg->identifier;
+    uint8_t len = gsusb_frame_dlc(msg->data_length_code);
+
+    if (msg->extd)
+    {
+        *p++ = msg->rtr ? 'R' : 'T';
+        p = gsusb_slcan_put_byte(p, (uint8_t)((id >> 24) & 0x1F));
+        p = gsusb_slcan_put_byte(p, (uint8_t)(id >> 16));
+        p = gsusb_slcan_put_byte(p, (uint8_t)(id >> 8));
+    }
+    else
+    {
+        *p++ = msg->rtr ? 'r' : 't';
+        *p++ = gsusb_slcan_tab.hex[(id >> 8) & 0x7][1];
+    }
+    p = gsusb_slcan_put_byte(p, (uint8_t)id);
+    *p++ = (char)('0' + len);
+    if (!msg->rtr)
+    {
+        for (uint8_t i = 0; i < len; i++)
+        {
+            p = gsusb_slcan_put_byte(p, msg->data[i]);
+        }
+    }
+    if (ts_ms >= 0)
+    {
+        p = gsusb_slcan_put_byte(p, (uint8_t)(ts_ms >> 8));
+        p = gsusb_slcan_put_byte(p, (uint8_t)ts_ms);
+    }
+    *p++ = '\r';
+    return (uint32_t)(p - start);
+}
+
+// n hex digits at p; false if one of them is not a digit.
+static inline bool gsusb_slcan_get_hex(const char *p, uint32_t n, uint32_t *out)
+{
+    uint32_t v = 0;
+    uint8_t bad = 0;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint8_t d = gsusb_slcan_tab.nibble[(uint8_t)p[i]];
+        bad |= d;
+        v = (v << 4) | (d & 0xF);
+    }
+    *out = v;
+    return (bad & 0xF0) == 0;
+}
+
+// Parses a t/T/r/R line of len characters, '\r' excluded, where it lies.
+static inline bool gsusb_slcan_parse_frame(const char *p, uint32_t len, twai_message_t *msg)
+{
+    bool ext = p[0] == 'T' || p[0] == 'R';
+    bool rtr = p[0] == 'r' || p[0] == 'R';
+    uint32_t id_len = ext ? 8 : 3;
+    uint32_t id;
+    uint32_t dlc;
+    if (len < 2 + id_len || !gsusb_slcan_get_hex(p + 1, id_len, &id) ||
+        !gsusb_slcan_get_hex(p + 1 + id_len, 1, &dlc) || dlc > 8 ||
+        id > (ext ? GSUSB_CAN_ID_MASK : 0x7FFU) || len != 2 + id_len + (rtr ? 0 : 2 * dlc))
+    {
+        return false;
+    }
+
+    memset(msg, 0, sizeof(*msg));
+    msg->extd = ext ? 1 : 0;
+    msg->rtr = rtr ? 1 : 0;
+    msg->identifier = id;
+    msg->data_length_code = (uint8_t)dlc;
+    if (!rtr)
+    {
+        const char *d = p + 2 + id_len;
+        for (uint32_t i = 0; i < dlc; i++)
+        {
+            uint32_t b;
+            if (!gsusb_slcan_get_hex(d + 2 * i, 2, &b))
+            {
+                return false;
+            }
+            msg->data[i] = (uint8_t)b;
+        }
+    }
+    return true;
+}
+
+// The standard rates of S0..S8; 0 for anything else.
+static inline uint32_t gsusb_slcan_bitrate(char code)
+{
+    static const uint32_t rates[] = {10000, 20000, 50000, 100000, 125000,
+                                     250000, 500000, 800000, 1000000};
+    uint32_t n = (uint32_t)(code - '0');
+    return n < sizeof(rates) / sizeof(rates[0]) ? rates[n] : 0;
+}
@@ -0,0 +1,50 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "esp_timer.h"
+
+#include "gs_usb.h"
+#include "gsusb_stats.h"
+
+#if GSUSB_STATS
+uint32_t gsusb_stat_counters[GSUSB_STAT_COUNT];
+uint32_t gsusb_stat_hist[GSUSB_HIST_COUNT][GSUSB_STATS_BUCKETS];
+bool gsusb_stat_counter_clear[GSUSB_STAT_COUNT];
+bool gsusb_stat_hist_clear[GSUSB_HIST_COUNT];
+#endif
+
+void gsusb_stats_snapshot(struct gsusb_stats *out, bool clear)
+{
+    memset(out, 0, sizeof(*out));
+    out->version = GSUSB_STATS_VERSION;
+    out->uptime_ms = (uint32_t)(esp_timer_get_time() / 1000);
+
+#if GSUSB_STATS
+    out->cpu_hz = esp_rom_get_cpu_ticks_per_us() * 1000000U;
+    // A clear is carried out by the writers, see gsusb_stats.h.
+    for (uint32_t c = 0; c < GSUSB_STAT_COUNT; c++)
+    {
+        if (!__atomic_load_n(&gsusb_stat_counter_clear[c], __ATOMIC_ACQUIRE))
+        {
+            out->counters[c] = gsusb_stat_counters[c];
+        }
+        if (clear)
+        {
+            __atomic_store_n(&gsusb_stat_counter_clear[c], true, __ATOMIC_RELEASE);
+        }
+    }
+    for (uint32_t h = 0; h < GSUSB_HIST_COUNT; h++)
+    {
+        if (!__atomic_load_n(&gsusb_stat_hist_clear[h], __ATOMIC_ACQUIRE))
+        {
+            memcpy(out->hist[h], gsusb_stat_hist[h], sizeof(out->hist[h]));
+        }
+        if (clear)
+        {
+            __atomic_store_n(&gsusb_stat_hist_clear[h], true, __ATOMIC_RELEASE);
+        }
+    }
+#else
+    (void)clear;
+#endif
+}
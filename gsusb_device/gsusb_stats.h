@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gs_usb.h"
+#include "gsusb_config.h"
+
+#if GSUSB_STATS
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Each counter and histogram has a single writing task, so the probes are
+// plain increments; a concurrent GSUSB_BREQ_STATS read may see a sample
+// half-way through, never a torn counter. A clear only raises the flags;
+// the writer zeroes its own counter or histogram at its next sample, and
+// reads return zero until it has.
+
+#if GSUSB_STATS
+
+extern uint32_t gsusb_stat_counters[GSUSB_STAT_COUNT];
+extern uint32_t gsusb_stat_hist[GSUSB_HIST_COUNT][GSUSB_STATS_BUCKETS];
+extern bool gsusb_stat_counter_clear[GSUSB_STAT_COUNT];
+extern bool gsusb_stat_hist_clear[GSUSB_HIST_COUNT];
+
+static inline uint32_t *gsusb_stat_counter(uint32_t c)
+{
+    if (__atomic_load_n(&gsusb_stat_counter_clear[c], __ATOMIC_ACQUIRE))
+    {
+        gsusb_stat_counters[c] = 0;
+        __atomic_store_n(&gsusb_stat_counter_clear[c], false, __ATOMIC_RELEASE);
+    }
+    return &gsusb_stat_counters[c];
+}
+
+static inline void gsusb_stat_hist_add(enum gsusb_stat_hist h, uint32_t cycles)
+{
+    if (__atomic_load_n(&gsusb_stat_hist_clear[h], __ATOMIC_ACQUIRE))
+    {
+        for (uint32_t i = 0; i < GSUSB_STATS_BUCKETS; i++)
+        {
+            gsusb_stat_hist[h][i] = 0;
+        }
+        __atomic_store_n(&gsusb_stat_hist_clear[h], false, __ATOMIC_RELEASE);
+    }
+    uint32_t v = cycles >> GSUSB_STATS_BUCKET_SHIFT;
+    uint32_t b = v ? 32 - __builtin_clz(v) : 0;
+    gsusb_stat_hist[h][b < GSUSB_STATS_BUCKETS ? b : GSUSB_STATS_BUCKETS - 1]++;
+}
+
+#define GSUSB_STAT_INC(c)        ((*gsusb_stat_counter(c))++)
+#define GSUSB_STAT_ADD(c, n)     ((*gsusb_stat_counter(c)) += (n))
+#define GSUSB_STAT_CYCLES()      esp_cpu_get_cycle_count()
+#define GSUSB_STAT_SINCE(h, t0)  gsusb_stat_hist_add((h), esp_cpu_get_cycle_count() - (t0))
+#define GSUSB_STAT_US(h, us)     gsusb_stat_hist_add((h), (us) * esp_rom_get_cpu_ticks_per_us())
+
+#else
+
+#define GSUSB_STAT_INC(c)        do {} while (0)
+#define GSUSB_STAT_ADD(c, n)     ((void)(n))
+#define GSUSB_STAT_CYCLES()      0U
+#define GSUSB_STAT_SINCE(h, t0)  ((void)(t0))
+#define GSUSB_STAT_US(h, us)     ((void)(us))
+
+#endif
+
+// Copies the current values into the wire block; everything is zero when
+// GSUSB_STATS is off. clear restarts the counters and histograms.
+void gsusb_stats_snapshot(struct gsusb_stats *out, bool clear);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <stdint.h>
+
+// TWAI bit timing limits (ESP32-S3, APB clock) and a solver mapping a bitrate
+// and sample point onto them. Everything is constexpr so the table of common
+// bitrates below is computed and checked at compile time.
+
+#define GSUSB_TWAI_CLOCK_HZ  80000000UL
+#define GSUSB_TWAI_BRP_MIN   2
+#define GSUSB_TWAI_BRP_MAX   16384
+#define GSUSB_TWAI_BRP_INC   2
+#define GSUSB_TWAI_TSEG1_MIN 1
+#define GSUSB_TWAI_TSEG1_MAX 16
+#define GSUSB_TWAI_TSEG2_MIN 1
+#define GSUSB_TWAI_TSEG2_MAX 8
+#define GSUSB_TWAI_SJW_MAX   4
+
+// Largest bitrate error a substituted timing may have (Linux allows 0.5%).
+#define GSUSB_TIMING_MAX_ERR_PPM 5000
+
+struct gsusb_timing
+{
+    uint32_t brp;
+    uint8_t tseg1; // prop_seg + phase_seg1
+    uint8_t tseg2;
+    uint8_t sjw;
+};
+
+static constexpr bool gsusb_timing_legal(uint32_t brp, uint32_t tseg1, uint32_t tseg2)
+{
+    return brp >= GSUSB_TWAI_BRP_MIN && brp <= GSUSB_TWAI_BRP_MAX &&
+           brp % GSUSB_TWAI_BRP_INC == 0 &&
+           tseg1 >= GSUSB_TWAI_TSEG1_MIN && tseg1 <= GSUSB_TWAI_TSEG1_MAX &&
+           tseg2 >= GSUSB_TWAI_TSEG2_MIN && tseg2 <= GSUSB_TWAI_TSEG2_MAX;
+}
+
+static constexpr uint32_t gsusb_timing_bitrate(const gsusb_timing &t)
+{
+    return (uint32_t)(GSUSB_TWAI_CLOCK_HZ / ((uint64_t)t.brp * (1 + t.tseg1 + t.tseg2)));
+}
+
+static constexpr uint32_t gsusb_timing_sample_point(const gsusb_timing &t)
+{
+    return 1000U * (1 + t.tseg1) / (1 + t.tseg1 + t.tseg2);
+}
+
+static constexpr uint32_t gsusb_abs_diff(uint32_t a, uint32_t b)
+{
+    return a > b ? a - b : b - a;
+}
+
+// Nearest legal timing for bitrate with the sample point (per mille) as
+// close to sp as the quanta allow. Bitrate error decides first, then the
+// sample point; ties go to more quanta per bit for a finer SJW. Returns
+// false when nothing is within GSUSB_TIMING_MAX_ERR_PPM.
+static constexpr bool gsusb_timing_solve(uint32_t bitrate, uint32_t sp, gsusb_timing &out)
+{
+    if (bitrate == 0)
+    {
+        return false;
+    }
+
+    uint64_t best_err = UINT64_MAX;
+    uint32_t best_sp_err = UINT32_MAX;
+    const uint32_t tq_max = 1 + GSUSB_TWAI_TSEG1_MAX + GSUSB_TWAI_TSEG2_MAX;
+    const uint32_t tq_min = 1 + GSUSB_TWAI_TSEG1_MIN + GSUSB_TWAI_TSEG2_MIN;
+
+    for (uint32_t tq = tq_max; tq >= tq_min; tq--)
+    {
+        // Round to the nearest even prescaler.
+        uint64_t div = (uint64_t)bitrate * tq * GSUSB_TWAI_BRP_INC;
+        uint32_t brp = (uint32_t)((GSUSB_TWAI_CLOCK_HZ + div / 2) / div) * GSUSB_TWAI_BRP_INC;
+        if (brp < GSUSB_TWAI_BRP_MIN || brp > GSUSB_TWAI_BRP_MAX)
+        {
+            continue;
+        }
+
+        uint32_t tseg1 = (sp * tq + 500) / 1000 - 1;
+        if (tseg1 > tq - 1 - GSUSB_TWAI_TSEG2_MIN)
+        {
+            tseg1 = tq - 1 - GSUSB_TWAI_TSEG2_MIN;
+        }
+        if (tseg1 < tq - 1 - GSUSB_TWAI_TSEG2_MAX)
+        {
+            tseg1 = tq - 1 - GSUSB_TWAI_TSEG2_MAX;
+        }
+        if (tseg1 > GSUSB_TWAI_TSEG1_MAX)
+        {
+            tseg1 = GSUSB_TWAI_TSEG1_MAX;
+        }
+        uint32_t tseg2 = tq - 1 - tseg1;
+        if (!gsusb_timing_legal(brp, tseg1, tseg2))
+        {
+            continue;
+        }
+
+        gsusb_timing t = {brp, (uint8_t)tseg1, (uint8_t)tseg2, 0};
+        uint64_t err = gsusb_abs_diff(gsusb_timing_bitrate(t), bitrate);
+        uint32_t sp_err = gsusb_abs_diff(gsusb_timing_sample_point(t), sp);
+        if (err < best_err || (err == best_err && sp_err < best_sp_err))
+        {
+            best_err = err;
+            best_sp_err = sp_err;
+            t.sjw = (uint8_t)(tseg2 < GSUSB_TWAI_SJW_MAX ? tseg2 : GSUSB_TWAI_SJW_MAX);
+            out = t;
+        }
+    }
+    return best_err != UINT64_MAX && best_err * 1000000 <= (uint64_t)bitrate * GSUSB_TIMING_MAX_ERR_PPM;
+}
+
+// Sample points as chosen by Linux can_calc_bittiming().
+static constexpr uint32_t gsusb_timing_default_sp(uint32_t bitrate)
+{
+    return bitrate > 800000 ? 750 : bitrate > 500000 ? 800 : 875;
+}
+
+struct gsusb_timing_entry
+{
+    uint32_t bitrate;
+    uint32_t sp;
+    gsusb_timing timing;
+};
+
+static constexpr gsusb_timing_entry gsusb_timing_entry_make(uint32_t bitrate)
+{
+    gsusb_timing_entry e = {bitrate, gsusb_timing_default_sp(bitrate), {0, 0, 0, 0}};
+    gsusb_timing_solve(bitrate, e.sp, e.timing);
+    return e;
+}
+
+static constexpr gsusb_timing_entry gsusb_timing_table[] = {
+    gsusb_timing_entry_make(10000),
+    gsusb_timing_entry_make(20000),
+    gsusb_timing_entry_make(50000),
+    gsusb_timing_entry_make(83333),
+    gsusb_timing_entry_make(100000),
+    gsusb_timing_entry_make(125000),
+    gsusb_timing_entry_make(250000),
+    gsusb_timing_entry_make(500000),
+    gsusb_timing_entry_make(800000),
+    gsusb_timing_entry_make(1000000),
+};
+
+// Every entry must be legal and within 0.1% of its bitrate.
+static constexpr bool gsusb_timing_table_valid(void)
+{
+    for (const gsusb_timing_entry &e : gsusb_timing_table)
+    {
+        if (!gsusb_timing_legal(e.timing.brp, e.timing.tseg1, e.timing.tseg2) ||
+            gsusb_abs_diff(gsusb_timing_bitrate(e.timing), e.bitrate) * 1000 > e.bitrate)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(gsusb_timing_table_valid(), "TWAI timing table has an illegal entry");
@@ -0,0 +1,258 @@
+#include <atomic>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "esp_timer.h"
+
+#include "gs_usb.h"
+#include "gsusb_config.h"
+
+#include "gsusb_can.h"
+#include "gsusb_frame.h"
+#include "gsusb_traffic.h"
+
+#define TRAFFIC_WINDOW_MID 10 // slots in the middle window
+
+#if GSUSB_TRAFFIC
+
+// One slot more than the longest window: the current slot is still filling.
+#define TRAFFIC_RING    (GSUSB_TRAFFIC_SLOTS + 1)
+#define TRAFFIC_ID_BITS __builtin_ctz(GSUSB_TRAFFIC_IDS)
+
+static_assert((GSUSB_TRAFFIC_IDS & (GSUSB_TRAFFIC_IDS - 1)) == 0 && GSUSB_TRAFFIC_IDS >= 16,
+              "GSUSB_TRAFFIC_IDS must be a power of two, 16 or more");
+static_assert(GSUSB_TRAFFIC_PROBES <= GSUSB_TRAFFIC_IDS, "GSUSB_TRAFFIC_PROBES too large");
+static_assert(GSUSB_TRAFFIC_SLOTS >= TRAFFIC_WINDOW_MID, "GSUSB_TRAFFIC_SLOTS too small");
+
+struct traffic_entry
+{
+    uint32_t tag; // can_id (with CAN_EFF_FLAG) + 1; 0 for a free slot
+    uint32_t count;
+    uint32_t bits;
+    uint32_t last_us;
+    uint32_t last_period_us;
+    uint32_t period_min_us;
+    uint32_t period_max_us;
+    float period_mean_us;
+    float jitter_us;
+};
+
+struct traffic_table
+{
+    struct traffic_entry ids[GSUSB_TRAFFIC_IDS];
+    uint32_t used;
+    uint32_t untracked;
+    std::atomic<uint32_t> slot; // number of the load slot being filled
+    uint32_t slot_bits[TRAFFIC_RING];
+    std::atomic<bool> clear;    // set by the host, carried out by the writer
+};
+
+// [0]: can_rx_task, [1]: usb_tx_task (GSUSB_TRAFFIC_TX).
+static struct traffic_table traffic[2];
+
+static void traffic_reset(struct traffic_table &t)
+{
+    memset(t.ids, 0, sizeof(t.ids));
+    memset(t.slot_bits, 0, sizeof(t.slot_bits));
+    t.used = 0;
+    t.untracked = 0;
+}
+
+static void traffic_load_add(struct traffic_table &t, uint32_t bits)
+{
+    uint32_t now = (uint32_t)(esp_timer_get_time() / GSUSB_TRAFFIC_SLOT_US);
+    uint32_t last = t.slot.load(std::memory_order_relaxed);
+    if (now != last)
+    {
+        // The slots nothing was sent in since the last frame.
+        for (uint32_t i = 1; i <= now - last && i <= TRAFFIC_RING; i++)
+        {
+            t.slot_bits[(last + i) % TRAFFIC_RING] = 0;
+        }
+        t.slot.store(now, std::memory_order_release);
+    }
+    t.slot_bits[now % TRAFFIC_RING] += bits;
+}
+
+// Open addressing with linear probing; a new ID takes the first free slot.
+static struct traffic_entry *traffic_find(struct traffic_table &t, uint32_t tag)
+{
+    uint32_t i = (tag * 0x9E3779B1U) >> (32 - TRAFFIC_ID_BITS);
+    for (uint32_t n = 0; n < GSUSB_TRAFFIC_PROBES; n++, i = (i + 1) & (GSUSB_TRAFFIC_IDS - 1))
+    {
+        struct traffic_entry *e = &t.ids[i];
+        if (e->tag == tag)
+        {
+            return e;
+        }
+        if (e->tag == 0)
+        {
+            e->tag = tag;
+            t.used++;
+            return e;
+        }
+    }
+    return nullptr;
+}
+
+void gsusb_traffic_frame(uint32_t timestamp_us, const twai_message_t *msg, uint32_t flags)
+{
+    struct traffic_table &t = traffic[(flags & GSUSB_TRAFFIC_TX) ? 1 : 0];
+    if (t.clear.load(std::memory_order_acquire))
+    {
+        traffic_reset(t);
+        t.clear.store(false, std::memory_order_release);
+    }
+
+    uint32_t bits = gsusb_frame_bits_max(msg);
+    traffic_load_add(t, bits);
+
+    struct traffic_entry *e = traffic_find(t, (msg->identifier | (msg->extd ? CAN_EFF_FLAG : 0)) + 1);
+    if (e == nullptr)
+    {
+        t.untracked++;
+        return;
+    }
+
+    if (e->count > 0)
+    {
+        uint32_t period = timestamp_us - e->last_us;
+        if (e->count == 1)
+        {
+            e->period_min_us = period;
+            e->period_max_us = period;
+            e->period_mean_us = (float)period;
+        }
+        else
+        {
+            if (period < e->period_min_us)
+            {
+                e->period_min_us = period;
+            }
+            if (period > e->period_max_us)
+            {
+                e->period_max_us = period;
+            }
+            e->period_mean_us += ((float)period - e->period_mean_us) / (float)e->count;
+            float d = fabsf((float)period - (float)e->last_period_us);
+            e->jitter_us += (d - e->jitter_us) / 16.0f;
+        }
+        e->last_period_us = period;
+    }
+    e->count++;
+    e->bits += bits;
+    e->last_us = timestamp_us;
+}
+
+static uint32_t traffic_permille(uint64_t bits, uint32_t bitrate, uint32_t window_us)
+{
+    if (bitrate == 0)
+    {
+        return 0;
+    }
+    return (uint32_t)(bits * 1000000000ULL / ((uint64_t)bitrate * window_us));
+}
+
+void gsusb_traffic_info(struct gsusb_traffic_info *out, bool clear)
+{
+    memset(out, 0, sizeof(*out));
+    out->version = GSUSB_TRAFFIC_VERSION;
+    out->entry_size = sizeof(struct gsusb_traffic_id);
+    out->slots = 2 * GSUSB_TRAFFIC_IDS;
+    out->bitrate = gsusb_can_bitrate();
+    out->window_us[0] = GSUSB_TRAFFIC_SLOT_US;
+    out->window_us[1] = TRAFFIC_WINDOW_MID * GSUSB_TRAFFIC_SLOT_US;
+    out->window_us[2] = GSUSB_TRAFFIC_SLOTS * GSUSB_TRAFFIC_SLOT_US;
+
+    // Complete slots only, newest first; a slot older than what a table
+    // still holds, or newer than its last frame, was idle for it.
+    uint32_t now = (uint32_t)(esp_timer_get_time() / GSUSB_TRAFFIC_SLOT_US);
+    uint64_t sum = 0;
+    uint32_t peak = 0;
+    for (uint32_t k = 1; k <= GSUSB_TRAFFIC_SLOTS; k++)
+    {
+        uint32_t s = now - k;
+        uint32_t bits = 0;
+        for (const struct traffic_table &t : traffic)
+        {
+            if (!t.clear.load(std::memory_order_acquire) &&
+                t.slot.load(std::memory_order_acquire) - s < TRAFFIC_RING - 1)
+            {
+                bits += t.slot_bits[s % TRAFFIC_RING];
+            }
+        }
+        sum += bits;
+        peak = bits > peak ? bits : peak;
+        if (k == 1)
+        {
+            out->load_permille[0] = traffic_permille(sum, out->bitrate, out->window_us[0]);
+        }
+        else if (k == TRAFFIC_WINDOW_MID)
+        {
+            out->load_permille[1] = traffic_permille(sum, out->bitrate, out->window_us[1]);
+        }
+    }
+    out->load_permille[2] = traffic_permille(sum, out->bitrate, out->window_us[2]);
+    out->peak_permille = traffic_permille(peak, out->bitrate, out->window_us[0]);
+
+    for (struct traffic_table &t : traffic)
+    {
+        if (!t.clear.load(std::memory_order_acquire))
+        {
+            out->ids += t.used;
+            out->untracked += t.untracked;
+        }
+        if (clear)
+        {
+            t.clear.store(true, std::memory_order_release);
+        }
+    }
+}
+
+uint32_t gsusb_traffic_read(uint32_t first, struct gsusb_traffic_id *out, uint32_t max)
+{
+    uint32_t n = 0;
+    for (uint32_t i = first; i < first + max && i < 2 * GSUSB_TRAFFIC_IDS; i++)
+    {
+        const struct traffic_table &t = traffic[i / GSUSB_TRAFFIC_IDS];
+        const struct traffic_entry &e = t.ids[i % GSUSB_TRAFFIC_IDS];
+        if (t.clear.load(std::memory_order_acquire) || e.tag == 0)
+        {
+            continue;
+        }
+
+        struct gsusb_traffic_id &r = out[n++];
+        r.can_id = e.tag - 1;
+        r.flags = i >= GSUSB_TRAFFIC_IDS ? GSUSB_TRAFFIC_TX : 0;
+        r.count = e.count;
+        r.bits = e.bits;
+        r.last_us = e.last_us;
+        bool periods = e.count > 1;
+        r.period_min_us = periods ? e.period_min_us : 0;
+        r.period_mean_us = periods ? (uint32_t)lroundf(e.period_mean_us) : 0;
+        r.period_max_us = periods ? e.period_max_us : 0;
+        r.jitter_us = periods ? (uint32_t)lroundf(e.jitter_us) : 0;
+    }
+    return n;
+}
+
+#else
+
+void gsusb_traffic_info(struct gsusb_traffic_info *out, bool clear)
+{
+    (void)clear;
+    memset(out, 0, sizeof(*out));
+    out->version = GSUSB_TRAFFIC_VERSION;
+    out->entry_size = sizeof(struct gsusb_traffic_id);
+}
+
+uint32_t gsusb_traffic_read(uint32_t first, struct gsusb_traffic_id *out, uint32_t max)
+{
+    (void)first;
+    (void)out;
+    (void)max;
+    return 0;
+}
+
+#endif
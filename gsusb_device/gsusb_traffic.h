@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "driver/twai.h"
+#include "gs_usb.h"
+#include "gsusb_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Traffic statistics for capacity planning: bus load over sliding windows
+// and the IDs that make it up. can_rx_task feeds the frames it dequeues and
+// usb_tx_task the frames it queues, each into a table of its own, so an
+// update takes no lock: at most GSUSB_TRAFFIC_PROBES hash slots and a few
+// stores, nothing allocated. A host clear is carried out by each writer at
+// its next frame; until then its table reads as empty.
+
+#if GSUSB_TRAFFIC
+// flags: GSUSB_TRAFFIC_TX for frames queued by this device.
+void gsusb_traffic_frame(uint32_t timestamp_us, const twai_message_t *msg, uint32_t flags);
+#else
+static inline void gsusb_traffic_frame(uint32_t timestamp_us, const twai_message_t *msg,
+                                       uint32_t flags)
+{
+    (void)timestamp_us;
+    (void)msg;
+    (void)flags;
+}
+#endif
+
+// Current load and table occupancy; clear restarts everything after the read.
+void gsusb_traffic_info(struct gsusb_traffic_info *out, bool clear);
+
+// Copies the IDs held in up to max table slots starting at slot first, RX
+// table first. Returns the number of IDs copied.
+uint32_t gsusb_traffic_read(uint32_t first, struct gsusb_traffic_id *out, uint32_t max);
+
+#ifdef __cplusplus
+}
+#endif
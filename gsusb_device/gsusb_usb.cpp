@@ -1,3 +1,4 @@
+#include <atomic>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -10,24 +11,50 @@
 
 #include "tinyusb.h"
 #include "class/vendor/vendor_device.h"
+#if GSUSB_SLCAN
+#include "class/cdc/cdc_device.h"
+#endif
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "led_service.h"
 #include "board_pins.h"
 #include "gs_usb.h"
+#include "gsusb_config.h"
 
 #include "gsusb_can.h"
+#include "gsusb_cdc.h"
+#include "gsusb_cyclic.h"
+#include "gsusb_ep.h"
+#include "gsusb_errors.h"
+#include "gsusb_filter.h"
+#include "gsusb_frame.h"
+#include "gsusb_net.h"
+#include "gsusb_recorder.h"
+#include "gsusb_stats.h"
+#include "gsusb_timing.h"
+#include "gsusb_traffic.h"
 #include "gsusb_usb.h"
+#include "spsc_ring.h"
+#include "tx_prio_queue.h"
+#include "tx_time_queue.h"
 
 
 
 
 static TaskHandle_t h_usb_tx_task = nullptr;
+static TaskHandle_t h_usb_in_task = nullptr;
+static TaskHandle_t h_can_rx_task = nullptr;
+static TaskHandle_t h_can_alert_task = nullptr;
 
 
+#if GSUSB_SLCAN
+#define TUSB_DESC_TOTAL_LEN (TUD_CONFIG_DESC_LEN + TUD_VENDOR_DESC_LEN + TUD_CDC_DESC_LEN)
+#define TUSB_ITF_COUNT      3 // gs_usb, CDC control, CDC data
+#else
 #define TUSB_DESC_TOTAL_LEN (TUD_CONFIG_DESC_LEN + TUD_VENDOR_DESC_LEN)
-
-#define CAN_CLOCK_SPEED 80000000UL
+#define TUSB_ITF_COUNT      1
+#endif
 
 
 static uint32_t gs_resp_identify = 0xBEBAFECA;
@@ -45,29 +72,195 @@ static struct gs_device_config gs_resp_conf = {
     1  // hw_version
 };
 
+static uint32_t gs_resp_timestamp = 0;
+
+static struct gs_device_state gs_resp_state;
+
+static struct gsusb_stats gs_resp_stats;
+
+static struct gsusb_rec_info gs_resp_rec_info;
+#if GSUSB_RECORDER
+static struct gsusb_rec_frame gs_resp_rec[GSUSB_REC_READ_RECORDS];
+#endif
+
+static struct gsusb_traffic_info gs_resp_traffic_info;
+
+static struct gsusb_cyclic_status gs_resp_cyclic[GSUSB_CYCLIC_JOBS];
+
+static struct gsusb_autobaud gs_resp_autobaud;
+
+// GSUSB_BREQ_AUTOBAUD only asks; can_alert_task runs the sweep and fills
+// autobaud_result before it moves the state off RUNNING.
+static struct gsusb_autobaud autobaud_result;
+static std::atomic<uint32_t> autobaud_state{GSUSB_AUTOBAUD_IDLE};
+#if GSUSB_TRAFFIC
+static struct gsusb_traffic_id gs_resp_traffic[GSUSB_TRAFFIC_READ_SLOTS];
+#endif
+
+// Cycle count of the latest bulk OUT packet, start of GSUSB_HIST_TX_SUBMIT.
+static volatile uint32_t tx_out_cycles = 0;
+
 static struct gs_device_bt_const gs_resp_btc = {
-    0,               // feature
-    CAN_CLOCK_SPEED, // fclk_can
-    1,               // tseg1_min
-    16,              // tseg1_max
-    1,               // tseg2_min
-    8,               // tseg2_max
-    4,               // sjw_max
-    1,               // brp_min
-    128,             // brp_max
-    1                // brp_inc
+    GS_CAN_FEATURE_LISTEN_ONLY |
+        GS_CAN_FEATURE_LOOP_BACK |
+        GS_CAN_FEATURE_TRIPLE_SAMPLE |
+        GS_CAN_FEATURE_ONE_SHOT |
+        GS_CAN_FEATURE_HW_TIMESTAMP |
+        GS_CAN_FEATURE_BERR_REPORTING |
+        GS_CAN_FEATURE_GET_STATE |
+        (GSUSB_TX_TIMED ? GSUSB_CAN_FEATURE_TX_TIMED : 0), // feature
+    GSUSB_TWAI_CLOCK_HZ,  // fclk_can
+    GSUSB_TWAI_TSEG1_MIN, // tseg1_min
+    GSUSB_TWAI_TSEG1_MAX, // tseg1_max
+    GSUSB_TWAI_TSEG2_MIN, // tseg2_min
+    GSUSB_TWAI_TSEG2_MAX, // tseg2_max
+    GSUSB_TWAI_SJW_MAX,   // sjw_max
+    GSUSB_TWAI_BRP_MIN,   // brp_min
+    GSUSB_TWAI_BRP_MAX,   // brp_max
+    GSUSB_TWAI_BRP_INC    // brp_inc
+};
+
+
+static_assert(sizeof(struct gs_host_frame) == GS_HOST_FRAME_TS_SIZE, "gs_host_frame layout");
+static_assert(!GSUSB_RX_BATCH || GSUSB_RX_BATCH_BYTES >= GS_HOST_FRAME_TS_SIZE,
+              "GSUSB_RX_BATCH_BYTES smaller than one gs_host_frame");
+
+// Size of each frame on the bulk IN endpoint: the kernel expects the
+// timestamp only when it asked for GS_CAN_MODE_HW_TIMESTAMP.
+static volatile uint32_t in_frame_len = GS_HOST_FRAME_SIZE;
+
+// Size of each frame on the bulk OUT endpoint: with GSUSB_CAN_MODE_TX_TIMED
+// the host sends the timestamp too.
+static volatile uint32_t out_frame_len = GS_HOST_FRAME_SIZE;
+
+// Report bus errors and lost arbitration as error frames; set by
+// GS_CAN_MODE_BERR_REPORTING or GS_USB_BREQ_BERR.
+static volatile bool berr_reporting = false;
+
+// gs_device_mode.flags of the running interface; the TX path reads
+// listen-only, loopback and one-shot from here.
+static volatile uint32_t can_mode_flags = 0;
+
+// Pre-encoded frames waiting for the bulk IN endpoint. usb_in_task is the
+// only writer of the vendor FIFO; everything else hands frames over here.
+static SpscRing<struct gs_host_frame> rx_ring;   // can_rx_task -> usb_in_task
+static SpscRing<struct gs_host_frame> echo_ring; // can_alert_task -> usb_in_task
+
+static int64_t rx_batch_start_us = 0;
+
+// tx_order entries carry the driver epoch the frame was queued in, so
+// frames lost to a stop or reinstall are told apart from newer ones.
+// TX_ORDER_REJECTED marks a frame that never reached the driver (listen-
+// only); it retires as failed so the host still gets its echo_id back.
+// TX_ORDER_NO_ECHO stands for a frame from the network bridge.
+#define TX_ORDER_ENTRY(echo_id, epoch) (((epoch) << 8) | (echo_id))
+#define TX_ORDER_REJECTED              0x80U
+#define TX_ORDER_NO_ECHO               0x7FU
+#define TX_ORDER_ECHO_ID(entry)        ((entry) & 0x7FU)
+#define TX_ORDER_EPOCH(entry)          ((entry) >> 8)
+
+static_assert(GSUSB_TX_ECHO_SLOTS <= TX_ORDER_NO_ECHO, "echo_id must fit TX_ORDER_ENTRY()");
+static_assert(GSUSB_TX_ORDER_SLOTS >= GSUSB_CAN_TX_QUEUE_LEN + 1,
+              "tx_order must hold an entry per frame in the TWAI queue and controller");
+static_assert(GSUSB_ECHO_RING_SLOTS >= 2 * GSUSB_TX_ECHO_SLOTS,
+              "echo ring must hold an echo plus an error frame per TX slot");
+
+// Frames on their way to the bus, indexed by the host's echo_id. usb_tx_task
+// claims a slot and queues its echo_id in tx_order; can_alert_task retires
+// slots in that order as TWAI reports completions (the controller sends
+// strictly in queue order).
+struct tx_echo_slot
+{
+    struct gs_host_frame frame;
+    uint32_t submit_us; // esp_timer: the completion is timed on the other core
+    uint32_t sched_epoch; // driver epoch when scheduled (GSUSB_TX_SCHED)
+    std::atomic<bool> busy;
 };
 
+static struct tx_echo_slot tx_slots[GSUSB_TX_ECHO_SLOTS];
+static SpscRing<uint32_t> tx_order;           // usb_tx_task -> can_alert_task, TX_ORDER_ENTRY()
+static std::atomic<uint32_t> tx_submitted{0}; // frames accepted by twai_transmit
+static std::atomic<uint32_t> tx_retired{0};   // tx_order entries can_alert_task is done with
+
+#if GSUSB_TX_SCHED
+// Host frames held back for the bus, by echo_id; usb_tx_task only. A slot
+// is claimed while its frame waits here, so the echo_id check still holds.
+static TxPrioQueue<GSUSB_TX_ECHO_SLOTS> tx_sched;
+#endif
+
+#if GSUSB_TX_TIMED
+// Host frames waiting for their time, by echo_id; usb_tx_task only. They
+// hold their slot like scheduled frames, and all of them were queued in
+// tx_timed_epoch. The timer is armed for tx_timed_armed_us while
+// tx_timed_armed is set; its callback clears it.
+static TxTimeQueue<GSUSB_TX_ECHO_SLOTS> tx_timed;
+static uint32_t tx_timed_epoch = 0;
+static esp_timer_handle_t tx_timed_timer = nullptr;
+static uint32_t tx_timed_armed_us = 0;
+static std::atomic<bool> tx_timed_armed{false};
+#endif
+
+// Frames from the network bridge; usb_tx_task queues them for TWAI between
+// bulk OUT frames so tx_order keeps a single producer.
+static SpscRing<twai_message_t> net_tx_ring;  // net_in_task -> usb_tx_task
+
+
+static struct gsusb_filter_range temp_filter[GSUSB_FILTER_REQ_RANGES];
+static struct gsusb_cyclic_job temp_cyclic;
 
 static struct gs_device_bittiming temp_bt;
 static struct gs_device_mode     temp_mode;
 static uint32_t                  temp_host_format;
+static uint32_t                  temp_berr;
 
 
 extern "C" void tinyusb_task(void *param);
 extern "C" void can_rx_task(void *arg);
 extern "C" void usb_tx_task(void *arg);
+extern "C" void usb_in_task(void *arg);
+extern "C" void can_alert_task(void *arg);
+
+
+// The gs_usb interface is configured, whichever driver runs its endpoints.
+static bool usb_host_mounted(void)
+{
+#if GSUSB_USB_DIRECT
+    return gsusb_ep_mounted();
+#else
+    return tud_vendor_mounted();
+#endif
+}
+
+
+// The CAN tasks sleep until there is work: frames announced by
+// TWAI_ALERT_RX_DATA or a freshly started bus.
+static void can_tasks_kick(void)
+{
+    if (h_can_alert_task != nullptr)
+    {
+        xTaskNotifyGive(h_can_alert_task);
+    }
+    if (h_can_rx_task != nullptr)
+    {
+        xTaskNotifyGive(h_can_rx_task);
+    }
+}
+
+void gsusb_usb_kick(void)
+{
+    can_tasks_kick();
+}
+
+// can_alert_task only runs while someone is attached to the bus.
+extern "C" void tud_mount_cb(void)
+{
+    can_tasks_kick();
+}
 
+extern "C" void tud_umount_cb(void)
+{
+    can_tasks_kick();
+}
 
 extern "C" bool tud_vendor_control_xfer_cb(uint8_t rhport,
                                            uint8_t stage,
@@ -106,6 +299,140 @@ extern "C" bool tud_vendor_control_xfer_cb(uint8_t rhport,
                                     sizeof(gs_resp_btc));
 
 
+        case GS_USB_BREQ_TIMESTAMP:
+            gs_resp_timestamp = (uint32_t)esp_timer_get_time();
+            return tud_control_xfer(rhport,
+                                    request,
+                                    (void *)&gs_resp_timestamp,
+                                    sizeof(gs_resp_timestamp));
+
+        case GS_USB_BREQ_GET_STATE:
+            gsusb_can_get_state(&gs_resp_state);
+            return tud_control_xfer(rhport,
+                                    request,
+                                    (void *)&gs_resp_state,
+                                    sizeof(gs_resp_state));
+
+        case GSUSB_BREQ_STATS:
+        {
+            gsusb_stats_snapshot(&gs_resp_stats, request->wValue == 1);
+            twai_status_info_t status;
+            if (gsusb_can_get_status(&status) == ESP_OK)
+            {
+                gs_resp_stats.counters[GSUSB_STAT_RX_DROP_DRIVER] =
+                    status.rx_missed_count + status.rx_overrun_count;
+            }
+            return tud_control_xfer(rhport,
+                                    request,
+                                    (void *)&gs_resp_stats,
+                                    sizeof(gs_resp_stats));
+        }
+
+        case GSUSB_BREQ_REC:
+            GSUSB_LOGI("GSUSB", "REQ REC op=%u", request->wValue);
+            if (request->wValue == GSUSB_REC_FREEZE)
+            {
+                gsusb_rec_freeze(GSUSB_REC_FROZEN_HOST);
+            }
+            else if (request->wValue == GSUSB_REC_RESUME || request->wValue == GSUSB_REC_CLEAR)
+            {
+                gsusb_rec_resume(request->wValue == GSUSB_REC_CLEAR);
+            }
+            else
+            {
+                return false;
+            }
+            return tud_control_xfer(rhport, request, nullptr, 0);
+
+        case GSUSB_BREQ_REC_INFO:
+            gsusb_rec_info(&gs_resp_rec_info);
+            return tud_control_xfer(rhport,
+                                    request,
+                                    (void *)&gs_resp_rec_info,
+                                    sizeof(gs_resp_rec_info));
+
+#if GSUSB_RECORDER
+        case GSUSB_BREQ_REC_READ:
+        {
+            // Copied out of the ring so the data stage never races a
+            // resume and PSRAM is only touched here.
+            uint32_t max = request->wLength / sizeof(gs_resp_rec[0]);
+            uint32_t n = gsusb_rec_read((uint32_t)request->wValue * GSUSB_REC_READ_RECORDS,
+                                        gs_resp_rec,
+                                        max < GSUSB_REC_READ_RECORDS ? max : GSUSB_REC_READ_RECORDS);
+            return tud_control_xfer(rhport,
+                                    request,
+                                    (void *)gs_resp_rec,
+                                    (uint16_t)(n * sizeof(gs_resp_rec[0])));
+        }
+#endif
+
+        case GSUSB_BREQ_TRAFFIC:
+            gsusb_traffic_info(&gs_resp_traffic_info, request->wValue == 1);
+            return tud_control_xfer(rhport,
+                                    request,
+                                    (void *)&gs_resp_traffic_info,
+                                    sizeof(gs_resp_traffic_info));
+
+#if GSUSB_TRAFFIC
+        case GSUSB_BREQ_TRAFFIC_READ:
+        {
+            uint32_t max = request->wLength / sizeof(gs_resp_traffic[0]);
+            uint32_t n = gsusb_traffic_read((uint32_t)request->wValue * GSUSB_TRAFFIC_READ_SLOTS,
+                                            gs_resp_traffic,
+                                            max < GSUSB_TRAFFIC_READ_SLOTS ? max : GSUSB_TRAFFIC_READ_SLOTS);
+            return tud_control_xfer(rhport,
+                                    request,
+                                    (void *)gs_resp_traffic,
+                                    (uint16_t)(n * sizeof(gs_resp_traffic[0])));
+        }
+#endif
+
+        case GSUSB_BREQ_CYCLIC_STATUS:
+        {
+            uint32_t n = gsusb_cyclic_status(gs_resp_cyclic, request->wLength / sizeof(gs_resp_cyclic[0]));
+            return tud_control_xfer(rhport,
+                                    request,
+                                    (void *)gs_resp_cyclic,
+                                    (uint16_t)(n * sizeof(gs_resp_cyclic[0])));
+        }
+
+        case GSUSB_BREQ_AUTOBAUD:
+            GSUSB_LOGI("GSUSB", "REQ AUTOBAUD");
+            if (!GSUSB_AUTOBAUD || gsusb_can_is_active() ||
+                autobaud_state.exchange(GSUSB_AUTOBAUD_RUNNING) == GSUSB_AUTOBAUD_RUNNING)
+            {
+                return false;
+            }
+            can_tasks_kick();
+            return tud_control_xfer(rhport, request, nullptr, 0);
+
+        case GSUSB_BREQ_AUTOBAUD_RESULT:
+        {
+            // The result is only written while the state reads RUNNING.
+            uint32_t state = autobaud_state.load(std::memory_order_acquire);
+            if (state == GSUSB_AUTOBAUD_RUNNING || state == GSUSB_AUTOBAUD_IDLE)
+            {
+                memset(&gs_resp_autobaud, 0, sizeof(gs_resp_autobaud));
+            }
+            else
+            {
+                gs_resp_autobaud = autobaud_result;
+            }
+            gs_resp_autobaud.state = state;
+            return tud_control_xfer(rhport,
+                                    request,
+                                    (void *)&gs_resp_autobaud,
+                                    sizeof(gs_resp_autobaud));
+        }
+
+        case GS_USB_BREQ_BERR:
+            GSUSB_LOGI("GSUSB", "REQ BERR (OUT)");
+            return tud_control_xfer(rhport,
+                                    request,
+                                    (void *)&temp_berr,
+                                    sizeof(temp_berr));
+
         case GS_USB_BREQ_HOST_FORMAT:
             GSUSB_LOGI("GSUSB", "REQ HOST_FORMAT (OUT)");
             return tud_control_xfer(rhport,
@@ -127,6 +454,45 @@ extern "C" bool tud_vendor_control_xfer_cb(uint8_t rhport,
                                     (void *)&temp_mode,
                                     sizeof(temp_mode));
 
+        case GSUSB_BREQ_FILTER:
+            GSUSB_LOGI("GSUSB", "REQ FILTER (OUT) op=%u len=%u",
+                       request->wValue, request->wLength);
+            if (request->wLength > sizeof(temp_filter) ||
+                request->wLength % sizeof(temp_filter[0]) != 0)
+            {
+                return false;
+            }
+            if (request->wLength == 0)
+            {
+                // No data stage follows.
+                if (request->wValue == GSUSB_FILTER_REPLACE)
+                {
+                    gsusb_filter_clear();
+                }
+                return tud_control_xfer(rhport, request, nullptr, 0);
+            }
+            return tud_control_xfer(rhport,
+                                    request,
+                                    (void *)temp_filter,
+                                    request->wLength);
+
+        case GSUSB_BREQ_CYCLIC:
+            GSUSB_LOGI("GSUSB", "REQ CYCLIC (OUT) job=%u len=%u",
+                       request->wValue, request->wLength);
+            if (request->wLength == 0)
+            {
+                return gsusb_cyclic_set(request->wValue, nullptr) &&
+                       tud_control_xfer(rhport, request, nullptr, 0);
+            }
+            if (request->wLength != sizeof(temp_cyclic))
+            {
+                return false;
+            }
+            return tud_control_xfer(rhport,
+                                    request,
+                                    (void *)&temp_cyclic,
+                                    sizeof(temp_cyclic));
+
         default:
             GSUSB_LOGE("GSUSB",
                        "Unsupported vendor request in SETUP: bReq=%u",
@@ -138,11 +504,7 @@ extern "C" bool tud_vendor_control_xfer_cb(uint8_t rhport,
     case CONTROL_STAGE_DATA:
     {
         GSUSB_LOGI("GSUSB", "CTRL DATA stage: bReq=%u", request->bRequest);
-        SemaphoreHandle_t mtx = gsusb_can_get_mutex();
-        if (mtx)
-        {
-            xSemaphoreTake(mtx, portMAX_DELAY);
-        }
+        bool ok = true;
 
         if (request->bRequest == GS_USB_BREQ_BITTIMING)
         {
@@ -175,13 +537,24 @@ extern "C" bool tud_vendor_control_xfer_cb(uint8_t rhport,
                 }
                 else
                 {
-                    esp_err_t err = gsusb_can_start();
-                    (void)err; 
+                    in_frame_len = (temp_mode.flags & GS_CAN_MODE_HW_TIMESTAMP)
+                                       ? GS_HOST_FRAME_TS_SIZE
+                                       : GS_HOST_FRAME_SIZE;
+                    out_frame_len = (GSUSB_TX_TIMED && (temp_mode.flags & GSUSB_CAN_MODE_TX_TIMED))
+                                        ? GS_HOST_FRAME_TS_SIZE
+                                        : GS_HOST_FRAME_SIZE;
+                    berr_reporting = (temp_mode.flags & GS_CAN_MODE_BERR_REPORTING) != 0;
+                    can_mode_flags = temp_mode.flags;
+                    if (gsusb_can_start(temp_mode.flags) == ESP_OK)
+                    {
+                        can_tasks_kick();
+                    }
                 }
             }
             else if (temp_mode.mode == GS_CAN_MODE_RESET)
             {
                 GSUSB_LOGI("GSUSB", "MODE RESET received");
+                gsusb_cyclic_set(GSUSB_CYCLIC_ALL, nullptr);
                 gsusb_can_stop();
             }
             else
@@ -189,13 +562,26 @@ extern "C" bool tud_vendor_control_xfer_cb(uint8_t rhport,
                 GSUSB_LOGW("GSUSB", "Unknown MODE value=%" PRIu32, temp_mode.mode);
             }
         }
-
-        if (mtx)
+        else if (request->bRequest == GS_USB_BREQ_BERR)
+        {
+            berr_reporting = temp_berr != 0;
+        }
+        else if (request->bRequest == GSUSB_BREQ_FILTER)
+        {
+            // The software filter applies at once; the hardware filter
+            // follows at the next BITTIMING, which reinstalls the driver.
+            if (request->wValue == GSUSB_FILTER_REPLACE)
+            {
+                gsusb_filter_clear();
+            }
+            ok = gsusb_filter_add(temp_filter, request->wLength / sizeof(temp_filter[0]));
+        }
+        else if (request->bRequest == GSUSB_BREQ_CYCLIC)
         {
-            xSemaphoreGive(mtx);
+            ok = gsusb_cyclic_set(request->wValue, &temp_cyclic);
         }
 
-        return true;
+        return ok;
     }
 
     case CONTROL_STAGE_ACK:
@@ -213,6 +599,8 @@ extern "C" void tud_vendor_rx_cb(uint8_t itf, uint8_t const *buffer, uint16_t bu
     (void)buffer;
     (void)bufsize;
 
+    tx_out_cycles = GSUSB_STAT_CYCLES();
+
     BaseType_t xHigherPriorityTaskWoken = pdFALSE;
     if (h_usb_tx_task != nullptr)
     {
@@ -221,12 +609,70 @@ extern "C" void tud_vendor_rx_cb(uint8_t itf, uint8_t const *buffer, uint16_t bu
     }
 }
 
+#if GSUSB_SLCAN
+// SLCAN lines are read by usb_tx_task too, next to bulk OUT.
+extern "C" void tud_cdc_rx_cb(uint8_t itf)
+{
+    (void)itf;
+    if (h_usb_tx_task != nullptr)
+    {
+        xTaskNotifyGive(h_usb_tx_task);
+    }
+}
+#endif
+
+
+// Converts one received frame into the RX ring; true when it was queued.
+static bool can_rx_frame(const twai_message_t &msg)
+{
+    // Stamp before anything else: the driver queue is the earliest
+    // point the frame is visible to us.
+    uint32_t rx_ts = (uint32_t)esp_timer_get_time();
+    uint32_t rx_cycles = GSUSB_STAT_CYCLES();
+    GSUSB_STAT_INC(GSUSB_STAT_RX_FRAMES);
+    LedService::countRx();
+
+    // Everything on the bus is recorded, filtered frames included.
+    gsusb_rec_frame(rx_ts, gsusb_frame_can_id(&msg), gsusb_frame_dlc(msg.data_length_code),
+                    msg.data, 0);
+    gsusb_traffic_frame(rx_ts, &msg, 0);
+
+    if (!gsusb_filter_match(msg.identifier, msg.extd))
+    {
+        GSUSB_STAT_INC(GSUSB_STAT_RX_FILTERED);
+        return false;
+    }
+
+    gsusb_net_rx_frame(&msg);
+    gsusb_cdc_rx_frame(&msg, rx_ts);
+
+    if (!usb_host_mounted())
+    {
+        GSUSB_STAT_INC(GSUSB_STAT_RX_DROP_UNMOUNTED);
+    }
+    else
+    {
+        struct gs_host_frame frame;
+        gsusb_frame_from_twai(&msg, rx_ts, &frame);
+
+        GSUSB_LOGI("GSUSB", "CAN RX: id=0x%08" PRIx32 " dlc=%u",
+                   frame.can_id, frame.can_dlc);
+
+        if (rx_ring.push(frame))
+        {
+            GSUSB_STAT_SINCE(GSUSB_HIST_RX_CONVERT, rx_cycles);
+            return true;
+        }
+        GSUSB_STAT_INC(GSUSB_STAT_RX_DROP_RING_FULL);
+        GSUSB_LOGE("GSUSB", "RX ring full, dropping frame");
+    }
+    return false;
+}
 
 extern "C" void can_rx_task(void *arg)
 {
     (void)arg;
 
-    struct gs_host_frame frame;
     twai_message_t msg;
     esp_err_t ret;
 
@@ -234,175 +680,902 @@ extern "C" void can_rx_task(void *arg)
 
     for (;;)
     {
-        if (!gsusb_can_is_initialized() || !gsusb_can_is_active())
+        // Woken by can_alert_task on TWAI_ALERT_RX_DATA and by MODE START;
+        // nothing wakes this task while the bus is idle.
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // One alert may stand for many frames: empty the driver queue.
+        bool queued = false;
+        while ((ret = gsusb_can_receive(&msg, 0)) == ESP_OK)
         {
-            vTaskDelay(pdMS_TO_TICKS(10));
-            continue;
+            queued = can_rx_frame(msg) || queued;
         }
-
-        ret = gsusb_can_receive(&msg, pdMS_TO_TICKS(1000));
-
-        if (ret == ESP_OK)
+        if (queued)
         {
-            if (tud_vendor_mounted())
-            {
-                memset(&frame, 0, sizeof(frame));
+            xTaskNotifyGive(h_usb_in_task);
+        }
 
-                frame.echo_id  = 0xFFFFFFFF; // RX frame
-                frame.channel  = 0;
-                frame.flags    = 0;
-                frame.reserved = 0;
+        // ESP_ERR_INVALID_STATE: stopped or being reconfigured; the next
+        // MODE START wakes us again.
+        if (ret != ESP_ERR_TIMEOUT && ret != ESP_ERR_INVALID_STATE)
+        {
+            GSUSB_LOGE("GSUSB", "gsusb_can_receive error: %s", esp_err_to_name(ret));
+        }
+    }
+}
 
-                frame.can_id = msg.identifier;
+static uint32_t rx_batch_frames(void)
+{
+#if GSUSB_RX_BATCH
+    return GSUSB_RX_BATCH_BYTES / in_frame_len;
+#else
+    return 1;
+#endif
+}
 
-                if (msg.extd)
-                {
-                    frame.can_id |= 0x80000000U; // CAN_EFF_FLAG
-                }
-                if (msg.rtr)
-                {
-                    frame.can_id |= 0x40000000U; // CAN_RTR_FLAG
-                }
+// Appends frames from ring to the vendor FIFO, or to dst (the IN buffer)
+// with GSUSB_USB_DIRECT, until the transfer holds max_frames; n are already
+// in it. Returns the new count.
+static uint32_t usb_in_write_frames(SpscRing<struct gs_host_frame> &ring, uint32_t n,
+                                    uint32_t max_frames, uint8_t *dst)
+{
+    uint32_t len = in_frame_len;
+    const struct gs_host_frame *frame;
 
-                frame.can_dlc = msg.data_length_code;
-                if (frame.can_dlc > 8)
-                {
-                    frame.can_dlc = 8;
-                }
+    while (n < max_frames && (frame = ring.front()) != nullptr)
+    {
+#if GSUSB_USB_DIRECT
+        memcpy(dst + n * len, frame, len);
+#else
+        (void)dst;
+        if (tud_vendor_write_available() < len)
+        {
+            break;
+        }
+        tud_vendor_write(frame, len);
+#endif
+#if GSUSB_STATS
+        if (&ring == &rx_ring)
+        {
+            GSUSB_STAT_INC(GSUSB_STAT_RX_TO_USB);
+            GSUSB_STAT_US(GSUSB_HIST_RX_DWELL, (uint32_t)esp_timer_get_time() - frame->timestamp_us);
+        }
+#endif
+        ring.pop();
+        n++;
+    }
+    return n;
+}
 
-                if (frame.can_dlc > 0)
-                {
-                    memcpy(frame.data, msg.data, frame.can_dlc);
-                }
+// Moves queued frames into the vendor FIFO (or the free IN buffer) and
+// returns how long usb_in_task may sleep. Unbatched, a frame is only written
+// into an empty FIFO so every bulk IN transfer carries exactly one
+// gs_host_frame. Batched, a transfer is started once a batch worth of frames
+// is queued or the flush deadline passes. Echoes go first: the host's TX
+// window waits on them.
+static TickType_t usb_in_drain(void)
+{
+    if (!usb_host_mounted())
+    {
+        rx_ring.clear();
+        echo_ring.clear();
+        rx_batch_start_us = 0;
+        return portMAX_DELAY;
+    }
 
-                GSUSB_LOGI("GSUSB", "CAN RX: id=0x%08" PRIx32 " dlc=%u",
-                           frame.can_id, frame.can_dlc);
+    uint32_t batch = rx_batch_frames();
 
-                uint32_t avail = tud_vendor_write_available();
-                if (avail >= sizeof(frame))
-                {
-                    uint32_t written = tud_vendor_write(&frame, sizeof(frame));
-                    tud_vendor_write_flush();
+    for (;;)
+    {
+        uint32_t pending = echo_ring.size() + rx_ring.size();
+        if (pending == 0)
+        {
+            rx_batch_start_us = 0;
+            return portMAX_DELAY;
+        }
 
-                    if (written != sizeof(frame))
-                    {
-                        GSUSB_LOGE("GSUSB",
-                                   "tud_vendor_write wrote %u/%u bytes",
-                                   (unsigned)written,
-                                   (unsigned)sizeof(frame));
-                    }
-                }
-                else
-                {
-                    GSUSB_LOGE("GSUSB",
-                               "USB TX buffer full, dropping frame (avail=%u)",
-                               (unsigned)avail);
-                }
+#if GSUSB_RX_BATCH
+        if (pending < batch)
+        {
+            int64_t now = esp_timer_get_time();
+            if (rx_batch_start_us == 0)
+            {
+                rx_batch_start_us = now;
+            }
+            int64_t left_us = rx_batch_start_us + GSUSB_RX_BATCH_FLUSH_US - now;
+            if (left_us > 0)
+            {
+                TickType_t ticks = (TickType_t)((left_us * configTICK_RATE_HZ + 999999) / 1000000);
+                return ticks > 0 ? ticks : 1;
             }
         }
-        else if (ret == ESP_ERR_INVALID_STATE)
+
+#endif
+
+#if GSUSB_USB_DIRECT
+        uint8_t *buf = gsusb_ep_in_acquire();
+        if (buf == nullptr)
         {
-         
-            vTaskDelay(pdMS_TO_TICKS(10));
+            return portMAX_DELAY; // tud_vendor_tx_cb wakes us
         }
-        else if (ret == ESP_ERR_TIMEOUT)
+#elif GSUSB_RX_BATCH
+        uint8_t *buf = nullptr;
+        uint32_t want = pending < batch ? pending : batch;
+        if (tud_vendor_write_available() < want * in_frame_len)
         {
-            continue;
+            return portMAX_DELAY; // tud_vendor_tx_cb wakes us
         }
-        else
+#else
+        uint8_t *buf = nullptr;
+        if (tud_vendor_write_available() < CFG_TUD_VENDOR_TX_BUFSIZE)
         {
-            GSUSB_LOGE("GSUSB", "gsusb_can_receive error: %s", esp_err_to_name(ret));
-            vTaskDelay(pdMS_TO_TICKS(100));
+            return portMAX_DELAY; // tud_vendor_tx_cb wakes us
         }
+#endif
+
+        uint32_t n = usb_in_write_frames(echo_ring, 0, batch, buf);
+        n = usb_in_write_frames(rx_ring, n, batch, buf);
+#if GSUSB_USB_DIRECT
+        gsusb_ep_in_commit(n * in_frame_len);
+#else
+        tud_vendor_write_flush();
+#endif
+        GSUSB_STAT_INC(GSUSB_STAT_USB_IN_WRITES);
+        rx_batch_start_us = 0;
     }
 }
 
-extern "C" void usb_tx_task(void *arg)
+extern "C" void usb_in_task(void *arg)
 {
     (void)arg;
 
-    struct gs_host_frame frame __attribute__((aligned(4)));
-    twai_message_t msg;
+    TickType_t wait = portMAX_DELAY;
 
-    GSUSB_LOGI("GSUSB", "usb_tx_task started");
+    GSUSB_LOGI("GSUSB", "usb_in_task started");
 
     for (;;)
     {
-        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        ulTaskNotifyTake(pdTRUE, wait);
+        wait = usb_in_drain();
+    }
+}
+
+extern "C" void tud_vendor_tx_cb(uint8_t itf, uint32_t sent_bytes)
+{
+    (void)itf;
+    (void)sent_bytes;
+
+    if (h_usb_in_task != nullptr)
+    {
+        xTaskNotifyGive(h_usb_in_task);
+    }
+}
+
+enum tx_source
+{
+    TX_SOURCE_USB,    // bulk OUT, echoed
+    TX_SOURCE_NET,    // network bridge
+    TX_SOURCE_SLCAN,  // CDC port
+    TX_SOURCE_CYCLIC, // jobs the USB host uploaded
+};
+
+static bool tx_source_up(enum tx_source source)
+{
+    switch (source)
+    {
+    case TX_SOURCE_USB:
+    case TX_SOURCE_CYCLIC:
+        return usb_host_mounted();
+    case TX_SOURCE_NET:
+        return gsusb_net_active();
+    default:
+        return gsusb_cdc_active();
+    }
+}
+
+// Hands one frame to TWAI: a host frame to echo, or one from the network
+// bridge or the SLCAN port (frame == nullptr). While the controller queue
+// is full the frame is held here and no source is read, so TinyUSB NAKs
+// the host until a TX slot frees up instead of the frame being dropped.
+// The driver is released between attempts so MODE/BITTIMING requests are
+// never stuck behind a saturated bus. Returns whether TWAI took the frame.
+static bool can_tx_submit(twai_message_t &msg, const struct gs_host_frame *frame,
+                          enum tx_source source)
+{
+    uint32_t mode = can_mode_flags;
+    msg.ss = (mode & GS_CAN_MODE_ONE_SHOT) ? 1 : 0;
+    msg.self = (mode & GS_CAN_MODE_LOOP_BACK) ? 1 : 0;
+    uint32_t echo_id = frame != nullptr ? frame->echo_id : TX_ORDER_NO_ECHO;
 
-        while (tud_vendor_available() >= sizeof(frame))
+    for (;;)
+    {
+        uint32_t epoch;
+        if (!tx_source_up(source) || !gsusb_can_acquire(&epoch))
         {
-            uint32_t count = tud_vendor_read(&frame, sizeof(frame));
-            if (count != sizeof(frame))
+            if (frame != nullptr)
             {
-                GSUSB_LOGE("GSUSB",
-                           "tud_vendor_read partial frame: %u/%u bytes",
-                           (unsigned)count,
-                           (unsigned)sizeof(frame));
-                continue;
+                tx_slots[echo_id].busy.store(false, std::memory_order_release);
             }
+            GSUSB_STAT_INC(GSUSB_STAT_TX_DROP_INACTIVE);
+            GSUSB_LOGW("GSUSB", "TX frame but CAN is not active/initialized");
+            return false;
+        }
 
-            GSUSB_LOGI("GSUSB",
-                       "USB RX: echo_id=%" PRIu32 " can_id=0x%08" PRIx32 " dlc=%u",
-                       frame.echo_id, frame.can_id, frame.can_dlc);
+        // A frame without its tx_order entry would never be retired. The
+        // ring only fills while can_alert_task has yet to drop the entries
+        // of an older epoch; wait for it like for a full TWAI queue.
+        if (tx_order.size() >= tx_order.capacity())
+        {
+            gsusb_can_release();
+            GSUSB_STAT_INC(GSUSB_STAT_TX_BACKPRESSURE);
+            vTaskDelay(1);
+            continue;
+        }
 
-            SemaphoreHandle_t mtx = gsusb_can_get_mutex();
-            if (mtx)
+        if (frame != nullptr)
+        {
+            // Claim the slot before queueing: the frame may complete
+            // before twai_transmit() even returns.
+            struct tx_echo_slot &slot = tx_slots[echo_id];
+            if (frame != &slot.frame)
             {
-                xSemaphoreTake(mtx, portMAX_DELAY);
+                memcpy(&slot.frame, frame, GS_HOST_FRAME_SIZE);
             }
+            slot.busy.store(true, std::memory_order_release);
+        }
 
-            if (gsusb_can_is_initialized() && gsusb_can_is_active())
+        // A listening node never drives the bus; fail the frame instead.
+        if (mode & GS_CAN_MODE_LISTEN_ONLY)
+        {
+            if (frame != nullptr)
             {
-                memset(&msg, 0, sizeof(msg));
-                msg.extd = (frame.can_id & 0x80000000U) ? 1 : 0;
-                msg.rtr  = (frame.can_id & 0x40000000U) ? 1 : 0;
-                msg.identifier = frame.can_id & 0x1FFFFFFF;
-                msg.data_length_code = frame.can_dlc;
-                if (msg.data_length_code > 8)
-                    msg.data_length_code = 8;
-                memcpy(msg.data, frame.data, msg.data_length_code);
-
-                esp_err_t tx_err = gsusb_can_transmit(&msg, 0);
-                if (tx_err != ESP_OK)
-                {
-                    GSUSB_LOGE("GSUSB", "gsusb_can_transmit failed: %s",
-                               esp_err_to_name(tx_err));
-                }
-                else
-                {
-                    if (tud_vendor_write_available() >= sizeof(frame))
-                    {
-                        uint32_t w = tud_vendor_write(&frame, sizeof(frame));
-                        tud_vendor_write_flush();
-                        GSUSB_LOGI("GSUSB",
-                                   "Echo TX frame back to host, written=%u",
-                                   (unsigned)w);
-                    }
-                }
+                tx_slots[echo_id].submit_us = (uint32_t)esp_timer_get_time();
+                tx_order.push(TX_ORDER_ENTRY(echo_id, epoch) | TX_ORDER_REJECTED);
+                tx_submitted.fetch_add(1, std::memory_order_release);
             }
             else
             {
-                GSUSB_LOGW("GSUSB",
-                           "USB RX frame but CAN is not active/initialized");
+                GSUSB_STAT_INC(GSUSB_STAT_TX_DROP_INACTIVE);
             }
+            gsusb_can_release();
+            return false;
+        }
 
-            if (mtx)
+        esp_err_t tx_err = gsusb_can_transmit(&msg, pdMS_TO_TICKS(GSUSB_TX_BLOCK_MS));
+        if (tx_err == ESP_OK)
+        {
+            if (frame != nullptr)
+            {
+                tx_slots[echo_id].submit_us = (uint32_t)esp_timer_get_time();
+            }
+            tx_order.push(TX_ORDER_ENTRY(echo_id, epoch));
+            tx_submitted.fetch_add(1, std::memory_order_release);
+            GSUSB_STAT_INC(GSUSB_STAT_TX_QUEUED);
+            if (frame != nullptr)
             {
-                xSemaphoreGive(mtx);
+                GSUSB_STAT_SINCE(GSUSB_HIST_TX_SUBMIT, tx_out_cycles);
             }
         }
-    }
-}
+        else if (frame != nullptr)
+        {
+            tx_slots[echo_id].busy.store(false, std::memory_order_release);
+        }
 
-extern "C" void tinyusb_task(void *param)
-{
-    (void)param;
-    GSUSB_LOGI("GSUSB", "tinyusb_task started");
+        gsusb_can_release();
+
+        if (tx_err == ESP_OK)
+        {
+            uint32_t tx_ts = (uint32_t)esp_timer_get_time();
+            gsusb_rec_frame(tx_ts, gsusb_frame_can_id(&msg), msg.data_length_code, msg.data,
+                            GSUSB_REC_TX);
+            gsusb_traffic_frame(tx_ts, &msg, GSUSB_TRAFFIC_TX);
+            return true;
+        }
+        // ESP_ERR_INVALID_STATE: a reconfiguration started since the
+        // acquire; the next attempt sees the bus stopped or restarted.
+        if (tx_err != ESP_ERR_TIMEOUT && tx_err != ESP_ERR_INVALID_STATE)
+        {
+            GSUSB_STAT_INC(GSUSB_STAT_TX_DROP_ERROR);
+            GSUSB_LOGE("GSUSB", "gsusb_can_transmit failed: %s", esp_err_to_name(tx_err));
+            return false;
+        }
+        if (tx_err == ESP_ERR_TIMEOUT)
+        {
+            GSUSB_STAT_INC(GSUSB_STAT_TX_BACKPRESSURE);
+        }
+    }
+}
+
+#if GSUSB_TX_TIMED
+// Gives every waiting timed frame up; the host has given up on them.
+static void timed_tx_flush(void)
+{
+    while (!tx_timed.empty())
+    {
+        tx_slots[tx_timed.front()].busy.store(false, std::memory_order_release);
+        tx_timed.pop();
+        GSUSB_STAT_INC(GSUSB_STAT_TX_DROP_INACTIVE);
+    }
+}
+
+// Claims the frame's slot and holds it until its time.
+static void timed_tx_push(const struct gs_host_frame *frame)
+{
+    uint32_t epoch = gsusb_can_epoch();
+    if (epoch != tx_timed_epoch)
+    {
+        timed_tx_flush();
+        tx_timed_epoch = epoch;
+    }
+
+    uint32_t now = (uint32_t)esp_timer_get_time();
+    uint32_t due = frame->timestamp_us;
+    if ((int32_t)(due - now) > GSUSB_TX_TIMED_HORIZON_US)
+    {
+        due = now;
+    }
+
+    struct tx_echo_slot &slot = tx_slots[frame->echo_id];
+    memcpy(&slot.frame, frame, GS_HOST_FRAME_SIZE);
+    slot.frame.flags &= ~GSUSB_FRAME_FLAG_TX_TIMED;
+    slot.busy.store(true, std::memory_order_release);
+    tx_timed.push(frame->echo_id, due);
+    GSUSB_STAT_INC(GSUSB_STAT_TX_TIMED);
+}
+#endif
+
+// One frame from bulk OUT; false once the FIFO holds no complete frame.
+static bool usb_tx_next(void)
+{
+    // Host-to-device frames carry a timestamp only as the time to send
+    // them at (GSUSB_CAN_MODE_TX_TIMED).
+    uint32_t len = out_frame_len;
+#if GSUSB_USB_DIRECT
+    // Decoded where the OUT transfer left it.
+    const struct gs_host_frame *frame =
+        static_cast<const struct gs_host_frame *>(gsusb_ep_out_peek(len));
+    if (frame == nullptr)
+    {
+        return false;
+    }
+    gsusb_ep_out_consume(len);
+#else
+    struct gs_host_frame read_frame __attribute__((aligned(4)));
+    const struct gs_host_frame *frame = &read_frame;
+    if (tud_vendor_available() < len)
+    {
+        return false;
+    }
+
+    uint32_t count = tud_vendor_read(&read_frame, len);
+    if (count != len)
+    {
+        GSUSB_LOGE("GSUSB",
+                   "tud_vendor_read partial frame: %u/%u bytes",
+                   (unsigned)count,
+                   (unsigned)len);
+        return true;
+    }
+#endif
+
+    GSUSB_LOGI("GSUSB",
+               "USB RX: echo_id=%" PRIu32 " can_id=0x%08" PRIx32 " dlc=%u",
+               frame->echo_id, frame->can_id, frame->can_dlc);
+    GSUSB_STAT_INC(GSUSB_STAT_TX_FRAMES);
+
+    if (frame->echo_id >= GSUSB_TX_ECHO_SLOTS ||
+        tx_slots[frame->echo_id].busy.load(std::memory_order_acquire))
+    {
+        GSUSB_LOGE("GSUSB", "echo_id %" PRIu32 " out of range or in flight, dropping",
+                   frame->echo_id);
+        GSUSB_STAT_INC(GSUSB_STAT_TX_DROP_ECHO_ID);
+        return true;
+    }
+
+#if GSUSB_TX_TIMED
+    if (len == GS_HOST_FRAME_TS_SIZE && (frame->flags & GSUSB_FRAME_FLAG_TX_TIMED))
+    {
+        timed_tx_push(frame);
+        return true;
+    }
+#endif
+
+    twai_message_t msg;
+    gsusb_frame_to_twai(frame, &msg);
+#if GSUSB_TX_SCHED
+    struct tx_echo_slot &slot = tx_slots[frame->echo_id];
+    memcpy(&slot.frame, frame, GS_HOST_FRAME_SIZE);
+    slot.sched_epoch = gsusb_can_epoch();
+    slot.busy.store(true, std::memory_order_release);
+    tx_sched.push(frame->echo_id, gsusb_frame_arb_key(&msg));
+#else
+    can_tx_submit(msg, frame, TX_SOURCE_USB);
+#endif
+    return true;
+}
+
+// The most urgent scheduled host frame to TWAI, once fewer than
+// GSUSB_TX_SCHED_INFLIGHT frames are ahead of it; false when none can go.
+static bool sched_tx_next(void)
+{
+#if GSUSB_TX_SCHED
+    if (tx_sched.empty())
+    {
+        return false;
+    }
+    // Completions are counted late, never early: this can only overestimate.
+    uint32_t ahead = tx_submitted.load(std::memory_order_relaxed) -
+                     tx_retired.load(std::memory_order_acquire);
+    if (ahead >= GSUSB_TX_SCHED_INFLIGHT && gsusb_can_is_active())
+    {
+        return false;
+    }
+
+    uint32_t echo_id = tx_sched.front();
+    tx_sched.pop();
+    struct tx_echo_slot &slot = tx_slots[echo_id];
+    if (slot.sched_epoch != gsusb_can_epoch())
+    {
+        // Held across a stop or reinstall: the host has given up on it.
+        slot.busy.store(false, std::memory_order_release);
+        GSUSB_STAT_INC(GSUSB_STAT_TX_DROP_INACTIVE);
+        return true;
+    }
+    twai_message_t msg;
+    gsusb_frame_to_twai(&slot.frame, &msg);
+    can_tx_submit(msg, &slot.frame, TX_SOURCE_USB);
+    return true;
+#else
+    return false;
+#endif
+}
+
+#if GSUSB_TX_TIMED
+static void timed_tx_timer_cb(void *arg)
+{
+    (void)arg;
+    tx_timed_armed.store(false, std::memory_order_release);
+    xTaskNotifyGive(h_usb_tx_task);
+}
+
+static void timed_tx_arm(uint32_t due, uint32_t now)
+{
+    if (due == tx_timed_armed_us && tx_timed_armed.load(std::memory_order_acquire))
+    {
+        return;
+    }
+    esp_timer_stop(tx_timed_timer);
+    tx_timed_armed_us = due;
+    tx_timed_armed.store(true, std::memory_order_release);
+    if (esp_timer_start_once(tx_timed_timer, due - now) != ESP_OK)
+    {
+        tx_timed_armed.store(false, std::memory_order_release);
+    }
+}
+#endif
+
+// The first timed host frame once its time has come; false while none is
+// due, with the timer armed for it. Straight to TWAI, past the scheduler,
+// so at most GSUSB_TX_SCHED_INFLIGHT frames are ahead of it.
+static bool timed_tx_next(void)
+{
+#if GSUSB_TX_TIMED
+    if (tx_timed.empty())
+    {
+        return false;
+    }
+    if (tx_timed_epoch != gsusb_can_epoch() || !usb_host_mounted())
+    {
+        // Held across a stop, reinstall or disconnect.
+        timed_tx_flush();
+        return false;
+    }
+
+    uint32_t now = (uint32_t)esp_timer_get_time();
+    uint32_t due = tx_timed.front_due();
+    if ((int32_t)(due - now) > 0)
+    {
+        timed_tx_arm(due, now);
+        return false;
+    }
+
+    uint32_t echo_id = tx_timed.front();
+    tx_timed.pop();
+    struct tx_echo_slot &slot = tx_slots[echo_id];
+    twai_message_t msg;
+    gsusb_frame_to_twai(&slot.frame, &msg);
+    if (can_tx_submit(msg, &slot.frame, TX_SOURCE_USB))
+    {
+        uint32_t late = (uint32_t)esp_timer_get_time() - due;
+        GSUSB_STAT_US(GSUSB_HIST_TX_TIMED, late);
+        if (late > GSUSB_TX_TIMED_LATE_US)
+        {
+            GSUSB_STAT_INC(GSUSB_STAT_TX_TIMED_LATE);
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+// One due cyclic frame; false when none is. Jobs end with the host.
+static bool cyclic_tx_next(void)
+{
+    if (!usb_host_mounted())
+    {
+        gsusb_cyclic_reset();
+        return false;
+    }
+    twai_message_t msg;
+    uint32_t job;
+    if (!gsusb_cyclic_next(&msg, &job))
+    {
+        return false;
+    }
+    gsusb_cyclic_done(job, can_tx_submit(msg, nullptr, TX_SOURCE_CYCLIC));
+    return true;
+}
+
+// One frame from the network bridge; false when none is queued.
+static bool net_tx_next(void)
+{
+    const twai_message_t *queued = net_tx_ring.front();
+    if (queued == nullptr)
+    {
+        return false;
+    }
+    twai_message_t msg = *queued;
+    net_tx_ring.pop();
+    can_tx_submit(msg, nullptr, TX_SOURCE_NET);
+    return true;
+}
+
+// One frame line from the SLCAN port; false when none is complete.
+static bool slcan_tx_next(void)
+{
+#if GSUSB_SLCAN
+    twai_message_t msg;
+    if (!gsusb_cdc_tx_next(&msg))
+    {
+        return false;
+    }
+    gsusb_cdc_tx_done(&msg, can_tx_submit(msg, nullptr, TX_SOURCE_SLCAN));
+    return true;
+#else
+    return false;
+#endif
+}
+
+extern "C" void usb_tx_task(void *arg)
+{
+    (void)arg;
+
+    GSUSB_LOGI("GSUSB", "usb_tx_task started");
 
     for (;;)
     {
-        tud_task();
+#if GSUSB_TX_SCHED
+        // can_alert_task wakes us as frames leave the bus; the timeout only
+        // catches scheduled frames left behind by a stopped bus.
+        ulTaskNotifyTake(pdTRUE, tx_sched.empty() ? portMAX_DELAY : pdMS_TO_TICKS(GSUSB_TX_BLOCK_MS));
+#else
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#endif
+
+        // Alternate between the sources so none starves the others.
+        bool more = true;
+        while (more)
+        {
+            // Timed and cyclic frames first: they have a time to keep.
+            more = timed_tx_next();
+            more = cyclic_tx_next() || more;
+            more = usb_tx_next() || more;
+            more = sched_tx_next() || more;
+            more = net_tx_next() || more;
+            more = slcan_tx_next() || more;
+        }
+    }
+}
+
+// Hands a retired TX slot back to the host. A failed frame still returns
+// its echo so the host releases the echo_id, preceded by an error frame so
+// the failure is visible on the SocketCAN side.
+static void tx_echo_retire(uint32_t echo_id, bool failed)
+{
+    if (echo_id == TX_ORDER_NO_ECHO)
+    {
+        if (failed)
+        {
+            GSUSB_STAT_INC(GSUSB_STAT_TX_FAILED);
+        }
+        else
+        {
+            LedService::countTx();
+        }
+        return;
+    }
+
+    struct tx_echo_slot &slot = tx_slots[echo_id];
+    struct gs_host_frame echo = slot.frame;
+    uint32_t now = (uint32_t)esp_timer_get_time();
+    GSUSB_STAT_US(GSUSB_HIST_TX_COMPLETE, now - slot.submit_us);
+    slot.busy.store(false, std::memory_order_release);
+
+    GSUSB_STAT_INC(failed ? GSUSB_STAT_TX_FAILED : GSUSB_STAT_TX_ECHOES);
+    if (!failed)
+    {
+        LedService::countTx();
+    }
+
+    if (failed)
+    {
+        struct gs_host_frame err = {};
+        err.echo_id = GS_HOST_FRAME_ECHO_ID_RX;
+        err.can_id = CAN_ERR_FLAG | CAN_ERR_TX_TIMEOUT;
+        err.can_dlc = CAN_ERR_DLC;
+        err.timestamp_us = now;
+        echo_ring.push(err);
+    }
+
+    echo.timestamp_us = now;
+    if (!echo_ring.push(echo))
+    {
+        GSUSB_LOGE("GSUSB", "Echo ring full, echo %" PRIu32 " lost", echo_id);
+    }
+}
+
+// Drops frames queued in an earlier driver epoch without echoing them:
+// after MODE RESET or a USB reset the host has already forgotten their
+// echo_ids, and a reinstall emptied the TX queue. The epoch is re-read per
+// entry so a frame queued right after a restart is kept.
+static void tx_echo_discard(uint32_t &completed)
+{
+    const uint32_t *entry;
+    while ((entry = tx_order.front()) != nullptr &&
+           TX_ORDER_EPOCH(*entry) != gsusb_can_epoch())
+    {
+        uint32_t echo_id = TX_ORDER_ECHO_ID(*entry);
+        if (echo_id != TX_ORDER_NO_ECHO)
+        {
+            tx_slots[echo_id].busy.store(false, std::memory_order_release);
+        }
+        tx_order.pop();
+        completed++;
+    }
+    tx_retired.store(completed, std::memory_order_release);
+}
+
+// TWAI raises a single TX_SUCCESS alert for any number of completions, so
+// the count is reconstructed from the driver: whatever was submitted and is
+// no longer in msgs_to_tx has left the controller. tx_submitted is read
+// before the status so a frame queued in between can only be seen late,
+// never early.
+static void tx_echo_reconcile(uint32_t submitted, const twai_status_info_t &status,
+                              uint32_t &completed, uint32_t &failed_seen, bool bus_off)
+{
+    uint32_t done = bus_off ? submitted : submitted - status.msgs_to_tx;
+    int32_t n = (int32_t)(done - completed);
+    if (n <= 0)
+    {
+        return;
+    }
+
+    uint32_t failed;
+    if (bus_off)
+    {
+        // Recovery flushes the TX queue: nothing in flight will be sent.
+        failed = (uint32_t)n;
+        failed_seen = status.tx_failed_count;
+    }
+    else
+    {
+        // Failures inside one batch cannot be told apart; charge them to
+        // the oldest frames.
+        failed = status.tx_failed_count - failed_seen;
+        if (failed > (uint32_t)n)
+        {
+            failed = (uint32_t)n;
+        }
+        failed_seen += failed;
+    }
+
+    bool queued = false;
+    for (; n > 0; n--)
+    {
+        const uint32_t *entry = tx_order.front();
+        if (entry == nullptr)
+        {
+            break;
+        }
+        if (*entry & TX_ORDER_REJECTED)
+        {
+            tx_echo_retire(TX_ORDER_ECHO_ID(*entry), true);
+        }
+        else
+        {
+            tx_echo_retire(TX_ORDER_ECHO_ID(*entry), failed > 0);
+            if (failed > 0)
+            {
+                failed--;
+            }
+        }
+        tx_order.pop();
+        completed++;
+        queued = true;
+    }
+    tx_retired.store(completed, std::memory_order_release);
+
+    if (queued)
+    {
+        xTaskNotifyGive(h_usb_in_task);
+#if GSUSB_TX_SCHED
+        xTaskNotifyGive(h_usb_tx_task);
+#endif
+    }
+}
+
+// Bus-off is left automatically: the gs_usb driver has no restart request
+// and would otherwise see a dead interface until it is brought down and up.
+static void can_alert_bus_off(uint32_t alerts)
+{
+#if GSUSB_REC_FREEZE_ON_BUS_OFF
+    if (alerts & TWAI_ALERT_BUS_OFF)
+    {
+        gsusb_rec_freeze(GSUSB_REC_FROZEN_BUS_OFF);
+    }
+#endif
+#if GSUSB_BUS_OFF_AUTO_RECOVER
+    if (alerts & TWAI_ALERT_BUS_OFF)
+    {
+        gsusb_can_recover();
+    }
+    if (alerts & TWAI_ALERT_BUS_RECOVERED)
+    {
+        gsusb_can_restart();
+    }
+#else
+    (void)alerts;
+#endif
+}
+
+extern "C" void can_alert_task(void *arg)
+{
+    (void)arg;
+
+    uint32_t completed = 0;   // frames retired from tx_order
+    uint32_t failed_seen = 0; // tx_failed_count already accounted for
+    bool have_baseline = false;
+    uint32_t baseline_epoch = 0;
+    twai_status_info_t status;
+
+    GSUSB_LOGI("GSUSB", "can_alert_task started");
+
+    for (;;)
+    {
+        // The bus is down while a detection runs, so this task is free.
+        if (autobaud_state.load(std::memory_order_acquire) == GSUSB_AUTOBAUD_RUNNING)
+        {
+            struct gsusb_autobaud result;
+            gsusb_can_autobaud(&result);
+            autobaud_result = result;
+            autobaud_state.store(result.state, std::memory_order_release);
+        }
+
+        uint32_t epoch;
+        bool served = usb_host_mounted() || gsusb_net_active() || gsusb_cdc_active();
+        if (!served || !gsusb_can_acquire(&epoch))
+        {
+            tx_echo_discard(completed);
+            have_baseline = false;
+            // Kicked by MODE START, AUTOBAUD, USB (un)mounts and the SLCAN
+            // port and network bridge coming and going.
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        // A stop/start or reinstall since the last pass resets the driver
+        // counters, even if this task never saw the driver stopped.
+        if (!have_baseline || epoch != baseline_epoch)
+        {
+            tx_echo_discard(completed);
+            if (gsusb_can_get_status(&status) != ESP_OK)
+            {
+                gsusb_can_release();
+                vTaskDelay(pdMS_TO_TICKS(10));
+                continue;
+            }
+            failed_seen = status.tx_failed_count;
+            gsusb_errors_reset(&status, rx_ring.overflowCount());
+            have_baseline = true;
+            baseline_epoch = epoch;
+        }
+
+        // While frames are in flight poll every tick, so a completion that
+        // raced with its own tx_submitted update is picked up promptly.
+        bool in_flight = tx_submitted.load(std::memory_order_acquire) != completed;
+        TickType_t wait = in_flight                ? 1
+                          : gsusb_errors_pending() ? pdMS_TO_TICKS(10)
+                                                   : pdMS_TO_TICKS(100);
+        uint32_t alerts = 0;
+        esp_err_t ret = gsusb_can_read_alerts(&alerts, wait);
+
+        // A reconfiguration started since the acquire; the next pass waits
+        // it out like any stopped bus.
+        if (ret == ESP_ERR_INVALID_STATE)
+        {
+            gsusb_can_release();
+            continue;
+        }
+        if (ret != ESP_OK && ret != ESP_ERR_TIMEOUT)
+        {
+            gsusb_can_release();
+            GSUSB_LOGE("GSUSB", "gsusb_can_read_alerts error: %s", esp_err_to_name(ret));
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+
+        if (alerts & TWAI_ALERT_RX_DATA)
+        {
+            xTaskNotifyGive(h_can_rx_task);
+        }
+
+        // Plain RX traffic needs nothing else from this task.
+        if (alerts == TWAI_ALERT_RX_DATA && !in_flight && !gsusb_errors_pending())
+        {
+            gsusb_can_release();
+            continue;
+        }
+
+        // Read before the status, see tx_echo_reconcile().
+        uint32_t submitted = tx_submitted.load(std::memory_order_acquire);
+        if (gsusb_can_get_status(&status) != ESP_OK)
+        {
+            gsusb_can_release();
+            continue;
+        }
+
+        bool bus_off = (alerts & TWAI_ALERT_BUS_OFF) != 0;
+        if (bus_off)
+        {
+            GSUSB_LOGW("GSUSB", "Bus-off: failing all in-flight TX frames");
+        }
+        if (in_flight || bus_off || (alerts & (TWAI_ALERT_TX_SUCCESS | TWAI_ALERT_TX_FAILED)))
+        {
+            tx_echo_reconcile(submitted, status, completed, failed_seen, bus_off);
+        }
+
+        gsusb_errors_collect(alerts, &status, rx_ring.overflowCount(), berr_reporting);
+        struct gs_host_frame err;
+        if (gsusb_errors_take(&status, &err))
+        {
+            GSUSB_STAT_INC(GSUSB_STAT_ERR_FRAMES);
+            err.timestamp_us = (uint32_t)esp_timer_get_time();
+            if (echo_ring.push(err))
+            {
+                xTaskNotifyGive(h_usb_in_task);
+            }
+        }
+
+        // Recovery takes the writer side; never hold the driver across it.
+        gsusb_can_release();
+
+        if (alerts & (TWAI_ALERT_BUS_OFF | TWAI_ALERT_BUS_RECOVERED))
+        {
+            can_alert_bus_off(alerts);
+        }
+    }
+}
+
+extern "C" void tinyusb_task(void *param)
+{
+    (void)param;
+    GSUSB_LOGI("GSUSB", "tinyusb_task started");
+
+    for (;;)
+    {
+        // Sleeps on the TinyUSB event queue until the ISR posts an event.
+        tud_task_ext(UINT32_MAX, false);
     }
 }
 
@@ -411,7 +1584,7 @@ static const uint8_t vendor_conf_desc[] = {
   
     9, TUSB_DESC_CONFIGURATION,
     U16_TO_U8S_LE(TUSB_DESC_TOTAL_LEN),
-    1,    // Number of interfaces
+    TUSB_ITF_COUNT, // Number of interfaces
     1,    // Configuration value
     0,    // Configuration string index
     0x80, // Attributes (bus powered)
@@ -439,13 +1612,138 @@ static const uint8_t vendor_conf_desc[] = {
     0x81, // EP 1 IN
     TUSB_XFER_BULK,
     U16_TO_U8S_LE(64),
-    0
+    0,
+
+#if GSUSB_SLCAN
+    // SLCAN port: interfaces 1-2, notification EP 2 IN, data EP 3
+    TUD_CDC_DESCRIPTOR(1, 0, 0x82, 8, 0x03, 0x83, 64),
+#endif
 };
 
+struct gsusb_task_def
+{
+    TaskFunction_t fn;
+    const char *name;
+    uint32_t stack;
+    UBaseType_t prio;
+    BaseType_t core;
+    TaskHandle_t *handle;
+};
+
+// Every task is created after the tasks it notifies.
+static const struct gsusb_task_def gsusb_tasks[] = {
+    // esp_tinyusb runs its own tud_task() loop unless
+    // CONFIG_TINYUSB_NO_DEFAULT_TASK is set; never service the stack twice.
+#if CONFIG_TINYUSB_NO_DEFAULT_TASK
+    {tinyusb_task, "tinyusb", GSUSB_TINYUSB_TASK_STACK, GSUSB_TINYUSB_TASK_PRIO, GSUSB_USB_CORE, nullptr},
+#endif
+    {usb_in_task, "usb_in", GSUSB_USB_IN_TASK_STACK, GSUSB_USB_IN_TASK_PRIO, GSUSB_USB_CORE, &h_usb_in_task},
+    {usb_tx_task, "usb_tx", GSUSB_USB_TX_TASK_STACK, GSUSB_USB_TX_TASK_PRIO, GSUSB_USB_CORE, &h_usb_tx_task},
+    {can_rx_task, "can_rx", GSUSB_CAN_RX_TASK_STACK, GSUSB_CAN_RX_TASK_PRIO, GSUSB_CAN_CORE, &h_can_rx_task},
+    {can_alert_task, "can_alert", GSUSB_CAN_ALERT_TASK_STACK, GSUSB_CAN_ALERT_TASK_PRIO, GSUSB_CAN_CORE, &h_can_alert_task},
+};
+
+static_assert(GSUSB_CAN_ALERT_TASK_PRIO >= GSUSB_CAN_RX_TASK_PRIO,
+              "can_alert_task must not run below the RX task it wakes");
+
+void gsusb_usb_get_rx_ring_stats(struct gsusb_ring_stats *stats)
+{
+    stats->capacity   = rx_ring.capacity();
+    stats->used       = rx_ring.size();
+    stats->high_water = rx_ring.highWaterMark();
+    stats->overflows  = rx_ring.overflowCount();
+}
+
+esp_err_t gsusb_usb_bus_start(uint32_t bitrate, uint32_t mode_flags)
+{
+    struct gsusb_timing t;
+    if (!gsusb_timing_solve(bitrate, GSUSB_NET_SAMPLE_POINT, t))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    struct gs_device_bittiming bt = {};
+    bt.prop_seg = 0;
+    bt.phase_seg1 = t.tseg1;
+    bt.phase_seg2 = t.tseg2;
+    bt.sjw = t.sjw;
+    bt.brp = t.brp;
+    if (!gsusb_can_set_bittiming(&bt))
+    {
+        return ESP_FAIL;
+    }
+
+    can_mode_flags = mode_flags;
+    esp_err_t err = gsusb_can_start(mode_flags);
+    if (err == ESP_OK)
+    {
+        can_tasks_kick();
+    }
+    return err;
+}
+
+esp_err_t gsusb_usb_net_tx(const twai_message_t *msg)
+{
+    if (net_tx_ring.capacity() == 0 || !gsusb_can_is_active())
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!net_tx_ring.push(*msg))
+    {
+        return ESP_ERR_TIMEOUT;
+    }
+    xTaskNotifyGive(h_usb_tx_task);
+    return ESP_OK;
+}
+
+#if GSUSB_CYCLIC
+static void usb_tx_wake(void)
+{
+    if (h_usb_tx_task != nullptr)
+    {
+        xTaskNotifyGive(h_usb_tx_task);
+    }
+}
+#endif
+
 esp_err_t gsusb_init(void)
 {
     gsusb_can_init();  
 
+    if (!rx_ring.init(GSUSB_RX_RING_SLOTS, GSUSB_RX_RING_PSRAM) ||
+        !echo_ring.init(GSUSB_ECHO_RING_SLOTS, false) ||
+        !tx_order.init(GSUSB_TX_ORDER_SLOTS, false))
+    {
+        GSUSB_LOGE("gsusb_init", "Failed to allocate USB IN rings");
+        return ESP_ERR_NO_MEM;
+    }
+#if GSUSB_NET
+    if (!net_tx_ring.init(GSUSB_NET_RING_SLOTS, false))
+    {
+        GSUSB_LOGE("gsusb_init", "Failed to allocate the network TX ring");
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+    // Without a recorder the device still works; the requests report it empty.
+    gsusb_rec_init();
+#if GSUSB_CYCLIC
+    if (!gsusb_cyclic_init(usb_tx_wake))
+    {
+        GSUSB_LOGE("gsusb_init", "Failed to set up cyclic transmit");
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+#if GSUSB_TX_TIMED
+    esp_timer_create_args_t timed_args = {};
+    timed_args.callback = timed_tx_timer_cb;
+    timed_args.dispatch_method = ESP_TIMER_TASK;
+    timed_args.name = "gsusb_tx_timed";
+    if (esp_timer_create(&timed_args, &tx_timed_timer) != ESP_OK)
+    {
+        GSUSB_LOGE("gsusb_init", "Failed to create the timed transmit timer");
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+
     tinyusb_config_t tusb_cfg = {};
     tusb_cfg.external_phy = false;
     tusb_cfg.configuration_descriptor = vendor_conf_desc;
@@ -457,9 +1755,24 @@ esp_err_t gsusb_init(void)
         return err;
     }
 
-    xTaskCreate(tinyusb_task, "tinyusb", 4096, nullptr, 10, nullptr);
-    xTaskCreate(can_rx_task, "can_rx", 4096, nullptr, 9, nullptr);
-    xTaskCreate(usb_tx_task, "usb_tx", 4096, nullptr, 8, &h_usb_tx_task);
+#if GSUSB_SLCAN
+    // Before usb_tx_task and can_rx_task, which feed it.
+    err = gsusb_cdc_start();
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+#endif
+
+    for (const struct gsusb_task_def &t : gsusb_tasks)
+    {
+        BaseType_t core = t.core < portNUM_PROCESSORS ? t.core : 0;
+        if (xTaskCreatePinnedToCore(t.fn, t.name, t.stack, nullptr, t.prio, t.handle, core) != pdPASS)
+        {
+            GSUSB_LOGE("gsusb_init", "Failed to create task %s", t.name);
+            return ESP_ERR_NO_MEM;
+        }
+    }
 
     GSUSB_LOGI("gsusb_init","CandleLight Firmware Running (GS-USB, split USB/CAN).");
 
@@ -1,13 +1,37 @@
 #pragma once
 
 #include "esp_check.h"
+#include "driver/twai.h"
 #include "dbg_helpers.h"
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct gsusb_ring_stats
+{
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t high_water;
+    uint32_t overflows;
+};
+
 esp_err_t gsusb_init(void);
 
+void gsusb_usb_get_rx_ring_stats(struct gsusb_ring_stats *stats);
+
+// For the network bridge and the SLCAN port. Starts the bus at bitrate the
+// way a host's BITTIMING + MODE START with mode_flags (GS_CAN_MODE_*) would.
+esp_err_t gsusb_usb_bus_start(uint32_t bitrate, uint32_t mode_flags);
+
+// Queues a frame for TWAI next to the bulk OUT frames; it gets no echo.
+// ESP_ERR_TIMEOUT while the queue is full, ESP_ERR_INVALID_STATE while the
+// bus is down.
+esp_err_t gsusb_usb_net_tx(const twai_message_t *msg);
+
+// Wakes the CAN tasks after the SLCAN port or the network bridge attached
+// or detached; they sleep while nothing is served.
+void gsusb_usb_kick(void);
+
 #ifdef __cplusplus
 }
 #endif
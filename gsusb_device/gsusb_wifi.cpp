@@ -0,0 +1,91 @@
+#include <string.h>
+
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_wifi.h"
+#include "nvs_flash.h"
+
+#include "dbg_helpers.h"
+#include "gsusb_config.h"
+#include "gsusb_wifi.h"
+
+#if GSUSB_NET
+
+static void wifi_event(void *arg, esp_event_base_t base, int32_t id, void *data)
+{
+    (void)arg;
+    (void)data;
+
+    if (base == WIFI_EVENT && (id == WIFI_EVENT_STA_START || id == WIFI_EVENT_STA_DISCONNECTED))
+    {
+        esp_wifi_connect();
+    }
+    else if (base == IP_EVENT && id == IP_EVENT_STA_GOT_IP)
+    {
+        const ip_event_got_ip_t *got = static_cast<const ip_event_got_ip_t *>(data);
+        GSUSB_LOGI("gsusb_wifi", "Got IP " IPSTR, IP2STR(&got->ip_info.ip));
+        (void)got;
+    }
+}
+
+esp_err_t gsusb_wifi_start(void)
+{
+    if (GSUSB_NET_WIFI_SSID[0] == '\0')
+    {
+        GSUSB_LOGE("gsusb_wifi", "GSUSB_NET_WIFI_SSID is not set");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND)
+    {
+        nvs_flash_erase();
+        err = nvs_flash_init();
+    }
+    if (err == ESP_OK)
+        err = esp_netif_init();
+    if (err == ESP_OK)
+        err = esp_event_loop_create_default();
+    if (err != ESP_OK)
+    {
+        GSUSB_LOGE("gsusb_wifi", "Network stack init failed: %s", esp_err_to_name(err));
+        return err;
+    }
+    esp_netif_create_default_wifi_sta();
+
+    wifi_init_config_t init = WIFI_INIT_CONFIG_DEFAULT();
+    wifi_config_t cfg = {};
+    strncpy((char *)cfg.sta.ssid, GSUSB_NET_WIFI_SSID, sizeof(cfg.sta.ssid));
+    strncpy((char *)cfg.sta.password, GSUSB_NET_WIFI_PASS, sizeof(cfg.sta.password));
+
+    err = esp_wifi_init(&init);
+    if (err == ESP_OK)
+        err = esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, wifi_event, nullptr);
+    if (err == ESP_OK)
+        err = esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, wifi_event, nullptr);
+    if (err == ESP_OK)
+        err = esp_wifi_set_mode(WIFI_MODE_STA);
+    if (err == ESP_OK)
+        err = esp_wifi_set_config(WIFI_IF_STA, &cfg);
+    if (err == ESP_OK)
+        err = esp_wifi_start();
+    if (err != ESP_OK)
+    {
+        GSUSB_LOGE("gsusb_wifi", "Wi-Fi station start failed: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    // Modem sleep holds received datagrams back for a beacon interval.
+    esp_wifi_set_ps(WIFI_PS_NONE);
+    return ESP_OK;
+}
+
+#else
+
+esp_err_t gsusb_wifi_start(void)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif
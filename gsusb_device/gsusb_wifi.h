@@ -0,0 +1,16 @@
+#pragma once
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Joins GSUSB_NET_WIFI_SSID as a station and keeps reconnecting. Returns
+// once the connection attempt is under way; sockets work as soon as DHCP
+// hands out an address.
+esp_err_t gsusb_wifi_start(void);
+
+#ifdef __cplusplus
+}
+#endif
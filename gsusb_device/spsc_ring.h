@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+#include "esp_heap_caps.h"
+
+// Lock-free single-producer / single-consumer ring of fixed-size slots.
+// The producer owns head, the consumer owns tail; each side only reads the
+// other's index, so no critical section is needed between tasks or cores.
+template <typename T>
+class SpscRing
+{
+public:
+    // capacity is rounded up to a power of two. With prefer_psram the slots
+    // are placed in external RAM when available, internal RAM otherwise.
+    bool init(uint32_t capacity, bool prefer_psram)
+    {
+        uint32_t slots = 1;
+        while (slots < capacity)
+        {
+            slots <<= 1;
+        }
+
+        size_t bytes = slots * sizeof(T);
+        void *mem = nullptr;
+        if (prefer_psram)
+        {
+            mem = heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        }
+        if (!mem)
+        {
+            mem = heap_caps_malloc(bytes, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        }
+        if (!mem)
+        {
+            return false;
+        }
+
+        buf = static_cast<T *>(mem);
+        mask = slots - 1;
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        highWater = 0;
+        overflows.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Producer side. Returns false and counts an overflow when full.
+    bool push(const T &item)
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        uint32_t used = h - tail.load(std::memory_order_acquire);
+        if (used > mask)
+        {
+            overflows.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        buf[h & mask] = item;
+        head.store(h + 1, std::memory_order_release);
+
+        if (used + 1 > highWater)
+        {
+            highWater = used + 1;
+        }
+        return true;
+    }
+
+    // Consumer side: oldest slot, or nullptr when empty. The slot stays
+    // valid until pop().
+    const T *front() const
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+        return &buf[t & mask];
+    }
+
+    void pop()
+    {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer side: discard everything currently queued.
+    void clear()
+    {
+        tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    uint32_t size() const
+    {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    uint32_t capacity() const { return buf ? mask + 1 : 0; }
+    uint32_t highWaterMark() const { return highWater; }
+    uint32_t overflowCount() const { return overflows.load(std::memory_order_relaxed); }
+
+private:
+    T *buf = nullptr;
+    uint32_t mask = 0;
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+    volatile uint32_t highWater = 0;
+    std::atomic<uint32_t> overflows{0};
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+
+// Priority queue over the entries 0..N-1 of a fixed table, lowest key
+// first and first in, first out among equal keys. The top bits of the key
+// pick one of 32 buckets; a bitmap of the non-empty ones finds the most
+// urgent bucket with one count-trailing-zeros, and each bucket keeps its
+// entries in a sorted list. Nothing is allocated; one task only.
+template <uint32_t N>
+class TxPrioQueue
+{
+public:
+    bool empty() const
+    {
+        return nonEmpty == 0;
+    }
+
+    // index must not be queued already.
+    void push(uint32_t index, uint32_t key)
+    {
+        uint32_t b = key >> (32 - BUCKET_BITS);
+        if (!(nonEmpty & (1U << b)))
+        {
+            heads[b] = END;
+            nonEmpty |= 1U << b;
+        }
+
+        uint8_t *link = &heads[b];
+        while (*link != END && keys[*link] <= key)
+        {
+            link = &next[*link];
+        }
+        keys[index] = key;
+        next[index] = *link;
+        *link = (uint8_t)index;
+    }
+
+    // Only valid when not empty.
+    uint32_t front() const
+    {
+        return heads[__builtin_ctz(nonEmpty)];
+    }
+
+    void pop()
+    {
+        uint32_t b = __builtin_ctz(nonEmpty);
+        heads[b] = next[heads[b]];
+        if (heads[b] == END)
+        {
+            nonEmpty &= ~(1U << b);
+        }
+    }
+
+private:
+    static constexpr uint32_t BUCKET_BITS = 5;
+    static constexpr uint8_t END = 0xFF;
+    static_assert(N < END, "TxPrioQueue entries must fit in a byte");
+
+    uint32_t nonEmpty = 0;
+    uint8_t heads[1U << BUCKET_BITS];
+    uint8_t next[N];
+    uint32_t keys[N];
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+
+// Binary min-heap over the entries 0..N-1 of a fixed table, earliest time
+// first and first in, first out among equal times. Times are 32-bit
+// microseconds that wrap, so two of them compare by their difference and
+// must lie within 2^31 us of each other. Nothing is allocated; one task
+// only.
+template <uint32_t N>
+class TxTimeQueue
+{
+public:
+    bool empty() const
+    {
+        return size == 0;
+    }
+
+    // index must not be queued already.
+    void push(uint32_t index, uint32_t due)
+    {
+        times[index] = due;
+        seqs[index] = seq++;
+        uint32_t pos = size++;
+        while (pos > 0 && before(index, heap[(pos - 1) / 2]))
+        {
+            heap[pos] = heap[(pos - 1) / 2];
+            pos = (pos - 1) / 2;
+        }
+        heap[pos] = (uint8_t)index;
+    }
+
+    // Only valid when not empty.
+    uint32_t front() const
+    {
+        return heap[0];
+    }
+
+    uint32_t front_due() const
+    {
+        return times[heap[0]];
+    }
+
+    void pop()
+    {
+        uint32_t last = heap[--size];
+        uint32_t pos = 0;
+        for (;;)
+        {
+            uint32_t child = 2 * pos + 1;
+            if (child >= size)
+            {
+                break;
+            }
+            if (child + 1 < size && before(heap[child + 1], heap[child]))
+            {
+                child++;
+            }
+            if (!before(heap[child], last))
+            {
+                break;
+            }
+            heap[pos] = heap[child];
+            pos = child;
+        }
+        heap[pos] = (uint8_t)last;
+    }
+
+private:
+    static_assert(N <= 0xFF, "TxTimeQueue entries must fit in a byte");
+
+    bool before(uint32_t a, uint32_t b) const
+    {
+        int32_t d = (int32_t)(times[a] - times[b]);
+        return d < 0 || (d == 0 && (int32_t)(seqs[a] - seqs[b]) < 0);
+    }
+
+    uint32_t size = 0;
+    uint32_t seq = 0;
+    uint8_t heap[N];
+    uint32_t times[N];
+    uint32_t seqs[N];
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+// Class driver interface of the TinyUSB device stack. sim_tinyusb.cpp offers
+// the configuration's interfaces to the application driver, if one is
+// linked in, and runs its endpoints against the in-memory host.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "tinyusb.h"
+
+typedef struct
+{
+    char const *name;
+    void (*init)(void);
+    bool (*deinit)(void);
+    void (*reset)(uint8_t rhport);
+    uint16_t (*open)(uint8_t rhport, tusb_desc_interface_t const *desc_intf, uint16_t max_len);
+    bool (*control_xfer_cb)(uint8_t rhport, uint8_t stage, tusb_control_request_t const *request);
+    bool (*xfer_cb)(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes);
+    void (*sof)(uint8_t rhport, uint32_t frame_count);
+} usbd_class_driver_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+__attribute__((weak)) usbd_class_driver_t const *usbd_app_driver_get_cb(uint8_t *driver_count);
+
+bool usbd_open_edpt_pair(uint8_t rhport, uint8_t const *p_desc, uint8_t ep_count,
+                         uint8_t xfer_type, uint8_t *ep_out, uint8_t *ep_in);
+bool usbd_edpt_claim(uint8_t rhport, uint8_t ep_addr);
+bool usbd_edpt_release(uint8_t rhport, uint8_t ep_addr);
+bool usbd_edpt_xfer(uint8_t rhport, uint8_t ep_addr, uint8_t *buffer, uint16_t total_bytes);
+
+#ifdef __cplusplus
+}
+#endif
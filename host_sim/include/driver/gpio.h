@@ -0,0 +1,11 @@
+#pragma once
+
+typedef enum
+{
+    GPIO_NUM_NC = -1,
+    GPIO_NUM_38 = 38,
+    GPIO_NUM_41 = 41,
+    GPIO_NUM_42 = 42,
+} gpio_num_t;
+
+#define TWAI_IO_UNUSED GPIO_NUM_NC
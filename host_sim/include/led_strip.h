@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "driver/gpio.h"
+
+typedef struct led_strip_t *led_strip_handle_t;
+
+typedef struct
+{
+    int strip_gpio_num;
+    uint32_t max_leds;
+} led_strip_config_t;
+
+typedef struct
+{
+    uint32_t resolution_hz;
+    struct
+    {
+        uint32_t with_dma : 1;
+    } flags;
+} led_strip_rmt_config_t;
+
+static inline esp_err_t led_strip_new_rmt_device(const led_strip_config_t *, const led_strip_rmt_config_t *,
+                                                 led_strip_handle_t *out)
+{
+    *out = nullptr;
+    return ESP_OK;
+}
+static inline esp_err_t led_strip_set_pixel(led_strip_handle_t, uint32_t, uint32_t, uint32_t, uint32_t) { return ESP_OK; }
+static inline esp_err_t led_strip_refresh(led_strip_handle_t) { return ESP_OK; }
+static inline esp_err_t led_strip_clear(led_strip_handle_t) { return ESP_OK; }
@@ -0,0 +1,164 @@
+#pragma once
+
+// Host simulation stand-in for esp_tinyusb / TinyUSB device stack. The
+// endpoints are backed by the in-memory host in sim_tinyusb.cpp.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#define CFG_TUD_ENDPOINT0_SIZE    64
+#define CFG_TUD_VENDOR_EPSIZE     64
+#ifndef CFG_TUD_VENDOR_RX_BUFSIZE
+#define CFG_TUD_VENDOR_RX_BUFSIZE 64
+#endif
+#ifndef CFG_TUD_VENDOR_TX_BUFSIZE
+#define CFG_TUD_VENDOR_TX_BUFSIZE 64
+#endif
+
+#define CFG_TUD_CDC_EP_BUFSIZE    64
+#ifndef CFG_TUD_CDC_RX_BUFSIZE
+#define CFG_TUD_CDC_RX_BUFSIZE    512
+#endif
+#ifndef CFG_TUD_CDC_TX_BUFSIZE
+#define CFG_TUD_CDC_TX_BUFSIZE    512
+#endif
+
+#define CFG_TUSB_MEM_SECTION
+#define CFG_TUSB_MEM_ALIGN __attribute__((aligned(4)))
+
+#define TU_ATTR_PACKED __attribute__((packed))
+#define U16_TO_U8S_LE(u16) (uint8_t)((u16) & 0xFF), (uint8_t)(((u16) >> 8) & 0xFF)
+
+enum
+{
+    TUSB_DESC_DEVICE = 0x01,
+    TUSB_DESC_CONFIGURATION = 0x02,
+    TUSB_DESC_STRING = 0x03,
+    TUSB_DESC_INTERFACE = 0x04,
+    TUSB_DESC_ENDPOINT = 0x05,
+    TUSB_DESC_INTERFACE_ASSOCIATION = 0x0B,
+    TUSB_DESC_CS_INTERFACE = 0x24,
+};
+
+typedef enum
+{
+    TUSB_XFER_CONTROL = 0,
+    TUSB_XFER_ISOCHRONOUS,
+    TUSB_XFER_BULK,
+    TUSB_XFER_INTERRUPT
+} tusb_xfer_type_t;
+
+typedef enum
+{
+    TUSB_DIR_OUT = 0,
+    TUSB_DIR_IN = 1,
+} tusb_dir_t;
+
+enum
+{
+    TUSB_CLASS_CDC = 0x02,
+    TUSB_CLASS_CDC_DATA = 0x0A,
+    TUSB_CLASS_VENDOR_SPECIFIC = 0xFF,
+};
+
+typedef enum
+{
+    XFER_RESULT_SUCCESS,
+    XFER_RESULT_FAILED,
+    XFER_RESULT_STALLED,
+    XFER_RESULT_TIMEOUT,
+} xfer_result_t;
+
+enum
+{
+    CONTROL_STAGE_IDLE,
+    CONTROL_STAGE_SETUP,
+    CONTROL_STAGE_DATA,
+    CONTROL_STAGE_ACK
+};
+
+#define TUD_CONFIG_DESC_LEN (9)
+#define TUD_VENDOR_DESC_LEN (9 + 7 + 7)
+#define TUD_CDC_DESC_LEN    (8 + 9 + 5 + 5 + 4 + 5 + 7 + 9 + 7 + 7)
+
+// Same bytes as TinyUSB's: IAD, ACM control interface with its functional
+// descriptors and notification endpoint, data interface with bulk OUT/IN.
+#define TUD_CDC_DESCRIPTOR(_itfnum, _stridx, _ep_notif, _ep_notif_size, _epout, _epin, _epsize) \
+    8, TUSB_DESC_INTERFACE_ASSOCIATION, _itfnum, 2, TUSB_CLASS_CDC, 2, 0, 0,                   \
+    9, TUSB_DESC_INTERFACE, _itfnum, 0, 1, TUSB_CLASS_CDC, 2, 0, _stridx,                      \
+    5, TUSB_DESC_CS_INTERFACE, 0x00, U16_TO_U8S_LE(0x0120),                                    \
+    5, TUSB_DESC_CS_INTERFACE, 0x01, 0, (uint8_t)((_itfnum) + 1),                              \
+    4, TUSB_DESC_CS_INTERFACE, 0x02, 6,                                                        \
+    5, TUSB_DESC_CS_INTERFACE, 0x06, _itfnum, (uint8_t)((_itfnum) + 1),                        \
+    7, TUSB_DESC_ENDPOINT, _ep_notif, TUSB_XFER_INTERRUPT, U16_TO_U8S_LE(_ep_notif_size), 16,  \
+    9, TUSB_DESC_INTERFACE, (uint8_t)((_itfnum) + 1), 0, 2, TUSB_CLASS_CDC_DATA, 0, 0, 0,      \
+    7, TUSB_DESC_ENDPOINT, _epout, TUSB_XFER_BULK, U16_TO_U8S_LE(_epsize), 0,                  \
+    7, TUSB_DESC_ENDPOINT, _epin, TUSB_XFER_BULK, U16_TO_U8S_LE(_epsize), 0
+
+typedef struct TU_ATTR_PACKED
+{
+    union
+    {
+        struct TU_ATTR_PACKED
+        {
+            uint8_t recipient : 5;
+            uint8_t type : 2;
+            uint8_t direction : 1;
+        } bmRequestType_bit;
+        uint8_t bmRequestType;
+    };
+    uint8_t bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+} tusb_control_request_t;
+
+typedef struct TU_ATTR_PACKED
+{
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bInterfaceNumber;
+    uint8_t bAlternateSetting;
+    uint8_t bNumEndpoints;
+    uint8_t bInterfaceClass;
+    uint8_t bInterfaceSubClass;
+    uint8_t bInterfaceProtocol;
+    uint8_t iInterface;
+} tusb_desc_interface_t;
+
+static inline uint8_t const *tu_desc_next(void const *desc)
+{
+    uint8_t const *p = (uint8_t const *)desc;
+    return p + p[0];
+}
+
+typedef struct
+{
+    const void *device_descriptor;
+    const char **string_descriptor;
+    int string_descriptor_count;
+    bool external_phy;
+    const uint8_t *configuration_descriptor;
+    bool self_powered;
+    int vbus_monitor_io;
+} tinyusb_config_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+esp_err_t tinyusb_driver_install(const tinyusb_config_t *config);
+
+void tud_task(void);
+void tud_task_ext(uint32_t timeout_ms, bool in_isr);
+bool tud_mounted(void);
+// Invoked, when linked in, once the host configures or drops the device.
+__attribute__((weak)) void tud_mount_cb(void);
+__attribute__((weak)) void tud_umount_cb(void);
+bool tud_control_xfer(uint8_t rhport, tusb_control_request_t const *request,
+                      void *buffer, uint16_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,108 @@
+#pragma once
+
+// Control surface of the host simulation: the "other side" of the fake TWAI
+// peripheral (remote CAN nodes) and of the fake USB device (the host PC).
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "driver/twai.h"
+
+namespace sim
+{
+
+uint64_t now_us();
+
+// ---- CAN bus ----------------------------------------------------------------
+
+// Nominal bit length of a frame on the wire (no stuff bits), including the
+// 3-bit interframe space.
+uint32_t can_frame_bits(const twai_message_t &msg);
+
+// Bitrate of the installed timing, 0 if no driver is installed.
+uint32_t can_bitrate();
+
+// A remote node puts a frame on the bus. Returns false if the DUT controller
+// was not running to see it.
+bool can_inject(const twai_message_t &msg);
+
+// Bus disturbances seen by the DUT controller: a bus error while receiving
+// (REC + 1) or transmitting (TEC + 8), and a forced bus-off (TEC = 256).
+void can_bus_error(bool while_transmitting);
+void can_force_bus_off();
+
+// false: no other node ACKs, so DUT frames fail with ACK errors unless the
+// controller runs in no-ACK mode.
+void can_set_remote_ack(bool ack);
+
+// Bitrate the remote nodes send at; 0 follows whatever the DUT installed.
+// Injected frames at a rate more than 1 % off arrive as receive bus errors.
+void can_set_bus_bitrate(uint32_t bitrate);
+
+// What the firmware installed.
+struct CanConfig
+{
+    bool installed;
+    twai_mode_t mode;
+    bool triple_sampling;
+};
+CanConfig can_config();
+
+// Called from the bus thread whenever a DUT frame finishes transmission.
+using CanTxSink = void (*)(const twai_message_t &msg, uint64_t done_us);
+void can_set_tx_sink(CanTxSink sink);
+
+struct CanCounters
+{
+    uint64_t injected;
+    uint64_t hw_filtered; // dropped by the acceptance filter
+    uint64_t rx_missed;
+    uint64_t tx_done;
+    uint64_t misuse; // driver calls against an uninstalled/reinstalled driver
+    uint64_t installs;
+};
+CanCounters can_counters();
+
+// ---- USB host ---------------------------------------------------------------
+
+struct UsbTiming
+{
+    uint32_t in_txn_us;  // cost of one bulk IN transaction
+    uint32_t out_txn_us; // cost of one bulk OUT transaction
+};
+
+void usb_connect(const UsbTiming &timing);
+
+bool usb_control_out(uint8_t request, uint16_t value, const void *data, uint16_t len);
+bool usb_control_in(uint8_t request, uint16_t value, void *data, uint16_t len);
+
+// One bulk OUT transfer (split into max-packet sized packets). Blocks while
+// the device NAKs. accepted_us receives the time the last packet was taken.
+bool usb_bulk_out(const void *data, uint16_t len, uint32_t timeout_ms, uint64_t *accepted_us);
+
+// Called from the host thread for every completed bulk IN transaction.
+using UsbInSink = void (*)(const uint8_t *data, size_t len, uint64_t done_us);
+void usb_set_in_sink(UsbInSink sink);
+
+struct UsbCounters
+{
+    uint64_t in_transactions;
+    uint64_t in_bytes;
+    uint64_t out_transactions;
+    uint64_t out_naks; // OUT attempts that found the endpoint not armed
+};
+UsbCounters usb_counters();
+
+// ---- CDC-ACM port (SLCAN) ---------------------------------------------------
+
+// SET_CONTROL_LINE_STATE, as sent when a terminal program opens (DTR set)
+// or closes the port.
+bool cdc_set_line_state(bool dtr, bool rts);
+
+// Bytes written to the port; same packet/NAK behaviour as usb_bulk_out().
+bool cdc_write(const void *data, size_t len, uint32_t timeout_ms, uint64_t *accepted_us);
+
+// Called from the host thread for every completed CDC IN transaction.
+void cdc_set_in_sink(UsbInSink sink);
+
+} // namespace sim
@@ -0,0 +1,107 @@
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "esp_timer.h"
+
+#include "sim.h"
+
+struct esp_timer
+{
+    esp_timer_cb_t callback;
+    void *arg;
+    bool armed;
+    uint64_t expiry_us;
+};
+
+namespace
+{
+
+std::mutex timer_mtx;
+std::condition_variable timer_cv;
+std::vector<esp_timer *> timers;
+bool dispatcher_started = false;
+
+// The esp_timer task: fires expired timers in expiry order.
+void dispatch_loop()
+{
+    std::unique_lock<std::mutex> lk(timer_mtx);
+    for (;;)
+    {
+        esp_timer *next = nullptr;
+        for (esp_timer *t : timers)
+        {
+            if (t->armed && (next == nullptr || t->expiry_us < next->expiry_us))
+            {
+                next = t;
+            }
+        }
+        if (next == nullptr)
+        {
+            timer_cv.wait(lk);
+            continue;
+        }
+        uint64_t now = sim::now_us();
+        if (next->expiry_us > now)
+        {
+            timer_cv.wait_for(lk, std::chrono::microseconds(next->expiry_us - now));
+            continue;
+        }
+        next->armed = false;
+        lk.unlock();
+        next->callback(next->arg);
+        lk.lock();
+    }
+}
+
+} // namespace
+
+extern "C" int64_t esp_timer_get_time(void)
+{
+    return (int64_t)sim::now_us();
+}
+
+extern "C" esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out_handle)
+{
+    if (args == nullptr || args->callback == nullptr || out_handle == nullptr)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    std::lock_guard<std::mutex> lk(timer_mtx);
+    esp_timer *t = new esp_timer{args->callback, args->arg, false, 0};
+    timers.push_back(t);
+    if (!dispatcher_started)
+    {
+        std::thread(dispatch_loop).detach();
+        dispatcher_started = true;
+    }
+    *out_handle = t;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    std::lock_guard<std::mutex> lk(timer_mtx);
+    if (timer->armed)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->armed = true;
+    timer->expiry_us = sim::now_us() + timeout_us;
+    timer_cv.notify_all();
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    std::lock_guard<std::mutex> lk(timer_mtx);
+    if (!timer->armed)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->armed = false;
+    timer_cv.notify_all();
+    return ESP_OK;
+}
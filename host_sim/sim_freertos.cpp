@@ -0,0 +1,344 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/prctl.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#include "sim.h"
+
+struct sim_task
+{
+    std::mutex m;
+    std::condition_variable cv;
+    uint32_t value = 0;
+    bool pending = false;
+    std::string name;
+    TaskFunction_t fn = nullptr;
+    void *param = nullptr;
+};
+
+struct sim_queue
+{
+    std::mutex m;
+    std::condition_variable cv;
+    size_t item_size = 0;
+    size_t capacity = 0;
+    size_t count = 0;
+    std::deque<std::vector<uint8_t>> items;
+    bool is_mutex = false;
+};
+
+static thread_local sim_task *current_task = nullptr;
+
+static const auto sim_epoch = std::chrono::steady_clock::now();
+
+namespace sim
+{
+uint64_t now_us()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - sim_epoch)
+        .count();
+}
+}
+
+template <typename Pred>
+static bool wait_ticks(std::unique_lock<std::mutex> &lk, std::condition_variable &cv,
+                       TickType_t ticks, Pred pred)
+{
+    if (ticks == portMAX_DELAY)
+    {
+        cv.wait(lk, pred);
+        return true;
+    }
+    return cv.wait_for(lk, std::chrono::milliseconds(ticks), pred);
+}
+
+static void *task_entry(void *arg)
+{
+    sim_task *t = static_cast<sim_task *>(arg);
+    current_task = t;
+    prctl(PR_SET_TIMERSLACK, 1000UL);
+    t->fn(t->param);
+    return nullptr;
+}
+
+extern "C" BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack,
+                                              void *param, UBaseType_t prio, TaskHandle_t *out,
+                                              BaseType_t core)
+{
+    (void)stack;
+    (void)prio;
+    (void)core;
+
+    sim_task *t = new sim_task();
+    t->name = name ? name : "";
+    t->fn = fn;
+    t->param = param;
+    if (out)
+    {
+        *out = t;
+    }
+
+    pthread_t th;
+    if (pthread_create(&th, nullptr, task_entry, t) != 0)
+    {
+        return pdFAIL;
+    }
+    pthread_detach(th);
+    return pdPASS;
+}
+
+extern "C" BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack,
+                                  void *param, UBaseType_t prio, TaskHandle_t *out)
+{
+    return xTaskCreatePinnedToCore(fn, name, stack, param, prio, out, tskNO_AFFINITY);
+}
+
+extern "C" void vTaskDelete(TaskHandle_t task)
+{
+    if (task == nullptr || task == current_task)
+    {
+        pthread_exit(nullptr);
+    }
+}
+
+extern "C" void vTaskDelay(TickType_t ticks)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+extern "C" TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(sim::now_us() / 1000U);
+}
+
+extern "C" TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return current_task;
+}
+
+extern "C" uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks)
+{
+    sim_task *t = current_task;
+    std::unique_lock<std::mutex> lk(t->m);
+    wait_ticks(lk, t->cv, ticks, [t] { return t->value != 0; });
+    uint32_t v = t->value;
+    if (v != 0)
+    {
+        t->value = clear_on_exit ? 0 : v - 1;
+    }
+    t->pending = false;
+    return v;
+}
+
+extern "C" BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action)
+{
+    if (task == nullptr)
+    {
+        return pdFAIL;
+    }
+    {
+        std::lock_guard<std::mutex> lk(task->m);
+        switch (action)
+        {
+        case eSetBits:
+            task->value |= value;
+            break;
+        case eIncrement:
+            task->value++;
+            break;
+        case eSetValueWithOverwrite:
+            task->value = value;
+            break;
+        case eSetValueWithoutOverwrite:
+            if (task->pending)
+            {
+                return pdFAIL;
+            }
+            task->value = value;
+            break;
+        case eNoAction:
+        default:
+            break;
+        }
+        task->pending = true;
+    }
+    task->cv.notify_all();
+    return pdPASS;
+}
+
+extern "C" BaseType_t xTaskNotifyFromISR(TaskHandle_t task, uint32_t value, eNotifyAction action,
+                                         BaseType_t *woken)
+{
+    if (woken)
+    {
+        *woken = pdFALSE;
+    }
+    return xTaskNotify(task, value, action);
+}
+
+extern "C" BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    return xTaskNotify(task, 0, eIncrement);
+}
+
+extern "C" void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken)
+{
+    xTaskNotifyFromISR(task, 0, eIncrement, woken);
+}
+
+extern "C" BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit,
+                                      uint32_t *value, TickType_t ticks)
+{
+    sim_task *t = current_task;
+    std::unique_lock<std::mutex> lk(t->m);
+    if (!t->pending)
+    {
+        t->value &= ~clear_on_entry;
+    }
+    if (!wait_ticks(lk, t->cv, ticks, [t] { return t->pending; }))
+    {
+        return pdFALSE;
+    }
+    if (value)
+    {
+        *value = t->value;
+    }
+    t->value &= ~clear_on_exit;
+    t->pending = false;
+    return pdTRUE;
+}
+
+extern "C" QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    sim_queue *q = new sim_queue();
+    q->capacity = length;
+    q->item_size = item_size;
+    return q;
+}
+
+extern "C" void vQueueDelete(QueueHandle_t queue)
+{
+    delete queue;
+}
+
+extern "C" BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks)
+{
+    std::unique_lock<std::mutex> lk(q->m);
+    if (!wait_ticks(lk, q->cv, ticks, [q] { return q->count < q->capacity; }))
+    {
+        return pdFAIL;
+    }
+    if (q->item_size)
+    {
+        const uint8_t *p = static_cast<const uint8_t *>(item);
+        q->items.emplace_back(p, p + q->item_size);
+    }
+    q->count++;
+    lk.unlock();
+    q->cv.notify_all();
+    return pdPASS;
+}
+
+extern "C" BaseType_t xQueueSendFromISR(QueueHandle_t q, const void *item, BaseType_t *woken)
+{
+    if (woken)
+    {
+        *woken = pdFALSE;
+    }
+    return xQueueSend(q, item, 0);
+}
+
+extern "C" BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks)
+{
+    std::unique_lock<std::mutex> lk(q->m);
+    if (!wait_ticks(lk, q->cv, ticks, [q] { return q->count > 0; }))
+    {
+        return pdFAIL;
+    }
+    if (q->item_size)
+    {
+        memcpy(item, q->items.front().data(), q->item_size);
+        q->items.pop_front();
+    }
+    q->count--;
+    lk.unlock();
+    q->cv.notify_all();
+    return pdPASS;
+}
+
+extern "C" UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+    std::lock_guard<std::mutex> lk(q->m);
+    return (UBaseType_t)q->count;
+}
+
+extern "C" SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    sim_queue *q = new sim_queue();
+    q->capacity = 1;
+    q->count = 1;
+    q->is_mutex = true;
+    return q;
+}
+
+extern "C" SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    sim_queue *q = new sim_queue();
+    q->capacity = 1;
+    return q;
+}
+
+extern "C" BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    return xQueueReceive(sem, nullptr, ticks);
+}
+
+extern "C" BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    return xQueueSend(sem, nullptr, 0);
+}
+
+extern "C" BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t *woken)
+{
+    return xQueueSendFromISR(sem, nullptr, woken);
+}
+
+extern "C" const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code)
+    {
+    case ESP_OK:
+        return "ESP_OK";
+    case ESP_FAIL:
+        return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:
+        return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:
+        return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:
+        return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:
+        return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:
+        return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:
+        return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:
+        return "ESP_ERR_TIMEOUT";
+    default:
+        return "UNKNOWN ERROR";
+    }
+}
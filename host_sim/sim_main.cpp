@@ -0,0 +1,2683 @@
+// End-to-end throughput/latency run of the firmware tasks against the
+// in-memory CAN bus and USB host.
+//
+//   RX phase: a remote node floods the bus, the host counts what arrives on
+//             the bulk IN endpoint (CAN -> USB latency).
+//   TX phase: the host streams frames over bulk OUT with the kernel's limit
+//             of in-flight echoes (USB -> CAN latency).
+//
+// With --net the USB cable stays unplugged and a cannelloni peer on
+// localhost takes the host's place for both phases. With --slcan a tool on
+// the CDC-ACM port does, speaking SLCAN.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "lwip/sockets.h"
+
+#include "gs_usb.h"
+#include "gsusb_errors.h"
+#include "gsusb_filter.h"
+#include "gsusb_frame.h"
+#include "gsusb_can.h"
+#include "gsusb_cannelloni.h"
+#include "gsusb_net.h"
+#include "gsusb_slcan.h"
+#include "gsusb_stats.h"
+#include "gsusb_usb.h"
+
+#include "sim.h"
+#include "sim_replay.h"
+
+#define SIM_CAN_CLOCK_HZ 80000000UL
+#define SIM_GS_MAX_TX_URBS 10
+// ID of the frames --tx-urgent mixes into the host stream.
+#define SIM_URGENT_ID 0x010U
+// First ID of the --cyclic jobs.
+#define SIM_CYCLIC_ID 0x300U
+// ID of the --timed frames and how far ahead of the device clock they start.
+#define SIM_TIMED_ID      0x400U
+#define SIM_TIMED_LEAD_US 20000U
+// Expected frames searched for a match before a replayed frame counts as
+// corrupted rather than the ones before it as lost.
+#define SIM_REPLAY_MATCH_WINDOW 64
+
+namespace
+{
+
+struct Options
+{
+    uint32_t bitrate = 1000000;
+    uint32_t rx_frames = 20000;
+    uint32_t rx_load = 100;
+    uint32_t tx_frames = 5000;
+    uint32_t tx_inflight = SIM_GS_MAX_TX_URBS;
+    uint32_t tx_urgent = 0;
+    uint32_t dlc = 8;
+    uint32_t rx_ids = 1;
+    uint32_t filter_ids = 0;
+    bool ext = false;
+    bool hw_timestamp = false;
+    bool berr = false;
+    uint32_t bus_errors = 0;
+    bool bus_off = false;
+    uint32_t reconfig = 0;
+    uint32_t bitrate_cycles = 0;
+    std::string replay;
+    bool replay_timing = false;
+    bool replay_tx = false;
+    bool modes = false;
+    bool net = false;
+    uint32_t net_port = 21000;
+    bool slcan = false;
+    bool cyclic = false;
+    uint32_t timed = 0;
+    bool autobaud = false;
+    sim::UsbTiming usb = {50, 50};
+    double min_rx_fps = 0;
+    double min_tx_fps = 0;
+    long max_rx_drops = -1;
+    long max_tx_drops = -1;
+};
+
+struct Latency
+{
+    std::vector<uint32_t> samples;
+
+    uint32_t pct(double p)
+    {
+        if (samples.empty())
+        {
+            return 0;
+        }
+        std::sort(samples.begin(), samples.end());
+        size_t idx = (size_t)(p * (double)(samples.size() - 1) + 0.5);
+        return samples[idx];
+    }
+};
+
+Options opt;
+
+// What bring_up() configured, replayed by the reconfiguration thread.
+struct gs_device_bt_const host_btc;
+struct gs_device_bittiming host_bt;
+struct gs_device_mode host_mode = {GS_CAN_MODE_START, GS_CAN_MODE_NORMAL};
+
+std::mutex host_mtx;
+std::condition_variable host_cv;
+
+std::vector<uint8_t> in_pending;
+size_t in_frame_size = GS_HOST_FRAME_SIZE;
+size_t out_frame_size = GS_HOST_FRAME_SIZE;
+
+std::vector<uint64_t> rx_inject_us;
+std::vector<bool> rx_seen;
+uint64_t rx_delivered = 0;
+uint64_t rx_last_us = 0;
+uint64_t rx_other = 0;
+Latency rx_lat;
+Latency rx_stamp_lag;
+
+std::vector<uint64_t> tx_accept_us;
+std::vector<uint64_t> tx_bus_us;
+std::vector<bool> tx_slot_busy;
+std::vector<uint32_t> tx_slot_seq;
+uint32_t tx_outstanding = 0;
+uint64_t tx_echoes = 0;
+uint64_t tx_echo_lost = 0;
+uint64_t tx_early_echoes = 0;
+uint64_t tx_err_frames = 0;
+
+struct ErrFrameCounts
+{
+    uint64_t total;
+    uint64_t bus_off;
+    uint64_t restarted;
+    uint64_t state;
+    uint64_t rx_overflow;
+    uint64_t bus_error;
+};
+ErrFrameCounts err_frames = {};
+std::atomic<uint64_t> tx_on_bus{0};
+uint64_t tx_first_us = 0;
+std::atomic<uint64_t> tx_last_us{0};
+Latency tx_lat;
+Latency tx_urgent_lat;
+Latency tx_echo_lag;
+
+// Replay: frames put on the bus (RX) or sent by the host (TX) and not yet
+// seen on the other side, oldest first.
+bool replay_active = false;
+std::deque<twai_message_t> replay_rx_expect;
+std::deque<twai_message_t> replay_tx_expect;
+uint64_t replay_rx_delivered = 0;
+uint64_t replay_rx_lost = 0;
+uint64_t replay_rx_corrupt = 0;
+uint64_t replay_tx_lost = 0;
+uint64_t replay_tx_corrupt = 0;
+
+// Mode checks: everything the device returns and puts on the bus while a
+// probe frame is out, taken before the stream bookkeeping sees it.
+bool probe_active = false;
+std::vector<struct gs_host_frame> probe_in;
+std::vector<twai_message_t> probe_bus;
+
+// --cyclic: every frame the device puts on the bus while jobs run.
+bool cyclic_active = false;
+std::vector<std::pair<twai_message_t, uint64_t>> cyclic_bus;
+
+// --timed: the same for the frames sent for a device time.
+bool timed_active = false;
+std::vector<std::pair<twai_message_t, uint64_t>> timed_bus;
+
+bool same_frame(const twai_message_t &a, const twai_message_t &b)
+{
+    return a.identifier == b.identifier && a.extd == b.extd && a.rtr == b.rtr &&
+           a.data_length_code == b.data_length_code &&
+           (a.rtr || memcmp(a.data, b.data, a.data_length_code) == 0);
+}
+
+// Pops the expected frames up to the one matching msg; the skipped ones were
+// lost. A frame matching none of the next SIM_REPLAY_MATCH_WINDOW is corrupt.
+void replay_match(std::deque<twai_message_t> &expect, const twai_message_t &msg,
+                  uint64_t &lost, uint64_t &corrupt)
+{
+    size_t window = std::min<size_t>(expect.size(), SIM_REPLAY_MATCH_WINDOW);
+    for (size_t i = 0; i < window; i++)
+    {
+        if (same_frame(expect[i], msg))
+        {
+            lost += i;
+            expect.erase(expect.begin(), expect.begin() + (long)i + 1);
+            return;
+        }
+    }
+    corrupt++;
+}
+
+bool rx_expected(uint32_t seq)
+{
+    return opt.filter_ids == 0 || seq % opt.rx_ids < opt.filter_ids;
+}
+
+uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+// An RX phase frame reached the host side; host_mtx held. False for a
+// duplicate or a frame that is not part of the phase.
+bool rx_arrived(const uint8_t *data, uint8_t dlc, uint64_t done_us)
+{
+    uint32_t seq = get_le32(data);
+    if (dlc < 4 || seq >= rx_seen.size() || rx_seen[seq] || !rx_expected(seq))
+    {
+        rx_other++;
+        return false;
+    }
+    rx_seen[seq] = true;
+    rx_delivered++;
+    rx_last_us = done_us;
+    rx_lat.samples.push_back((uint32_t)(done_us - rx_inject_us[seq]));
+    return true;
+}
+
+void on_usb_in(const uint8_t *data, size_t len, uint64_t done_us)
+{
+    std::lock_guard<std::mutex> lk(host_mtx);
+    in_pending.insert(in_pending.end(), data, data + len);
+
+    size_t off = 0;
+    while (in_pending.size() - off >= in_frame_size)
+    {
+        struct gs_host_frame hf = {};
+        memcpy(&hf, in_pending.data() + off, in_frame_size);
+        off += in_frame_size;
+
+        if (probe_active)
+        {
+            probe_in.push_back(hf);
+            continue;
+        }
+        if (hf.echo_id == GS_HOST_FRAME_ECHO_ID_RX && (hf.can_id & CAN_ERR_FLAG))
+        {
+            if (hf.can_id & CAN_ERR_TX_TIMEOUT)
+            {
+                tx_err_frames++;
+                continue;
+            }
+            err_frames.total++;
+            err_frames.bus_off += (hf.can_id & CAN_ERR_BUSOFF) ? 1 : 0;
+            err_frames.restarted += (hf.can_id & CAN_ERR_RESTARTED) ? 1 : 0;
+            err_frames.bus_error += (hf.can_id & CAN_ERR_BUSERROR) ? 1 : 0;
+            if (hf.can_id & CAN_ERR_CRTL)
+            {
+                err_frames.rx_overflow += (hf.data[1] & CAN_ERR_CRTL_RX_OVERFLOW) ? 1 : 0;
+                err_frames.state += (hf.data[1] & ~CAN_ERR_CRTL_RX_OVERFLOW) ? 1 : 0;
+            }
+        }
+        else if (hf.echo_id == GS_HOST_FRAME_ECHO_ID_RX && replay_active)
+        {
+            // Back through the firmware's own conversion, compared with
+            // what went on the bus.
+            twai_message_t msg;
+            gsusb_frame_to_twai(&hf, &msg);
+            replay_match(replay_rx_expect, msg, replay_rx_lost, replay_rx_corrupt);
+            replay_rx_delivered++;
+            rx_last_us = done_us;
+        }
+        else if (hf.echo_id == GS_HOST_FRAME_ECHO_ID_RX)
+        {
+            if (rx_arrived(hf.data, hf.can_dlc, done_us) && opt.hw_timestamp)
+            {
+                uint32_t seq = get_le32(hf.data);
+                rx_stamp_lag.samples.push_back(hf.timestamp_us - (uint32_t)rx_inject_us[seq]);
+            }
+        }
+        else if (hf.echo_id < tx_slot_busy.size() && tx_slot_busy[hf.echo_id])
+        {
+            tx_slot_busy[hf.echo_id] = false;
+            tx_outstanding--;
+            tx_echoes++;
+            if (replay_active || timed_active)
+            {
+                continue; // matched on the bus side
+            }
+            uint64_t bus_us = tx_bus_us[tx_slot_seq[hf.echo_id]];
+            if (bus_us == 0)
+            {
+                tx_early_echoes++;
+            }
+            else
+            {
+                tx_echo_lag.samples.push_back((uint32_t)(done_us - bus_us));
+            }
+        }
+    }
+    in_pending.erase(in_pending.begin(), in_pending.begin() + off);
+    host_cv.notify_all();
+}
+
+void on_can_tx(const twai_message_t &msg, uint64_t done_us)
+{
+    if (probe_active)
+    {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        probe_bus.push_back(msg);
+        return;
+    }
+    if (cyclic_active)
+    {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        cyclic_bus.emplace_back(msg, done_us);
+        return;
+    }
+    if (timed_active)
+    {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        timed_bus.emplace_back(msg, done_us);
+        return;
+    }
+    if (replay_active)
+    {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        replay_match(replay_tx_expect, msg, replay_tx_lost, replay_tx_corrupt);
+        tx_on_bus++;
+        tx_last_us = done_us;
+        return;
+    }
+    if (msg.data_length_code < 4)
+    {
+        return;
+    }
+    uint32_t seq = get_le32(msg.data);
+    if (seq < tx_accept_us.size() && tx_accept_us[seq] != 0)
+    {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        tx_lat.samples.push_back((uint32_t)(done_us - tx_accept_us[seq]));
+        if (msg.identifier == SIM_URGENT_ID)
+        {
+            tx_urgent_lat.samples.push_back((uint32_t)(done_us - tx_accept_us[seq]));
+        }
+        tx_bus_us[seq] = done_us;
+        tx_on_bus++;
+        tx_last_us = done_us;
+    }
+}
+
+twai_message_t make_frame(uint32_t seq);
+bool usb_host_up();
+template <typename Counter>
+void wait_quiet(Counter counter, uint32_t quiet_ms);
+
+// Linux can_calc_bittiming(), reduced to what the device advertises.
+bool calc_bittiming(const struct gs_device_bt_const &btc, uint32_t bitrate,
+                    struct gs_device_bittiming &bt)
+{
+    uint32_t sp_target = bitrate > 800000 ? 750 : bitrate > 500000 ? 800 : 875;
+    uint64_t best_err = UINT64_MAX;
+    uint32_t best_sp_err = UINT32_MAX;
+    bool found = false;
+
+    uint32_t tseg_max = 1 + btc.tseg1_max + btc.tseg2_max;
+    uint32_t tseg_min = 1 + btc.tseg1_min + btc.tseg2_min;
+    for (uint32_t tseg = tseg_max; tseg >= tseg_min; tseg--)
+    {
+        uint32_t brp = (uint32_t)((btc.fclk_can + (uint64_t)tseg * bitrate / 2) / ((uint64_t)tseg * bitrate));
+        brp = (brp / btc.brp_inc) * btc.brp_inc;
+        if (brp < btc.brp_min || brp > btc.brp_max)
+        {
+            continue;
+        }
+        uint64_t actual = btc.fclk_can / ((uint64_t)brp * tseg);
+        uint64_t err = actual > bitrate ? actual - bitrate : bitrate - actual;
+
+        uint32_t tseg2 = tseg - (sp_target * tseg + 500) / 1000;
+        tseg2 = std::max(btc.tseg2_min, std::min(btc.tseg2_max, tseg2));
+        uint32_t tseg1 = tseg - 1 - tseg2;
+        if (tseg1 > btc.tseg1_max)
+        {
+            tseg1 = btc.tseg1_max;
+            tseg2 = tseg - 1 - tseg1;
+        }
+        if (tseg1 < btc.tseg1_min || tseg2 < btc.tseg2_min || tseg2 > btc.tseg2_max)
+        {
+            continue;
+        }
+        uint32_t sp = 1000 * (tseg - tseg2) / tseg;
+        uint32_t sp_err = sp > sp_target ? sp - sp_target : sp_target - sp;
+
+        if (err < best_err || (err == best_err && sp_err < best_sp_err))
+        {
+            best_err = err;
+            best_sp_err = sp_err;
+            bt.brp = brp;
+            bt.prop_seg = tseg1 / 2;
+            bt.phase_seg1 = tseg1 - bt.prop_seg;
+            bt.phase_seg2 = tseg2;
+            bt.sjw = 1;
+            found = true;
+            if (err == 0 && sp_err == 0)
+            {
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+bool bring_up()
+{
+    sim::usb_set_in_sink(on_usb_in);
+    sim::can_set_tx_sink(on_can_tx);
+
+    if (gsusb_init() != ESP_OK)
+    {
+        fprintf(stderr, "gsusb_init failed\n");
+        return false;
+    }
+    sim::usb_connect(opt.usb);
+    return usb_host_up();
+}
+
+// What the gs_usb driver does on "ip link set can0 up": enumeration,
+// BITTIMING and MODE START with the options asked for.
+bool usb_host_up()
+{
+    // Frames queued for a host that was not reading yet come in the
+    // format they were queued in; let them through before it changes.
+    wait_quiet([] { return sim::usb_counters().in_bytes; }, 20);
+
+    uint32_t byte_order = 0x0000beef;
+    struct gs_device_config conf;
+    struct gs_device_bt_const &btc = host_btc;
+    struct gs_device_bittiming &bt = host_bt;
+    struct gs_device_mode &mode = host_mode;
+
+    if (!sim::usb_control_out(GS_USB_BREQ_HOST_FORMAT, 1, &byte_order, sizeof(byte_order)) ||
+        !sim::usb_control_in(GS_USB_BREQ_DEVICE_CONFIG, 1, &conf, sizeof(conf)) ||
+        !sim::usb_control_in(GS_USB_BREQ_BT_CONST, 0, &btc, sizeof(btc)))
+    {
+        fprintf(stderr, "device enumeration requests failed\n");
+        return false;
+    }
+    if (opt.hw_timestamp)
+    {
+        uint32_t ts = 0;
+        if (!(btc.feature & GS_CAN_FEATURE_HW_TIMESTAMP) ||
+            !sim::usb_control_in(GS_USB_BREQ_TIMESTAMP, 0, &ts, sizeof(ts)))
+        {
+            fprintf(stderr, "device does not support hardware timestamps\n");
+            return false;
+        }
+        mode.flags |= GS_CAN_MODE_HW_TIMESTAMP;
+        in_frame_size = GS_HOST_FRAME_TS_SIZE;
+    }
+    if (opt.timed)
+    {
+        if (!(btc.feature & GSUSB_CAN_FEATURE_TX_TIMED))
+        {
+            fprintf(stderr, "device does not support timed transmit\n");
+            return false;
+        }
+        mode.flags |= GSUSB_CAN_MODE_TX_TIMED;
+        out_frame_size = GS_HOST_FRAME_TS_SIZE;
+    }
+    if (opt.berr)
+    {
+        if (!(btc.feature & GS_CAN_FEATURE_BERR_REPORTING))
+        {
+            fprintf(stderr, "device does not support bus error reporting\n");
+            return false;
+        }
+        mode.flags |= GS_CAN_MODE_BERR_REPORTING;
+    }
+    if (opt.filter_ids > 0)
+    {
+        // Before BITTIMING, so the hardware filter is part of the install.
+        // The second range, of the other ID kind and never on the bus,
+        // puts the controller in dual filter mode.
+        struct gsusb_filter_range range[2];
+        range[0].id_lo = make_frame(0).identifier;
+        range[0].id_hi = range[0].id_lo + opt.filter_ids - 1;
+        range[1].id_lo = range[1].id_hi = 0x0001E000U | CAN_EFF_FLAG;
+        if (opt.ext)
+        {
+            range[0].id_lo |= CAN_EFF_FLAG;
+            range[0].id_hi |= CAN_EFF_FLAG;
+            range[1].id_lo = range[1].id_hi = 0x7F0U;
+        }
+        if (!sim::usb_control_out(GSUSB_BREQ_FILTER, GSUSB_FILTER_REPLACE, range, sizeof(range)))
+        {
+            fprintf(stderr, "FILTER request failed\n");
+            return false;
+        }
+    }
+    if (!calc_bittiming(btc, opt.bitrate, bt))
+    {
+        fprintf(stderr, "no bit timing for %u bit/s within device limits\n", (unsigned)opt.bitrate);
+        return false;
+    }
+    if (!sim::usb_control_out(GS_USB_BREQ_BITTIMING, 0, &bt, sizeof(bt)) ||
+        !sim::usb_control_out(GS_USB_BREQ_MODE, 0, &mode, sizeof(mode)))
+    {
+        fprintf(stderr, "BITTIMING/MODE requests failed\n");
+        return false;
+    }
+    if (sim::can_bitrate() == 0)
+    {
+        fprintf(stderr, "device did not install the CAN driver (brp=%u tseg1=%u tseg2=%u)\n",
+                (unsigned)bt.brp, (unsigned)(bt.prop_seg + bt.phase_seg1), (unsigned)bt.phase_seg2);
+        return false;
+    }
+    return true;
+}
+
+twai_message_t make_frame(uint32_t seq)
+{
+    twai_message_t msg = {};
+    msg.extd = opt.ext ? 1 : 0;
+    msg.identifier = (opt.ext ? 0x18DAF100U : 0x123U) + seq % opt.rx_ids;
+    msg.data_length_code = (uint8_t)opt.dlc;
+    memset(msg.data, 0xA5, sizeof(msg.data));
+    put_le32(msg.data, seq);
+    return msg;
+}
+
+template <typename Counter>
+void wait_quiet(Counter counter, uint32_t quiet_ms)
+{
+    uint64_t last = counter();
+    auto stable_since = std::chrono::steady_clock::now();
+    for (;;)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        uint64_t now = counter();
+        if (now != last)
+        {
+            last = now;
+            stable_since = std::chrono::steady_clock::now();
+        }
+        else if (std::chrono::steady_clock::now() - stable_since > std::chrono::milliseconds(quiet_ms))
+        {
+            return;
+        }
+    }
+}
+
+bool run_rx_phase()
+{
+    if (opt.rx_frames == 0)
+    {
+        return true;
+    }
+
+    rx_inject_us.assign(opt.rx_frames, 0);
+    rx_seen.assign(opt.rx_frames, false);
+
+    twai_message_t probe = make_frame(0);
+    uint32_t bits = sim::can_frame_bits(probe);
+    double fps = (double)sim::can_bitrate() / bits * opt.rx_load / 100.0;
+    auto interval = std::chrono::nanoseconds((uint64_t)(1e9 / fps));
+
+    sim::CanCounters before = sim::can_counters();
+    auto start = std::chrono::steady_clock::now();
+    uint64_t start_us = sim::now_us();
+    uint32_t err_every = opt.bus_errors ? (opt.rx_frames + opt.bus_errors - 1) / opt.bus_errors : 0;
+    for (uint32_t i = 0; i < opt.rx_frames; i++)
+    {
+        std::this_thread::sleep_until(start + interval * i);
+        if (err_every && i % err_every == 0)
+        {
+            sim::can_bus_error(false);
+        }
+        twai_message_t msg = make_frame(i);
+        {
+            std::lock_guard<std::mutex> lk(host_mtx);
+            rx_inject_us[i] = sim::now_us();
+        }
+        sim::can_inject(msg);
+    }
+
+    wait_quiet([] { std::lock_guard<std::mutex> lk(host_mtx); return rx_delivered; }, 200);
+    sim::CanCounters after = sim::can_counters();
+
+    std::lock_guard<std::mutex> lk(host_mtx);
+    uint64_t expected = 0;
+    for (uint32_t i = 0; i < opt.rx_frames; i++)
+    {
+        expected += rx_expected(i) ? 1 : 0;
+    }
+    uint64_t dropped = expected - rx_delivered;
+    double elapsed = rx_last_us > start_us ? (double)(rx_last_us - start_us) / 1e6 : 0;
+    double rate = elapsed > 0 ? rx_delivered / elapsed : 0;
+
+    printf("RX  CAN->%s: offered=%u (%.0f fps, %u%% load) delivered=%llu dropped=%llu "
+           "(twai_rx_missed=%llu) rate=%.0f fps latency p50=%uus p99=%uus max=%uus\n",
+           opt.net ? "NET" : opt.slcan ? "SLCAN" : "USB", (unsigned)opt.rx_frames, fps, (unsigned)opt.rx_load,
+           (unsigned long long)rx_delivered, (unsigned long long)dropped,
+           (unsigned long long)(after.rx_missed - before.rx_missed), rate,
+           rx_lat.pct(0.50), rx_lat.pct(0.99), rx_lat.pct(1.0));
+    if (opt.filter_ids > 0)
+    {
+        printf("RX  filter: expected=%llu hw_rejected=%llu sw_rejected=%u leaked=%llu\n",
+               (unsigned long long)expected,
+               (unsigned long long)(after.hw_filtered - before.hw_filtered),
+               (unsigned)gsusb_filter_rejected(), (unsigned long long)rx_other);
+    }
+    if (opt.hw_timestamp && !opt.slcan)
+    {
+        printf("RX  device timestamp behind bus arrival: p50=%uus p99=%uus max=%uus\n",
+               rx_stamp_lag.pct(0.50), rx_stamp_lag.pct(0.99), rx_stamp_lag.pct(1.0));
+    }
+
+    bool ok = true;
+    if (opt.min_rx_fps > 0 && rate < opt.min_rx_fps)
+    {
+        printf("FAIL: RX rate %.0f fps below %.0f fps\n", rate, opt.min_rx_fps);
+        ok = false;
+    }
+    if (opt.filter_ids > 0 && rx_other > 0)
+    {
+        printf("FAIL: %llu frames outside the filter reached the host\n", (unsigned long long)rx_other);
+        ok = false;
+    }
+    if (opt.filter_ids > 0 && after.hw_filtered - before.hw_filtered > opt.rx_frames - expected)
+    {
+        printf("FAIL: the hardware filter dropped %llu frames the host asked for\n",
+               (unsigned long long)(after.hw_filtered - before.hw_filtered - (opt.rx_frames - expected)));
+        ok = false;
+    }
+    if (opt.max_rx_drops >= 0 && dropped > (uint64_t)opt.max_rx_drops)
+    {
+        printf("FAIL: RX dropped %llu frames, limit %ld\n", (unsigned long long)dropped, opt.max_rx_drops);
+        ok = false;
+    }
+    return ok;
+}
+
+bool get_state(struct gs_device_state &st)
+{
+    return sim::usb_control_in(GS_USB_BREQ_GET_STATE, 0, &st, sizeof(st));
+}
+
+const char *state_name(uint32_t state)
+{
+    static const char *const names[] = {"error-active", "error-warning", "error-passive",
+                                        "bus-off", "stopped", "sleeping"};
+    return state < 6 ? names[state] : "?";
+}
+
+// Upper bound in microseconds of the bucket holding the q-th sample.
+double hist_quantile_us(const uint32_t *buckets, uint32_t cpu_hz, double q)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < GSUSB_STATS_BUCKETS; i++)
+    {
+        total += buckets[i];
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < GSUSB_STATS_BUCKETS; i++)
+    {
+        seen += buckets[i];
+        if (total && seen >= q * total)
+        {
+            return (double)(1ULL << (i + GSUSB_STATS_BUCKET_SHIFT)) * 1e6 / cpu_hz;
+        }
+    }
+    return 0;
+}
+
+void print_device_stats()
+{
+    static const char *const counter_names[GSUSB_STAT_COUNT] = {
+        "rx_frames", "rx_filtered", "rx_to_usb", "rx_drop_ring_full", "rx_drop_unmounted",
+        "rx_drop_driver", "tx_frames", "tx_queued", "tx_backpressure", "tx_drop_echo_id",
+        "tx_drop_inactive", "tx_drop_error", "tx_echoes", "tx_failed", "err_frames",
+        "usb_in_writes", "rx_to_net", "rx_drop_net", "net_out_packets", "net_send_errors",
+        "net_in_packets", "net_in_lost", "net_in_bad", "tx_from_net", "tx_net_backpressure",
+        "rx_to_slcan", "rx_drop_slcan", "tx_from_slcan", "slcan_bad_lines", "slcan_drop_reply",
+        "tx_timed", "tx_timed_late"};
+    static const char *const hist_names[GSUSB_HIST_COUNT] = {
+        "rx_convert", "rx_dwell", "tx_submit", "tx_complete", "quiesce", "tx_timed"};
+
+    struct gsusb_stats stats;
+    if (!sim::usb_control_in(GSUSB_BREQ_STATS, 0, &stats, sizeof(stats)) ||
+        stats.version != GSUSB_STATS_VERSION || stats.cpu_hz == 0)
+    {
+        printf("STATS: unavailable\n");
+        return;
+    }
+
+    printf("STATS: uptime=%ums", (unsigned)stats.uptime_ms);
+    for (int i = 0; i < GSUSB_STAT_COUNT; i++)
+    {
+        if (stats.counters[i])
+        {
+            printf(" %s=%u", counter_names[i], (unsigned)stats.counters[i]);
+        }
+    }
+    printf("\n");
+    for (int h = 0; h < GSUSB_HIST_COUNT; h++)
+    {
+        uint32_t buckets[GSUSB_STATS_BUCKETS];
+        memcpy(buckets, stats.hist[h], sizeof(buckets)); // the wire struct is packed
+        uint64_t n = 0;
+        for (int i = 0; i < GSUSB_STATS_BUCKETS; i++)
+        {
+            n += buckets[i];
+        }
+        if (n)
+        {
+            printf("STATS %-11s n=%-7llu p50<=%.1fus p99<=%.1fus\n", hist_names[h],
+                   (unsigned long long)n, hist_quantile_us(buckets, stats.cpu_hz, 0.5),
+                   hist_quantile_us(buckets, stats.cpu_hz, 0.99));
+        }
+    }
+}
+
+// Clears the statistics and puts a few frames on the bus: the next read
+// must count exactly those, so every reset reached its writer.
+bool check_stats_clear()
+{
+    const uint32_t frames = 10;
+    struct gsusb_stats stats;
+    if (!sim::usb_control_in(GSUSB_BREQ_STATS, 1, &stats, sizeof(stats)))
+    {
+        printf("FAIL: STATS clear request failed\n");
+        return false;
+    }
+    twai_message_t msg = make_frame(0);
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        if (!sim::can_inject(msg))
+        {
+            printf("STATS clear: bus not running, skipped\n");
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    if (!sim::usb_control_in(GSUSB_BREQ_STATS, 0, &stats, sizeof(stats)))
+    {
+        printf("FAIL: STATS request failed\n");
+        return false;
+    }
+
+    uint32_t convert[GSUSB_STATS_BUCKETS];
+    memcpy(convert, stats.hist[GSUSB_HIST_RX_CONVERT], sizeof(convert)); // packed
+    uint32_t samples = 0;
+    for (uint32_t n : convert)
+    {
+        samples += n;
+    }
+    printf("STATS clear: rx_frames=%u rx_convert=%u tx_frames=%u after %u frames\n",
+           (unsigned)stats.counters[GSUSB_STAT_RX_FRAMES], (unsigned)samples,
+           (unsigned)stats.counters[GSUSB_STAT_TX_FRAMES], (unsigned)frames);
+    if (stats.counters[GSUSB_STAT_RX_FRAMES] != frames || samples != frames ||
+        stats.counters[GSUSB_STAT_TX_FRAMES] != 0)
+    {
+        printf("FAIL: the statistics did not restart from zero\n");
+        return false;
+    }
+    return true;
+}
+
+// Drives the controller into bus-off and waits for the device to recover
+// on its own.
+bool run_bus_off()
+{
+    if (!opt.bus_off)
+    {
+        return true;
+    }
+
+    sim::can_force_bus_off();
+    uint64_t t0 = sim::now_us();
+    struct gs_device_state st = {};
+    while (sim::now_us() - t0 < 1000000)
+    {
+        if (get_state(st) && st.state == GS_CAN_STATE_ERROR_ACTIVE)
+        {
+            printf("BUS-OFF: recovered to %s after %lluus\n", state_name(st.state),
+                   (unsigned long long)(sim::now_us() - t0));
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    printf("FAIL: still %s 1 s after bus-off\n", state_name(st.state));
+    return false;
+}
+
+// Waits for a free echo slot, like the kernel's URB window.
+uint32_t take_tx_slot(uint32_t seq)
+{
+    std::unique_lock<std::mutex> lk(host_mtx);
+    if (!host_cv.wait_for(lk, std::chrono::milliseconds(200),
+                          [] { return tx_outstanding < opt.tx_inflight; }))
+    {
+        // The device never echoed: reclaim the slots like a host giving up
+        // on stuck URBs.
+        tx_echo_lost += tx_outstanding;
+        tx_outstanding = 0;
+        std::fill(tx_slot_busy.begin(), tx_slot_busy.end(), false);
+    }
+    uint32_t slot = 0;
+    while (tx_slot_busy[slot])
+    {
+        slot++;
+    }
+    tx_slot_busy[slot] = true;
+    tx_slot_seq[slot] = seq;
+    tx_outstanding++;
+    return slot;
+}
+
+bool run_tx_phase()
+{
+    if (opt.tx_frames == 0)
+    {
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        tx_accept_us.assign(opt.tx_frames, 0);
+        tx_bus_us.assign(opt.tx_frames, 0);
+        tx_slot_busy.assign(opt.tx_inflight, false);
+        tx_slot_seq.assign(opt.tx_inflight, 0);
+        tx_first_us = 0;
+    }
+
+    for (uint32_t i = 0; i < opt.tx_frames; i++)
+    {
+        uint32_t slot = take_tx_slot(i);
+
+        twai_message_t msg = make_frame(i);
+        struct gs_host_frame hf = {};
+        hf.echo_id = slot;
+        hf.can_id = msg.identifier | (opt.ext ? 0x80000000U : 0);
+        if (opt.tx_urgent != 0 && i % opt.tx_urgent == opt.tx_urgent - 1)
+        {
+            // A low standard ID behind the bulk stream, like a control
+            // message during a flash download.
+            hf.can_id = SIM_URGENT_ID;
+        }
+        hf.can_dlc = msg.data_length_code;
+        memcpy(hf.data, msg.data, sizeof(hf.data));
+
+        uint64_t accepted = 0;
+        if (!sim::usb_bulk_out(&hf, out_frame_size, 1000, &accepted))
+        {
+            printf("FAIL: bulk OUT stalled for 1 s at frame %u\n", (unsigned)i);
+            return false;
+        }
+        std::lock_guard<std::mutex> lk(host_mtx);
+        tx_accept_us[i] = accepted;
+        if (tx_first_us == 0)
+        {
+            tx_first_us = accepted;
+        }
+    }
+
+    wait_quiet([] { return tx_on_bus.load(); }, 200);
+
+    std::lock_guard<std::mutex> lk(host_mtx);
+    uint64_t on_bus = tx_on_bus.load();
+    uint64_t dropped = opt.tx_frames - on_bus;
+    double elapsed = tx_last_us > tx_first_us ? (double)(tx_last_us - tx_first_us) / 1e6 : 0;
+    double rate = elapsed > 0 ? on_bus / elapsed : 0;
+
+    printf("TX  USB->CAN: sent=%u on_bus=%llu dropped=%llu echoes=%llu echo_lost=%llu "
+           "rate=%.0f fps latency p50=%uus p99=%uus max=%uus\n",
+           (unsigned)opt.tx_frames, (unsigned long long)on_bus, (unsigned long long)dropped,
+           (unsigned long long)tx_echoes, (unsigned long long)tx_echo_lost, rate,
+           tx_lat.pct(0.50), tx_lat.pct(0.99), tx_lat.pct(1.0));
+    printf("TX  echo behind bus completion: p50=%uus p99=%uus max=%uus early_echoes=%llu "
+           "tx_error_frames=%llu\n",
+           tx_echo_lag.pct(0.50), tx_echo_lag.pct(0.99), tx_echo_lag.pct(1.0),
+           (unsigned long long)tx_early_echoes, (unsigned long long)tx_err_frames);
+    if (opt.tx_urgent != 0)
+    {
+        printf("TX  urgent 0x%03x: n=%zu latency p50=%uus p99=%uus max=%uus\n", SIM_URGENT_ID,
+               tx_urgent_lat.samples.size(), tx_urgent_lat.pct(0.50), tx_urgent_lat.pct(0.99),
+               tx_urgent_lat.pct(1.0));
+    }
+
+    bool ok = true;
+    if (tx_early_echoes > 0)
+    {
+        printf("FAIL: %llu echoes arrived before their frame left the bus\n",
+               (unsigned long long)tx_early_echoes);
+        ok = false;
+    }
+    if (opt.min_tx_fps > 0 && rate < opt.min_tx_fps)
+    {
+        printf("FAIL: TX rate %.0f fps below %.0f fps\n", rate, opt.min_tx_fps);
+        ok = false;
+    }
+    if (opt.max_tx_drops >= 0 && dropped > (uint64_t)opt.max_tx_drops)
+    {
+        printf("FAIL: TX dropped %llu frames, limit %ld\n", (unsigned long long)dropped, opt.max_tx_drops);
+        ok = false;
+    }
+    return ok;
+}
+
+// Another gs_usb TX phase with fresh counters after traffic that takes no
+// echo slot; every frame must still come back as an echo.
+bool run_echo_check(const char *after)
+{
+    if (opt.tx_frames == 0)
+    {
+        return true;
+    }
+    {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        tx_on_bus = 0;
+        tx_last_us = 0;
+        tx_echoes = 0;
+        tx_echo_lost = 0;
+        tx_early_echoes = 0;
+        tx_lat.samples.clear();
+        tx_urgent_lat.samples.clear();
+        tx_echo_lag.samples.clear();
+    }
+    bool ok = run_tx_phase();
+    wait_quiet([] {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        return tx_echoes;
+    }, 100);
+
+    std::lock_guard<std::mutex> lk(host_mtx);
+    if (tx_echoes != opt.tx_frames || tx_echo_lost > 0)
+    {
+        printf("FAIL: after %s only %llu of %u gs_usb frames were echoed\n", after,
+               (unsigned long long)tx_echoes, (unsigned)opt.tx_frames);
+        ok = false;
+    }
+    return ok;
+}
+
+// Uploads a few cyclic jobs, lets the device run them for a second and
+// checks their frames: count, rolling counter, checksum and how far each
+// interval strays from the period. Stopping them must end the frames.
+bool run_cyclic()
+{
+    if (!opt.cyclic)
+    {
+        return true;
+    }
+
+    struct Plan
+    {
+        uint32_t period_us;
+        uint32_t count;
+    } const plan[] = {{10000, 0}, {20000, 10}, {50000, 0}, {100000, 0}};
+    const uint32_t jobs = sizeof(plan) / sizeof(plan[0]);
+    const uint32_t run_us = 1000000;
+
+    struct gsusb_cyclic_job bad = {};
+    bad.period_us = 0;
+    bool ok = true;
+    if (sim::usb_control_out(GSUSB_BREQ_CYCLIC, 0, &bad, sizeof(bad)))
+    {
+        printf("FAIL: a cyclic job without a period was accepted\n");
+        ok = false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        cyclic_bus.clear();
+        cyclic_active = true;
+    }
+    for (uint32_t j = 0; j < jobs; j++)
+    {
+        struct gsusb_cyclic_job job = {};
+        job.can_id = SIM_CYCLIC_ID + j;
+        job.period_us = plan[j].period_us;
+        job.count = plan[j].count;
+        job.delay_us = 1000 * j;
+        job.can_dlc = 8;
+        job.counter_pos = 0;
+        job.counter_mask = 0x0F;
+        job.checksum_pos = 7;
+        job.checksum_type = (j & 1) ? GSUSB_CYCLIC_XOR8 : GSUSB_CYCLIC_SUM8;
+        memset(job.data, 0x10 * (j + 1), sizeof(job.data));
+        if (!sim::usb_control_out(GSUSB_BREQ_CYCLIC, (uint16_t)j, &job, sizeof(job)))
+        {
+            printf("FAIL: cyclic job %u refused\n", (unsigned)j);
+            return false;
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(run_us));
+
+    struct gsusb_cyclic_status st[jobs];
+    bool got_status = sim::usb_control_in(GSUSB_BREQ_CYCLIC_STATUS, 0, st, sizeof(st));
+    bool stopped = sim::usb_control_out(GSUSB_BREQ_CYCLIC, GSUSB_CYCLIC_ALL, nullptr, 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    size_t at_stop;
+    {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        at_stop = cyclic_bus.size();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    std::lock_guard<std::mutex> lk(host_mtx);
+    cyclic_active = false;
+    if (!got_status || !stopped || cyclic_bus.size() != at_stop)
+    {
+        printf("FAIL: cyclic status/stop failed, %zu frames after the stop\n", cyclic_bus.size() - at_stop);
+        ok = false;
+    }
+
+    for (uint32_t j = 0; j < jobs; j++)
+    {
+        uint32_t frames = 0;
+        uint32_t bad_counter = 0;
+        uint32_t bad_checksum = 0;
+        uint64_t last_us = 0;
+        Latency jitter;
+        for (const auto &f : cyclic_bus)
+        {
+            const twai_message_t &m = f.first;
+            if (m.identifier != SIM_CYCLIC_ID + j)
+            {
+                continue;
+            }
+            bad_counter += (m.data[0] & 0x0F) != (frames & 0x0F) ? 1 : 0;
+            uint8_t sum = 0;
+            for (int b = 0; b < 7; b++)
+            {
+                sum = (j & 1) ? sum ^ m.data[b] : (uint8_t)(sum + m.data[b]);
+            }
+            bad_checksum += m.data[7] != sum ? 1 : 0;
+            if (frames > 0)
+            {
+                int64_t d = (int64_t)(f.second - last_us) - plan[j].period_us;
+                jitter.samples.push_back((uint32_t)(d < 0 ? -d : d));
+            }
+            last_us = f.second;
+            frames++;
+        }
+
+        uint32_t want = plan[j].count != 0 ? plan[j].count : run_us / plan[j].period_us;
+        printf("CYCLIC 0x%03x period=%uus frames=%u (device %u) jitter p50=%uus p99=%uus max=%uus "
+               "late=%u skipped=%u\n",
+               (unsigned)(SIM_CYCLIC_ID + j), (unsigned)plan[j].period_us, (unsigned)frames,
+               got_status ? (unsigned)st[j].sent : 0, jitter.pct(0.50), jitter.pct(0.99),
+               jitter.pct(1.0), got_status ? (unsigned)st[j].late : 0,
+               got_status ? (unsigned)st[j].skipped : 0);
+        if (bad_counter || bad_checksum ||
+            (plan[j].count != 0 ? frames != want : frames + 2 < want || frames > want + 2))
+        {
+            printf("FAIL: cyclic job %u: %u frames (want %u), %u bad counters, %u bad checksums\n",
+                   (unsigned)j, (unsigned)frames, (unsigned)want, (unsigned)bad_counter,
+                   (unsigned)bad_checksum);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// Cyclic jobs asking for more than the bus carries keep the TWAI queue
+// full of frames that take no echo slot. Afterwards, and with one more job
+// still running, gs_usb frames must all come back as echoes.
+bool run_cyclic_flood()
+{
+    if (!opt.cyclic)
+    {
+        return true;
+    }
+
+    const uint32_t jobs = 5;
+    for (uint32_t j = 0; j < jobs; j++)
+    {
+        struct gsusb_cyclic_job job = {};
+        job.can_id = SIM_CYCLIC_ID + 0x10 + j;
+        job.period_us = j + 1 < jobs ? 100 : 1000;
+        job.count = j + 1 < jobs ? 500 : 0;
+        job.can_dlc = 8;
+        job.counter_pos = GSUSB_CYCLIC_NONE;
+        job.checksum_pos = GSUSB_CYCLIC_NONE;
+        // Never taken for a TX phase sequence number.
+        memset(job.data, 0xFF, sizeof(job.data));
+        if (!sim::usb_control_out(GSUSB_BREQ_CYCLIC, (uint16_t)j, &job, sizeof(job)))
+        {
+            printf("FAIL: cyclic job %u refused\n", (unsigned)j);
+            return false;
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    bool ok = run_echo_check("a cyclic flood");
+    if (!sim::usb_control_out(GSUSB_BREQ_CYCLIC, GSUSB_CYCLIC_ALL, nullptr, 0))
+    {
+        printf("FAIL: cyclic jobs could not be stopped\n");
+        ok = false;
+    }
+    return ok;
+}
+
+// A job running while the interface listens only: TWAI refuses every
+// frame, so the device must report them skipped, none sent.
+bool run_cyclic_refused()
+{
+    if (!opt.cyclic)
+    {
+        return true;
+    }
+
+    const uint32_t frames = 10;
+    struct gs_device_mode reset = {GS_CAN_MODE_RESET, 0};
+    struct gs_device_mode listen = host_mode;
+    listen.flags |= GS_CAN_MODE_LISTEN_ONLY;
+    if (!sim::usb_control_out(GS_USB_BREQ_MODE, 0, &reset, sizeof(reset)) ||
+        !sim::usb_control_out(GS_USB_BREQ_MODE, 0, &listen, sizeof(listen)))
+    {
+        printf("FAIL: could not restart listen-only\n");
+        return false;
+    }
+
+    struct gsusb_cyclic_job job = {};
+    job.can_id = SIM_CYCLIC_ID;
+    job.period_us = 2000;
+    job.count = frames;
+    job.can_dlc = 8;
+    job.counter_pos = GSUSB_CYCLIC_NONE;
+    job.checksum_pos = GSUSB_CYCLIC_NONE;
+    memset(job.data, 0xFF, sizeof(job.data));
+    bool ok = sim::usb_control_out(GSUSB_BREQ_CYCLIC, 0, &job, sizeof(job));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    struct gsusb_cyclic_status st = {};
+    ok = sim::usb_control_in(GSUSB_BREQ_CYCLIC_STATUS, 0, &st, sizeof(st)) && ok;
+    printf("CYCLIC listen-only: sent=%u skipped=%u of %u\n", (unsigned)st.sent,
+           (unsigned)st.skipped, (unsigned)frames);
+    if (!ok || st.sent != 0 || st.skipped != frames)
+    {
+        printf("FAIL: cyclic frames refused by TWAI were not reported skipped\n");
+        ok = false;
+    }
+
+    if (!sim::usb_control_out(GS_USB_BREQ_MODE, 0, &reset, sizeof(reset)) ||
+        !sim::usb_control_out(GS_USB_BREQ_MODE, 0, &host_mode, sizeof(host_mode)))
+    {
+        printf("FAIL: could not restart after listen-only\n");
+        ok = false;
+    }
+    return ok;
+}
+
+// Sends --timed frames for device times with irregular gaps, like a log
+// being replayed, the first one already past. Each must start on the bus
+// at its time, never before, and the device must count the first as late.
+bool run_timed()
+{
+    if (opt.timed == 0)
+    {
+        return true;
+    }
+
+    struct gsusb_stats before;
+    uint32_t dev_now = 0;
+    if (!sim::usb_control_in(GSUSB_BREQ_STATS, 0, &before, sizeof(before)) ||
+        !sim::usb_control_in(GS_USB_BREQ_TIMESTAMP, 0, &dev_now, sizeof(dev_now)))
+    {
+        printf("FAIL: STATS/TIMESTAMP requests failed\n");
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        timed_bus.clear();
+        timed_active = true;
+        tx_slot_busy.assign(opt.tx_inflight, false);
+        tx_slot_seq.assign(opt.tx_inflight, 0);
+        tx_outstanding = 0;
+    }
+
+    std::vector<uint32_t> due(opt.timed);
+    uint32_t t = dev_now + SIM_TIMED_LEAD_US;
+    for (uint32_t i = 0; i < opt.timed; i++)
+    {
+        due[i] = i == 0 ? dev_now - 1000 : t;
+        t += 200 + (i * 7919) % 1800;
+
+        uint32_t slot = take_tx_slot(i);
+        struct gs_host_frame hf = {};
+        hf.echo_id = slot;
+        hf.can_id = SIM_TIMED_ID;
+        hf.can_dlc = 8;
+        hf.flags = GSUSB_FRAME_FLAG_TX_TIMED;
+        put_le32(hf.data, i);
+        hf.timestamp_us = due[i];
+        if (!sim::usb_bulk_out(&hf, out_frame_size, 1000, nullptr))
+        {
+            printf("FAIL: bulk OUT stalled for 1 s at timed frame %u\n", (unsigned)i);
+            return false;
+        }
+    }
+    wait_quiet([] {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        return (uint64_t)timed_bus.size();
+    }, 100);
+
+    struct gsusb_stats after;
+    bool got_stats = sim::usb_control_in(GSUSB_BREQ_STATS, 0, &after, sizeof(after));
+
+    std::lock_guard<std::mutex> lk(host_mtx);
+    timed_active = false;
+    uint64_t bitrate = sim::can_bitrate();
+    uint32_t frames = 0;
+    uint32_t out_of_order = 0;
+    uint32_t early = 0;
+    Latency offset;
+    for (const auto &f : timed_bus)
+    {
+        uint32_t seq = get_le32(f.first.data);
+        if (f.first.identifier != SIM_TIMED_ID || seq != frames)
+        {
+            out_of_order++;
+            continue;
+        }
+        uint64_t start_us = f.second - sim::can_frame_bits(f.first) * 1000000ULL / (bitrate ? bitrate : 1);
+        int32_t d = (int32_t)((uint32_t)start_us - due[seq]);
+        if (seq > 0)
+        {
+            // The bus model rounds to microseconds.
+            early += d < -2 ? 1 : 0;
+            offset.samples.push_back((uint32_t)(d < 0 ? 0 : d));
+        }
+        frames++;
+    }
+
+    uint32_t queued = after.counters[GSUSB_STAT_TX_TIMED] - before.counters[GSUSB_STAT_TX_TIMED];
+    uint32_t late = after.counters[GSUSB_STAT_TX_TIMED_LATE] - before.counters[GSUSB_STAT_TX_TIMED_LATE];
+    printf("TIMED: sent=%u on_bus=%u (device held %u, late %u) start behind time p50=%uus p99=%uus "
+           "max=%uus early=%u out_of_order=%u\n",
+           (unsigned)opt.timed, (unsigned)frames, (unsigned)queued, (unsigned)late, offset.pct(0.50),
+           offset.pct(0.99), offset.pct(1.0), (unsigned)early, (unsigned)out_of_order);
+
+    bool ok = true;
+    if (frames != opt.timed || out_of_order || early || !got_stats || queued != opt.timed || late == 0)
+    {
+        printf("FAIL: timed frames lost, reordered or sent early, or the device miscounted them\n");
+        ok = false;
+    }
+    if (offset.pct(0.50) > 1000)
+    {
+        printf("FAIL: timed frames start %uus after their time (p50)\n", offset.pct(0.50));
+        ok = false;
+    }
+    return ok;
+}
+
+// --net: the peer's socket, what it has received and the device address.
+int net_sock = -1;
+struct sockaddr_in net_device = {};
+std::thread net_thread;
+std::atomic<bool> net_stop{false};
+uint64_t net_packets = 0;
+uint64_t net_lost = 0;
+uint64_t net_bad = 0;
+
+// The cannelloni peer's receive side: datagrams from the bridge feed the
+// same RX bookkeeping as bulk IN.
+void net_peer_rx()
+{
+    std::vector<uint8_t> buf(2048);
+    int last_seq = -1;
+    while (!net_stop.load())
+    {
+        ssize_t n = recv(net_sock, buf.data(), buf.size(), 0);
+        if (n < 0)
+        {
+            continue;
+        }
+        uint64_t now = sim::now_us();
+
+        std::lock_guard<std::mutex> lk(host_mtx);
+        struct gsusb_cnl_reader r;
+        uint8_t seq;
+        if (!gsusb_cnl_begin(&r, buf.data(), (uint32_t)n, &seq))
+        {
+            net_bad++;
+            continue;
+        }
+        net_packets++;
+        if (last_seq >= 0)
+        {
+            net_lost += (uint8_t)(seq - (uint8_t)(last_seq + 1));
+        }
+        last_seq = seq;
+
+        twai_message_t msg;
+        enum gsusb_cnl_result res;
+        while ((res = gsusb_cnl_next(&r, &msg)) == GSUSB_CNL_FRAME)
+        {
+            rx_arrived(msg.data, msg.data_length_code, now);
+        }
+        net_bad += res == GSUSB_CNL_END ? 0 : 1;
+    }
+}
+
+// Boots the firmware without USB and points the bridge at a peer socket
+// on localhost; the bridge starts the bus itself.
+bool bring_up_net()
+{
+    sim::can_set_tx_sink(on_can_tx);
+
+    if (gsusb_init() != ESP_OK)
+    {
+        fprintf(stderr, "gsusb_init failed\n");
+        return false;
+    }
+
+    net_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    local.sin_port = htons((uint16_t)(opt.net_port + 1));
+    struct timeval tv = {0, 50000};
+    if (net_sock < 0 || bind(net_sock, (struct sockaddr *)&local, sizeof(local)) != 0 ||
+        setsockopt(net_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0)
+    {
+        fprintf(stderr, "cannot bind the peer to UDP port %u\n", (unsigned)(opt.net_port + 1));
+        return false;
+    }
+    net_device = local;
+    net_device.sin_port = htons((uint16_t)opt.net_port);
+
+    struct gsusb_net_config cfg;
+    gsusb_net_default_config(&cfg);
+    cfg.peer_addr = htonl(INADDR_LOOPBACK);
+    cfg.peer_port = (uint16_t)(opt.net_port + 1);
+    cfg.local_port = (uint16_t)opt.net_port;
+    cfg.bitrate = opt.bitrate;
+    if (gsusb_net_start(&cfg) != ESP_OK || sim::can_bitrate() == 0)
+    {
+        fprintf(stderr, "the network bridge did not come up on UDP port %u\n", (unsigned)opt.net_port);
+        return false;
+    }
+    net_thread = std::thread(net_peer_rx);
+    return true;
+}
+
+// The peer forwards a bus running at full load: datagrams of as many
+// frames as fit, paced at the bitrate. One sequence number is skipped on
+// purpose; the bridge must count exactly that one as lost.
+bool run_net_tx_phase()
+{
+    if (opt.tx_frames == 0)
+    {
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        tx_accept_us.assign(opt.tx_frames, 0);
+        tx_bus_us.assign(opt.tx_frames, 0);
+        tx_first_us = 0;
+    }
+    struct gsusb_stats before;
+    gsusb_stats_snapshot(&before, false);
+
+    const uint32_t per_packet = (GSUSB_NET_MAX_PACKET - GSUSB_CNL_HEADER_SIZE) / GSUSB_CNL_FRAME_MAX;
+    double fps = (double)sim::can_bitrate() / sim::can_frame_bits(make_frame(0));
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uint8_t> buf(GSUSB_NET_MAX_PACKET);
+    uint8_t seq = 0;
+    uint32_t packets = 0;
+    for (uint32_t i = 0; i < opt.tx_frames; packets++)
+    {
+        std::this_thread::sleep_until(start + std::chrono::nanoseconds((uint64_t)(1e9 * i / fps)));
+        uint32_t len = GSUSB_CNL_HEADER_SIZE;
+        uint32_t count = 0;
+        uint64_t now = sim::now_us();
+        for (; count < per_packet && i < opt.tx_frames; count++, i++)
+        {
+            twai_message_t msg = make_frame(i);
+            len += gsusb_cnl_put_frame(buf.data() + len, &msg);
+            std::lock_guard<std::mutex> lk(host_mtx);
+            tx_accept_us[i] = now;
+            tx_first_us = tx_first_us ? tx_first_us : now;
+        }
+        seq += packets == 5 ? 1 : 0;
+        gsusb_cnl_put_header(buf.data(), seq++, (uint16_t)count);
+        if (sendto(net_sock, buf.data(), len, 0, (struct sockaddr *)&net_device, sizeof(net_device)) != (ssize_t)len)
+        {
+            printf("FAIL: peer could not send datagram %u\n", (unsigned)packets);
+            return false;
+        }
+    }
+
+    wait_quiet([] { return tx_on_bus.load(); }, 200);
+    struct gsusb_stats after;
+    gsusb_stats_snapshot(&after, false);
+    auto delta = [&](int c) { return after.counters[c] - before.counters[c]; };
+
+    std::lock_guard<std::mutex> lk(host_mtx);
+    uint64_t on_bus = tx_on_bus.load();
+    uint64_t dropped = opt.tx_frames - on_bus;
+    double elapsed = tx_last_us > tx_first_us ? (double)(tx_last_us - tx_first_us) / 1e6 : 0;
+    double rate = elapsed > 0 ? on_bus / elapsed : 0;
+    printf("TX  NET->CAN: sent=%u in %u datagrams on_bus=%llu dropped=%llu rate=%.0f fps "
+           "(bus %.0f fps) latency p50=%uus p99=%uus max=%uus backpressure=%u lost_datagrams=%u\n",
+           (unsigned)opt.tx_frames, (unsigned)packets, (unsigned long long)on_bus,
+           (unsigned long long)dropped, rate, fps, tx_lat.pct(0.50), tx_lat.pct(0.99),
+           tx_lat.pct(1.0), (unsigned)delta(GSUSB_STAT_TX_NET_BACKPRESSURE),
+           (unsigned)delta(GSUSB_STAT_NET_IN_LOST));
+
+    bool ok = true;
+    if (delta(GSUSB_STAT_NET_IN_LOST) != 1 || delta(GSUSB_STAT_NET_IN_BAD) != 0)
+    {
+        printf("FAIL: the bridge counted %u lost and %u bad datagrams, expected 1 and 0\n",
+               (unsigned)delta(GSUSB_STAT_NET_IN_LOST), (unsigned)delta(GSUSB_STAT_NET_IN_BAD));
+        ok = false;
+    }
+    if (opt.min_tx_fps > 0 && rate < opt.min_tx_fps)
+    {
+        printf("FAIL: TX rate %.0f fps below %.0f fps\n", rate, opt.min_tx_fps);
+        ok = false;
+    }
+    if (opt.max_tx_drops >= 0 && dropped > (uint64_t)opt.max_tx_drops)
+    {
+        printf("FAIL: TX dropped %llu frames, limit %ld\n", (unsigned long long)dropped, opt.max_tx_drops);
+        ok = false;
+    }
+    return ok;
+}
+
+// Stops the peer and reports its side of the RX phase.
+bool finish_net()
+{
+    net_stop.store(true);
+    if (net_thread.joinable())
+    {
+        net_thread.join();
+    }
+    struct gsusb_stats stats;
+    gsusb_stats_snapshot(&stats, false);
+    std::lock_guard<std::mutex> lk(host_mtx);
+    printf("NET: datagrams=%llu lost=%llu bad=%llu frames/datagram=%.1f send_errors=%u ring_drops=%u\n",
+           (unsigned long long)net_packets, (unsigned long long)net_lost, (unsigned long long)net_bad,
+           net_packets ? (double)stats.counters[GSUSB_STAT_RX_TO_NET] / net_packets : 0.0,
+           (unsigned)stats.counters[GSUSB_STAT_NET_SEND_ERRORS],
+           (unsigned)stats.counters[GSUSB_STAT_RX_DROP_NET]);
+    if (net_lost > 0 || net_bad > 0)
+    {
+        printf("FAIL: the peer saw lost or malformed datagrams\n");
+        return false;
+    }
+    return true;
+}
+
+// --slcan: the port as a tool reads it. Frame lines feed the RX
+// bookkeeping; every other line or BELL answers the last command.
+std::string slcan_partial;
+std::string slcan_answer;
+uint64_t slcan_answers = 0;
+uint64_t slcan_acks = 0;      // z/Z
+uint64_t slcan_bad = 0;       // frame lines the codec rejects
+uint64_t slcan_stamped = 0;   // frames with a Z1 timestamp
+uint64_t slcan_bad_stamp = 0; // ... more than 2 ms off the injection time
+
+void slcan_frame_line(const std::string &line, uint64_t done_us)
+{
+    uint32_t len = (uint32_t)line.size();
+    uint32_t ts = 0;
+    twai_message_t msg;
+    bool ok = gsusb_slcan_parse_frame(line.data(), len, &msg);
+    if (!ok && opt.hw_timestamp && len > 4)
+    {
+        ok = gsusb_slcan_parse_frame(line.data(), len - 4, &msg) &&
+             gsusb_slcan_get_hex(line.data() + len - 4, 4, &ts);
+        slcan_stamped += ok ? 1 : 0;
+    }
+    if (!ok)
+    {
+        slcan_bad++;
+        return;
+    }
+    if (rx_arrived(msg.data, msg.data_length_code, done_us) && opt.hw_timestamp)
+    {
+        uint32_t sent = (uint32_t)((rx_inject_us[get_le32(msg.data)] / 1000) % GSUSB_SLCAN_TS_WRAP);
+        uint32_t lag = (ts + GSUSB_SLCAN_TS_WRAP - sent) % GSUSB_SLCAN_TS_WRAP;
+        slcan_bad_stamp += lag > 2 ? 1 : 0;
+    }
+}
+
+void on_cdc_in(const uint8_t *data, size_t len, uint64_t done_us)
+{
+    std::lock_guard<std::mutex> lk(host_mtx);
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = (char)data[i];
+        if (c == GSUSB_SLCAN_BELL)
+        {
+            slcan_answer = "\a";
+            slcan_answers++;
+        }
+        else if (c != '\r')
+        {
+            slcan_partial += c;
+        }
+        else if (!slcan_partial.empty() && strchr("tTrR", slcan_partial[0]) != nullptr)
+        {
+            slcan_frame_line(slcan_partial, done_us);
+            slcan_partial.clear();
+        }
+        else if (slcan_partial == "z" || slcan_partial == "Z")
+        {
+            slcan_acks++;
+            slcan_partial.clear();
+        }
+        else
+        {
+            slcan_answer = slcan_partial + "\r";
+            slcan_answers++;
+            slcan_partial.clear();
+        }
+    }
+    host_cv.notify_all();
+}
+
+// Sends one command line and returns the answer, "\r" for OK and "\a" for
+// BELL.
+std::string slcan_cmd(const char *cmd)
+{
+    uint64_t before;
+    {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        before = slcan_answers;
+    }
+    if (!sim::cdc_write(cmd, strlen(cmd), 1000, nullptr))
+    {
+        return "stalled";
+    }
+    std::unique_lock<std::mutex> lk(host_mtx);
+    if (!host_cv.wait_for(lk, std::chrono::seconds(1), [&] { return slcan_answers != before; }))
+    {
+        return "timeout";
+    }
+    return slcan_answer;
+}
+
+char slcan_rate_code(uint32_t bitrate)
+{
+    for (char c = '0'; c <= '9'; c++)
+    {
+        if (gsusb_slcan_bitrate(c) == bitrate)
+        {
+            return c;
+        }
+    }
+    return 0;
+}
+
+// Opens the port and the channel the way slcand does; the firmware starts
+// the bus itself.
+bool bring_up_slcan()
+{
+    sim::can_set_tx_sink(on_can_tx);
+    sim::cdc_set_in_sink(on_cdc_in);
+
+    if (gsusb_init() != ESP_OK)
+    {
+        fprintf(stderr, "gsusb_init failed\n");
+        return false;
+    }
+    sim::usb_connect(opt.usb);
+
+    char rate[] = {'S', slcan_rate_code(opt.bitrate), '\r', '\0'};
+    std::string version;
+    if (!sim::cdc_set_line_state(true, true) || !sim::cdc_write("\r\r\r", 3, 1000, nullptr) ||
+        (version = slcan_cmd("V\r"))[0] != 'V' || slcan_cmd(rate) != "\r" ||
+        slcan_cmd(opt.hw_timestamp ? "Z1\r" : "Z0\r") != "\r" || slcan_cmd("O\r") != "\r")
+    {
+        fprintf(stderr, "SLCAN setup commands failed\n");
+        return false;
+    }
+    if (sim::can_bitrate() == 0)
+    {
+        fprintf(stderr, "O did not start the bus\n");
+        return false;
+    }
+    return true;
+}
+
+// The tool sends as fast as the port takes lines, a few frames per write
+// like a buffered serial port; the device NAKs while TWAI is full.
+bool run_slcan_tx_phase()
+{
+    if (opt.tx_frames == 0)
+    {
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        tx_accept_us.assign(opt.tx_frames, 0);
+        tx_bus_us.assign(opt.tx_frames, 0);
+        tx_first_us = 0;
+        slcan_acks = 0;
+    }
+    struct gsusb_stats before;
+    gsusb_stats_snapshot(&before, false);
+
+    const uint32_t per_write = 8;
+    char buf[per_write * GSUSB_SLCAN_LINE_MAX];
+    for (uint32_t i = 0; i < opt.tx_frames;)
+    {
+        uint32_t len = 0;
+        uint64_t now = sim::now_us();
+        for (uint32_t n = 0; n < per_write && i < opt.tx_frames; n++, i++)
+        {
+            twai_message_t msg = make_frame(i);
+            len += gsusb_slcan_put_frame(buf + len, &msg, -1);
+            std::lock_guard<std::mutex> lk(host_mtx);
+            tx_accept_us[i] = now;
+            tx_first_us = tx_first_us ? tx_first_us : now;
+        }
+        if (!sim::cdc_write(buf, len, 1000, nullptr))
+        {
+            printf("FAIL: the port stalled for 1 s at frame %u\n", (unsigned)i);
+            return false;
+        }
+    }
+
+    wait_quiet([] { return tx_on_bus.load(); }, 200);
+    struct gsusb_stats after;
+    gsusb_stats_snapshot(&after, false);
+    auto delta = [&](int c) { return after.counters[c] - before.counters[c]; };
+    double fps = (double)sim::can_bitrate() / sim::can_frame_bits(make_frame(0));
+
+    std::lock_guard<std::mutex> lk(host_mtx);
+    uint64_t on_bus = tx_on_bus.load();
+    uint64_t dropped = opt.tx_frames - on_bus;
+    double elapsed = tx_last_us > tx_first_us ? (double)(tx_last_us - tx_first_us) / 1e6 : 0;
+    double rate = elapsed > 0 ? on_bus / elapsed : 0;
+    printf("TX  SLCAN->CAN: sent=%u on_bus=%llu dropped=%llu acks=%llu rate=%.0f fps (bus %.0f fps) "
+           "latency p50=%uus p99=%uus max=%uus backpressure=%u\n",
+           (unsigned)opt.tx_frames, (unsigned long long)on_bus, (unsigned long long)dropped,
+           (unsigned long long)slcan_acks, rate, fps, tx_lat.pct(0.50), tx_lat.pct(0.99),
+           tx_lat.pct(1.0), (unsigned)delta(GSUSB_STAT_TX_BACKPRESSURE));
+
+    bool ok = true;
+    if (slcan_acks != on_bus || delta(GSUSB_STAT_SLCAN_BAD_LINES) != 0)
+    {
+        printf("FAIL: %llu z/Z acks and %u bad lines for %llu frames on the bus\n",
+               (unsigned long long)slcan_acks, (unsigned)delta(GSUSB_STAT_SLCAN_BAD_LINES),
+               (unsigned long long)on_bus);
+        ok = false;
+    }
+    if (opt.min_tx_fps > 0 && rate < opt.min_tx_fps)
+    {
+        printf("FAIL: TX rate %.0f fps below %.0f fps\n", rate, opt.min_tx_fps);
+        ok = false;
+    }
+    if (opt.max_tx_drops >= 0 && dropped > (uint64_t)opt.max_tx_drops)
+    {
+        printf("FAIL: TX dropped %llu frames, limit %ld\n", (unsigned long long)dropped, opt.max_tx_drops);
+        ok = false;
+    }
+    return ok;
+}
+
+// Command handling around the phases, then the channel is closed.
+bool finish_slcan()
+{
+    struct Check
+    {
+        const char *cmd;
+        const char *expect;
+    };
+    static const Check checks[] = {
+        {"O\r", "\a"},        // already open
+        {"S4\r", "\a"},       // no bitrate change while open
+        {"t12G1AA\r", "\a"},  // not hex
+        {"t1232AA\r", "\a"},  // shorter than its length
+        {"F\r", "F00\r"},
+        {"C\r", "\r"},
+        {"t1231AA\r", "\a"},  // closed
+        {"C\r", "\a"},
+    };
+
+    bool ok = true;
+    for (const Check &c : checks)
+    {
+        std::string got = slcan_cmd(c.cmd);
+        if (got != c.expect)
+        {
+            std::string shown = c.cmd;
+            shown.pop_back();
+            printf("FAIL: SLCAN \"%s\" answered %s\n", shown.c_str(),
+                   got == "\a" ? "BELL" : got == "\r" ? "OK" : got.c_str());
+            ok = false;
+        }
+    }
+    if (gsusb_can_is_active())
+    {
+        printf("FAIL: C left the bus running\n");
+        ok = false;
+    }
+
+    std::lock_guard<std::mutex> lk(host_mtx);
+    printf("SLCAN: frame lines rejected by the host=%llu", (unsigned long long)slcan_bad);
+    if (opt.hw_timestamp)
+    {
+        printf(" stamped=%llu stamps off by >2ms=%llu", (unsigned long long)slcan_stamped,
+               (unsigned long long)slcan_bad_stamp);
+    }
+    printf("\n");
+    if (slcan_bad > 0 || slcan_bad_stamp > 0 || (opt.hw_timestamp && slcan_stamped != rx_delivered))
+    {
+        printf("FAIL: the port carried malformed or mis-stamped frame lines\n");
+        ok = false;
+    }
+    return ok;
+}
+
+// Streams a candump/ASC capture through the firmware: received frames are
+// put on the bus, transmitted ones (or all with --replay-tx) go through bulk
+// OUT. Max rate packs RX frames back to back on the bus; --replay-timing
+// keeps the gaps of the capture.
+bool run_replay()
+{
+    sim::LogReader log;
+    if (!log.open(opt.replay.c_str()))
+    {
+        printf("FAIL: cannot open %s\n", opt.replay.c_str());
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        replay_active = true;
+        tx_slot_busy.assign(opt.tx_inflight, false);
+        tx_slot_seq.assign(opt.tx_inflight, 0);
+        tx_outstanding = 0;
+    }
+
+    sim::CanCounters before = sim::can_counters();
+    uint64_t bitrate = sim::can_bitrate();
+    auto start = std::chrono::steady_clock::now();
+    auto bus_free = start;
+    uint64_t start_us = sim::now_us();
+    uint64_t rx_offered = 0;
+    uint64_t rx_not_running = 0;
+    uint64_t tx_sent = 0;
+    uint64_t late = 0;
+    uint64_t max_lag_us = 0;
+    uint64_t log_us = 0;
+    size_t max_rx_pending = 0;
+    uint32_t max_tx_window = 0;
+    uint32_t max_drv_rx = 0;
+    uint32_t max_drv_tx = 0;
+
+    sim::LogFrame f;
+    for (uint64_t n = 0; log.next(f); n++)
+    {
+        log_us = f.ts_us;
+        auto now = std::chrono::steady_clock::now();
+        if (opt.replay_timing)
+        {
+            auto due = start + std::chrono::microseconds(f.ts_us);
+            if (now > due + std::chrono::milliseconds(1))
+            {
+                late++;
+                max_lag_us = std::max<uint64_t>(
+                    max_lag_us, std::chrono::duration_cast<std::chrono::microseconds>(now - due).count());
+            }
+            else
+            {
+                std::this_thread::sleep_until(due);
+            }
+        }
+
+        if (!f.tx && !opt.replay_tx)
+        {
+            if (!opt.replay_timing)
+            {
+                std::this_thread::sleep_until(bus_free);
+                bus_free = std::max(bus_free, now) +
+                           std::chrono::nanoseconds(sim::can_frame_bits(f.msg) * 1000000000ULL /
+                                                    (bitrate ? bitrate : 1));
+            }
+            {
+                std::lock_guard<std::mutex> lk(host_mtx);
+                replay_rx_expect.push_back(f.msg);
+                max_rx_pending = std::max(max_rx_pending, replay_rx_expect.size());
+            }
+            rx_offered++;
+            if (!sim::can_inject(f.msg))
+            {
+                // Controller down (reconfiguration): nothing to expect.
+                std::lock_guard<std::mutex> lk(host_mtx);
+                replay_rx_expect.pop_back();
+                rx_not_running++;
+            }
+        }
+        else
+        {
+            uint32_t slot = take_tx_slot((uint32_t)n);
+            struct gs_host_frame hf;
+            gsusb_frame_from_twai(&f.msg, 0, &hf);
+            hf.echo_id = slot;
+            {
+                std::lock_guard<std::mutex> lk(host_mtx);
+                replay_tx_expect.push_back(f.msg);
+                max_tx_window = std::max(max_tx_window, tx_outstanding);
+            }
+            uint64_t accepted = 0;
+            if (!sim::usb_bulk_out(&hf, out_frame_size, 1000, &accepted))
+            {
+                printf("FAIL: bulk OUT stalled for 1 s at log line %llu\n",
+                       (unsigned long long)log.lines());
+                return false;
+            }
+            tx_sent++;
+        }
+
+        if (n % 256 == 0)
+        {
+            twai_status_info_t st;
+            if (gsusb_can_get_status(&st) == ESP_OK)
+            {
+                max_drv_rx = std::max(max_drv_rx, st.msgs_to_rx);
+                max_drv_tx = std::max(max_drv_tx, st.msgs_to_tx);
+            }
+        }
+    }
+    uint64_t feed_us = sim::now_us() - start_us;
+
+    wait_quiet([] {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        return replay_rx_delivered + tx_on_bus.load();
+    }, 200);
+    sim::CanCounters after = sim::can_counters();
+    struct gsusb_ring_stats ring;
+    gsusb_usb_get_rx_ring_stats(&ring);
+
+    std::lock_guard<std::mutex> lk(host_mtx);
+    replay_active = false;
+    // Whatever is still expected never arrived.
+    uint64_t rx_lost = replay_rx_lost + replay_rx_expect.size();
+    uint64_t tx_lost = replay_tx_lost + replay_tx_expect.size();
+    uint64_t on_bus = tx_on_bus.load();
+    uint64_t end_us = std::max<uint64_t>(rx_last_us, tx_last_us.load());
+    double elapsed = end_us > start_us ? (double)(end_us - start_us) / 1e6 : 0;
+
+    printf("REPLAY: %s format=%s lines=%llu frames=%llu skipped=%llu span=%.3fs mode=%s\n",
+           opt.replay.c_str(), log.format(), (unsigned long long)log.lines(),
+           (unsigned long long)(rx_offered + tx_sent), (unsigned long long)log.skipped(),
+           log_us / 1e6, opt.replay_timing ? "original-timing" : "max-rate");
+    printf("REPLAY RX: offered=%llu delivered=%llu lost=%llu corrupt=%llu controller_down=%llu "
+           "twai_rx_missed=%llu rate=%.0f fps\n",
+           (unsigned long long)rx_offered, (unsigned long long)replay_rx_delivered,
+           (unsigned long long)rx_lost, (unsigned long long)replay_rx_corrupt,
+           (unsigned long long)rx_not_running,
+           (unsigned long long)(after.rx_missed - before.rx_missed),
+           elapsed > 0 ? replay_rx_delivered / elapsed : 0.0);
+    printf("REPLAY TX: sent=%llu on_bus=%llu lost=%llu corrupt=%llu echoes=%llu rate=%.0f fps\n",
+           (unsigned long long)tx_sent, (unsigned long long)on_bus, (unsigned long long)tx_lost,
+           (unsigned long long)replay_tx_corrupt, (unsigned long long)tx_echoes,
+           elapsed > 0 ? on_bus / elapsed : 0.0);
+    printf("REPLAY queues: host_rx_pending<=%zu tx_window<=%u twai_rx<=%u twai_tx<=%u "
+           "rx_ring_high_water=%u rx_ring_overflows=%u\n",
+           max_rx_pending, (unsigned)max_tx_window, (unsigned)max_drv_rx, (unsigned)max_drv_tx,
+           (unsigned)ring.high_water, (unsigned)ring.overflows);
+    printf("REPLAY feed: %.0f frames/s offered over %.3fs",
+           feed_us ? (rx_offered + tx_sent) * 1e6 / feed_us : 0.0, feed_us / 1e6);
+    if (opt.replay_timing)
+    {
+        printf(" late=%llu max_lag=%lluus", (unsigned long long)late, (unsigned long long)max_lag_us);
+    }
+    printf("\n");
+
+    bool ok = true;
+    if (replay_rx_corrupt || replay_tx_corrupt)
+    {
+        printf("FAIL: %llu replayed frames changed on the way through the firmware\n",
+               (unsigned long long)(replay_rx_corrupt + replay_tx_corrupt));
+        ok = false;
+    }
+    if (opt.max_rx_drops >= 0 && rx_lost > (uint64_t)opt.max_rx_drops)
+    {
+        printf("FAIL: RX dropped %llu frames, limit %ld\n", (unsigned long long)rx_lost, opt.max_rx_drops);
+        ok = false;
+    }
+    if (opt.max_tx_drops >= 0 && tx_lost > (uint64_t)opt.max_tx_drops)
+    {
+        printf("FAIL: TX dropped %llu frames, limit %ld\n", (unsigned long long)tx_lost, opt.max_tx_drops);
+        ok = false;
+    }
+    return ok;
+}
+
+// Interface down/up with a new timing; returns the BITTIMING request time.
+bool restart_with(const struct gs_device_bittiming &bt, uint64_t &bt_us)
+{
+    struct gs_device_mode reset = {GS_CAN_MODE_RESET, 0};
+    if (!sim::usb_control_out(GS_USB_BREQ_MODE, 0, &reset, sizeof(reset)))
+    {
+        return false;
+    }
+    uint64_t t0 = sim::now_us();
+    bool ok = sim::usb_control_out(GS_USB_BREQ_BITTIMING, 0, &bt, sizeof(bt));
+    bt_us = sim::now_us() - t0;
+    return ok && sim::usb_control_out(GS_USB_BREQ_MODE, 0, &host_mode, sizeof(host_mode));
+}
+
+// Cycles bitrates like a test rig does, each one twice in a row, and checks
+// that repeats keep the driver installed. Two timings the controller cannot
+// run as sent must still come up at their bitrate.
+bool run_bitrate_cycles()
+{
+    if (opt.bitrate_cycles == 0)
+    {
+        return true;
+    }
+
+    struct
+    {
+        uint32_t bitrate;
+        struct gs_device_bittiming bt;
+    } const illegal[] = {
+        {1000000, {5, 6, 4, 1, 5}},  // odd BRP
+        {500000, {15, 19, 5, 1, 4}}, // tseg1 34
+    };
+    static const uint32_t rates[] = {125000, 250000, 500000, 1000000};
+
+    bool ok = true;
+    uint64_t bt_us = 0;
+    for (const auto &t : illegal)
+    {
+        if (!restart_with(t.bt, bt_us) || sim::can_bitrate() != t.bitrate)
+        {
+            printf("FAIL: timing brp=%u tq=%u should run at %u bit/s, got %u\n",
+                   (unsigned)t.bt.brp, (unsigned)(1 + t.bt.prop_seg + t.bt.phase_seg1 + t.bt.phase_seg2),
+                   (unsigned)t.bitrate, (unsigned)sim::can_bitrate());
+            ok = false;
+        }
+    }
+
+    Latency changed_lat;
+    Latency same_lat;
+    uint64_t installs = sim::can_counters().installs;
+    uint32_t changes = 0;
+    uint32_t wrong = 0;
+    uint32_t prev = 0;
+    for (uint32_t i = 0; i < opt.bitrate_cycles; i++)
+    {
+        uint32_t rate = rates[(i / 2) % 4];
+        struct gs_device_bittiming bt;
+        if (!calc_bittiming(host_btc, rate, bt) || !restart_with(bt, bt_us))
+        {
+            printf("FAIL: bitrate change to %u failed\n", (unsigned)rate);
+            return false;
+        }
+        (rate == prev ? same_lat : changed_lat).samples.push_back((uint32_t)bt_us);
+        changes += rate != prev ? 1 : 0;
+        wrong += sim::can_bitrate() != rate ? 1 : 0;
+        prev = rate;
+    }
+    installs = sim::can_counters().installs - installs;
+
+    printf("BITRATE: cycles=%u reinstalls=%llu (changes %u) wrong_bitrate=%u "
+           "request p50 changed=%uus unchanged=%uus\n",
+           (unsigned)opt.bitrate_cycles, (unsigned long long)installs, (unsigned)changes,
+           (unsigned)wrong, changed_lat.pct(0.5), same_lat.pct(0.5));
+    if (installs > changes || wrong > 0)
+    {
+        printf("FAIL: unchanged bit timing reinstalled the driver or a bitrate was wrong\n");
+        ok = false;
+    }
+    return restart_with(host_bt, bt_us) && ok;
+}
+
+// Another node keeps sending at a bitrate the interface is not set to.
+// Detection is refused while the bus runs; once stopped, it must find the
+// bitrate well within a second, leave it installed and send nothing.
+bool run_autobaud()
+{
+    if (!opt.autobaud)
+    {
+        return true;
+    }
+
+    bool ok = true;
+    if (sim::usb_control_out(GSUSB_BREQ_AUTOBAUD, 0, nullptr, 0))
+    {
+        printf("FAIL: bitrate detection accepted while the bus runs\n");
+        ok = false;
+    }
+
+    struct gs_device_mode reset = {GS_CAN_MODE_RESET, 0};
+    if (!sim::usb_control_out(GS_USB_BREQ_MODE, 0, &reset, sizeof(reset)))
+    {
+        printf("FAIL: MODE RESET failed\n");
+        return false;
+    }
+    const uint32_t bus_rate = opt.bitrate == 250000 ? 125000 : 250000;
+    sim::can_set_bus_bitrate(bus_rate);
+    std::atomic<bool> stop{false};
+    std::thread node([&stop] {
+        twai_message_t msg = {};
+        msg.identifier = 0x123;
+        msg.data_length_code = 8;
+        for (uint32_t i = 0; !stop.load(); i++)
+        {
+            put_le32(msg.data, i);
+            sim::can_inject(msg);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    uint64_t tx_done = sim::can_counters().tx_done;
+    struct gsusb_autobaud res = {};
+    uint64_t t0 = sim::now_us();
+    bool started = sim::usb_control_out(GSUSB_BREQ_AUTOBAUD, 0, nullptr, 0);
+    while (started && sim::now_us() - t0 < 5000000)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        if (!sim::usb_control_in(GSUSB_BREQ_AUTOBAUD_RESULT, 0, &res, sizeof(res)) ||
+            res.state != GSUSB_AUTOBAUD_RUNNING)
+        {
+            break;
+        }
+    }
+    uint64_t wait_us = sim::now_us() - t0;
+    uint32_t installed = sim::can_bitrate();
+    stop = true;
+    node.join();
+    sim::can_set_bus_bitrate(0);
+
+    printf("AUTOBAUD: bus=%u state=%u bitrate=%u sp=%u.%u%% candidates=%u frames=%u errors=%u "
+           "device=%uus host=%lluus\n",
+           (unsigned)bus_rate, (unsigned)res.state, (unsigned)res.bitrate,
+           (unsigned)res.sample_point / 10, (unsigned)res.sample_point % 10,
+           (unsigned)res.candidates, (unsigned)res.frames, (unsigned)res.errors,
+           (unsigned)res.elapsed_us, (unsigned long long)wait_us);
+    if (!started || res.state != GSUSB_AUTOBAUD_LOCKED || res.bitrate != bus_rate ||
+        installed != bus_rate || wait_us > 1000000 || sim::can_counters().tx_done != tx_done)
+    {
+        printf("FAIL: bitrate detection did not lock onto %u bit/s within 1 s, or transmitted\n",
+               (unsigned)bus_rate);
+        ok = false;
+    }
+    uint64_t bt_us = 0;
+    return restart_with(host_bt, bt_us) && ok;
+}
+
+// Restarts the interface every period while traffic flows, the way
+// "ip link set can0 down/up" does: MODE RESET, BITTIMING, MODE START.
+struct Reconfigurer
+{
+    std::atomic<bool> stop{false};
+    uint32_t done = 0;
+    std::thread thread;
+
+    void start()
+    {
+        if (opt.reconfig == 0)
+        {
+            return;
+        }
+        thread = std::thread([this] {
+            struct gs_device_mode reset = {GS_CAN_MODE_RESET, 0};
+            for (uint32_t i = 0; i < opt.reconfig && !stop.load(); i++)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                if (!sim::usb_control_out(GS_USB_BREQ_MODE, 0, &reset, sizeof(reset)) ||
+                    !sim::usb_control_out(GS_USB_BREQ_BITTIMING, 0, &host_bt, sizeof(host_bt)) ||
+                    !sim::usb_control_out(GS_USB_BREQ_MODE, 0, &host_mode, sizeof(host_mode)))
+                {
+                    break;
+                }
+                done++;
+            }
+        });
+    }
+
+    void finish()
+    {
+        if (thread.joinable())
+        {
+            stop.store(true);
+            thread.join();
+            printf("RECONFIG: %u down/up cycles under traffic\n", (unsigned)done);
+        }
+    }
+};
+
+struct ProbeResult
+{
+    uint32_t on_bus;
+    uint32_t echoes;
+    uint32_t tx_errors;
+    uint32_t rx_remote; // the frame injected by another node
+    uint32_t rx_self;   // the probe frame received back
+    uint32_t late;      // on the bus only once another node ACKs
+};
+
+#define PROBE_TX_ID 0x321
+#define PROBE_RX_ID 0x456
+
+// Restarts the interface with extra mode flags, sends one frame and lets
+// another node send one. remote_ack false leaves the DUT alone on the bus.
+bool run_probe(uint32_t flags, bool remote_ack, ProbeResult &r)
+{
+    struct gs_device_mode mode = host_mode;
+    mode.flags |= flags;
+    struct gs_device_mode reset = {GS_CAN_MODE_RESET, 0};
+    if (!sim::usb_control_out(GS_USB_BREQ_MODE, 0, &reset, sizeof(reset)) ||
+        !sim::usb_control_out(GS_USB_BREQ_BITTIMING, 0, &host_bt, sizeof(host_bt)) ||
+        !sim::usb_control_out(GS_USB_BREQ_MODE, 0, &mode, sizeof(mode)))
+    {
+        return false;
+    }
+
+    sim::can_set_remote_ack(remote_ack);
+    {
+        std::lock_guard<std::mutex> lk(host_mtx);
+        probe_in.clear();
+        probe_bus.clear();
+        probe_active = true;
+    }
+
+    struct gs_host_frame hf = {};
+    hf.echo_id = 0;
+    hf.can_id = PROBE_TX_ID;
+    hf.can_dlc = 2;
+    hf.data[0] = 0xA5;
+    hf.data[1] = (uint8_t)flags;
+    twai_message_t remote = {};
+    remote.identifier = PROBE_RX_ID;
+    remote.data_length_code = 1;
+    bool sent = sim::usb_bulk_out(&hf, out_frame_size, 1000, nullptr) && sim::can_inject(remote);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    std::unique_lock<std::mutex> lk(host_mtx);
+    size_t on_bus = probe_bus.size();
+    size_t in = probe_in.size();
+    lk.unlock();
+    sim::can_set_remote_ack(true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    lk.lock();
+    probe_active = false;
+
+    r = {};
+    r.on_bus = (uint32_t)on_bus;
+    r.late = (uint32_t)(probe_bus.size() - on_bus);
+    probe_in.resize(in);
+    for (const struct gs_host_frame &f : probe_in)
+    {
+        if (f.echo_id != GS_HOST_FRAME_ECHO_ID_RX)
+            r.echoes++;
+        else if (f.can_id & CAN_ERR_FLAG)
+            r.tx_errors += (f.can_id & CAN_ERR_TX_TIMEOUT) ? 1 : 0;
+        else if (f.can_id == PROBE_RX_ID)
+            r.rx_remote++;
+        else if (f.can_id == PROBE_TX_ID)
+            r.rx_self++;
+    }
+    return sent;
+}
+
+// Each gs_usb mode flag the device advertises, the way "ip link set can0
+// type can listen-only on" etc. request it.
+bool run_mode_checks()
+{
+    if (!opt.modes)
+    {
+        return true;
+    }
+
+    struct Check
+    {
+        const char *name;
+        uint32_t flags;
+        bool remote_ack;
+        twai_mode_t mode;
+        ProbeResult want;
+    } const checks[] = {
+        // Nothing may leave the controller; the host gets its echo_id back
+        // with a TX error and still receives.
+        {"listen-only", GS_CAN_MODE_LISTEN_ONLY, true, TWAI_MODE_LISTEN_ONLY, {0, 1, 1, 1, 0, 0}},
+        // Alone on the bus: no ACK needed, the frame comes back as RX.
+        {"loopback", GS_CAN_MODE_LOOP_BACK, false, TWAI_MODE_NO_ACK, {1, 1, 0, 1, 1, 0}},
+        // Alone on the bus: one attempt, then a failed echo.
+        {"one-shot", GS_CAN_MODE_ONE_SHOT, false, TWAI_MODE_NORMAL, {0, 1, 1, 1, 0, 0}},
+        {"triple-sample", GS_CAN_MODE_TRIPLE_SAMPLE, true, TWAI_MODE_NORMAL, {1, 1, 0, 1, 0, 0}},
+        // Alone on the bus without one-shot: retransmitted until ACKed.
+        {"normal", 0, false, TWAI_MODE_NORMAL, {0, 0, 0, 1, 0, 1}},
+    };
+
+    bool ok = true;
+    for (const Check &c : checks)
+    {
+        ProbeResult r;
+        bool sent = run_probe(c.flags, c.remote_ack, r);
+        sim::CanConfig cfg = sim::can_config();
+        bool match = sent && cfg.mode == c.mode &&
+                     cfg.triple_sampling == ((c.flags & GS_CAN_MODE_TRIPLE_SAMPLE) != 0) &&
+                     memcmp(&r, &c.want, sizeof(r)) == 0;
+        printf("MODE %-13s on_bus=%u echoes=%u tx_errors=%u rx=%u self_rx=%u late=%u %s\n",
+               c.name, (unsigned)r.on_bus, (unsigned)r.echoes, (unsigned)r.tx_errors,
+               (unsigned)r.rx_remote, (unsigned)r.rx_self, (unsigned)r.late, match ? "ok" : "FAIL");
+        ok = match && ok;
+    }
+
+    // The mode is installed with the driver: only a change reinstalls.
+    ProbeResult r;
+    uint64_t installs = sim::can_counters().installs;
+    uint64_t bt_us = 0;
+    if (!run_probe(GS_CAN_MODE_LISTEN_ONLY, true, r) || !run_probe(GS_CAN_MODE_LISTEN_ONLY, true, r) ||
+        !restart_with(host_bt, bt_us) || sim::can_counters().installs != installs + 2)
+    {
+        printf("FAIL: mode changes reinstalled the driver %llu times, expected 2\n",
+               (unsigned long long)(sim::can_counters().installs - installs));
+        ok = false;
+    }
+    if (!ok)
+    {
+        printf("FAIL: mode flags not honored\n");
+    }
+    return ok;
+}
+
+// Freezes the flight recorder, reads it back the way a host tool would and
+// checks it against the device counters: every frame dequeued from TWAI and
+// every frame queued for TX must be there while the ring has not wrapped.
+bool check_recorder()
+{
+    struct gsusb_rec_info info;
+    if (!sim::usb_control_out(GSUSB_BREQ_REC, GSUSB_REC_FREEZE, nullptr, 0) ||
+        !sim::usb_control_in(GSUSB_BREQ_REC_INFO, 0, &info, sizeof(info)) ||
+        info.version != GSUSB_REC_VERSION || info.record_size != sizeof(struct gsusb_rec_frame))
+    {
+        printf("REC: unavailable\n");
+        return false;
+    }
+    if (info.capacity == 0)
+    {
+        printf("REC: compiled out\n");
+        return true;
+    }
+
+    std::vector<struct gsusb_rec_frame> chunk(GSUSB_REC_READ_RECORDS);
+    uint64_t rx = 0;
+    uint64_t tx = 0;
+    uint64_t bad_seq = 0;
+    uint64_t ts_back = 0;
+    uint32_t last_ts[2] = {0, 0};
+    uint64_t t0 = sim::now_us();
+    for (uint32_t first = 0; first < info.count; first += GSUSB_REC_READ_RECORDS)
+    {
+        uint32_t n = std::min<uint32_t>(GSUSB_REC_READ_RECORDS, info.count - first);
+        if (!sim::usb_control_in(GSUSB_BREQ_REC_READ, (uint16_t)(first / GSUSB_REC_READ_RECORDS),
+                                 chunk.data(), (uint16_t)(GSUSB_REC_READ_RECORDS * sizeof(chunk[0]))))
+        {
+            printf("REC: read failed at record %u\n", (unsigned)first);
+            return false;
+        }
+        for (uint32_t i = 0; i < n; i++)
+        {
+            const struct gsusb_rec_frame &r = chunk[i];
+            if (r.seq != (uint16_t)(info.first_seq + first + i))
+            {
+                bad_seq++;
+                continue;
+            }
+            int dir = (r.flags & GSUSB_REC_TX) ? 1 : 0;
+            (dir ? tx : rx)++;
+            if ((int32_t)(r.timestamp_us - last_ts[dir]) < 0)
+            {
+                ts_back++;
+            }
+            last_ts[dir] = r.timestamp_us;
+        }
+    }
+    uint64_t dump_us = sim::now_us() - t0;
+
+    printf("REC: capacity=%u count=%u rx=%llu tx=%llu missed=%u bad_seq=%llu ts_back=%llu "
+           "dump=%lluus\n",
+           (unsigned)info.capacity, (unsigned)info.count, (unsigned long long)rx,
+           (unsigned long long)tx, (unsigned)info.missed, (unsigned long long)bad_seq,
+           (unsigned long long)ts_back, (unsigned long long)dump_us);
+
+    bool ok = bad_seq == 0 && ts_back == 0;
+    struct gsusb_stats stats;
+    if (info.frozen == GSUSB_REC_FROZEN_HOST && info.count < info.capacity &&
+        sim::usb_control_in(GSUSB_BREQ_STATS, 0, &stats, sizeof(stats)) && stats.cpu_hz != 0 &&
+        (rx != stats.counters[GSUSB_STAT_RX_FRAMES] || tx != stats.counters[GSUSB_STAT_TX_QUEUED]))
+    {
+        printf("FAIL: recorder holds rx=%llu tx=%llu, device saw rx=%u tx=%u\n",
+               (unsigned long long)rx, (unsigned long long)tx,
+               (unsigned)stats.counters[GSUSB_STAT_RX_FRAMES],
+               (unsigned)stats.counters[GSUSB_STAT_TX_QUEUED]);
+        ok = false;
+    }
+    if (bad_seq || ts_back)
+    {
+        printf("FAIL: recorder dump is inconsistent\n");
+    }
+    return sim::usb_control_out(GSUSB_BREQ_REC, GSUSB_REC_CLEAR, nullptr, 0) && ok;
+}
+
+// Reads the traffic table page by page and checks it accounts for every
+// frame the device counted, then clears it.
+bool check_traffic()
+{
+    struct gsusb_traffic_info info;
+    if (!sim::usb_control_in(GSUSB_BREQ_TRAFFIC, 0, &info, sizeof(info)) ||
+        info.version != GSUSB_TRAFFIC_VERSION || info.entry_size != sizeof(struct gsusb_traffic_id))
+    {
+        printf("TRAFFIC: unavailable\n");
+        return false;
+    }
+    if (info.slots == 0)
+    {
+        printf("TRAFFIC: compiled out\n");
+        return true;
+    }
+
+    std::vector<struct gsusb_traffic_id> ids;
+    std::vector<struct gsusb_traffic_id> chunk(GSUSB_TRAFFIC_READ_SLOTS);
+    for (uint32_t first = 0; first < info.slots; first += GSUSB_TRAFFIC_READ_SLOTS)
+    {
+        // The reply only holds the IDs found; the rest of the buffer reads as zero.
+        if (!sim::usb_control_in(GSUSB_BREQ_TRAFFIC_READ, (uint16_t)(first / GSUSB_TRAFFIC_READ_SLOTS),
+                                 chunk.data(), (uint16_t)(GSUSB_TRAFFIC_READ_SLOTS * sizeof(chunk[0]))))
+        {
+            printf("TRAFFIC: read failed at slot %u\n", (unsigned)first);
+            return false;
+        }
+        for (const struct gsusb_traffic_id &e : chunk)
+        {
+            if (e.count == 0)
+            {
+                break;
+            }
+            ids.push_back(e);
+        }
+    }
+
+    uint64_t count[2] = {0, 0};
+    for (const struct gsusb_traffic_id &e : ids)
+    {
+        count[(e.flags & GSUSB_TRAFFIC_TX) ? 1 : 0] += e.count;
+    }
+    std::sort(ids.begin(), ids.end(),
+              [](const gsusb_traffic_id &a, const gsusb_traffic_id &b) { return a.bits > b.bits; });
+
+    printf("TRAFFIC: ids=%u untracked=%u rx=%llu tx=%llu load=%u/%u/%u%% peak=%u%%\n",
+           (unsigned)info.ids, (unsigned)info.untracked, (unsigned long long)count[0],
+           (unsigned long long)count[1], (unsigned)(info.load_permille[0] / 10),
+           (unsigned)(info.load_permille[1] / 10), (unsigned)(info.load_permille[2] / 10),
+           (unsigned)(info.peak_permille / 10));
+    for (size_t i = 0; i < ids.size() && i < 3; i++)
+    {
+        const struct gsusb_traffic_id &e = ids[i];
+        printf("  %s 0x%08x count=%u period=%u/%u/%uus jitter=%uus\n",
+               (e.flags & GSUSB_TRAFFIC_TX) ? "tx" : "rx", (unsigned)e.can_id, (unsigned)e.count,
+               (unsigned)e.period_min_us, (unsigned)e.period_mean_us, (unsigned)e.period_max_us,
+               (unsigned)e.jitter_us);
+    }
+
+    bool ok = ids.size() == info.ids;
+    struct gsusb_stats stats;
+    if (sim::usb_control_in(GSUSB_BREQ_STATS, 0, &stats, sizeof(stats)) && stats.cpu_hz != 0 &&
+        count[0] + count[1] + info.untracked !=
+            (uint64_t)stats.counters[GSUSB_STAT_RX_FRAMES] + stats.counters[GSUSB_STAT_TX_QUEUED])
+    {
+        printf("FAIL: traffic table holds rx=%llu tx=%llu, device saw rx=%u tx=%u\n",
+               (unsigned long long)count[0], (unsigned long long)count[1],
+               (unsigned)stats.counters[GSUSB_STAT_RX_FRAMES],
+               (unsigned)stats.counters[GSUSB_STAT_TX_QUEUED]);
+        ok = false;
+    }
+
+    struct gsusb_traffic_info cleared;
+    if (!sim::usb_control_in(GSUSB_BREQ_TRAFFIC, 1, &info, sizeof(info)) ||
+        !sim::usb_control_in(GSUSB_BREQ_TRAFFIC, 0, &cleared, sizeof(cleared)) || cleared.ids != 0)
+    {
+        printf("FAIL: traffic table not cleared\n");
+        ok = false;
+    }
+    return ok;
+}
+
+void usage(const char *argv0)
+{
+    printf("usage: %s [options]\n"
+           "  --bitrate N        CAN bitrate (default 1000000)\n"
+           "  --rx-frames N      frames injected on the bus (default 20000)\n"
+           "  --rx-load PCT      bus load of the injected stream (default 100)\n"
+           "  --tx-frames N      frames sent by the host (default 5000)\n"
+           "  --tx-inflight N    host echo window (default 10, like gs_usb)\n"
+           "  --tx-urgent N      every Nth host frame uses ID 0x010\n"
+           "  --dlc N            payload length 4..8 (default 8)\n"
+           "  --ext              use 29-bit identifiers\n"
+           "  --rx-ids N         cycle the RX stream over N consecutive IDs (default 1)\n"
+           "  --filter-ids N     accept only the first N of those IDs (GSUSB_BREQ_FILTER)\n"
+           "  --hw-timestamp     request GS_CAN_MODE_HW_TIMESTAMP (24-byte frames)\n"
+           "  --berr             request GS_CAN_MODE_BERR_REPORTING\n"
+           "  --bus-errors N     spread N receive-side bus errors over the RX phase\n"
+           "  --bus-off          force bus-off between the phases, expect auto recovery\n"
+           "  --reconfig N       restart the interface N times during the phases\n"
+           "  --bitrate-cycles N change the bitrate N times after the phases\n"
+           "  --modes            check listen-only, loopback, one-shot and triple-sample\n"
+           "  --cyclic           run cyclic jobs on the device and check their timing\n"
+           "  --timed N          send N frames for a device time and check their timing\n"
+           "  --autobaud         let the device detect a foreign bus bitrate\n"
+           "  --net              no USB: a cannelloni peer on localhost drives both phases\n"
+           "  --net-port N       UDP port of the bridge, the peer uses N+1 (default 21000)\n"
+           "  --slcan            an SLCAN tool on the CDC port drives both phases\n"
+           "                     (--hw-timestamp: Z1 timestamps)\n"
+           "  --replay FILE      replay a candump -l or Vector ASC log instead of the phases\n"
+           "  --replay-timing    keep the log's timing (default: as fast as the bus allows)\n"
+           "  --replay-tx        send every replayed frame from the host, not only Tx ones\n"
+           "  --in-txn-us N      cost of one bulk IN transaction (default 50)\n"
+           "  --out-txn-us N     cost of one bulk OUT transaction (default 50)\n"
+           "  --min-rx-fps X     fail if sustained RX rate is lower\n"
+           "  --min-tx-fps X     fail if sustained TX rate is lower\n"
+           "  --max-rx-drops N   fail if more RX frames are lost\n"
+           "  --max-tx-drops N   fail if more TX frames are lost\n",
+           argv0);
+}
+
+bool parse_args(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string a = argv[i];
+        auto next = [&]() -> const char * {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "missing value for %s\n", a.c_str());
+                exit(2);
+            }
+            return argv[++i];
+        };
+
+        if (a == "--bitrate")
+            opt.bitrate = (uint32_t)strtoul(next(), nullptr, 0);
+        else if (a == "--rx-frames")
+            opt.rx_frames = (uint32_t)strtoul(next(), nullptr, 0);
+        else if (a == "--rx-load")
+            opt.rx_load = (uint32_t)strtoul(next(), nullptr, 0);
+        else if (a == "--tx-frames")
+            opt.tx_frames = (uint32_t)strtoul(next(), nullptr, 0);
+        else if (a == "--tx-inflight")
+            opt.tx_inflight = (uint32_t)strtoul(next(), nullptr, 0);
+        else if (a == "--tx-urgent")
+            opt.tx_urgent = (uint32_t)strtoul(next(), nullptr, 0);
+        else if (a == "--dlc")
+            opt.dlc = (uint32_t)strtoul(next(), nullptr, 0);
+        else if (a == "--ext")
+            opt.ext = true;
+        else if (a == "--rx-ids")
+            opt.rx_ids = (uint32_t)strtoul(next(), nullptr, 0);
+        else if (a == "--filter-ids")
+            opt.filter_ids = (uint32_t)strtoul(next(), nullptr, 0);
+        else if (a == "--hw-timestamp")
+            opt.hw_timestamp = true;
+        else if (a == "--berr")
+            opt.berr = true;
+        else if (a == "--bus-errors")
+            opt.bus_errors = (uint32_t)strtoul(next(), nullptr, 0);
+        else if (a == "--bus-off")
+            opt.bus_off = true;
+        else if (a == "--bitrate-cycles")
+            opt.bitrate_cycles = (uint32_t)strtoul(next(), nullptr, 0);
+        else if (a == "--modes")
+            opt.modes = true;
+        else if (a == "--cyclic")
+            opt.cyclic = true;
+        else if (a == "--timed")
+            opt.timed = (uint32_t)strtoul(next(), nullptr, 0);
+        else if (a == "--autobaud")
+            opt.autobaud = true;
+        else if (a == "--net")
+            opt.net = true;
+        else if (a == "--net-port")
+            opt.net_port = (uint32_t)strtoul(next(), nullptr, 0);
+        else if (a == "--slcan")
+            opt.slcan = true;
+        else if (a == "--replay")
+            opt.replay = next();
+        else if (a == "--replay-timing")
+            opt.replay_timing = true;
+        else if (a == "--replay-tx")
+            opt.replay_tx = true;
+        else if (a == "--reconfig")
+            opt.reconfig = (uint32_t)strtoul(next(), nullptr, 0);
+        else if (a == "--in-txn-us")
+            opt.usb.in_txn_us = (uint32_t)strtoul(next(), nullptr, 0);
+        else if (a == "--out-txn-us")
+            opt.usb.out_txn_us = (uint32_t)strtoul(next(), nullptr, 0);
+        else if (a == "--min-rx-fps")
+            opt.min_rx_fps = strtod(next(), nullptr);
+        else if (a == "--min-tx-fps")
+            opt.min_tx_fps = strtod(next(), nullptr);
+        else if (a == "--max-rx-drops")
+            opt.max_rx_drops = strtol(next(), nullptr, 0);
+        else if (a == "--max-tx-drops")
+            opt.max_tx_drops = strtol(next(), nullptr, 0);
+        else
+        {
+            usage(argv[0]);
+            return false;
+        }
+    }
+    if (opt.dlc < 4 || opt.dlc > 8 || opt.rx_load == 0 || opt.tx_inflight == 0 ||
+        opt.rx_ids == 0 || opt.filter_ids > opt.rx_ids)
+    {
+        usage(argv[0]);
+        return false;
+    }
+    // Everything else is configured over USB.
+    if (opt.net && (!opt.replay.empty() || opt.modes || opt.bitrate_cycles || opt.reconfig || opt.timed ||
+                    opt.autobaud || opt.hw_timestamp || opt.berr || opt.filter_ids || opt.bus_off ||
+                    opt.net_port == 0 || opt.net_port > 65534))
+    {
+        usage(argv[0]);
+        return false;
+    }
+    // Only the standard S0..S8 rates.
+    if (opt.slcan && (opt.net || !opt.replay.empty() || opt.modes || opt.bitrate_cycles || opt.timed ||
+                      opt.autobaud || opt.reconfig || opt.berr || opt.filter_ids || opt.bus_off ||
+                      slcan_rate_code(opt.bitrate) == 0))
+    {
+        usage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    if (!parse_args(argc, argv))
+    {
+        return 2;
+    }
+
+    int rc = 0;
+    if (opt.net ? !bring_up_net() : opt.slcan ? !bring_up_slcan() : !bring_up())
+    {
+        rc = 1;
+    }
+    else
+    {
+        printf("gsusb host sim: bitrate=%u dlc=%u %s-id frame_bits=%u usb_in_txn=%uus usb_out_txn=%uus\n",
+               (unsigned)sim::can_bitrate(), (unsigned)opt.dlc, opt.ext ? "29bit" : "11bit",
+               (unsigned)sim::can_frame_bits(make_frame(0)),
+               (unsigned)opt.usb.in_txn_us, (unsigned)opt.usb.out_txn_us);
+
+        Reconfigurer reconfig;
+        reconfig.start();
+        bool ok;
+        if (!opt.replay.empty())
+        {
+            ok = run_replay();
+        }
+        else if (opt.net)
+        {
+            ok = run_rx_phase();
+            ok = run_net_tx_phase() && ok;
+            ok = finish_net() && ok;
+            // Plug the cable in to read the device like a host tool would.
+            sim::usb_set_in_sink(on_usb_in);
+            sim::usb_connect(opt.usb);
+            if (!usb_host_up())
+            {
+                printf("FAIL: gs_usb could not take the bus after the bridge\n");
+                ok = false;
+            }
+            else
+            {
+                ok = run_echo_check("the bridge") && ok;
+            }
+        }
+        else if (opt.slcan)
+        {
+            ok = run_rx_phase();
+            ok = run_slcan_tx_phase() && ok;
+            ok = finish_slcan() && ok;
+            // The gs_usb interface is there too; read the device through it.
+            sim::usb_set_in_sink(on_usb_in);
+            if (!usb_host_up())
+            {
+                printf("FAIL: gs_usb could not take the bus after SLCAN\n");
+                ok = false;
+            }
+            else
+            {
+                ok = run_echo_check("SLCAN") && ok;
+            }
+        }
+        else
+        {
+            ok = run_rx_phase();
+            ok = run_bus_off() && ok;
+            ok = run_tx_phase() && ok;
+            ok = run_cyclic() && ok;
+            ok = run_cyclic_flood() && ok;
+            ok = run_cyclic_refused() && ok;
+            ok = run_timed() && ok;
+        }
+        reconfig.finish();
+        ok = run_mode_checks() && ok;
+        ok = run_bitrate_cycles() && ok;
+        ok = run_autobaud() && ok;
+
+        sim::UsbCounters usb = sim::usb_counters();
+        sim::CanCounters can = sim::can_counters();
+        printf("USB: in_txn=%llu in_bytes=%llu out_txn=%llu out_naks=%llu\n",
+               (unsigned long long)usb.in_transactions, (unsigned long long)usb.in_bytes,
+               (unsigned long long)usb.out_transactions, (unsigned long long)usb.out_naks);
+        struct gsusb_ring_stats ring;
+        gsusb_usb_get_rx_ring_stats(&ring);
+        printf("RX ring: slots=%u high_water=%u overflows=%u\n",
+               (unsigned)ring.capacity, (unsigned)ring.high_water, (unsigned)ring.overflows);
+        printf("TWAI: driver calls racing uninstall=%llu\n", (unsigned long long)can.misuse);
+        if (can.misuse > 0)
+        {
+            printf("FAIL: the device used the TWAI driver while it was being uninstalled\n");
+            ok = false;
+        }
+
+        struct gs_device_state st = {};
+        uint32_t err_sent = 0;
+        uint32_t err_merged = 0;
+        gsusb_errors_get_counts(&err_sent, &err_merged);
+        {
+            std::lock_guard<std::mutex> lk(host_mtx);
+            printf("ERR: frames=%llu (device sent %u, merged %u) bus_off=%llu restarted=%llu "
+                   "state=%llu rx_overflow=%llu bus_error=%llu\n",
+                   (unsigned long long)err_frames.total, (unsigned)err_sent, (unsigned)err_merged,
+                   (unsigned long long)err_frames.bus_off, (unsigned long long)err_frames.restarted,
+                   (unsigned long long)err_frames.state, (unsigned long long)err_frames.rx_overflow,
+                   (unsigned long long)err_frames.bus_error);
+        }
+        if (get_state(st))
+        {
+            printf("STATE: %s txerr=%u rxerr=%u\n", state_name(st.state),
+                   (unsigned)st.txerr, (unsigned)st.rxerr);
+        }
+        print_device_stats();
+        ok = check_recorder() && ok;
+        ok = check_traffic() && ok;
+        ok = check_stats_clear() && ok;
+        rc = ok ? 0 : 1;
+    }
+
+    // Firmware tasks never return; skip static destructors under them.
+    fflush(stdout);
+    fflush(stderr);
+    _exit(rc);
+}
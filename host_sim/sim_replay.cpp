@@ -0,0 +1,348 @@
+#include "sim_replay.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+namespace sim
+{
+
+namespace
+{
+
+const char *skip_space(const char *p)
+{
+    while (*p == ' ' || *p == '\t')
+    {
+        p++;
+    }
+    return p;
+}
+
+int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// "<sec>.<fraction>" in microseconds; p is left after the number.
+bool parse_seconds(const char *&p, uint64_t &us)
+{
+    if (!isdigit((unsigned char)*p))
+    {
+        return false;
+    }
+    char *end = nullptr;
+    uint64_t sec = strtoull(p, &end, 10);
+    p = end;
+    uint64_t frac = 0;
+    int digits = 0;
+    if (*p == '.')
+    {
+        p++;
+        for (; isdigit((unsigned char)*p); p++, digits++)
+        {
+            if (digits < 6)
+            {
+                frac = frac * 10 + (uint64_t)(*p - '0');
+            }
+        }
+    }
+    for (; digits < 6; digits++)
+    {
+        frac *= 10;
+    }
+    us = sec * 1000000 + frac;
+    return true;
+}
+
+bool starts_with(const char *p, const char *word)
+{
+    return strncmp(p, word, strlen(word)) == 0;
+}
+
+} // namespace
+
+LogReader::~LogReader()
+{
+    if (fp != nullptr && fp != stdin)
+    {
+        fclose(fp);
+    }
+    free(buf);
+}
+
+bool LogReader::open(const char *path)
+{
+    fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    return fp != nullptr;
+}
+
+const char *LogReader::format() const
+{
+    if (candump_frames && asc_frames)
+        return "mixed";
+    if (asc_frames)
+        return "asc";
+    return candump_frames ? "candump" : "none";
+}
+
+bool LogReader::next(LogFrame &frame)
+{
+    ssize_t len;
+    while (fp != nullptr && (len = getline(&buf, &buf_cap, fp)) >= 0)
+    {
+        line_count++;
+        const char *p = skip_space(buf);
+        if (*p == '\0' || *p == '\n' || *p == '\r')
+        {
+            continue;
+        }
+
+        bool ok;
+        if (*p == '(')
+        {
+            ok = parse_candump(p, frame);
+            candump_frames += ok ? 1 : 0;
+        }
+        else if (isdigit((unsigned char)*p))
+        {
+            ok = parse_asc(p, frame);
+            asc_frames += ok ? 1 : 0;
+        }
+        else
+        {
+            parse_asc_header(p);
+            continue;
+        }
+
+        if (ok)
+        {
+            return true;
+        }
+        skip_count++;
+    }
+    return false;
+}
+
+bool LogReader::stamp(uint64_t abs_us, LogFrame &frame)
+{
+    if (!have_t0)
+    {
+        have_t0 = true;
+        t0_us = abs_us;
+    }
+    // Keep time monotonic across logs glued together out of order.
+    uint64_t rel = abs_us > t0_us ? abs_us - t0_us : 0;
+    if (rel < last_us)
+    {
+        rel = last_us;
+    }
+    last_us = rel;
+    frame.ts_us = rel;
+    return true;
+}
+
+// (1436509052.249713) can0 123#DEADBEEF
+// (1436509052.249713) can0 12345678#R4 T
+bool LogReader::parse_candump(const char *p, LogFrame &frame)
+{
+    uint64_t ts = 0;
+    p++;
+    if (!parse_seconds(p, ts) || *p != ')')
+    {
+        return false;
+    }
+    p = skip_space(p + 1);
+    while (*p && *p != ' ' && *p != '\t') // interface
+    {
+        p++;
+    }
+    p = skip_space(p);
+
+    frame.msg = {};
+    frame.tx = false;
+
+    int id_digits = 0;
+    uint32_t id = 0;
+    for (int d; (d = hex_digit(*p)) >= 0; p++, id_digits++)
+    {
+        id = (id << 4) | (uint32_t)d;
+    }
+    if (*p != '#' || (id_digits != 3 && id_digits != 8) || p[1] == '#')
+    {
+        return false; // CAN FD "##" and malformed lines
+    }
+    p++;
+    if (id_digits == 8)
+    {
+        if (id > 0x1FFFFFFFU)
+        {
+            return false; // error frame (CAN_ERR_FLAG)
+        }
+        frame.msg.extd = 1;
+    }
+    else if (id > 0x7FF)
+    {
+        return false;
+    }
+    frame.msg.identifier = id;
+
+    if (*p == 'R' || *p == 'r')
+    {
+        frame.msg.rtr = 1;
+        p++;
+        int d = hex_digit(*p);
+        if (d >= 0 && d <= 8)
+        {
+            frame.msg.data_length_code = (uint8_t)d;
+            p++;
+        }
+    }
+    else
+    {
+        uint8_t n = 0;
+        for (;;)
+        {
+            if (*p == '.')
+            {
+                p++;
+                continue;
+            }
+            int hi = hex_digit(p[0]);
+            int lo = hi >= 0 ? hex_digit(p[1]) : -1;
+            if (lo < 0)
+            {
+                break;
+            }
+            if (n == 8)
+            {
+                return false;
+            }
+            frame.msg.data[n++] = (uint8_t)((hi << 4) | lo);
+            p += 2;
+        }
+        frame.msg.data_length_code = n;
+    }
+
+    p = skip_space(p);
+    frame.tx = *p == 'T';
+    return stamp(ts, frame);
+}
+
+// 0.004000 1  123             Rx   d 8 01 02 03 04 05 06 07 08  Length = 228000 ...
+// 0.005000 1  18DAF100x       Tx   r 4
+bool LogReader::parse_asc(const char *p, LogFrame &frame)
+{
+    uint64_t ts = 0;
+    if (!parse_seconds(p, ts))
+    {
+        return false;
+    }
+    p = skip_space(p);
+    if (!isdigit((unsigned char)*p)) // channel; "CANFD", "ErrorFrame" etc. follow otherwise
+    {
+        return false;
+    }
+    while (isdigit((unsigned char)*p))
+    {
+        p++;
+    }
+    p = skip_space(p);
+
+    frame.msg = {};
+    char *end = nullptr;
+    unsigned long id = strtoul(p, &end, asc_dec_ids ? 10 : 16);
+    if (end == p)
+    {
+        return false;
+    }
+    p = end;
+    if (*p == 'x' || *p == 'X')
+    {
+        frame.msg.extd = 1;
+        p++;
+    }
+    if (id > (frame.msg.extd ? 0x1FFFFFFFUL : 0x7FFUL) || (*p != ' ' && *p != '\t'))
+    {
+        return false;
+    }
+    frame.msg.identifier = (uint32_t)id;
+
+    p = skip_space(p);
+    if (starts_with(p, "Rx"))
+        frame.tx = false;
+    else if (starts_with(p, "Tx") || starts_with(p, "TxRq"))
+        frame.tx = true;
+    else
+        return false;
+    while (*p && *p != ' ' && *p != '\t')
+    {
+        p++;
+    }
+    p = skip_space(p);
+
+    char kind = *p;
+    if (kind != 'd' && kind != 'r')
+    {
+        return false;
+    }
+    p = skip_space(p + 1);
+    int dlc = hex_digit(*p);
+    if (dlc < 0 || dlc > 8 || isxdigit((unsigned char)p[1]))
+    {
+        if (kind == 'd')
+        {
+            return false;
+        }
+        dlc = 0; // "r" without a length
+    }
+    else
+    {
+        p++;
+    }
+    frame.msg.data_length_code = (uint8_t)dlc;
+
+    if (kind == 'r')
+    {
+        frame.msg.rtr = 1;
+    }
+    else
+    {
+        for (int i = 0; i < dlc; i++)
+        {
+            p = skip_space(p);
+            int hi = hex_digit(p[0]);
+            int lo = hi >= 0 ? hex_digit(p[1]) : -1;
+            if (lo < 0)
+            {
+                return false;
+            }
+            frame.msg.data[i] = (uint8_t)((hi << 4) | lo);
+            p += 2;
+        }
+    }
+
+    if (asc_relative)
+    {
+        asc_clock_us += ts;
+        ts = asc_clock_us;
+    }
+    return stamp(ts, frame);
+}
+
+void LogReader::parse_asc_header(const char *p)
+{
+    if (starts_with(p, "base "))
+    {
+        asc_dec_ids = strstr(p, "base dec") != nullptr;
+        asc_relative = strstr(p, "timestamps relative") != nullptr;
+    }
+}
+
+} // namespace sim
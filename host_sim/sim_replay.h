@@ -0,0 +1,69 @@
+#pragma once
+
+// Streaming reader for recorded CAN traffic, used to replay real captures
+// through the firmware. Lines are parsed one at a time, so the size of the
+// log does not matter.
+//
+//   candump -l:  (1436509052.249713) can0 123#DEADBEEF [R|T]
+//   Vector ASC:  0.004000 1  18DAF100x       Rx   d 8 01 02 03 04 05 06 07 08 ...
+//
+// CAN FD, error frames and event lines are counted and skipped.
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "driver/twai.h"
+
+namespace sim
+{
+
+struct LogFrame
+{
+    uint64_t ts_us; // from the start of the log
+    twai_message_t msg;
+    bool tx;        // sent by the logging node (ASC "Tx", candump "T")
+};
+
+class LogReader
+{
+public:
+    LogReader() = default;
+    LogReader(const LogReader &) = delete;
+    LogReader &operator=(const LogReader &) = delete;
+    ~LogReader();
+
+    // "-" reads stdin.
+    bool open(const char *path);
+
+    // Next classic CAN frame; false at the end of the log.
+    bool next(LogFrame &frame);
+
+    uint64_t lines() const { return line_count; }
+    uint64_t skipped() const { return skip_count; }
+    const char *format() const;
+
+private:
+    bool parse_candump(const char *p, LogFrame &frame);
+    bool parse_asc(const char *p, LogFrame &frame);
+    void parse_asc_header(const char *p);
+    bool stamp(uint64_t abs_us, LogFrame &frame);
+
+    FILE *fp = nullptr;
+    char *buf = nullptr;
+    size_t buf_cap = 0;
+
+    uint64_t line_count = 0;
+    uint64_t skip_count = 0;
+    uint64_t candump_frames = 0;
+    uint64_t asc_frames = 0;
+
+    bool have_t0 = false;
+    uint64_t t0_us = 0;
+    uint64_t last_us = 0;
+
+    bool asc_dec_ids = false;  // "base dec"
+    bool asc_relative = false; // "timestamps relative": each time is a delta
+    uint64_t asc_clock_us = 0;
+};
+
+} // namespace sim
@@ -0,0 +1,759 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/prctl.h>
+
+#include "tinyusb.h"
+#include "class/cdc/cdc_device.h"
+#include "class/vendor/vendor_device.h"
+#include "device/usbd_pvt.h"
+
+#include "sim.h"
+
+namespace
+{
+
+enum EventType
+{
+    EVT_CONTROL,
+    EVT_OUT_PACKET,
+    EVT_CDC_OUT_PACKET,
+    EVT_CDC_LINE_STATE,
+    EVT_XFER_DONE,
+};
+
+struct Event
+{
+    EventType type;
+    tusb_control_request_t request;
+    std::vector<uint8_t> data;
+    uint8_t ep = 0;
+    uint32_t xferred = 0;
+    bool done = false;
+    bool ok = false;
+};
+
+std::mutex mtx;
+std::condition_variable ev_cv;
+std::condition_variable done_cv;
+std::condition_variable in_cv;
+std::condition_variable out_cv;
+
+std::deque<Event *> events;
+
+bool mounted = false;
+sim::UsbTiming timing = {};
+sim::UsbCounters counters = {};
+
+// The IN endpoints share one wire: a transaction starts when the previous
+// one, on either endpoint, has finished.
+std::chrono::steady_clock::time_point wire_free;
+
+// Bulk IN: TinyUSB TX FIFO plus the transfer currently on the wire. The
+// host only polls an endpoint while something reads it (a sink is set).
+// A direct pipe belongs to the application class driver: its transfers
+// come from usbd_edpt_xfer() and complete through the driver's xfer_cb.
+struct InPipe
+{
+    size_t fifo_size;
+    void (*complete)(uint32_t sent);
+    sim::UsbInSink sink;
+    std::deque<uint8_t> ff;
+    std::vector<uint8_t> xfer;
+    bool busy;
+    bool direct;
+};
+
+// Bulk OUT: TinyUSB RX FIFO; the endpoint is armed only while a full
+// max-packet fits, exactly like _prep_out_transaction() on target. A direct
+// pipe is armed while the driver has a transfer on it; packets land in its
+// buffer until a short packet or the transfer length ends it.
+struct OutPipe
+{
+    size_t fifo_size;
+    EventType event;
+    std::deque<uint8_t> ff;
+    bool pending;
+    bool direct;
+    uint8_t *xfer_buf;
+    uint16_t xfer_len;
+    uint16_t xfer_got;
+};
+
+// usbd_edpt_claim() / usbd_edpt_xfer() bookkeeping of a direct endpoint;
+// both are cleared by the TinyUSB task before the driver hears of the
+// completion, as in usbd.c.
+struct EdptState
+{
+    bool claimed;
+    bool busy;
+};
+
+const usbd_class_driver_t *app_driver = nullptr;
+const uint8_t *config_desc = nullptr;
+EdptState edpt_in = {};
+EdptState edpt_out = {};
+
+void vendor_tx_done(uint32_t sent)
+{
+    tud_vendor_tx_cb(0, sent);
+}
+
+void cdc_tx_done(uint32_t sent)
+{
+    (void)sent;
+    tud_cdc_tx_complete_cb(0);
+}
+
+InPipe vendor_in = {CFG_TUD_VENDOR_TX_BUFSIZE, vendor_tx_done, nullptr, {}, {}, false, false};
+InPipe cdc_in = {CFG_TUD_CDC_TX_BUFSIZE, cdc_tx_done, nullptr, {}, {}, false, false};
+OutPipe vendor_out = {CFG_TUD_VENDOR_RX_BUFSIZE, EVT_OUT_PACKET, {}, false, false, nullptr, 0, 0};
+OutPipe cdc_out = {CFG_TUD_CDC_RX_BUFSIZE, EVT_CDC_OUT_PACKET, {}, false, false, nullptr, 0, 0};
+
+// The gs_usb endpoints, as in the configuration descriptor.
+constexpr uint8_t VENDOR_EP_OUT = 0x01;
+constexpr uint8_t VENDOR_EP_IN = 0x81;
+bool cdc_dtr = false;
+
+// Control transfer buffer registered by tud_control_xfer() in the callback.
+void *ctrl_buf = nullptr;
+uint16_t ctrl_len = 0;
+
+uint32_t in_flush_locked(InPipe &pipe)
+{
+    if (pipe.busy || pipe.ff.empty())
+    {
+        return 0;
+    }
+    size_t n = pipe.ff.size() < CFG_TUD_VENDOR_EPSIZE ? pipe.ff.size() : CFG_TUD_VENDOR_EPSIZE;
+    pipe.xfer.assign(pipe.ff.begin(), pipe.ff.begin() + n);
+    pipe.ff.erase(pipe.ff.begin(), pipe.ff.begin() + n);
+    pipe.busy = true;
+    in_cv.notify_all();
+    return (uint32_t)n;
+}
+
+uint32_t in_write_locked(InPipe &pipe, const void *buffer, uint32_t bufsize)
+{
+    uint32_t space = (uint32_t)(pipe.fifo_size - pipe.ff.size());
+    uint32_t n = bufsize < space ? bufsize : space;
+    const uint8_t *p = static_cast<const uint8_t *>(buffer);
+    pipe.ff.insert(pipe.ff.end(), p, p + n);
+    if (pipe.ff.size() >= CFG_TUD_VENDOR_EPSIZE)
+    {
+        in_flush_locked(pipe);
+    }
+    return n;
+}
+
+uint32_t out_read(OutPipe &pipe, void *buffer, uint32_t bufsize)
+{
+    std::unique_lock<std::mutex> lk(mtx);
+    uint32_t n = bufsize < pipe.ff.size() ? bufsize : (uint32_t)pipe.ff.size();
+    std::copy(pipe.ff.begin(), pipe.ff.begin() + n, static_cast<uint8_t *>(buffer));
+    pipe.ff.erase(pipe.ff.begin(), pipe.ff.begin() + n);
+    lk.unlock();
+    out_cv.notify_all();
+    return n;
+}
+
+bool out_armed_locked(const OutPipe &pipe)
+{
+    if (pipe.direct)
+    {
+        return pipe.xfer_buf != nullptr;
+    }
+    return !pipe.pending && pipe.fifo_size - pipe.ff.size() >= CFG_TUD_VENDOR_EPSIZE;
+}
+
+// Hands a finished direct transfer to the TinyUSB task.
+void xfer_done_locked(uint8_t ep, uint32_t xferred)
+{
+    Event *ev = new Event();
+    ev->type = EVT_XFER_DONE;
+    ev->ep = ep;
+    ev->xferred = xferred;
+    events.push_back(ev);
+    ev_cv.notify_all();
+}
+
+void host_in_thread(InPipe *pipe)
+{
+    prctl(PR_SET_TIMERSLACK, 1000UL);
+
+    for (;;)
+    {
+        std::unique_lock<std::mutex> lk(mtx);
+        in_cv.wait(lk, [pipe] { return pipe->busy && pipe->sink != nullptr; });
+        std::vector<uint8_t> data = pipe->xfer;
+        size_t packets = data.empty() ? 1 : (data.size() + CFG_TUD_VENDOR_EPSIZE - 1) / CFG_TUD_VENDOR_EPSIZE;
+
+        auto now = std::chrono::steady_clock::now();
+        if (wire_free < now)
+        {
+            wire_free = now;
+        }
+        wire_free += std::chrono::microseconds(timing.in_txn_us * packets);
+        auto done = wire_free;
+        lk.unlock();
+
+        std::this_thread::sleep_until(done);
+
+        lk.lock();
+        pipe->busy = false;
+        counters.in_transactions += packets;
+        counters.in_bytes += data.size();
+        sim::UsbInSink sink = pipe->sink;
+        if (pipe->direct)
+        {
+            xfer_done_locked(VENDOR_EP_IN, (uint32_t)data.size());
+        }
+        else
+        {
+            // Transfer complete: the class immediately starts the next one.
+            in_flush_locked(*pipe);
+        }
+        lk.unlock();
+
+        if (!pipe->direct)
+        {
+            pipe->complete((uint32_t)data.size());
+        }
+        sink(data.data(), data.size(), sim::now_us());
+    }
+}
+
+bool submit(Event &ev)
+{
+    std::unique_lock<std::mutex> lk(mtx);
+    events.push_back(&ev);
+    ev_cv.notify_all();
+    done_cv.wait(lk, [&] { return ev.done; });
+    return ev.ok;
+}
+
+void process_control(Event &ev)
+{
+    tusb_control_request_t const *req = &ev.request;
+
+    ctrl_buf = nullptr;
+    ctrl_len = 0;
+    if (!tud_vendor_control_xfer_cb(0, CONTROL_STAGE_SETUP, req))
+    {
+        ev.ok = false;
+        return;
+    }
+
+    uint16_t len = ctrl_len < req->wLength ? ctrl_len : req->wLength;
+    if (ctrl_buf && len > 0)
+    {
+        if (req->bmRequestType_bit.direction == TUSB_DIR_IN)
+        {
+            ev.data.assign(static_cast<uint8_t *>(ctrl_buf), static_cast<uint8_t *>(ctrl_buf) + len);
+        }
+        else
+        {
+            if (ev.data.size() < len)
+            {
+                len = (uint16_t)ev.data.size();
+            }
+            memcpy(ctrl_buf, ev.data.data(), len);
+        }
+        if (!tud_vendor_control_xfer_cb(0, CONTROL_STAGE_DATA, req))
+        {
+            ev.ok = false;
+            return;
+        }
+    }
+    tud_vendor_control_xfer_cb(0, CONTROL_STAGE_ACK, req);
+    ev.ok = true;
+}
+
+void process_out_packet(Event &ev)
+{
+    OutPipe &pipe = ev.type == EVT_OUT_PACKET ? vendor_out : cdc_out;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        pipe.ff.insert(pipe.ff.end(), ev.data.begin(), ev.data.end());
+        pipe.pending = false;
+    }
+    if (ev.type == EVT_OUT_PACKET)
+    {
+        tud_vendor_rx_cb(0, ev.data.data(), (uint16_t)ev.data.size());
+    }
+    else
+    {
+        tud_cdc_rx_cb(0);
+    }
+    out_cv.notify_all();
+    ev.ok = true;
+}
+
+void process_xfer_done(Event &ev)
+{
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        EdptState &st = (ev.ep & 0x80) ? edpt_in : edpt_out;
+        st.busy = false;
+        st.claimed = false;
+    }
+    app_driver->xfer_cb(0, ev.ep, XFER_RESULT_SUCCESS, ev.xferred);
+    out_cv.notify_all();
+    ev.ok = true;
+}
+
+void process_line_state(Event &ev)
+{
+    bool dtr = ev.request.wValue & 1;
+    bool rts = ev.request.wValue & 2;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        cdc_dtr = dtr;
+    }
+    tud_cdc_line_state_cb(0, dtr, rts);
+    ev.ok = true;
+}
+
+bool out_transfer(OutPipe &pipe, const void *data, size_t len, uint32_t timeout_ms,
+                  uint64_t *accepted_us)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+    while (len > 0)
+    {
+        size_t n = len < CFG_TUD_VENDOR_EPSIZE ? len : CFG_TUD_VENDOR_EPSIZE;
+
+        std::unique_lock<std::mutex> lk(mtx);
+        if (!out_armed_locked(pipe))
+        {
+            counters.out_naks++;
+            if (!out_cv.wait_until(lk, deadline, [&pipe] { return out_armed_locked(pipe); }))
+            {
+                return false;
+            }
+        }
+        pipe.pending = !pipe.direct;
+        lk.unlock();
+
+        std::this_thread::sleep_for(std::chrono::microseconds(timing.out_txn_us));
+
+        lk.lock();
+        counters.out_transactions++;
+        if (pipe.direct)
+        {
+            size_t room = pipe.xfer_len - pipe.xfer_got;
+            memcpy(pipe.xfer_buf + pipe.xfer_got, p, n < room ? n : room);
+            pipe.xfer_got += (uint16_t)(n < room ? n : room);
+            if (n < CFG_TUD_VENDOR_EPSIZE || pipe.xfer_got == pipe.xfer_len)
+            {
+                pipe.xfer_buf = nullptr;
+                xfer_done_locked(VENDOR_EP_OUT, pipe.xfer_got);
+            }
+        }
+        else
+        {
+            Event *ev = new Event();
+            ev->type = pipe.event;
+            ev->data.assign(p, p + n);
+            events.push_back(ev);
+            ev_cv.notify_all();
+        }
+        lk.unlock();
+
+        if (accepted_us)
+        {
+            *accepted_us = sim::now_us();
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// SET_CONFIGURATION: the application driver gets first pick of each
+// interface, then the built-in classes take the rest.
+void open_app_driver()
+{
+    if (app_driver == nullptr || config_desc == nullptr)
+    {
+        return;
+    }
+    const uint8_t *p = config_desc + config_desc[0];
+    const uint8_t *end = config_desc + (config_desc[2] | (config_desc[3] << 8));
+    while (p < end)
+    {
+        if (p[1] == TUSB_DESC_INTERFACE)
+        {
+            uint16_t n = app_driver->open(0, reinterpret_cast<tusb_desc_interface_t const *>(p),
+                                          (uint16_t)(end - p));
+            if (n > 0)
+            {
+                p += n;
+                continue;
+            }
+        }
+        p += p[0];
+    }
+}
+
+EdptState *edpt_state_locked(uint8_t ep)
+{
+    if (ep == VENDOR_EP_IN && vendor_in.direct)
+    {
+        return &edpt_in;
+    }
+    if (ep == VENDOR_EP_OUT && vendor_out.direct)
+    {
+        return &edpt_out;
+    }
+    return nullptr;
+}
+
+} // namespace
+
+extern "C" esp_err_t tinyusb_driver_install(const tinyusb_config_t *config)
+{
+    config_desc = config->configuration_descriptor;
+    if (usbd_app_driver_get_cb != nullptr)
+    {
+        uint8_t count = 0;
+        app_driver = usbd_app_driver_get_cb(&count);
+        if (count == 0)
+        {
+            app_driver = nullptr;
+        }
+        else if (app_driver->init != nullptr)
+        {
+            app_driver->init();
+        }
+    }
+    return ESP_OK;
+}
+
+extern "C" bool usbd_open_edpt_pair(uint8_t rhport, uint8_t const *p_desc, uint8_t ep_count,
+                                    uint8_t xfer_type, uint8_t *ep_out, uint8_t *ep_in)
+{
+    (void)rhport;
+    std::lock_guard<std::mutex> lk(mtx);
+    for (uint8_t i = 0; i < ep_count; i++, p_desc += p_desc[0])
+    {
+        uint8_t addr = p_desc[2];
+        if (p_desc[1] != TUSB_DESC_ENDPOINT || p_desc[3] != xfer_type)
+        {
+            return false;
+        }
+        if (addr == VENDOR_EP_IN)
+        {
+            vendor_in.direct = true;
+            edpt_in = {};
+            *ep_in = addr;
+        }
+        else if (addr == VENDOR_EP_OUT)
+        {
+            vendor_out.direct = true;
+            vendor_out.xfer_buf = nullptr;
+            edpt_out = {};
+            *ep_out = addr;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+extern "C" bool usbd_edpt_claim(uint8_t rhport, uint8_t ep_addr)
+{
+    (void)rhport;
+    std::lock_guard<std::mutex> lk(mtx);
+    EdptState *st = edpt_state_locked(ep_addr);
+    if (st == nullptr || st->claimed || st->busy)
+    {
+        return false;
+    }
+    st->claimed = true;
+    return true;
+}
+
+extern "C" bool usbd_edpt_release(uint8_t rhport, uint8_t ep_addr)
+{
+    (void)rhport;
+    std::lock_guard<std::mutex> lk(mtx);
+    EdptState *st = edpt_state_locked(ep_addr);
+    if (st == nullptr)
+    {
+        return false;
+    }
+    st->claimed = false;
+    return true;
+}
+
+extern "C" bool usbd_edpt_xfer(uint8_t rhport, uint8_t ep_addr, uint8_t *buffer, uint16_t total_bytes)
+{
+    (void)rhport;
+    std::lock_guard<std::mutex> lk(mtx);
+    EdptState *st = edpt_state_locked(ep_addr);
+    if (st == nullptr || st->busy)
+    {
+        return false;
+    }
+    st->busy = true;
+    if (ep_addr == VENDOR_EP_IN)
+    {
+        vendor_in.xfer.assign(buffer, buffer + total_bytes);
+        vendor_in.busy = true;
+        in_cv.notify_all();
+    }
+    else
+    {
+        vendor_out.xfer_buf = buffer;
+        vendor_out.xfer_len = total_bytes;
+        vendor_out.xfer_got = 0;
+        out_cv.notify_all();
+    }
+    return true;
+}
+
+extern "C" void tud_task_ext(uint32_t timeout_ms, bool in_isr)
+{
+    (void)in_isr;
+    for (;;)
+    {
+        std::unique_lock<std::mutex> lk(mtx);
+        auto pred = [] { return !events.empty(); };
+        if (timeout_ms == UINT32_MAX)
+        {
+            ev_cv.wait(lk, pred);
+        }
+        else if (!ev_cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), pred))
+        {
+            return;
+        }
+        Event *ev = events.front();
+        events.pop_front();
+        lk.unlock();
+
+        if (ev->type == EVT_CONTROL)
+        {
+            process_control(*ev);
+        }
+        else if (ev->type == EVT_CDC_LINE_STATE)
+        {
+            process_line_state(*ev);
+        }
+        else if (ev->type == EVT_XFER_DONE)
+        {
+            process_xfer_done(*ev);
+        }
+        else
+        {
+            process_out_packet(*ev);
+        }
+
+        bool wait_for_host = ev->type == EVT_CONTROL || ev->type == EVT_CDC_LINE_STATE;
+        lk.lock();
+        ev->done = true;
+        lk.unlock();
+        if (wait_for_host)
+        {
+            done_cv.notify_all();
+        }
+        else
+        {
+            delete ev;
+        }
+    }
+}
+
+extern "C" void tud_task(void)
+{
+    tud_task_ext(UINT32_MAX, false);
+}
+
+extern "C" bool tud_mounted(void)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    return mounted;
+}
+
+extern "C" bool tud_control_xfer(uint8_t rhport, tusb_control_request_t const *request,
+                                 void *buffer, uint16_t len)
+{
+    (void)rhport;
+    (void)request;
+    ctrl_buf = buffer;
+    ctrl_len = len;
+    return true;
+}
+
+extern "C" bool tud_vendor_mounted(void)
+{
+    return tud_mounted();
+}
+
+extern "C" uint32_t tud_vendor_available(void)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    return (uint32_t)vendor_out.ff.size();
+}
+
+extern "C" uint32_t tud_vendor_read(void *buffer, uint32_t bufsize)
+{
+    return out_read(vendor_out, buffer, bufsize);
+}
+
+extern "C" uint32_t tud_vendor_write_available(void)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    return (uint32_t)(vendor_in.fifo_size - vendor_in.ff.size());
+}
+
+extern "C" uint32_t tud_vendor_write(void const *buffer, uint32_t bufsize)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    return in_write_locked(vendor_in, buffer, bufsize);
+}
+
+extern "C" uint32_t tud_vendor_write_flush(void)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    return in_flush_locked(vendor_in);
+}
+
+extern "C" bool tud_cdc_connected(void)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    return mounted && cdc_dtr;
+}
+
+extern "C" uint32_t tud_cdc_available(void)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    return (uint32_t)cdc_out.ff.size();
+}
+
+extern "C" uint32_t tud_cdc_read(void *buffer, uint32_t bufsize)
+{
+    return out_read(cdc_out, buffer, bufsize);
+}
+
+extern "C" uint32_t tud_cdc_write_available(void)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    return (uint32_t)(cdc_in.fifo_size - cdc_in.ff.size());
+}
+
+extern "C" uint32_t tud_cdc_write(void const *buffer, uint32_t bufsize)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    return in_write_locked(cdc_in, buffer, bufsize);
+}
+
+extern "C" uint32_t tud_cdc_write_flush(void)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    return in_flush_locked(cdc_in);
+}
+
+namespace sim
+{
+
+void usb_connect(const UsbTiming &t)
+{
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (mounted)
+        {
+            return;
+        }
+        timing = t;
+        mounted = true;
+        std::thread(host_in_thread, &vendor_in).detach();
+        std::thread(host_in_thread, &cdc_in).detach();
+    }
+    open_app_driver();
+    if (tud_mount_cb != nullptr)
+    {
+        tud_mount_cb();
+    }
+}
+
+bool usb_control_out(uint8_t request, uint16_t value, const void *data, uint16_t len)
+{
+    Event ev;
+    ev.type = EVT_CONTROL;
+    ev.request = {};
+    ev.request.bmRequestType = 0x41; // vendor, interface, host-to-device
+    ev.request.bRequest = request;
+    ev.request.wValue = value;
+    ev.request.wLength = len;
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    ev.data.assign(p, p + len);
+    return submit(ev);
+}
+
+bool usb_control_in(uint8_t request, uint16_t value, void *data, uint16_t len)
+{
+    Event ev;
+    ev.type = EVT_CONTROL;
+    ev.request = {};
+    ev.request.bmRequestType = 0xC1; // vendor, interface, device-to-host
+    ev.request.bRequest = request;
+    ev.request.wValue = value;
+    ev.request.wLength = len;
+    if (!submit(ev))
+    {
+        return false;
+    }
+    memset(data, 0, len);
+    memcpy(data, ev.data.data(), ev.data.size() < len ? ev.data.size() : len);
+    return true;
+}
+
+bool usb_bulk_out(const void *data, uint16_t len, uint32_t timeout_ms, uint64_t *accepted_us)
+{
+    return out_transfer(vendor_out, data, len, timeout_ms, accepted_us);
+}
+
+void usb_set_in_sink(UsbInSink sink)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    vendor_in.sink = sink;
+    in_cv.notify_all();
+}
+
+bool cdc_set_line_state(bool dtr, bool rts)
+{
+    Event ev;
+    ev.type = EVT_CDC_LINE_STATE;
+    ev.request = {};
+    ev.request.wValue = (uint16_t)((dtr ? 1 : 0) | (rts ? 2 : 0));
+    return submit(ev);
+}
+
+bool cdc_write(const void *data, size_t len, uint32_t timeout_ms, uint64_t *accepted_us)
+{
+    return out_transfer(cdc_out, data, len, timeout_ms, accepted_us);
+}
+
+void cdc_set_in_sink(UsbInSink sink)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    cdc_in.sink = sink;
+    in_cv.notify_all();
+}
+
+UsbCounters usb_counters()
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    return counters;
+}
+
+} // namespace sim
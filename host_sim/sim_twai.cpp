@@ -0,0 +1,648 @@
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <sys/prctl.h>
+
+#include "driver/twai.h"
+
+#include "sim.h"
+
+#define SIM_CAN_CLOCK_HZ 80000000UL
+
+static std::mutex mtx;
+static std::condition_variable rx_cv;
+static std::condition_variable tx_cv;
+static std::condition_variable alert_cv;
+static std::condition_variable bus_cv;
+
+static bool installed = false;
+static bool running = false;
+static uint32_t generation = 0;
+static uint32_t blocked_calls = 0;
+
+static twai_general_config_t gcfg;
+static twai_timing_config_t tcfg;
+static twai_filter_config_t fcfg;
+
+static std::deque<twai_message_t> rxq;
+static std::deque<twai_message_t> txq;
+static uint32_t alerts_triggered = 0;
+static twai_status_info_t status;
+
+static uint64_t injected = 0;
+static uint64_t hw_filtered = 0;
+static uint64_t rx_missed = 0;
+static uint64_t tx_done = 0;
+static uint64_t misuse = 0;
+static uint64_t installs = 0;
+static sim::CanTxSink tx_sink = nullptr;
+static bool remote_ack = true;
+static uint32_t bus_bitrate = 0;
+
+static bool bus_started = false;
+
+static uint32_t bitrate_locked(void)
+{
+    if (!installed)
+    {
+        return 0;
+    }
+    uint32_t tq = 1U + tcfg.tseg_1 + tcfg.tseg_2;
+    return (uint32_t)(SIM_CAN_CLOCK_HZ / (tcfg.brp * tq));
+}
+
+static void trigger_alerts_locked(uint32_t bits)
+{
+    alerts_triggered |= bits & gcfg.alerts_enabled;
+    if (alerts_triggered)
+    {
+        alert_cv.notify_all();
+    }
+}
+
+enum ErrLevel
+{
+    LEVEL_ACTIVE,
+    LEVEL_WARNING,
+    LEVEL_PASSIVE,
+    LEVEL_BUS_OFF,
+};
+
+static ErrLevel err_level_locked(void)
+{
+    uint32_t tec = status.tx_error_counter;
+    uint32_t rec = status.rx_error_counter;
+    if (tec >= 256)
+        return LEVEL_BUS_OFF;
+    if (tec >= 128 || rec >= 128)
+        return LEVEL_PASSIVE;
+    if (tec >= 96 || rec >= 96)
+        return LEVEL_WARNING;
+    return LEVEL_ACTIVE;
+}
+
+// Raises the alerts for a TEC/REC change, like the TWAI ISR does.
+static void err_counters_changed_locked(ErrLevel before)
+{
+    ErrLevel after = err_level_locked();
+    if (after == before)
+    {
+        return;
+    }
+    if (after == LEVEL_BUS_OFF)
+    {
+        status.state = TWAI_STATE_BUS_OFF;
+        running = false;
+        trigger_alerts_locked(TWAI_ALERT_BUS_OFF);
+        return;
+    }
+    if (before < LEVEL_WARNING && after >= LEVEL_WARNING)
+        trigger_alerts_locked(TWAI_ALERT_ABOVE_ERR_WARN);
+    if (before < LEVEL_PASSIVE && after == LEVEL_PASSIVE)
+        trigger_alerts_locked(TWAI_ALERT_ERR_PASS);
+    if (before >= LEVEL_WARNING && after == LEVEL_ACTIVE)
+        trigger_alerts_locked(TWAI_ALERT_BELOW_ERR_WARN);
+    if (before == LEVEL_PASSIVE && after < LEVEL_PASSIVE)
+        trigger_alerts_locked(TWAI_ALERT_ERR_ACTIVE);
+}
+
+static bool filter_accepts_locked(const twai_message_t &msg)
+{
+    if (!fcfg.single_filter)
+    {
+        // Dual filter: each half compares a 16-bit view of the frame.
+        uint32_t word = msg.extd
+                            ? (msg.identifier >> 13) & 0xFFFFU
+                            : (msg.identifier << 5) | (msg.rtr ? 0x10U : 0U);
+        uint32_t word1 = word;
+        bool nibble = true;
+        if (!msg.extd && !msg.rtr && msg.data_length_code > 0)
+        {
+            // Data byte 1: high nibble next to the ID, low nibble in [3:0].
+            word1 |= msg.data[0] >> 4;
+            nibble = ((msg.data[0] ^ fcfg.acceptance_code) & ~fcfg.acceptance_mask & 0xFU) == 0;
+        }
+        bool f1 = nibble &&
+                  ((word1 ^ (fcfg.acceptance_code >> 16)) & ~(fcfg.acceptance_mask >> 16) & 0xFFFFU) == 0;
+        bool f2 = ((word ^ fcfg.acceptance_code) & ~fcfg.acceptance_mask &
+                   (msg.extd ? 0xFFFFU : 0xFFF0U)) == 0;
+        return f1 || f2;
+    }
+
+    uint32_t word;
+    if (msg.extd)
+    {
+        word = (msg.identifier << 3) | (msg.rtr ? 0x4U : 0U);
+    }
+    else
+    {
+        word = (msg.identifier << 21) | (msg.rtr ? 0x100000U : 0U);
+        if (!msg.rtr && msg.data_length_code > 0)
+        {
+            word |= (uint32_t)msg.data[0] << 8;
+        }
+        if (!msg.rtr && msg.data_length_code > 1)
+        {
+            word |= msg.data[1];
+        }
+    }
+    return ((word ^ fcfg.acceptance_code) & ~fcfg.acceptance_mask) == 0;
+}
+
+static void rx_push_locked(const twai_message_t &msg)
+{
+    if (rxq.size() >= gcfg.rx_queue_len)
+    {
+        status.rx_missed_count++;
+        rx_missed++;
+        trigger_alerts_locked(TWAI_ALERT_RX_QUEUE_FULL);
+        return;
+    }
+    rxq.push_back(msg);
+    if (status.rx_error_counter > 0)
+    {
+        ErrLevel before = err_level_locked();
+        status.rx_error_counter--;
+        err_counters_changed_locked(before);
+    }
+    trigger_alerts_locked(TWAI_ALERT_RX_DATA);
+    rx_cv.notify_all();
+}
+
+static void bus_thread(void)
+{
+    prctl(PR_SET_TIMERSLACK, 1000UL);
+
+    auto bus_free = std::chrono::steady_clock::now();
+    for (;;)
+    {
+        std::unique_lock<std::mutex> lk(mtx);
+        bus_cv.wait(lk, [] { return running && !txq.empty(); });
+
+        twai_message_t msg = txq.front();
+        uint32_t gen = generation;
+        uint32_t bits = sim::can_frame_bits(msg);
+        uint32_t br = bitrate_locked();
+        lk.unlock();
+
+        auto now = std::chrono::steady_clock::now();
+        if (bus_free < now)
+        {
+            bus_free = now;
+        }
+        bus_free += std::chrono::nanoseconds((uint64_t)bits * 1000000000ULL / br);
+        std::this_thread::sleep_until(bus_free);
+
+        lk.lock();
+        if (gen != generation || !running || txq.empty())
+        {
+            continue;
+        }
+        if (!remote_ack && gcfg.mode != TWAI_MODE_NO_ACK)
+        {
+            // ACK error: retransmitted unless single shot. An error-passive
+            // transmitter stops counting them, so this never reaches bus-off.
+            ErrLevel before = err_level_locked();
+            status.bus_error_count++;
+            if (status.tx_error_counter < 128)
+            {
+                status.tx_error_counter += 8;
+            }
+            trigger_alerts_locked(TWAI_ALERT_BUS_ERROR);
+            err_counters_changed_locked(before);
+            if (msg.ss)
+            {
+                txq.pop_front();
+                status.tx_failed_count++;
+                trigger_alerts_locked(TWAI_ALERT_TX_FAILED | (txq.empty() ? TWAI_ALERT_TX_IDLE : 0));
+                tx_cv.notify_all();
+            }
+            continue;
+        }
+        sim::CanTxSink sink = tx_sink;
+        lk.unlock();
+
+        // The remote side sees the frame before the controller raises its
+        // TX interrupt, as on a real bus.
+        if (sink)
+        {
+            sink(msg, sim::now_us());
+        }
+
+        lk.lock();
+        if (gen != generation || txq.empty())
+        {
+            continue;
+        }
+        txq.pop_front();
+        tx_done++;
+        if (status.tx_error_counter > 0)
+        {
+            ErrLevel before = err_level_locked();
+            status.tx_error_counter--;
+            err_counters_changed_locked(before);
+        }
+        trigger_alerts_locked(TWAI_ALERT_TX_SUCCESS | (txq.empty() ? TWAI_ALERT_TX_IDLE : 0));
+        if (msg.self)
+        {
+            rx_push_locked(msg);
+        }
+        tx_cv.notify_all();
+    }
+}
+
+extern "C" esp_err_t twai_driver_install(const twai_general_config_t *g_config,
+                                         const twai_timing_config_t *t_config,
+                                         const twai_filter_config_t *f_config)
+{
+    if (t_config->brp < 2 || t_config->brp > 16384 || (t_config->brp & 1) ||
+        t_config->tseg_1 < 1 || t_config->tseg_1 > 16 ||
+        t_config->tseg_2 < 1 || t_config->tseg_2 > 8 ||
+        t_config->sjw < 1 || t_config->sjw > 4)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    std::lock_guard<std::mutex> lk(mtx);
+    if (installed)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    gcfg = *g_config;
+    tcfg = *t_config;
+    fcfg = *f_config;
+    installed = true;
+    installs++;
+    running = false;
+    generation++;
+    rxq.clear();
+    txq.clear();
+    alerts_triggered = 0;
+    status = {};
+    status.state = TWAI_STATE_STOPPED;
+
+    if (!bus_started)
+    {
+        bus_started = true;
+        std::thread(bus_thread).detach();
+    }
+    return ESP_OK;
+}
+
+extern "C" esp_err_t twai_driver_uninstall(void)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    if (!installed || running)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    // On target a task still blocked inside the driver dereferences freed
+    // driver state here; the simulation counts it instead of crashing.
+    misuse += blocked_calls;
+    installed = false;
+    generation++;
+    rxq.clear();
+    txq.clear();
+    rx_cv.notify_all();
+    tx_cv.notify_all();
+    alert_cv.notify_all();
+    return ESP_OK;
+}
+
+extern "C" esp_err_t twai_start(void)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    if (!installed || running)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    running = true;
+    status.state = TWAI_STATE_RUNNING;
+    status.tx_error_counter = 0;
+    status.rx_error_counter = 0;
+    bus_cv.notify_all();
+    return ESP_OK;
+}
+
+extern "C" esp_err_t twai_stop(void)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    if (!installed || !running)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    running = false;
+    status.state = TWAI_STATE_STOPPED;
+    txq.clear();
+    tx_cv.notify_all();
+    return ESP_OK;
+}
+
+extern "C" esp_err_t twai_transmit(const twai_message_t *message, TickType_t ticks_to_wait)
+{
+    std::unique_lock<std::mutex> lk(mtx);
+    if (!installed || !running)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (gcfg.mode == TWAI_MODE_LISTEN_ONLY)
+    {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (message->data_length_code > TWAI_FRAME_MAX_DLC && !message->dlc_non_comp)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // One frame in the controller TX buffer plus tx_queue_len queued.
+    size_t capacity = gcfg.tx_queue_len + 1;
+    uint32_t gen = generation;
+    blocked_calls++;
+    bool ok = true;
+    auto pred = [&] { return gen != generation || !running || txq.size() < capacity; };
+    if (ticks_to_wait == portMAX_DELAY)
+    {
+        tx_cv.wait(lk, pred);
+    }
+    else
+    {
+        ok = tx_cv.wait_for(lk, std::chrono::milliseconds(ticks_to_wait), pred);
+    }
+    blocked_calls--;
+
+    if (gen != generation || !running)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!ok)
+    {
+        return ESP_ERR_TIMEOUT;
+    }
+    txq.push_back(*message);
+    bus_cv.notify_all();
+    return ESP_OK;
+}
+
+extern "C" esp_err_t twai_receive(twai_message_t *message, TickType_t ticks_to_wait)
+{
+    std::unique_lock<std::mutex> lk(mtx);
+    if (!installed)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint32_t gen = generation;
+    blocked_calls++;
+    bool ok = true;
+    auto pred = [&] { return gen != generation || !rxq.empty(); };
+    if (ticks_to_wait == portMAX_DELAY)
+    {
+        rx_cv.wait(lk, pred);
+    }
+    else
+    {
+        ok = rx_cv.wait_for(lk, std::chrono::milliseconds(ticks_to_wait), pred);
+    }
+    blocked_calls--;
+
+    if (gen != generation)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!ok)
+    {
+        return ESP_ERR_TIMEOUT;
+    }
+    *message = rxq.front();
+    rxq.pop_front();
+    return ESP_OK;
+}
+
+extern "C" esp_err_t twai_read_alerts(uint32_t *alerts, TickType_t ticks_to_wait)
+{
+    std::unique_lock<std::mutex> lk(mtx);
+    if (!installed)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint32_t gen = generation;
+    blocked_calls++;
+    auto pred = [&] { return gen != generation || alerts_triggered != 0; };
+    if (ticks_to_wait == portMAX_DELAY)
+    {
+        alert_cv.wait(lk, pred);
+    }
+    else
+    {
+        alert_cv.wait_for(lk, std::chrono::milliseconds(ticks_to_wait), pred);
+    }
+    blocked_calls--;
+
+    if (gen != generation)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    *alerts = alerts_triggered;
+    alerts_triggered = 0;
+    return *alerts ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+extern "C" esp_err_t twai_reconfigure_alerts(uint32_t alerts_enabled, uint32_t *current_alerts)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    if (!installed)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    gcfg.alerts_enabled = alerts_enabled;
+    if (current_alerts)
+    {
+        *current_alerts = alerts_triggered;
+    }
+    alerts_triggered = 0;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t twai_initiate_recovery(void)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    if (!installed || status.state != TWAI_STATE_BUS_OFF)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    // Real hardware waits for 128 x 11 recessive bits; the sim bus is idle.
+    status.state = TWAI_STATE_STOPPED;
+    running = false;
+    status.tx_error_counter = 0;
+    status.rx_error_counter = 0;
+    txq.clear();
+    tx_cv.notify_all();
+    trigger_alerts_locked(TWAI_ALERT_BUS_RECOVERED);
+    return ESP_OK;
+}
+
+extern "C" esp_err_t twai_get_status_info(twai_status_info_t *status_info)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    if (!installed)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    *status_info = status;
+    status_info->msgs_to_tx = (uint32_t)txq.size();
+    status_info->msgs_to_rx = (uint32_t)rxq.size();
+    return ESP_OK;
+}
+
+extern "C" esp_err_t twai_clear_transmit_queue(void)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    if (!installed)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    txq.clear();
+    tx_cv.notify_all();
+    return ESP_OK;
+}
+
+extern "C" esp_err_t twai_clear_receive_queue(void)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    if (!installed)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    rxq.clear();
+    return ESP_OK;
+}
+
+namespace sim
+{
+
+uint32_t can_frame_bits(const twai_message_t &msg)
+{
+    uint32_t data_bits = msg.rtr ? 0 : 8U * (msg.data_length_code > 8 ? 8 : msg.data_length_code);
+    return (msg.extd ? 67U : 47U) + data_bits;
+}
+
+uint32_t can_bitrate()
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    return bitrate_locked();
+}
+
+bool can_inject(const twai_message_t &msg)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    if (!installed || !running)
+    {
+        return false;
+    }
+    injected++;
+    // A controller sampling at the wrong rate sees stuff/form errors where
+    // the frame should be.
+    uint32_t br = bitrate_locked();
+    if (bus_bitrate != 0 && (br > bus_bitrate ? br - bus_bitrate : bus_bitrate - br) > bus_bitrate / 100)
+    {
+        ErrLevel before = err_level_locked();
+        status.bus_error_count++;
+        if (status.rx_error_counter < 255)
+        {
+            status.rx_error_counter++;
+        }
+        trigger_alerts_locked(TWAI_ALERT_BUS_ERROR);
+        err_counters_changed_locked(before);
+        return true;
+    }
+    if (filter_accepts_locked(msg))
+    {
+        rx_push_locked(msg);
+    }
+    else
+    {
+        hw_filtered++;
+    }
+    return true;
+}
+
+void can_bus_error(bool while_transmitting)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    if (!installed || !running)
+    {
+        return;
+    }
+    ErrLevel before = err_level_locked();
+    status.bus_error_count++;
+    if (while_transmitting)
+    {
+        status.tx_error_counter += 8;
+    }
+    else if (status.rx_error_counter < 255)
+    {
+        status.rx_error_counter++;
+    }
+    trigger_alerts_locked(TWAI_ALERT_BUS_ERROR);
+    err_counters_changed_locked(before);
+}
+
+void can_force_bus_off()
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    if (!installed || !running)
+    {
+        return;
+    }
+    ErrLevel before = err_level_locked();
+    status.tx_error_counter = 256;
+    err_counters_changed_locked(before);
+}
+
+void can_set_remote_ack(bool ack)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    remote_ack = ack;
+    bus_cv.notify_all();
+}
+
+void can_set_bus_bitrate(uint32_t bitrate)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    bus_bitrate = bitrate;
+}
+
+CanConfig can_config()
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    CanConfig c = {};
+    c.installed = installed;
+    c.mode = gcfg.mode;
+    c.triple_sampling = tcfg.triple_sampling;
+    return c;
+}
+
+void can_set_tx_sink(CanTxSink sink)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    tx_sink = sink;
+}
+
+CanCounters can_counters()
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    CanCounters c;
+    c.injected = injected;
+    c.hw_filtered = hw_filtered;
+    c.rx_missed = rx_missed;
+    c.tx_done = tx_done;
+    c.misuse = misuse;
+    c.installs = installs;
+    return c;
+}
+
+} // namespace sim
@@ -1,4 +1,6 @@
+#include "gsusb_net.h"
 #include "gsusb_usb.h"
+#include "gsusb_wifi.h"
 #include "led_service.h"
 
 extern "C" void app_main()
@@ -9,5 +11,15 @@ extern "C" void app_main()
     if (gsusb_init() != ESP_OK)
     {
         LedService::getInstance().setStatusLed(LED_ERROR);
+        return;
     }
+
+#if GSUSB_NET
+    struct gsusb_net_config net;
+    gsusb_net_default_config(&net);
+    if (gsusb_wifi_start() != ESP_OK || gsusb_net_start(&net) != ESP_OK)
+    {
+        LedService::getInstance().setStatusLed(LED_ERROR);
+    }
+#endif
 }
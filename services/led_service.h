@@ -1,10 +1,12 @@
 #pragma once
+#include <atomic>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
 #include "led_strip.h"
 #include "dbg_helpers.h"
 #include "board_pins.h"
+#include "gsusb_config.h"
 
 enum LedEvents
 {
@@ -68,6 +70,18 @@ public:
         }
     }
 
+    // Activity counters for GSUSB_LED_ACTIVITY. Each has a single writer
+    // (can_rx_task, can_alert_task), so a relaxed load/store is enough and
+    // the data path never notifies or waits on the LED task.
+    static void countRx() { bump(rxFrames); }
+    static void countTx() { bump(txFrames); }
+
+    // Frames per second at 100% bus load, for the brightness scale.
+    void setBitrate(uint32_t bitrate)
+    {
+        busFramesPerSec = bitrate / ACTIVITY_FRAME_BITS;
+    }
+
 private:
     led_strip_handle_t ledStrip;
     volatile int statusLed = LED_ACTIVE; 
@@ -78,6 +92,22 @@ private:
 
     static const constexpr char *TAG = "LED";
     const float BRIGHTNESS = 0.1;
+    const float BRIGHTNESS_FULL_LOAD = 0.5;
+
+    // 8-byte standard frame plus typical stuffing.
+    static const uint32_t ACTIVITY_FRAME_BITS = 125;
+
+    static inline std::atomic<uint32_t> rxFrames{0};
+    static inline std::atomic<uint32_t> txFrames{0};
+    volatile uint32_t busFramesPerSec = 1000000 / ACTIVITY_FRAME_BITS;
+    uint32_t lastRx = 0;
+    uint32_t lastTx = 0;
+    uint32_t lastColor = 0xFFFFFFFF;
+
+    static void bump(std::atomic<uint32_t> &counter)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
 
     LedService() {}
     LedService(const LedService &) = delete;
@@ -107,6 +137,41 @@ private:
 
         led_strip_set_pixel(ledStrip, 0, R, G, B);
         led_strip_refresh(ledStrip);
+        lastColor = ((uint32_t)R << 16) | ((uint32_t)G << 8) | B;
+    }
+
+    // One sample of GSUSB_LED_ACTIVITY: steady green when idle, otherwise
+    // RX blue blended towards TX orange by share, brighter with bus load.
+    // The strip is only refreshed when the colour changes.
+    void renderActivity()
+    {
+        uint32_t rx = rxFrames.load(std::memory_order_relaxed);
+        uint32_t tx = txFrames.load(std::memory_order_relaxed);
+        uint32_t drx = rx - lastRx;
+        uint32_t dtx = tx - lastTx;
+        lastRx = rx;
+        lastTx = tx;
+
+        uint32_t frames = drx + dtx;
+        uint8_t r = 0, g = 255, b = 0;
+        float brightness = BRIGHTNESS;
+        if (frames > 0)
+        {
+            uint32_t full = busFramesPerSec * GSUSB_LED_SAMPLE_MS / 1000;
+            float load = full > 0 && frames < full ? (float)frames / full : 1.0f;
+            brightness = BRIGHTNESS + (BRIGHTNESS_FULL_LOAD - BRIGHTNESS) * load;
+            r = (uint8_t)(255U * dtx / frames);
+            g = (uint8_t)((128U * drx + 165U * dtx) / frames);
+            b = (uint8_t)(255U * drx / frames);
+        }
+
+        uint32_t color = ((uint32_t)(uint8_t)(r * brightness) << 16) |
+                         ((uint32_t)(uint8_t)(g * brightness) << 8) |
+                         (uint8_t)(b * brightness);
+        if (color != lastColor)
+        {
+            updateLedColor(r, g, b, brightness);
+        }
     }
 
     void configureLed()
@@ -142,7 +207,8 @@ private:
     {
         switch (state) {
             case LED_ACTIVE:
-                r = 0; g = 255; b = 0; delay = portMAX_DELAY; 
+                r = 0; g = 255; b = 0;
+                delay = GSUSB_LED_ACTIVITY ? GSUSB_LED_SAMPLE_MS : portMAX_DELAY;
                 break;
             case LED_ERROR:
                 r = 255; g = 0; b = 0; delay = 200; 
@@ -171,10 +237,13 @@ private:
 
         for (;;)
         {
+            TickType_t wait = (startupDone && currentDelay_ms != portMAX_DELAY)
+                                  ? pdMS_TO_TICKS(currentDelay_ms)
+                                  : portMAX_DELAY;
             BaseType_t notified = xTaskNotifyWait(0x00, 
                                                   0xFFFFFFFF,
                                                   &notifiedValue,
-                                                  startupDone ? currentDelay_ms : portMAX_DELAY);
+                                                  wait);
             
            
             if (notified == pdTRUE && (notifiedValue & LED_EVENT_STARTUP) && !startupDone) {
@@ -220,6 +289,10 @@ private:
             }
             
         
+            if (GSUSB_LED_ACTIVITY && statusLed == LED_ACTIVE) {
+                renderActivity();
+            }
+
             if (statusLed == LED_ERROR) {
                 static bool isOn = false;
                 isOn = !isOn; 